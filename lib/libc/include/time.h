@@ -32,6 +32,7 @@
 
 #include <sys/time.h>
 
+int clock_gettime(clockid_t clock_id, struct timespec *tp);
 int sleep(struct timespec *__restrict tsp, struct timespec *__restrict remp);
 
 #endif  /* !_TIME_H_ */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/exec.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#define NSEC_PER_SECOND 1000000000ULL
+
+extern uint64_t __libc_auxv[_AT_MAX];
+
+#if defined(__x86_64__)
+static inline uint64_t
+__rdtsc(void)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#endif  /* __x86_64__ */
+
+/*
+ * Read the monotonic time from the shared time page
+ * without entering the kernel.
+ *
+ * @tp: Time page to read.
+ * @wall: Set to the wall clock base.
+ *
+ * Returns the monotonic time in nanoseconds, or zero
+ * if the time page cannot be used.
+ */
+static uint64_t
+timepage_read(const struct timepage *tp, uint64_t *wall)
+{
+#if defined(__x86_64__)
+    uint32_t seq;
+    uint64_t delta, nsec;
+
+    for (;;) {
+        seq = tp->seq;
+        if ((seq & 1) != 0) {
+            continue;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((tp->flags & TIMEPAGE_TSC) == 0) {
+            return 0;
+        }
+
+        delta = __rdtsc() - tp->tsc_base;
+        nsec = tp->mono_base;
+        nsec += ((__uint128_t)delta * tp->tsc_mult) >> 32;
+        *wall = tp->wall_base;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (tp->seq == seq) {
+            return nsec;
+        }
+    }
+#else
+    return 0;
+#endif  /* __x86_64__ */
+}
+
+int
+clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+    const struct timepage *timepage;
+    uint64_t nsec, wall;
+
+    if (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC) {
+        return -EINVAL;
+    }
+
+    /* Try the fast path first */
+    timepage = (void *)__libc_auxv[AT_TIMEPAGE];
+    if (timepage != NULL) {
+        nsec = timepage_read(timepage, &wall);
+        if (nsec != 0) {
+            if (clock_id == CLOCK_REALTIME) {
+                nsec += wall;
+            }
+
+            tp->tv_sec = nsec / NSEC_PER_SECOND;
+            tp->tv_nsec = nsec % NSEC_PER_SECOND;
+            return 0;
+        }
+    }
+
+    return syscall(SYS_clock_gettime, clock_id, (uintptr_t)tp);
+}
@@ -27,11 +27,11 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/syscall.h>
 #include <unistd.h>
 
 pid_t
 fork(void)
 {
-    /* TODO */
-    return -1;
+    return syscall(SYS_fork);
 }
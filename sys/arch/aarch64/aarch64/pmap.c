@@ -31,10 +31,12 @@
 #include <sys/cdefs.h>
 #include <sys/param.h>
 #include <sys/panic.h>
+#include <sys/errno.h>
 #include <machine/vas.h>
 #include <vm/pmap.h>
 #include <vm/physmem.h>
 #include <vm/vm.h>
+#include <string.h>
 
 /* Memory types for MAIR_ELx */
 #define MT_NORMAL           0x00
@@ -59,6 +61,7 @@
  * @PTE_ISH: Inner sharable
  * @PTE_AF: Accessed flag
  * @PTE_XN: Execute never
+ * @PTE_COW: Copy-on-write (software)
  */
 #define PTE_ADDR_MASK 0x0000FFFFFFFFF000
 #define PTE_VALID     BIT(0)
@@ -68,6 +71,10 @@
 #define PTE_ISH       (3 << 8)
 #define PTE_AF        BIT(10)
 #define PTE_XN        BIT(54)
+#define PTE_COW       BIT(55)
+
+/* Bytes mapped by a block or page at a pagemap level */
+#define PMAP_LEVEL_SIZE(level) (1UL << (12 + (3 - (level)) * 9))
 
 /*
  * Write the EL1 Memory Attribute Indirection
@@ -115,6 +122,8 @@ pmap_prot_to_pte(vm_prot_t prot)
         pte_flags &= ~PTE_XN;
     if (ISSET(prot, PROT_USER))
         pte_flags |= PTE_USER;
+    if (ISSET(prot, PROT_COW))
+        pte_flags |= (PTE_READONLY | PTE_COW);
 
     return pte_flags;
 }
@@ -137,6 +146,47 @@ pmap_level_idx(vaddr_t ia, uint8_t level)
     __builtin_unreachable();
 }
 
+/*
+ * Split a block into a table of smaller blocks
+ * or pages that map the same memory.
+ *
+ * @ent: Block descriptor.
+ * @level: Level the block lives in (1 or 2).
+ * @ia: Input virtual address within the block.
+ */
+static int
+pmap_demote(uintptr_t *ent, uint8_t level, vaddr_t ia)
+{
+    size_t size = PMAP_LEVEL_SIZE(level + 1);
+    uintptr_t tbl_pa, *tbl;
+    uint64_t attr;
+    paddr_t base;
+
+    tbl_pa = vm_alloc_frame(1);
+    if (tbl_pa == 0) {
+        return -ENOMEM;
+    }
+
+    base = *ent & PTE_ADDR_MASK & ~(PMAP_LEVEL_SIZE(level) - 1);
+    attr = *ent & ~PTE_ADDR_MASK;
+
+    /* Level 3 descriptors are pages which set bit 1 */
+    if (level == 2) {
+        attr |= PTE_TABLE;
+    }
+
+    tbl = PHYS_TO_VIRT(tbl_pa);
+    for (size_t i = 0; i < 512; ++i) {
+        tbl[i] = (base + i * size) | attr;
+    }
+
+    /* Break before make */
+    *ent = 0;
+    tlb_flush(ia);
+    *ent = (tbl_pa | PTE_VALID | PTE_USER | PTE_TABLE);
+    return 0;
+}
+
 /*
  * Extract a level from a pagemap
  *
@@ -160,6 +210,14 @@ pmap_extract(uint8_t level, vaddr_t ia, vaddr_t *pmap, bool alloc)
     idx = pmap_level_idx(ia, level);
     next = pmap[idx];
 
+    /* Split blocks when we need to go below them */
+    if ((next & (PTE_VALID | PTE_TABLE)) == PTE_VALID && level > 0) {
+        if (pmap_demote(&pmap[idx], level, ia) != 0) {
+            return NULL;
+        }
+        next = pmap[idx];
+    }
+
     if (ISSET(next, PTE_VALID)) {
         next = next & PTE_ADDR_MASK;
         return PHYS_TO_VIRT(next);
@@ -220,6 +278,39 @@ pmap_get_tbl(paddr_t ttbrn, vaddr_t ia, bool alloc, uintptr_t **res)
     return 0;
 }
 
+/*
+ * Get the descriptor that maps `ia' without
+ * splitting any blocks.
+ *
+ * @ttbrn: Translation table base to use
+ * @ia: Input virtual address
+ * @levelp: Level of the descriptor is written here
+ *
+ * Returns NULL if `ia' is not mapped.
+ */
+static uintptr_t *
+pmap_get_leaf(paddr_t ttbrn, vaddr_t ia, uint8_t *levelp)
+{
+    uintptr_t *tbl = PHYS_TO_VIRT(ttbrn);
+    uintptr_t *ent;
+
+    for (uint8_t level = 0; level <= 3; ++level) {
+        ent = &tbl[pmap_level_idx(ia, level)];
+        if (!ISSET(*ent, PTE_VALID)) {
+            return NULL;
+        }
+
+        if (level == 3 || !ISSET(*ent, PTE_TABLE)) {
+            *levelp = level;
+            return ent;
+        }
+
+        tbl = PHYS_TO_VIRT(*ent & PTE_ADDR_MASK);
+    }
+
+    return NULL;
+}
+
 struct vas
 pmap_read_vas(void)
 {
@@ -299,6 +390,236 @@ pmap_unmap(struct vas vas, vaddr_t va)
     return 0;
 }
 
+/*
+ * Returns the largest block size that can map `len'
+ * bytes from `va' to `pa' with a single descriptor.
+ */
+static size_t
+pmap_large_size(vaddr_t va, paddr_t pa, size_t len)
+{
+    for (uint8_t level = 1; level < 3; ++level) {
+        size_t size = PMAP_LEVEL_SIZE(level);
+
+        if (len >= size && ((va | pa) & (size - 1)) == 0) {
+            return size;
+        }
+    }
+
+    return DEFAULT_PAGESIZE;
+}
+
+/*
+ * Map a 2 MiB or 1 GiB block.
+ */
+static int
+pmap_map_large(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot,
+               size_t size)
+{
+    paddr_t ttbrn = vas.ttbr0_el1;
+    uintptr_t *tbl, *old_tbl, old;
+    uint8_t level;
+
+    if (va >= VM_HIGHER_HALF) {
+        ttbrn = vas.ttbr1_el1;
+    }
+
+    if (size == PMAP_LEVEL_SIZE(2)) {
+        level = 2;
+    } else if (size == PMAP_LEVEL_SIZE(1)) {
+        level = 1;
+    } else {
+        return -EINVAL;
+    }
+
+    if (((va | pa) & (size - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    tbl = PHYS_TO_VIRT(ttbrn);
+    for (uint8_t i = 0; i < level; ++i) {
+        if ((tbl = pmap_extract(i, va, tbl, true)) == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    tbl = &tbl[pmap_level_idx(va, level)];
+    old = *tbl;
+
+    /* Only replace tables that no longer map anything */
+    if ((old & (PTE_VALID | PTE_TABLE)) == (PTE_VALID | PTE_TABLE)) {
+        old_tbl = PHYS_TO_VIRT(old & PTE_ADDR_MASK);
+        for (size_t i = 0; i < 512; ++i) {
+            if (old_tbl[i] != 0)
+                return -EEXIST;
+        }
+    }
+
+    /* Break before make */
+    if (ISSET(old, PTE_VALID)) {
+        *tbl = 0;
+        tlb_flush(va);
+    }
+
+    *tbl = pa | (pmap_prot_to_pte(prot) & ~PTE_TABLE);
+    if ((old & (PTE_VALID | PTE_TABLE)) == (PTE_VALID | PTE_TABLE)) {
+        vm_free_frame(old & PTE_ADDR_MASK, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * XXX: Only blocks are filled in without walking down
+ *      from the root, pages are mapped one at a time.
+ */
+int
+pmap_map_range(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot,
+               size_t len)
+{
+    size_t step;
+    int error;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    pa = ALIGN_DOWN(pa, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+
+    for (size_t off = 0; off < len; off += step) {
+        step = pmap_large_size(va + off, pa + off, len - off);
+        if (step > DEFAULT_PAGESIZE) {
+            if (pmap_map_large(vas, va + off, pa + off, prot, step) == 0)
+                continue;
+            step = DEFAULT_PAGESIZE;
+        }
+
+        if ((error = pmap_map(vas, va + off, pa + off, prot)) != 0) {
+            pmap_unmap_range(vas, va, off);
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+int
+pmap_unmap_range(struct vas vas, vaddr_t va, size_t len)
+{
+    paddr_t ttbrn = vas.ttbr0_el1;
+    uintptr_t *ent;
+    uint8_t level;
+    size_t size;
+
+    if (va >= VM_HIGHER_HALF) {
+        ttbrn = vas.ttbr1_el1;
+    }
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+
+    for (size_t off = 0; off < len; off += size) {
+        size = DEFAULT_PAGESIZE;
+        if ((ent = pmap_get_leaf(ttbrn, va + off, &level)) == NULL) {
+            continue;
+        }
+
+        /* Whole blocks are dropped, partial ones are split */
+        size = PMAP_LEVEL_SIZE(level);
+        if (level < 3 && (((va + off) & (size - 1)) != 0 || len - off < size)) {
+            size = DEFAULT_PAGESIZE;
+            pmap_unmap(vas, va + off);
+            continue;
+        }
+
+        *ent = 0;
+    }
+
+    return 0;
+}
+
+int
+pmap_protect_range(struct vas vas, vaddr_t va, size_t len, vm_prot_t prot)
+{
+    paddr_t pa;
+    int error;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+
+    for (size_t off = 0; off < len; off += DEFAULT_PAGESIZE) {
+        if (pmap_lookup(vas, va + off, &pa, NULL) != 0) {
+            continue;
+        }
+        if ((error = pmap_map(vas, va + off, pa, prot)) != 0) {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+int
+pmap_lookup(struct vas vas, vaddr_t va, paddr_t *pa, vm_prot_t *prot)
+{
+    paddr_t ttbrn = vas.ttbr0_el1;
+    uintptr_t *ent;
+    uint64_t pte;
+    uint8_t level;
+    size_t size;
+
+    if (va >= VM_HIGHER_HALF) {
+        ttbrn = vas.ttbr1_el1;
+    }
+
+    if ((ent = pmap_get_leaf(ttbrn, va, &level)) == NULL) {
+        return -ENOENT;
+    }
+
+    /* Give the 4 KiB frame within a block */
+    pte = *ent;
+    size = PMAP_LEVEL_SIZE(level);
+    *pa = (pte & PTE_ADDR_MASK & ~(size - 1)) + (va & (size - 1));
+    *pa = ALIGN_DOWN(*pa, DEFAULT_PAGESIZE);
+    if (prot == NULL) {
+        return 0;
+    }
+
+    *prot = PROT_READ;
+    if (!ISSET(pte, PTE_READONLY))
+        *prot |= PROT_WRITE;
+    if (!ISSET(pte, PTE_XN))
+        *prot |= PROT_EXEC;
+    if (ISSET(pte, PTE_USER))
+        *prot |= PROT_USER;
+    if (ISSET(pte, PTE_COW))
+        *prot |= PROT_COW;
+
+    return 0;
+}
+
+/*
+ * XXX: TLBI by VA is broadcast to the inner shareable
+ *      domain so there is no IPI to send.
+ */
+void
+pmap_tlb_flush(struct vas vas, vaddr_t va, size_t len)
+{
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+
+    if (len / DEFAULT_PAGESIZE > 64) {
+        __ASMV(
+            "tlbi vmalle1is\n"
+            "dsb ish\n"
+            "isb\n"
+            ::: "memory"
+        );
+        return;
+    }
+
+    for (size_t i = 0; i < len; i += DEFAULT_PAGESIZE) {
+        tlb_flush(va + i);
+    }
+}
+
 void
 pmap_destroy_vas(struct vas vas)
 {
@@ -338,3 +659,9 @@ pmap_init(void)
     mair_el1_write(mair);
     return 0;
 }
+
+void
+pmap_zero_page(paddr_t pa)
+{
+    memset(PHYS_TO_VIRT(pa), 0, DEFAULT_PAGESIZE);
+}
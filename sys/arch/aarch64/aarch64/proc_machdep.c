@@ -28,6 +28,7 @@
  */
 
 #include <sys/proc.h>
+#include <sys/errno.h>
 
 /*
  * MD thread init code
@@ -43,6 +44,14 @@ md_spawn(struct proc *p, struct proc *parent, uintptr_t ip)
     return 0;
 }
 
+int
+md_fork(struct proc *p, struct proc *parent, const struct trapframe *tf,
+        uintptr_t ip)
+{
+    /* TODO: STUB */
+    return -ENOTSUP;
+}
+
 uintptr_t
 md_td_stackinit(struct proc *td, void *stack_top, struct exec_prog *prog)
 {
@@ -29,6 +29,7 @@
 
 #include <sys/reboot.h>
 #include <sys/param.h>
+#include <sys/bio.h>
 
 /*
  * Typically the reset vector is at address 0 but this can
@@ -49,6 +50,8 @@ cpu_reboot(int method)
 scret_t
 sys_reboot(struct syscall_args *scargs)
 {
+    /* Don't lose delayed writes */
+    bio_flush(NULL);
     cpu_reboot(scargs->arg0);
     __builtin_unreachable();
 }
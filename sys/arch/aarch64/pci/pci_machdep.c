@@ -28,6 +28,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/errno.h>
 #include <dev/pci/pci.h>
 
 /*
@@ -63,3 +64,17 @@ pci_enable_msix(struct pci_device *dev, const struct msi_intr *intr)
     /* TODO: STUB */
     return 0;
 }
+
+/*
+ * Route an MSI-X table entry to a processor.
+ *
+ * @dev: Device to route an entry of.
+ * @entry: MSI-X table entry.
+ * @ci: Processor to deliver the interrupt to.
+ */
+int
+pci_msix_route(struct pci_device *dev, uint16_t entry, struct cpu_info *ci)
+{
+    /* TODO: STUB */
+    return -ENOTSUP;
+}
@@ -58,24 +58,24 @@ __cacheline_aligned struct gdt_entry g_gdt_data[GDT_ENTRY_COUNT] = {
         .base_hi    = 0x00
     },
 
-    /* User code (0x18) */
+    /* User data (0x18) */
     {
         .limit      = 0x0000,
         .base_low   = 0x0000,
         .base_mid   = 0x00,
-        .attributes = GDT_ATTRIBUTE_64BIT_CODE | GDT_ATTRIBUTE_PRESENT   |
-                      GDT_ATTRIBUTE_DPL3       | GDT_ATTRIBUTE_NONSYSTEM |
-                      GDT_ATTRIBUTE_EXECUTABLE | GDT_ATTRIBUTE_READABLE,
+        .attributes = GDT_ATTRIBUTE_PRESENT    | GDT_ATTRIBUTE_DPL3      |
+                      GDT_ATTRIBUTE_NONSYSTEM  | GDT_ATTRIBUTE_WRITABLE,
         .base_hi    = 0x00
     },
 
-    /* User data (0x20) */
+    /* User code (0x20) */
     {
         .limit      = 0x0000,
         .base_low   = 0x0000,
         .base_mid   = 0x00,
-        .attributes = GDT_ATTRIBUTE_PRESENT    | GDT_ATTRIBUTE_DPL3      |
-                      GDT_ATTRIBUTE_NONSYSTEM  | GDT_ATTRIBUTE_WRITABLE,
+        .attributes = GDT_ATTRIBUTE_64BIT_CODE | GDT_ATTRIBUTE_PRESENT   |
+                      GDT_ATTRIBUTE_DPL3       | GDT_ATTRIBUTE_NONSYSTEM |
+                      GDT_ATTRIBUTE_EXECUTABLE | GDT_ATTRIBUTE_READABLE,
         .base_hi    = 0x00
     },
 
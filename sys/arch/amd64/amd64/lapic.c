@@ -43,6 +43,7 @@
 #include <machine/msr.h>
 #include <machine/idt.h>
 #include <machine/tss.h>
+#include <machine/tsc.h>
 
 #define pr_trace(fmt, ...) kprintf("lapic: " fmt, ##__VA_ARGS__)
 
@@ -60,6 +61,7 @@
 
 static struct timer lapic_timer;
 static uint8_t lapic_timer_vec = 0;
+static bool tsc_deadline = false;
 void *g_lapic_base = 0;
 
 void lapic_tmr_isr(void);
@@ -91,6 +93,21 @@ lapic_has_x2apic(void)
     return ISSET(ecx, BIT(21));
 }
 
+/*
+ * Checks if the Local APIC timer supports
+ * TSC-deadline mode. Returns true if so.
+ *
+ * Supported if CPUID.(EAX=1H):ECX[24] == 1
+ */
+static inline bool
+lapic_has_tsc_deadline(void)
+{
+    uint32_t ecx, tmp;
+
+    CPUID(0x00000001, tmp, tmp, ecx, tmp);
+    return ISSET(ecx, BIT(24));
+}
+
 /*
  * Reads a 32 bit value from Local APIC
  * register space.
@@ -175,8 +192,15 @@ lapic_timer_oneshot_us(size_t usec)
     uint64_t ticks;
     struct cpu_info *ci = this_cpu();
 
+    /* In TSC-deadline mode, arming is a single WRMSR */
+    if (tsc_deadline) {
+        ticks = MAX(tsc_ticks(usec, 1000000), 1);
+        wrmsr(IA32_TSC_DEADLINE, rdtsc() + ticks);
+        return;
+    }
+
     ticks = usec * (ci->lapic_tmr_freq / 1000000);
-    lapic_timer_oneshot(false, ticks);
+    lapic_timer_oneshot(false, MIN(ticks, 0xFFFFFFFF));
 }
 
 /*
@@ -185,10 +209,36 @@ lapic_timer_oneshot_us(size_t usec)
 static void
 lapic_timer_stop(void)
 {
+    /* A zero deadline disarms the timer */
+    if (tsc_deadline) {
+        wrmsr(IA32_TSC_DEADLINE, 0);
+        return;
+    }
+
     lapic_writel(LAPIC_LVT_TMR, LAPIC_LVT_MASK);
     lapic_writel(LAPIC_INIT_CNT, 0);
 }
 
+/*
+ * Put the Local APIC timer of the current processor
+ * in TSC-deadline mode, disarmed.
+ */
+static void
+lapic_timer_deadline_init(void)
+{
+    uint32_t tmp;
+
+    tmp = (LVT_TMR_TSC_DEADLINE << 17) | lapic_timer_vec;
+    lapic_writel(LAPIC_LVT_TMR, tmp);
+
+    /*
+     * In xAPIC mode the LVT write is not ordered with the
+     * WRMSR to IA32_TSC_DEADLINE, fence it.
+     */
+    __ASMV("mfence" ::: "memory");
+    wrmsr(IA32_TSC_DEADLINE, 0);
+}
+
 /*
  * Set bits within a LAPIC register
  * without overwriting the whole thing.
@@ -306,6 +356,17 @@ lapic_send_ipi(uint8_t id, uint8_t shorthand, uint8_t vector)
     }
 }
 
+/*
+ * Raise the timer interrupt on the current processor
+ * right away, the scheduler runs as soon as interrupts
+ * are unmasked.
+ */
+void
+lapic_timer_fire(void)
+{
+    lapic_send_ipi(0, IPI_SHORTHAND_SELF, lapic_timer_vec);
+}
+
 /*
  * Indicates that the current interrupt is finished
  * being serviced.
@@ -354,11 +415,25 @@ lapic_init(void)
     lapic_enable(ci);
 
     ci->apicid = lapic_read_id(ci);
-    ci->lapic_tmr_freq = lapic_timer_init();
     modestr = ci->has_x2apic ? "x2apic" : "xapic";
 
+    /*
+     * Prefer TSC-deadline mode as it needs no calibration
+     * and is armed with one MSR write. This relies on the
+     * TSC clock being set up on the BSP beforehand.
+     */
+    if (lapic_has_tsc_deadline() && tsc_usable()) {
+        tsc_deadline = true;
+        lapic_timer_deadline_init();
+    } else {
+        ci->lapic_tmr_freq = lapic_timer_init();
+    }
+
     bsp_trace("lapic0 at cpu0: apicid %d\n");
     bsp_trace("lapic0 in %s mode\n", modestr);
+    if (tsc_deadline) {
+        bsp_trace("lapic0 timer in TSC-deadline mode\n");
+    }
 
     /* Try to register the timer */
     lapic_timer.name = "LAPIC_INTEGRATED_TIMER";
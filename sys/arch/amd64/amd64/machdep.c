@@ -31,6 +31,7 @@
 #include <sys/syslog.h>
 #include <sys/ksyms.h>
 #include <sys/panic.h>
+#include <sys/schedvar.h>
 #include <machine/cpu.h>
 #include <machine/gdt.h>
 #include <machine/tss.h>
@@ -39,6 +40,7 @@
 #include <machine/asm.h>
 #include <machine/cpuid.h>
 #include <machine/lapic.h>
+#include <machine/tsc.h>
 #include <machine/uart.h>
 #include <machine/sync.h>
 #include <machine/intr.h>
@@ -46,6 +48,7 @@
 #include <machine/cdefs.h>
 #include <machine/isa/i8042var.h>
 #include <dev/cons/cons.h>
+#include <vm/vm.h>
 #include <string.h>
 
 /*
@@ -83,43 +86,131 @@
 int ibrs_enable(void);
 int simd_init(void);
 void syscall_isr(void);
+void syscall_entry(void);
 void pin_isr_load(void);
 
 struct cpu_info g_bsp_ci = {0};
 static struct cpu_ipi *tlb_ipi;
+static struct cpu_ipi *sched_ipi;
 static struct spinlock ipi_lock = {0};
 static bool bsp_init = false;
 
+/*
+ * The shootdown in flight, processors acknowledge
+ * it by copying `shootdown_gen' into their `tlb_gen'.
+ */
+static struct spinlock shootdown_lock = {0};
+static struct tlb_batch shootdown_batch;
+static volatile uint32_t shootdown_gen = 0;
+
+/*
+ * Carry out a shootdown batch on the current
+ * processor.
+ *
+ * @ci: Current processor.
+ * @tb: Batch to apply.
+ */
+static void
+tlb_batch_apply(struct cpu_info *ci, const struct tlb_batch *tb)
+{
+    const struct tlb_range *rp;
+    size_t npages = 0;
+    uint64_t cr4;
+
+    /*
+     * Not our address space, drop it when we switch to it.
+     * Without PCIDs `ci->pcid' is never set and every switch
+     * flushes anyway, so the batch must be applied as is.
+     */
+    if (!tb->kernel && ISSET(ci->feat, CPU_FEAT_PCID) &&
+        tb->pcid != ci->pcid) {
+        cpu_pcid_stale(ci, tb->pcid);
+        return;
+    }
+
+    for (uint8_t i = 0; i < tb->nrange; ++i) {
+        npages += tb->range[i].len / DEFAULT_PAGESIZE;
+    }
+
+    if (tb->all || npages > TLB_FLUSH_MAX) {
+        if (tb->kernel) {
+            /* Toggling CR4.PGE flushes every PCID and global page */
+            cr4 = amd64_read_cr4();
+            amd64_write_cr4(cr4 ^ CR4_PGE);
+            amd64_write_cr4(cr4);
+            return;
+        }
+
+        /* Reloading CR3 flushes the current PCID */
+        __ASMV("mov %%cr3, %%rax\n"
+               "mov %%rax, %%cr3"
+               ::: "rax", "memory"
+        );
+        return;
+    }
+
+    for (uint8_t i = 0; i < tb->nrange; ++i) {
+        rp = &tb->range[i];
+        for (vaddr_t va = rp->va; va < rp->va + rp->len; va += DEFAULT_PAGESIZE) {
+            tlb_flush(va);
+        }
+    }
+
+    /*
+     * INVLPG only reaches non-global entries of the
+     * current PCID, the kernel may be cached under
+     * the others as well.
+     */
+    if (tb->kernel && ISSET(ci->feat, CPU_FEAT_PCID)) {
+        for (size_t i = 0; i < TLB_PCID_MAX / 64; ++i) {
+            __atomic_store_n(&ci->pcid_stale[i], ~0ULL, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+/*
+ * Handle the shootdown in flight if we have not
+ * done so yet.
+ */
 static int
 tlb_shootdown_handler(struct cpu_ipi *ipi)
 {
     struct cpu_info *ci;
+    uint32_t gen;
     int ipl;
 
-    /*
-     * Get the current CPU and check if we even
-     * need a shootdown. If `tlb_shootdown' is
-     * unset, this is not for us.
-     */
     ci = this_cpu();
-    if (!ci->tlb_shootdown) {
+    gen = __atomic_load_n(&shootdown_gen, __ATOMIC_ACQUIRE);
+    if (ci->tlb_gen == gen) {
         return -1;
     }
 
     ipl = splraise(IPL_HIGH);
-    __invlpg(ci->shootdown_va);
-
-    ci->shootdown_va = 0;
-    ci->tlb_shootdown = 0;
+    tlb_batch_apply(ci, &shootdown_batch);
+    __atomic_store_n(&ci->tlb_gen, gen, __ATOMIC_RELEASE);
     splx(ipl);
     return 0;
 }
 
+/*
+ * Sent to a processor when there is new work
+ * for it, we just kick its scheduler so that it
+ * picks the work up right away instead of on its
+ * next quantum.
+ */
+static int
+sched_ipi_handler(struct cpu_ipi *ipi)
+{
+    sched_oneshot(true);
+    return 0;
+}
+
 static void
 setup_vectors(struct cpu_info *ci)
 {
     union tss_stack scstack;
     union tss_stack dfstack;
+    union tss_stack nmistack;
 
     /* Try to allocate a syscall stack */
     if (tss_alloc_stack(&scstack, DEFAULT_PAGESIZE) != 0) {
@@ -131,11 +222,21 @@ setup_vectors(struct cpu_info *ci)
         panic("failed to allocate double fault stack\n");
     }
 
+    /*
+     * NMIs may arrive right after SYSCALL while we are still
+     * on the user stack, so they need a stack of their own.
+     */
+    if (tss_alloc_stack(&nmistack, DEFAULT_PAGESIZE) != 0) {
+        panic("failed to allocate NMI stack\n");
+    }
+
     tss_update_ist(ci, scstack, IST_SYSCALL);
+    tss_update_ist(ci, nmistack, IST_NMI);
     tss_update_ist(ci, dfstack, IST_DBFLT);
+    ci->syscall_stack = scstack.top;
 
     idt_set_desc(0x0, IDT_TRAP_GATE, ISR(arith_err), 0);
-    idt_set_desc(0x2, IDT_TRAP_GATE, ISR(nmi), 0);
+    idt_set_desc(0x2, IDT_TRAP_GATE, ISR(nmi), IST_NMI);
     idt_set_desc(0x3, IDT_TRAP_GATE, ISR(breakpoint_handler), 0);
     idt_set_desc(0x4, IDT_TRAP_GATE, ISR(overflow), 0);
     idt_set_desc(0x5, IDT_TRAP_GATE, ISR(bound_range), 0);
@@ -150,6 +251,45 @@ setup_vectors(struct cpu_info *ci)
     pin_isr_load();
 }
 
+/*
+ * Setup the SYSCALL/SYSRET fast system call path,
+ * the int 0x80 gate is kept for compatibility.
+ *
+ * XXX: Every 64-bit processor supports SYSCALL in
+ *      long mode, there is no need to check CPUID.
+ */
+static void
+init_syscall(struct cpu_info *ci)
+{
+    const uint64_t SFMASK = (
+        BIT(8)  |       /* TF */
+        BIT(9)  |       /* IF */
+        BIT(10) |       /* DF */
+        BIT(18)         /* AC */
+    );
+    uint64_t star;
+
+    __static_assert(
+        __builtin_offsetof(struct cpu_info, syscall_stack) == 0x00,
+        "syscall_stack offset is used by syscall.S");
+    __static_assert(
+        __builtin_offsetof(struct cpu_info, syscall_scratch) == 0x08,
+        "syscall_scratch offset is used by syscall.S");
+
+    /*
+     * SYSCALL loads CS from STAR[47:32] and SS from that
+     * plus 8. SYSRET loads SS from STAR[63:48] plus 8 and
+     * CS from that plus 16.
+     */
+    star = ((uint64_t)KERNEL_CS << 32);
+    star |= ((uint64_t)(USER_DS - 8) << 48);
+
+    wrmsr(IA32_STAR, star);
+    wrmsr(IA32_LSTAR, (uintptr_t)syscall_entry);
+    wrmsr(IA32_SFMASK, SFMASK);
+    wrmsr(IA32_EFER, rdmsr(IA32_EFER) | EFER_SCE);
+}
+
 static inline void
 init_tss(struct cpu_info *ci)
 {
@@ -231,6 +371,16 @@ init_ipis(void)
     if (tlb_ipi->id != IPI_TLB)
         panic("expected IPI_TLB for TLB IPI\n");
 
+    error = md_ipi_alloc(&sched_ipi);
+    if (error < 0) {
+        pr_error("md_ipi_alloc: returned %d\n", error);
+        panic("failed to init sched IPI\n");
+    }
+
+    sched_ipi->handler = sched_ipi_handler;
+    if (sched_ipi->id != IPI_SCHED)
+        panic("expected IPI_SCHED for sched IPI\n");
+
     spinlock_release(&ipi_lock);
 }
 
@@ -372,24 +522,136 @@ cpu_enable_umip(void)
     }
 }
 
+/*
+ * Invalidate a batch of ranges on every processor and
+ * wait for them to finish. Processors that are not in
+ * the address space are only told to flush it on their
+ * next switch, so they are not interrupted.
+ *
+ * @tb: Batch to shoot down.
+ */
 void
-cpu_shootdown_tlb(vaddr_t va)
+cpu_shootdown_tlb(const struct tlb_batch *tb)
 {
     uint32_t ncpu = cpu_count();
-    struct cpu_info *cip;
+    struct cpu_info *ci, *cip;
+    bool sent[CPU_MAX];
+    uint32_t gen;
+
+    /* Only the BSP is up before it has its %GS base */
+    if ((ci = this_cpu()) == NULL) {
+        ci = &g_bsp_ci;
+    }
+
+    tlb_batch_apply(ci, tb);
+    if (ncpu <= 1) {
+        return;
+    }
+
+    /*
+     * Keep answering other shootdowns while we wait
+     * our turn in case we are spinning with interrupts
+     * masked.
+     */
+    while (spinlock_try_acquire(&shootdown_lock) != 0) {
+        tlb_shootdown_handler(NULL);
+        md_pause();
+    }
+
+    memcpy(&shootdown_batch, tb, sizeof(shootdown_batch));
+    gen = __atomic_add_fetch(&shootdown_gen, 1, __ATOMIC_SEQ_CST);
+    ci->tlb_gen = gen;
+    memset(sent, 0, sizeof(sent));
 
     for (uint32_t i = 0; i < ncpu; ++i) {
-        cip = cpu_get(i);
-        if (cip == NULL) {
-            break;
+        if ((cip = cpu_get(i)) == NULL || cip == ci) {
+            continue;
+        }
+
+        /*
+         * Mark the PCID stale before looking at what the
+         * processor has loaded. pmap_switch_vas() stores
+         * its PCID before taking the mark, so either it
+         * finds the mark or we see it in the address space
+         * and interrupt it.
+         */
+        if (!tb->kernel && ISSET(cip->feat, CPU_FEAT_PCID)) {
+            cpu_pcid_stale(cip, tb->pcid);
+            if (__atomic_load_n(&cip->pcid, __ATOMIC_SEQ_CST) != tb->pcid) {
+                continue;
+            }
         }
 
-        spinlock_acquire(&cip->lock);
-        cip->shootdown_va = va;
-        cip->tlb_shootdown = 1;
+        sent[i] = true;
         md_ipi_send(cip, IPI_TLB);
-        spinlock_release(&cip->lock);
     }
+
+    /* Wait for the acknowledgements */
+    for (uint32_t i = 0; i < ncpu; ++i) {
+        if (!sent[i] || (cip = cpu_get(i)) == NULL) {
+            continue;
+        }
+
+        while (__atomic_load_n(&cip->tlb_gen, __ATOMIC_ACQUIRE) != gen) {
+            md_pause();
+        }
+    }
+
+    spinlock_release(&shootdown_lock);
+}
+
+/*
+ * Process-context identifiers let address spaces keep
+ * their TLB entries across switches. They can only be
+ * enabled while CR3 has no flags set in its low bits.
+ */
+static void
+cpu_enable_pcid(struct cpu_info *ci)
+{
+    uint32_t unused, ecx;
+    uint64_t cr3;
+
+    CPUID(0x01, unused, unused, ecx, unused);
+    if (!ISSET(ecx, BIT(17))) {
+        pr_trace_bsp("PCID not supported\n");
+        return;
+    }
+
+    __ASMV("mov %%cr3, %0" : "=r" (cr3) :: "memory");
+    if ((cr3 & 0xFFF) != 0) {
+        pr_trace_bsp("CR3 flags set, not using PCID\n");
+        return;
+    }
+
+    amd64_write_cr4(amd64_read_cr4() | CR4_PCIDE);
+    ci->feat |= CPU_FEAT_PCID;
+}
+
+/*
+ * Kick the scheduler of another processor
+ *
+ * @ci: Processor to kick
+ */
+void
+md_sched_kick(struct cpu_info *ci)
+{
+    if (ci == this_cpu()) {
+        return;
+    }
+
+    spinlock_acquire(&ci->lock);
+    md_ipi_send(ci, IPI_SCHED);
+    spinlock_release(&ci->lock);
+}
+
+/*
+ * Switch out the current thread now rather
+ * than at the next timer interrupt.
+ */
+void
+md_sched_now(void)
+{
+    lapic_timer_fire();
 }
 
 void
@@ -572,6 +834,7 @@ cpu_startup(struct cpu_info *ci)
     init_tss(ci);
 
     setup_vectors(ci);
+    init_syscall(ci);
     md_ipi_init();
     init_ipis();
 
@@ -582,8 +845,15 @@ cpu_startup(struct cpu_info *ci)
     cpu_get_info(ci);
     cpu_enable_smep();
     cpu_enable_umip();
+    cpu_enable_pcid(ci);
 
     enable_simd();
+
+    /* The BSP sets up the clock, the LAPIC may use it */
+    if (!bsp_init) {
+        tsc_clock_init(ci);
+    }
+
     lapic_init();
 
     if (!bsp_init) {
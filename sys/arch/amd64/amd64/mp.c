@@ -33,8 +33,10 @@
 #include <sys/systm.h>
 #include <sys/syslog.h>
 #include <sys/proc.h>
+#include <sys/spawn.h>
 #include <sys/spinlock.h>
 #include <sys/sched.h>
+#include <sys/schedvar.h>
 #include <sys/atomic.h>
 #include <machine/cpu.h>
 #include <vm/dynalloc.h>
@@ -57,7 +59,6 @@ static void
 ap_trampoline(struct limine_smp_info *si)
 {
     struct cpu_info *ci;
-    struct proc *idle;
 
     ci = dynalloc(sizeof(*ci));
     __assert(ci != NULL);
@@ -68,8 +69,8 @@ ap_trampoline(struct limine_smp_info *si)
     ci_list[ncpu_up] = ci;
 
     ci->id = ncpu_up;
-    spawn(&g_proc0, sched_enter, NULL, 0, &idle);
-    proc_pin(idle, ci->id);
+    sched_init_cpu(ci);
+    spawn(&g_proc0, sched_enter, NULL, SPAWN_IDLE, NULL);
 
     spinlock_release(&ci_list_lock);
 
@@ -117,7 +118,6 @@ mp_bootstrap_aps(struct cpu_info *ci)
 {
     struct limine_smp_response *resp = g_smp_req.response;
     struct limine_smp_info **cpus;
-    struct proc *idle;
     size_t cpu_init_counter;
     uint32_t ncpu;
 
@@ -129,9 +129,8 @@ mp_bootstrap_aps(struct cpu_info *ci)
     cpu_init_counter = ncpu - 1;
     ci_list[0] = ci;
 
-    /* Pin an idle thread to the BSP */
-    spawn(&g_proc0, sched_enter, NULL, 0, &idle);
-    proc_pin(idle, 0);
+    /* Give the BSP an idle thread */
+    spawn(&g_proc0, sched_enter, NULL, SPAWN_IDLE, NULL);
 
     if (resp->cpu_count == 1) {
         pr_trace("CPU has 1 core, no APs to bootstrap...\n");
@@ -34,6 +34,8 @@
 #include <machine/tlb.h>
 #include <machine/vas.h>
 #include <machine/cpu.h>
+#include <machine/asm.h>
+#include <machine/cpuid.h>
 #include <machine/cdefs.h>
 #include <vm/pmap.h>
 #include <vm/physmem.h>
@@ -56,8 +58,76 @@
 #define PTE_DIRTY       BIT(6)        /* Dirty (written-to page) */
 #define PTE_PS          BIT(7)        /* Page size */
 #define PTE_GLOBAL      BIT(8)
+#define PTE_COW         BIT(9)        /* Copy-on-write (software) */
+#define PTE_PAT_LARGE   BIT(12)       /* PAT index of a large page */
 #define PTE_NX          BIT(63)       /* Execute-disable */
 
+#define CR3_NOFLUSH     BIT(63)       /* Keep the TLB entries of the PCID */
+
+/* Bytes mapped by a leaf entry at a pagemap level */
+#define PMAP_LEVEL_SIZE(level) (1UL << (12 + ((level) - 1) * 9))
+
+static bool have_1gib = false;
+
+/* PCIDs in use, zero belongs to the kernel */
+static uint64_t pcid_map[TLB_PCID_MAX / 64] = { BIT(0) };
+static struct spinlock pcid_lock = {0};
+
+/*
+ * Allocate a PCID for a new address space. Returns
+ * zero if we ran out or PCIDs are not in use,
+ * address spaces with PCID zero are flushed on
+ * every switch.
+ */
+static uint16_t
+pcid_alloc(void)
+{
+    struct cpu_info *ci = this_cpu();
+    uint16_t pcid = 0;
+
+    if (ci == NULL || !ISSET(ci->feat, CPU_FEAT_PCID)) {
+        return 0;
+    }
+
+    spinlock_acquire(&pcid_lock);
+    for (size_t i = 0; i < TLB_PCID_MAX / 64; ++i) {
+        if (pcid_map[i] == ~0ULL) {
+            continue;
+        }
+
+        pcid = i * 64 + __builtin_ctzll(~pcid_map[i]);
+        pcid_map[i] |= BIT(pcid % 64);
+        break;
+    }
+    spinlock_release(&pcid_lock);
+    return pcid;
+}
+
+/*
+ * Release a PCID. Every processor may still have
+ * entries tagged with it so they are all told to
+ * flush it before it is used again.
+ */
+static void
+pcid_free(uint16_t pcid)
+{
+    struct cpu_info *ci;
+
+    if (pcid == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < cpu_count(); ++i) {
+        if ((ci = cpu_get(i)) != NULL) {
+            cpu_pcid_stale(ci, pcid);
+        }
+    }
+
+    spinlock_acquire(&pcid_lock);
+    pcid_map[pcid / 64] &= ~BIT(pcid % 64);
+    spinlock_release(&pcid_lock);
+}
+
 /*
  * Convert pmap protection flags to PTE flags.
  */
@@ -72,6 +142,8 @@ pmap_prot_to_pte(vm_prot_t prot)
         pte_flags &= ~(PTE_NX);
     if (ISSET(prot, PROT_USER))
         pte_flags |= PTE_US;
+    if (ISSET(prot, PROT_COW))
+        pte_flags = (pte_flags & ~PTE_RW) | PTE_COW;
 
     return pte_flags;
 }
@@ -101,6 +173,49 @@ pmap_get_level_index(uint8_t level, vaddr_t va)
     }
 }
 
+/*
+ * Split a large page into a table of smaller
+ * pages that map the same memory.
+ *
+ * @ent: Entry of the large page.
+ * @level: Level the entry lives in (2 or 3).
+ * @va: Virtual address within the large page.
+ */
+static int
+pmap_demote(uintptr_t *ent, uint8_t level, vaddr_t va)
+{
+    size_t size = PMAP_LEVEL_SIZE(level - 1);
+    uintptr_t tbl_pa, *tbl;
+    uint64_t flags;
+    paddr_t base;
+
+    tbl_pa = vm_alloc_frame(1);
+    if (tbl_pa == 0) {
+        return -ENOMEM;
+    }
+
+    base = *ent & PTE_ADDR_MASK & ~(PMAP_LEVEL_SIZE(level) - 1);
+    flags = *ent & ~PTE_ADDR_MASK;
+
+    /* The PAT bit moves into PS for 4 KiB pages */
+    if (level == 2) {
+        flags &= ~PTE_PS;
+        if (ISSET(*ent, PTE_PAT_LARGE))
+            flags |= PTE_PS;
+    } else {
+        flags |= (*ent & PTE_PAT_LARGE);
+    }
+
+    tbl = PHYS_TO_VIRT(tbl_pa);
+    for (size_t i = 0; i < 512; ++i) {
+        tbl[i] = (base + i * size) | flags;
+    }
+
+    *ent = tbl_pa | (PTE_P | PTE_RW | PTE_US);
+    tlb_flush(va);
+    return 0;
+}
+
 /*
  * Extract a pagemap level.
  */
@@ -115,13 +230,13 @@ pmap_extract(uint8_t level, vaddr_t va, vaddr_t *pmap, bool alloc)
     }
 
     /*
-     * TODO: Support huge pages... For now, don't let the
-     *       bootloader fuck us up with their pre-kernel
-     *       mappings and tell huge pages to get the fuck.
-     *
+     * Large pages (including the ones the bootloader
+     * left us) are split when we need to go below them.
      */
-    if (ISSET(pmap[idx], PTE_PS)) {
-        pmap[idx] = 0;
+    if (level < 4 && (pmap[idx] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+        if (pmap_demote(&pmap[idx], level, va) != 0) {
+            return NULL;
+        }
     }
 
     if (ISSET(pmap[idx], PTE_P)) {
@@ -139,7 +254,6 @@ pmap_extract(uint8_t level, vaddr_t va, vaddr_t *pmap, bool alloc)
         return NULL;
     }
 
-    memset(PHYS_TO_VIRT(level_alloc), 0, DEFAULT_PAGESIZE);
     pmap[idx] = level_alloc | (PTE_P | PTE_RW | PTE_US);
     return PHYS_TO_VIRT(level_alloc);
 }
@@ -182,6 +296,41 @@ done:
     return status;
 }
 
+/*
+ * Get the entry that maps `va' without splitting
+ * any large pages.
+ *
+ * @vas: Virtual address space.
+ * @va: Virtual address.
+ * @levelp: Level of the entry is written here.
+ *
+ * Returns NULL if `va' is not mapped.
+ */
+static uintptr_t *
+pmap_get_leaf(struct vas vas, vaddr_t va, uint8_t *levelp)
+{
+    uintptr_t *tbl = PHYS_TO_VIRT(vas.top_level);
+    uintptr_t *ent;
+    paddr_t next;
+
+    for (uint8_t level = 4; level > 0; --level) {
+        ent = &tbl[pmap_get_level_index(level, va)];
+        if (!ISSET(*ent, PTE_P)) {
+            return NULL;
+        }
+
+        if (level == 1 || (level < 4 && ISSET(*ent, PTE_PS))) {
+            *levelp = level;
+            return ent;
+        }
+
+        next = (*ent & PTE_ADDR_MASK);
+        tbl = PHYS_TO_VIRT(next);
+    }
+
+    return NULL;
+}
+
 /*
  * Update the value in a page table.
  *
@@ -213,10 +362,13 @@ pmap_new_vas(struct vas *res)
     uint64_t *src, *dest;
 
     new_vas.cr3_flags = kvas->cr3_flags;
+    new_vas.use_l5_paging = kvas->use_l5_paging;
     new_vas.top_level = vm_alloc_frame(1);
     if (new_vas.top_level == 0)
         return -ENOMEM;
 
+    new_vas.pcid = pcid_alloc();
+
     src = PHYS_TO_VIRT(kvas->top_level);
     dest = PHYS_TO_VIRT(new_vas.top_level);
 
@@ -240,6 +392,7 @@ pmap_new_vas(struct vas *res)
 void
 pmap_destroy_vas(struct vas vas)
 {
+    pcid_free(vas.pcid);
     vm_free_frame(vas.top_level, 1);
 }
 
@@ -259,6 +412,14 @@ pmap_read_vas(void)
     vas.top_level = cr3_raw & PTE_ADDR_MASK;
     vas.use_l5_paging = false;  /* TODO */
     vas.lock.lock = 0;
+    vas.pcid = 0;
+
+    /* The low bits are the PCID if enabled */
+    if (ISSET(amd64_read_cr4(), CR4_PCIDE)) {
+        vas.pcid = vas.cr3_flags & 0xFFF;
+        vas.cr3_flags = 0;
+    }
+
     return vas;
 }
 
@@ -266,12 +427,40 @@ void
 pmap_switch_vas(struct vas vas)
 {
     uintptr_t cr3_val = vas.cr3_flags | vas.top_level;
+    struct cpu_info *ci = this_cpu();
+    bool masked;
+
+    if (ci == NULL || !ISSET(ci->feat, CPU_FEAT_PCID)) {
+        __ASMV("mov %0, %%cr3"
+               :
+               : "r" (cr3_val)
+               : "memory"
+        );
+        return;
+    }
+
+    /*
+     * Publish the PCID before checking if it went stale,
+     * a shootdown either sees us in the address space or
+     * leaves the mark for us to find.
+     */
+    if (!(masked = md_intr_masked()))
+        md_intoff();
+
+    __atomic_store_n(&ci->pcid, vas.pcid, __ATOMIC_SEQ_CST);
+    cr3_val = vas.top_level | vas.pcid;
+    if (!cpu_pcid_take_stale(ci, vas.pcid) && vas.pcid != 0) {
+        cr3_val |= CR3_NOFLUSH;
+    }
 
     __ASMV("mov %0, %%cr3"
            :
            : "r" (cr3_val)
            : "memory"
     );
+
+    if (!masked)
+        md_inton();
 }
 
 int
@@ -288,21 +477,290 @@ pmap_unmap(struct vas vas, vaddr_t va)
     return pmap_update_tbl(vas, va, 0, false);
 }
 
+/*
+ * Returns the largest page size that can map `len'
+ * bytes from `va' to `pa' with a single entry.
+ */
+static size_t
+pmap_large_size(vaddr_t va, paddr_t pa, size_t len)
+{
+    for (uint8_t level = have_1gib ? 3 : 2; level > 1; --level) {
+        size_t size = PMAP_LEVEL_SIZE(level);
+
+        if (len >= size && ((va | pa) & (size - 1)) == 0) {
+            return size;
+        }
+    }
+
+    return DEFAULT_PAGESIZE;
+}
+
+/*
+ * Map a 2 MiB or 1 GiB page. An empty table in the
+ * way is freed, if it still maps anything we return
+ * -EEXIST and the caller should use smaller pages.
+ */
+static int
+pmap_map_large(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot,
+               size_t size)
+{
+    uintptr_t *tbl = PHYS_TO_VIRT(vas.top_level);
+    uintptr_t *old_tbl, old;
+    paddr_t old_pa;
+    uint8_t level;
+
+    if (size == PMAP_LEVEL_SIZE(2)) {
+        level = 2;
+    } else if (size == PMAP_LEVEL_SIZE(3) && have_1gib) {
+        level = 3;
+    } else {
+        return -EINVAL;
+    }
+
+    if (((va | pa) & (size - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    for (uint8_t i = 4; i > level; --i) {
+        if ((tbl = pmap_extract(i, va, tbl, true)) == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    tbl = &tbl[pmap_get_level_index(level, va)];
+    old = *tbl;
+
+    if ((old & (PTE_P | PTE_PS)) == PTE_P) {
+        old_pa = (old & PTE_ADDR_MASK);
+        old_tbl = PHYS_TO_VIRT(old_pa);
+        for (size_t i = 0; i < 512; ++i) {
+            if (old_tbl[i] != 0)
+                return -EEXIST;
+        }
+    }
+
+    *tbl = pa | pmap_prot_to_pte(prot) | PTE_PS;
+    tlb_flush(va);
+
+    if ((old & (PTE_P | PTE_PS)) == PTE_P) {
+        vm_free_frame(old & PTE_ADDR_MASK, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Walk down to the entry that maps `va', stopping
+ * early at large pages or entries that are not
+ * present.
+ *
+ * @vas: Virtual address space.
+ * @va: Virtual address.
+ * @levelp: Level of the entry is written here.
+ */
+static uintptr_t *
+pmap_walk(struct vas vas, vaddr_t va, uint8_t *levelp)
+{
+    uintptr_t *tbl = PHYS_TO_VIRT(vas.top_level);
+    uintptr_t *ent = NULL;
+    paddr_t next;
+    uint8_t level;
+
+    for (level = 4; level > 0; --level) {
+        ent = &tbl[pmap_get_level_index(level, va)];
+        if (!ISSET(*ent, PTE_P) || level == 1) {
+            break;
+        }
+        if (level < 4 && ISSET(*ent, PTE_PS)) {
+            break;
+        }
+
+        next = (*ent & PTE_ADDR_MASK);
+        tbl = PHYS_TO_VIRT(next);
+    }
+
+    *levelp = level;
+    return ent;
+}
+
+/*
+ * Unmap or change the protection of every present
+ * page in a range. Large pages are split if the range
+ * only covers part of them.
+ *
+ * @vas: Virtual address space.
+ * @va: Page aligned start of the range.
+ * @len: Page aligned length of the range.
+ * @unmap: True to unmap, otherwise apply `prot'.
+ * @prot: New protection flags.
+ */
+static int
+pmap_modify_range(struct vas vas, vaddr_t va, size_t len, bool unmap,
+                  vm_prot_t prot)
+{
+    const uint64_t keep = PTE_PWT | PTE_PCD | PTE_ACC | PTE_DIRTY |
+        PTE_PS | PTE_GLOBAL;
+    uint64_t flags = pmap_prot_to_pte(prot);
+    uintptr_t *ent;
+    size_t size, off = 0;
+    uint8_t level;
+    int error;
+
+    while (off < len) {
+        ent = pmap_walk(vas, va + off, &level);
+        size = PMAP_LEVEL_SIZE(level);
+
+        /* Nothing mapped down here, skip the whole entry */
+        if (!ISSET(*ent, PTE_P)) {
+            off = ALIGN_UP(va + off + 1, size) - va;
+            continue;
+        }
+
+        if (level > 1) {
+            if (((va + off) & (size - 1)) != 0 || len - off < size) {
+                if ((error = pmap_demote(ent, level, va + off)) != 0)
+                    return error;
+                continue;
+            }
+
+            *ent = unmap ? 0 : (*ent & (PTE_ADDR_MASK | keep)) | flags;
+            off += size;
+            continue;
+        }
+
+        /* Run through the rest of this page table */
+        do {
+            if (ISSET(*ent, PTE_P))
+                *ent = unmap ? 0 : (*ent & (PTE_ADDR_MASK | keep)) | flags;
+
+            ++ent;
+            off += DEFAULT_PAGESIZE;
+        } while (off < len && pmap_get_level_index(1, va + off) != 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Map a range with as few walks as possible, large
+ * pages are used wherever the range lines up for one.
+ */
 int
-pmap_set_cache(struct vas vas, vaddr_t va, int type)
+pmap_map_range(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot,
+               size_t len)
 {
+    uint64_t flags = pmap_prot_to_pte(prot);
     uintptr_t *tbl;
-    uint32_t flags;
-    paddr_t pa;
-    int status;
-    size_t idx;
+    size_t step, idx, off = 0;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    pa = ALIGN_DOWN(pa, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+
+    while (off < len) {
+        step = pmap_large_size(va + off, pa + off, len - off);
+        if (step > DEFAULT_PAGESIZE) {
+            if (pmap_map_large(vas, va + off, pa + off, prot, step) == 0) {
+                off += step;
+                continue;
+            }
+        }
 
-    if ((status = pmap_get_tbl(vas, va, false, &tbl)) != 0)
-        return status;
+        if (pmap_get_tbl(vas, va + off, true, &tbl) != 0) {
+            pmap_modify_range(vas, va, off, true, 0);
+            return -ENOMEM;
+        }
+
+        /* Fill in this page table up to its end */
+        idx = pmap_get_level_index(1, va + off);
+        do {
+            if (ISSET(tbl[idx], PTE_P))
+                tlb_flush(va + off);
+
+            tbl[idx] = (pa + off) | flags;
+            off += DEFAULT_PAGESIZE;
+        } while (++idx < 512 && off < len);
+    }
+
+    return 0;
+}
+
+int
+pmap_unmap_range(struct vas vas, vaddr_t va, size_t len)
+{
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+    return pmap_modify_range(vas, va, len, true, 0);
+}
+
+int
+pmap_protect_range(struct vas vas, vaddr_t va, size_t len, vm_prot_t prot)
+{
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+    return pmap_modify_range(vas, va, len, false, prot);
+}
+
+/*
+ * Get the physical address and protection of
+ * the page mapped at `va'.
+ *
+ * @vas: Virtual address space.
+ * @va: Virtual address to look up.
+ * @pa: Physical address is written here.
+ * @prot: Protection flags are written here (may be NULL)
+ *
+ * Returns -ENOENT if `va' is not mapped.
+ */
+int
+pmap_lookup(struct vas vas, vaddr_t va, paddr_t *pa, vm_prot_t *prot)
+{
+    uintptr_t *ent;
+    uint64_t pte;
+    uint8_t level;
+    size_t size;
+
+    if ((ent = pmap_get_leaf(vas, va, &level)) == NULL) {
+        return -ENOENT;
+    }
+
+    /* Give the 4 KiB frame within a large page */
+    pte = *ent;
+    size = PMAP_LEVEL_SIZE(level);
+    *pa = (pte & PTE_ADDR_MASK & ~(size - 1)) + (va & (size - 1));
+    *pa = ALIGN_DOWN(*pa, DEFAULT_PAGESIZE);
+    if (prot == NULL) {
+        return 0;
+    }
+
+    *prot = PROT_READ;
+    if (ISSET(pte, PTE_RW))
+        *prot |= PROT_WRITE;
+    if (!ISSET(pte, PTE_NX))
+        *prot |= PROT_EXEC;
+    if (ISSET(pte, PTE_US))
+        *prot |= PROT_USER;
+    if (ISSET(pte, PTE_COW))
+        *prot |= PROT_COW;
+
+    return 0;
+}
+
+/*
+ * XXX: If `va' is in a large page, the caching
+ *      policy is set for the whole large page.
+ */
+int
+pmap_set_cache(struct vas vas, vaddr_t va, int type)
+{
+    uintptr_t *ent;
+    uint64_t flags;
+    uint8_t level;
+
+    if ((ent = pmap_get_leaf(vas, va, &level)) == NULL)
+        return 1;
 
-    idx = pmap_get_level_index(1, va);
-    pa = tbl[idx] & PTE_ADDR_MASK;
-    flags = tbl[idx] & ~PTE_ADDR_MASK;
+    flags = *ent;
 
     /* Set the caching policy */
     switch (type) {
@@ -318,45 +776,88 @@ pmap_set_cache(struct vas vas, vaddr_t va, int type)
         return -EINVAL;
     }
 
-    return pmap_update_tbl(vas, va, (pa | flags), false);
+    *ent = flags;
+    tlb_flush(va);
+    return 0;
 }
 
 bool
 pmap_is_clean(struct vas vas, vaddr_t va)
 {
-    uintptr_t *tbl;
-    int status;
-    size_t idx;
+    uintptr_t *ent;
+    uint8_t level;
 
-    if ((status = pmap_get_tbl(vas, va, false, &tbl)) != 0)
-        return status;
+    if ((ent = pmap_get_leaf(vas, va, &level)) == NULL)
+        return true;
 
-    idx = pmap_get_level_index(1, va);
-    return ISSET(tbl[idx], PTE_DIRTY) == 0;
+    return ISSET(*ent, PTE_DIRTY) == 0;
 }
 
 void
 pmap_mark_clean(struct vas vas, vaddr_t va)
 {
-    uintptr_t *tbl;
-    int status;
-    size_t idx;
+    uintptr_t *ent;
+    uint8_t level;
 
-    if ((status = pmap_get_tbl(vas, va, false, &tbl)) != 0)
+    if ((ent = pmap_get_leaf(vas, va, &level)) == NULL)
         return;
 
-    idx = pmap_get_level_index(1, va);
-    tbl[idx] &= ~PTE_DIRTY;
+    *ent &= ~PTE_DIRTY;
+    pmap_tlb_flush(vas, va, DEFAULT_PAGESIZE);
+}
 
-    if (cpu_count() > 1) {
-        cpu_shootdown_tlb(va);
-    } else {
-        __invlpg(va);
-    }
+void
+pmap_tlb_flush(struct vas vas, vaddr_t va, size_t len)
+{
+    struct tlb_batch tb;
+
+    tb.pcid = vas.pcid;
+    tb.kernel = va >= VM_HIGHER_HALF;
+    tb.all = 0;
+    tb.nrange = 0;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+    tlb_batch_add(&tb, va, len);
+    cpu_shootdown_tlb(&tb);
 }
 
 int
 pmap_init(void)
 {
+    uint32_t eax, ebx, ecx, edx;
+
+    /* See if we can use 1 GiB pages (PDPE1GB) */
+    CPUID(0x80000000, eax, ebx, ecx, edx);
+    if (eax >= 0x80000001) {
+        CPUID(0x80000001, eax, ebx, ecx, edx);
+        have_1gib = ISSET(edx, BIT(26)) != 0;
+    }
+
     return 0;
 }
+
+/*
+ * Zero a page with non-temporal stores, it is likely
+ * not going to be touched again for a while.
+ */
+void
+pmap_zero_page(paddr_t pa)
+{
+    uint64_t *p = PHYS_TO_VIRT(pa);
+
+    for (size_t i = 0; i < DEFAULT_PAGESIZE / sizeof(*p); i += 4) {
+        __ASMV(
+            "movnti %1, 0(%0)\n"
+            "movnti %1, 8(%0)\n"
+            "movnti %1, 16(%0)\n"
+            "movnti %1, 24(%0)"
+            :
+            : "r" (&p[i]), "r" (0UL)
+            : "memory"
+        );
+    }
+
+    /* Order the stores against whoever uses the page next */
+    __ASMV("sfence" ::: "memory");
+}
@@ -34,9 +34,12 @@
 #include <sys/exec.h>
 #include <sys/sched.h>
 #include <sys/schedvar.h>
+#include <sys/callout.h>
 #include <machine/frame.h>
 #include <machine/gdt.h>
 #include <machine/cpu.h>
+#include <machine/tss.h>
+#include <machine/intr.h>
 #include <vm/physmem.h>
 #include <vm/vm.h>
 #include <vm/map.h>
@@ -77,6 +80,7 @@ md_td_stackinit(struct proc *td, void *stack_top, struct exec_prog *prog)
     AUXVAL(sp, AT_PHDR, auxval.at_phdr);
     AUXVAL(sp, AT_PHNUM, auxval.at_phnum);
     AUXVAL(sp, AT_PAGESIZE, DEFAULT_PAGESIZE);
+    AUXVAL(sp, AT_TIMEPAGE, auxval.at_timepage);
     STACK_PUSH(sp, 0);
 
     /* Copy envp pointers */
@@ -220,6 +224,55 @@ md_spawn(struct proc *p, struct proc *parent, uintptr_t ip)
 
     p->stack_base = stack_base;
     tfp->rsp = ALIGN_DOWN((stack_base + PROC_STACK_SIZE) - 1, 16);
+
+    /*
+     * Each thread gets its own syscall stack so that it
+     * may block within the kernel and be resumed later,
+     * possibly on another processor.
+     */
+    p->kstack_base = vm_alloc_frame(PROC_KSTACK_PAGES);
+    if (p->kstack_base == 0) {
+        pmap_destroy_vas(pcbp->addrsp);
+        return -ENOMEM;
+    }
+
+    p->kstack_base += VM_HIGHER_HALF;
+    return 0;
+}
+
+/*
+ * MD fork code, the child gets a fresh address space
+ * and kernel stack and resumes from `tf' with a
+ * return value of zero.
+ *
+ * @p: New process.
+ * @parent: Parent of new process.
+ * @tf: Trapframe for the child to resume from.
+ * @ip: Instruction pointer to start at (0 to keep `tf')
+ */
+int
+md_fork(struct proc *p, struct proc *parent, const struct trapframe *tf,
+        uintptr_t ip)
+{
+    struct pcb *pcbp = &p->pcb;
+    int error;
+
+    if ((error = pmap_new_vas(&pcbp->addrsp)) != 0)
+        return error;
+
+    memcpy(&p->tf, tf, sizeof(p->tf));
+    if (ip != 0)
+        p->tf.rip = ip;
+
+    p->tf.rax = 0;
+    p->stack_base = parent->stack_base;
+    p->kstack_base = vm_alloc_frame(PROC_KSTACK_PAGES);
+    if (p->kstack_base == 0) {
+        pmap_destroy_vas(pcbp->addrsp);
+        return -ENOMEM;
+    }
+
+    p->kstack_base += VM_HIGHER_HALF;
     return 0;
 }
 
@@ -247,6 +300,7 @@ sched_switch_to(struct trapframe *tf, struct proc *td)
     struct cpu_info *ci;
     struct sched_cpu *cpustat;
     struct pcb *pcbp;
+    union tss_stack kstack;
 
     ci = this_cpu();
 
@@ -254,6 +308,18 @@ sched_switch_to(struct trapframe *tf, struct proc *td)
         memcpy(tf, &td->tf, sizeof(*tf));
     }
 
+    /*
+     * Syscalls, faults and interrupts from this thread now
+     * use its own stack, so it may sleep in the kernel
+     * without another thread landing on its frames.
+     */
+    if (td->kstack_base != 0) {
+        kstack.top = td->kstack_base + PROC_KSTACK_SIZE;
+        tss_update_ist(ci, kstack, IST_SYSCALL);
+        tss_update_rsp0(ci, kstack);
+        ci->syscall_stack = kstack.top;
+    }
+
     /* Update stats */
     cpustat = &ci->stat;
     atomic_inc_64(&cpustat->nswitch);
@@ -308,21 +374,44 @@ md_sched_switch(struct trapframe *tf)
         return;
     }
 
+    /* The timer also fires for expired callouts */
+    callout_tick();
     td = ci->curtd;
+    if (!sched_need_switch(td)) {
+        sched_timer_arm(td, false);
+        return;
+    }
+
     mi_sched_switch(td);
+    if (td != NULL && td->pid == 0) {
+        return;
+    }
 
-    if (td != NULL) {
-        if (td->pid == 0)
+    /*
+     * Pick the next thread before giving up the current
+     * one. Once the current thread is saved it may be
+     * stolen or woken up by another processor, so we
+     * must never fall back to running it after that.
+     *
+     * If nothing else is ready, keep running the current
+     * thread unless it is going to sleep (or there is none),
+     * in which case we fall back to the idle thread of this
+     * processor.
+     */
+    if ((next_td = sched_dequeue_td()) == NULL) {
+        if (td == NULL || ISSET(td->flags, PROC_SLEEP)) {
+            next_td = sched_idle_td();
+        }
+        if (next_td == NULL || next_td == td) {
+            sched_timer_arm(td, true);
             return;
-
-        sched_save_td(td, tf);
+        }
     }
 
-    if ((next_td = sched_dequeue_td()) == NULL) {
-        sched_oneshot(false);
-        return;
+    if (td != NULL) {
+        sched_save_td(td, tf);
     }
 
     sched_switch_to(tf, next_td);
-    sched_oneshot(false);
+    sched_timer_arm(next_td, true);
 }
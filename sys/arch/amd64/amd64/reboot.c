@@ -30,6 +30,7 @@
 #include <sys/reboot.h>
 #include <sys/param.h>
 #include <sys/cdefs.h>
+#include <sys/bio.h>
 #include <machine/pio.h>
 #include <machine/cpu.h>
 #include <dev/acpi/acpi.h>
@@ -96,6 +97,8 @@ cpu_reboot(int method)
 scret_t
 sys_reboot(struct syscall_args *scargs)
 {
+    /* Don't lose delayed writes */
+    bio_flush(NULL);
     cpu_reboot(scargs->arg0);
     __builtin_unreachable();
 }
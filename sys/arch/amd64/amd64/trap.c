@@ -29,6 +29,7 @@
 
 #include <sys/param.h>
 #include <sys/cdefs.h>
+#include <sys/errno.h>
 #include <sys/reboot.h>
 #include <sys/panic.h>
 #include <sys/syslog.h>
@@ -40,6 +41,9 @@
 #include <machine/trap.h>
 #include <machine/frame.h>
 #include <machine/intr.h>
+#include <vm/pmap.h>
+#include <vm/map.h>
+#include <vm/vm.h>
 
 #define pr_error(fmt, ...) kprintf("trap: " fmt, ##__VA_ARGS__)
 
@@ -79,6 +83,37 @@ pf_faultaddr(void)
     return cr2;
 }
 
+/*
+ * Try to resolve a page fault on a user address by
+ * paging in memory that was never touched or copying
+ * a copy-on-write page.
+ *
+ * Returns 0 if the access may be retried.
+ */
+static int
+pf_resolve(struct trapframe *tf)
+{
+    uintptr_t va = pf_faultaddr();
+    vm_prot_t access = PROT_READ;
+
+    /* Only writes may fix up a protection violation */
+    if (ISSET(tf->error_code, BIT(0)) && !ISSET(tf->error_code, BIT(1))) {
+        return -EFAULT;
+    }
+    if (va >= VM_HIGHER_HALF) {
+        return -EFAULT;
+    }
+
+    if (ISSET(tf->error_code, BIT(1))) {
+        access |= PROT_WRITE;
+    }
+    if (ISSET(tf->error_code, BIT(4))) {
+        access |= PROT_EXEC;
+    }
+
+    return vm_fault(va, access);
+}
+
 static void
 pf_code(uint64_t error_code)
 {
@@ -186,6 +221,11 @@ trap_handler(struct trapframe *tf)
         panic("got unknown trap %d\n", tf->trapno);
     }
 
+    /* Demand paged memory */
+    if (tf->trapno == TRAP_PAGEFLT && pf_resolve(tf) == 0) {
+        return;
+    }
+
     pr_error("got %s\n", trap_type[tf->trapno]);
 
     /* Handle traps from userland */
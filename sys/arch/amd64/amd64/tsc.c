@@ -33,9 +33,13 @@
 #include <sys/cdefs.h>
 #include <sys/driver.h>
 #include <sys/syslog.h>
+#include <sys/time.h>
+#include <dev/timer.h>
 #include <machine/tsc.h>
 #include <machine/asm.h>
+#include <machine/cpu.h>
 #include <machine/cpuid.h>
+#include <machine/isa/i8254.h>
 
 /* See kconf(9) */
 #if defined(__USER_TSC)
@@ -47,14 +51,180 @@
 #define pr_trace(fmt, ...) kprintf("tsc: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
 
+#define NSEC_PER_SECOND 1000000000ULL
+#define USEC_PER_SECOND 1000000ULL
+
+/* Calibration window against the reference clock */
+#define TSC_CAL_USEC    10000
+
 static uint64_t tsc_i = 0;
 
+/*
+ * Clocksource state, set up once on the BSP. The TSC
+ * is scaled with 32.32 fixed point multipliers and
+ * offset by the time the previous clock reported when
+ * we took over so that time never goes backwards.
+ */
+static struct timer tsc_timer;
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t usec_mult = 0;
+static uint64_t nsec_mult = 0;
+static size_t base_usec = 0;
+static size_t base_nsec = 0;
+
 uint64_t
 rdtsc_rel(void)
 {
     return rdtsc() - tsc_i;
 }
 
+/*
+ * Scale a TSC delta with a 32.32 fixed point
+ * multiplier.
+ */
+static inline uint64_t
+tsc_scale(uint64_t delta, uint64_t mult)
+{
+    return ((__uint128_t)delta * mult) >> 32;
+}
+
+static size_t
+tsc_time_usec(void)
+{
+    return base_usec + tsc_scale(rdtsc() - tsc_base, usec_mult);
+}
+
+static size_t
+tsc_time_nsec(void)
+{
+    return base_nsec + tsc_scale(rdtsc() - tsc_base, nsec_mult);
+}
+
+static size_t
+tsc_time_sec(void)
+{
+    return tsc_time_usec() / USEC_PER_SECOND;
+}
+
+/*
+ * Spin for `n' units where there are `per_sec'
+ * units in a second.
+ */
+static int
+tsc_sleep(uint64_t n, uint64_t per_sec)
+{
+    uint64_t end;
+
+    end = rdtsc() + tsc_ticks(n, per_sec);
+    while (rdtsc() < end) {
+        md_pause();
+    }
+
+    return 0;
+}
+
+static int
+tsc_msleep(size_t ms)
+{
+    return tsc_sleep(ms, 1000);
+}
+
+static int
+tsc_usleep(size_t us)
+{
+    return tsc_sleep(us, USEC_PER_SECOND);
+}
+
+static int
+tsc_nsleep(size_t ns)
+{
+    return tsc_sleep(ns, NSEC_PER_SECOND);
+}
+
+/*
+ * Get the TSC frequency from CPUID leaf 0x15 if the
+ * processor enumerates both the crystal clock and the
+ * TSC/crystal ratio. Returns 0 if it does not.
+ */
+static uint64_t
+tsc_cpuid_freq(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    CPUID(0x00, eax, ebx, ecx, edx);
+    if (eax < 0x15) {
+        return 0;
+    }
+
+    CPUID(0x15, eax, ebx, ecx, edx);
+    if (eax == 0 || ebx == 0 || ecx == 0) {
+        return 0;
+    }
+
+    return ((uint64_t)ecx * ebx) / eax;
+}
+
+/*
+ * Measure the TSC frequency against the general purpose
+ * timer, or against the i8254 if there is none.
+ *
+ * @gp: General purpose timer, NULL if none.
+ */
+static uint64_t
+tsc_calibrate(const struct timer *gp)
+{
+    uint64_t tsc_start, tsc_end;
+    size_t start, end;
+    uint16_t pit_start;
+    const uint16_t PIT_TICKS = (I8254_DIVIDEND * TSC_CAL_USEC) / USEC_PER_SECOND;
+
+    if (gp != NULL) {
+        start = gp->get_time_usec();
+        tsc_start = rdtsc();
+        do {
+            end = gp->get_time_usec();
+        } while ((end - start) < TSC_CAL_USEC);
+
+        tsc_end = rdtsc();
+        return ((tsc_end - tsc_start) * USEC_PER_SECOND) / (end - start);
+    }
+
+    /* The i8254 counts down from the reload value */
+    i8254_set_reload(0xFFFF);
+    pit_start = i8254_get_count();
+    tsc_start = rdtsc();
+    while ((uint16_t)(pit_start - i8254_get_count()) < PIT_TICKS);
+
+    tsc_end = rdtsc();
+    return ((tsc_end - tsc_start) * I8254_DIVIDEND) / PIT_TICKS;
+}
+
+/*
+ * Convert `n' units to TSC ticks where there are
+ * `per_sec' units in a second.
+ */
+uint64_t
+tsc_ticks(uint64_t n, uint64_t per_sec)
+{
+    uint64_t q, r;
+
+    /* Split up to avoid overflow without 128-bit division */
+    q = tsc_hz / per_sec;
+    r = tsc_hz % per_sec;
+    return (n * q) + ((n / per_sec) * r) + (((n % per_sec) * r) / per_sec);
+}
+
+/*
+ * Returns true if the TSC has been calibrated
+ * and may be used to keep time.
+ */
+bool
+tsc_usable(void)
+{
+    return tsc_hz != 0;
+}
+
 /*
  * Check if the TSC and RDTSC instruction is
  * supported on the current CPU.
@@ -75,6 +245,73 @@ tsc_check(void)
     return -ENOTSUP;
 }
 
+/*
+ * Calibrate the TSC and, if it is invariant, make it the
+ * general purpose clock. This must be called on the BSP
+ * before anything caches TIMER_GP. If the TSC may stop or
+ * change rate, the HPET is left in place.
+ *
+ * @ci: Processor to use the feature bits of.
+ */
+void
+tsc_clock_init(struct cpu_info *ci)
+{
+    struct timer gp;
+    struct timer *gpp = NULL;
+    tmrr_status_t tmr_status;
+
+    if (tsc_check() != 0) {
+        return;
+    }
+
+    tmr_status = req_timer(TIMER_GP, &gp);
+    if (tmr_status == TMRR_SUCCESS && gp.get_time_usec != NULL) {
+        gpp = &gp;
+    }
+
+    if ((tsc_hz = tsc_cpuid_freq()) == 0) {
+        tsc_hz = tsc_calibrate(gpp);
+    }
+
+    if (tsc_hz == 0) {
+        pr_error("failed to calibrate TSC\n");
+        return;
+    }
+
+    pr_trace("%d MHz\n", tsc_hz / USEC_PER_SECOND);
+    if (!ISSET(ci->feat, CPU_FEAT_TSCINV)) {
+        pr_trace("TSC not invariant, not using as clock\n");
+        return;
+    }
+
+    usec_mult = (USEC_PER_SECOND << 32) / tsc_hz;
+    nsec_mult = (NSEC_PER_SECOND << 32) / tsc_hz;
+
+    /* Continue where the old clock left off */
+    tsc_base = rdtsc();
+    if (gpp != NULL) {
+        base_usec = gpp->get_time_usec();
+        base_nsec = (gpp->get_time_nsec != NULL)
+            ? gpp->get_time_nsec()
+            : base_usec * 1000;
+    }
+
+    tsc_timer.name = "TIME_STAMP_COUNTER";
+    tsc_timer.msleep = tsc_msleep;
+    tsc_timer.usleep = tsc_usleep;
+    tsc_timer.nsleep = tsc_nsleep;
+    tsc_timer.get_time_usec = tsc_time_usec;
+    tsc_timer.get_time_nsec = tsc_time_nsec;
+    tsc_timer.get_time_sec = tsc_time_sec;
+    tsc_timer.flags = TIMER_MONOTONIC;
+
+    if (gpp != NULL) {
+        tmr_registry_overwrite(TIMER_GP, &tsc_timer);
+    } else {
+        register_timer(TIMER_GP, &tsc_timer);
+    }
+}
+
 static int
 tsc_init(void)
 {
@@ -103,6 +340,16 @@ tsc_init(void)
     }
 
     amd64_write_cr4(cr4);
+
+    /*
+     * Let userspace read the clock through the time page
+     * if it is allowed to use 'rdtsc' and the TSC is the
+     * clock in the first place.
+     */
+    if (usec_mult != 0 && !ISSET(cr4, CR4_TSD)) {
+        timepage_set_clock(tsc_base, nsec_mult, base_nsec);
+    }
+
     return 0;
 }
 
@@ -74,6 +74,22 @@ alloc_resources(struct cpu_info *ci)
     }
 }
 
+/*
+ * Update the stack the processor switches to when
+ * entering the kernel from user mode.
+ *
+ * @stack: Kernel stack.
+ */
+void
+tss_update_rsp0(struct cpu_info *ci, union tss_stack stack)
+{
+    volatile struct tss_entry *tss = ci->tss;
+
+    __assert(tss != NULL);
+    tss->rsp0_lo = stack.top_lo;
+    tss->rsp0_hi = stack.top_hi;
+}
+
 /*
  * Update interrupt stack table entry `istno' with `stack'
  *
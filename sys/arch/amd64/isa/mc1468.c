@@ -256,6 +256,7 @@ mc1468_dev_write(dev_t dev, struct sio_txn *sio, int flags)
 
     memcpy(&d, sio->buf, sio->len);
     mc1468_set_date(&d);
+    timepage_set_wall(date_to_time(&d));
     return sio->len;
 }
 
@@ -263,9 +264,14 @@ static int
 mc1468_init(void)
 {
     char devname[] = "rtc";
+    struct date d;
     devmajor_t major;
     dev_t dev;
 
+    /* Publish the wall clock base */
+    mc1468_get_date(&d);
+    timepage_set_wall(date_to_time(&d));
+
     major = dev_alloc_major();
     dev = dev_alloc(major);
     dev_register(major, dev, &mc1468_cdevsw);
@@ -218,3 +218,52 @@ pci_enable_msix(struct pci_device *dev, const struct msi_intr *intr)
     pci_writel(dev, dev->msix_capoff, msg_ctl);
     return 0;
 }
+
+/*
+ * Route an MSI-X table entry to a processor. The entry
+ * gets the interrupt vector of entry 0 so pci_enable_msix()
+ * must have been called first.
+ *
+ * @dev: Device to route an entry of.
+ * @entry: MSI-X table entry.
+ * @ci: Processor to deliver the interrupt to.
+ */
+int
+pci_msix_route(struct pci_device *dev, uint16_t entry, struct cpu_info *ci)
+{
+    volatile uint64_t *tbl;
+    uint32_t data, msg_ctl;
+    uint64_t tmp;
+    uint16_t tbl_off, tbl_size;
+    uint8_t bir, vector;
+
+    if (dev->msix_capoff == 0)
+        return -ENOTSUP;
+
+    /* MSI-X must be enabled, table size is bits 26:16 */
+    msg_ctl = pci_readl(dev, dev->msix_capoff);
+    if (!ISSET(msg_ctl, BIT(31)))
+        return -ENOTSUP;
+
+    tbl_size = ((msg_ctl >> 16) & 0x7FF) + 1;
+    if (entry >= tbl_size)
+        return -EINVAL;
+
+    data = pci_readl(dev, (dev->msix_capoff + 0x04));
+    bir = data & 3;
+    tbl_off = data & ~3;
+
+    tbl = (void *)((dev->bar[bir] & PCI_BAR_MEMMASK) + MMIO_OFFSET);
+    tbl = (void *)((char *)tbl + tbl_off);
+    vector = mmio_read64(&tbl[1]) & 0xFF;
+
+    /* Mask the entry while it is being changed */
+    tbl = &tbl[entry * 2];
+    tmp = mmio_read64(&tbl[1]);
+    mmio_write64(&tbl[1], tmp | BIT(32));
+    mmio_write64(&tbl[0], (0xFEE00000 | (ci->apicid << 12)));
+
+    tmp &= ~(0xFFFFFFFFULL | BIT(32));
+    mmio_write64(&tbl[1], tmp | vector);
+    return 0;
+}
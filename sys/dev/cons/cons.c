@@ -707,6 +707,7 @@ cons_expose(void)
 
     /* Register feat ctl */
     ctl.mode = 0666;
+    ctl.data = NULL;
     ctlfs_create_node(devname, &ctl);
     ctl.devname = devname;
     ctl.ops = &cons_feat_ctl;
@@ -28,157 +28,353 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/errno.h>
 #include <dev/dcdr/cache.h>
+#include <fs/ctlfs.h>
 #include <vm/dynalloc.h>
+#include <vm/kmem.h>
+#include <vm/physmem.h>
+#include <vm/vm.h>
 #include <string.h>
 
+#define DCDR_HASH_MUL 0x9E3779B97F4A7C15ULL
+
+#define dcd_resident(DCD) \
+    ((DCD)->state == DCD_A1IN || (DCD)->state == DCD_AM)
+
+static const struct ctlops dcdr_ctl;
+static struct kmem_cache *dcd_cache;
+static struct spinlock dcd_cache_lock;
+
+/*
+ * Get the hash bucket of a logical block.
+ */
+static inline struct dcd **
+dcdr_bucket(struct dcdr *dcdr, off_t lba)
+{
+    uint64_t hash;
+
+    hash = ((uint64_t)lba * DCDR_HASH_MUL) >> 32;
+    return &dcdr->hash[hash & (dcdr->nhash - 1)];
+}
+
+/*
+ * Find the DCD (resident or ghost) of a
+ * logical block.
+ */
+static struct dcd *
+dcdr_find(struct dcdr *dcdr, off_t lba)
+{
+    struct dcd *dcd = *dcdr_bucket(dcdr, lba);
+
+    while (dcd != NULL) {
+        if (dcd->lba == lba) {
+            return dcd;
+        }
+
+        dcd = dcd->hnext;
+    }
+
+    return NULL;
+}
+
+static void
+dcdr_hash_remove(struct dcdr *dcdr, struct dcd *dcd)
+{
+    struct dcd **dcdp = dcdr_bucket(dcdr, dcd->lba);
+
+    while (*dcdp != NULL) {
+        if (*dcdp == dcd) {
+            *dcdp = dcd->hnext;
+            break;
+        }
+
+        dcdp = &(*dcdp)->hnext;
+    }
+
+    dcd->hnext = NULL;
+}
+
+/*
+ * Take a DCD off of the queue its state
+ * says it is on.
+ */
+static void
+dcdr_unlink(struct dcdr *dcdr, struct dcd *dcd)
+{
+    switch (dcd->state) {
+    case DCD_A1IN:
+        TAILQ_REMOVE(&dcdr->a1in, dcd, link);
+        --dcdr->n_a1in;
+        break;
+    case DCD_AM:
+        TAILQ_REMOVE(&dcdr->am, dcd, link);
+        break;
+    case DCD_A1OUT:
+        TAILQ_REMOVE(&dcdr->a1out, dcd, link);
+        --dcdr->n_a1out;
+        break;
+    case DCD_FREE:
+        TAILQ_REMOVE(&dcdr->freeq, dcd, link);
+        break;
+    }
+}
+
+/*
+ * Give the block buffer of a resident DCD
+ * back to the pool.
+ */
+static void
+dcdr_drop_block(struct dcdr *dcdr, struct dcd *dcd)
+{
+    dcdr->bfree[dcdr->nbfree++] = dcd->block;
+    dcd->block = NULL;
+    --dcdr->size;
+}
+
 /*
  * Remove a DCD from a DCDR.
  */
 static void
 dcdr_remove(struct dcdr *dcdr, struct dcd *dcd)
 {
-    /* Handle the head being invalidated */
-    if (dcd == dcdr->head) {
-        dcdr->head = dcd->next;
-        return;
+    if (dcd_resident(dcd)) {
+        dcdr_drop_block(dcdr, dcd);
     }
 
-    /* Handle the tail being invalidated */
-    if (dcd == dcdr->tail) {
-        dcdr->tail = dcd->prev;
+    dcdr_unlink(dcdr, dcd);
+    dcdr_hash_remove(dcdr, dcd);
+    dcd->state = DCD_FREE;
+    TAILQ_INSERT_HEAD(&dcdr->freeq, dcd, link);
+}
+
+/*
+ * Make room for one more resident block if the
+ * DCDR is full. Blocks that were only seen once
+ * go first and are remembered as ghosts, otherwise
+ * the least recently used hot block is evicted.
+ */
+static void
+dcdr_reclaim(struct dcdr *dcdr)
+{
+    struct dcd *dcd;
+
+    if (dcdr->size < dcdr->cap) {
         return;
     }
 
-    if (dcd->prev != NULL) {
-        dcd->prev->next = dcd->next;
-    }
+    ++dcdr->stat.evictions;
+    if (dcdr->n_a1in > dcdr->kin || TAILQ_EMPTY(&dcdr->am)) {
+        dcd = TAILQ_LAST(&dcdr->a1in, dcd_queue);
+        dcdr_unlink(dcdr, dcd);
+        dcdr_drop_block(dcdr, dcd);
 
-    if (dcd->next != NULL) {
-        dcd->next->prev = dcd->prev;
-    }
+        dcd->state = DCD_A1OUT;
+        TAILQ_INSERT_HEAD(&dcdr->a1out, dcd, link);
+        ++dcdr->n_a1out;
 
-    if (dcdr->size > 0) {
-        --dcdr->size;
+        /* Forget the oldest ghost */
+        if (dcdr->n_a1out > dcdr->kout) {
+            dcd = TAILQ_LAST(&dcdr->a1out, dcd_queue);
+            dcdr_remove(dcdr, dcd);
+        }
+        return;
     }
+
+    dcd = TAILQ_LAST(&dcdr->am, dcd_queue);
+    dcdr_remove(dcdr, dcd);
 }
 
 /*
- * Evict a DCD with the lowest hit count
- * from a DCDR.
+ * Look up a resident block and count the access.
+ * Must be called with the DCDR lock held.
  */
-static void
-dcdr_evict_least(struct dcdr *dcdr)
+static struct dcd *
+dcdr_access(struct dcdr *dcdr, off_t lba)
 {
-    struct dcd *tmp = dcdr->head;
-    struct dcd *cnp = NULL;    /* Candidate */
-
-    /* Find DCD eviction candidate */
-    while (tmp != NULL) {
-        if (cnp == NULL) {
-            cnp = tmp;
-            continue;
-        }
+    struct dcd *dcd;
 
-        if (tmp->hit_count < cnp->hit_count) {
-            cnp = tmp;
-        }
+    dcd = dcdr_find(dcdr, lba);
+    if (dcd == NULL || !dcd_resident(dcd)) {
+        ++dcdr->stat.misses;
+        return NULL;
+    }
 
-        tmp = tmp->next;
+    ++dcdr->stat.hits;
+    ++dcd->hit_count;
+
+    /* A1in is a FIFO, only Am hits are reordered */
+    if (dcd->state == DCD_AM) {
+        TAILQ_REMOVE(&dcdr->am, dcd, link);
+        TAILQ_INSERT_HEAD(&dcdr->am, dcd, link);
     }
 
-    /* Invalidate DCD found if any */
-    if (cnp != NULL) {
-        dcdr_invldcd(dcdr, cnp->lba);
+    return dcd;
+}
+
+/*
+ * Get the object cache DCDs come from, it is
+ * set up along with the first DCDR.
+ */
+static struct kmem_cache *
+dcdr_dcd_cache(void)
+{
+    spinlock_acquire(&dcd_cache_lock);
+    if (dcd_cache == NULL) {
+        dcd_cache = kmem_cache_create("dcd", sizeof(struct dcd), 0);
     }
+
+    spinlock_release(&dcd_cache_lock);
+    return dcd_cache;
 }
 
 /*
  * Allocates a DCDR structure using a
  * specific block size.
  *
+ * @bsize: Block size in bytes.
+ * @cap: Number of blocks to cache.
+ *
  * Returns NULL on failure.
  */
 struct dcdr *
 dcdr_alloc(size_t bsize, size_t cap)
 {
     struct dcdr *tmp;
+    struct dcd *dcd;
+    struct kmem_cache *kcp;
+    size_t ndcd, npages;
+    uintptr_t pool;
+
+    if (bsize == 0 || cap == 0) {
+        return NULL;
+    }
+    if ((kcp = dcdr_dcd_cache()) == NULL) {
+        return NULL;
+    }
 
     tmp = dynalloc(sizeof(*tmp));
     if (tmp == NULL) {
         return NULL;
     }
 
+    memset(tmp, 0, sizeof(*tmp));
     tmp->bsize = bsize;
-    tmp->head = NULL;
-    tmp->tail = NULL;
     tmp->cap = cap;
-    tmp->size = 0;
+    tmp->kin = MAX(cap / 4, 1);
+    tmp->kout = MAX(cap / 2, 1);
+    tmp->stat.cap = cap;
+    tmp->stat.bsize = bsize;
+    TAILQ_INIT(&tmp->a1in);
+    TAILQ_INIT(&tmp->a1out);
+    TAILQ_INIT(&tmp->am);
+    TAILQ_INIT(&tmp->freeq);
+
+    /* Keep chains short, one bucket per block */
+    tmp->nhash = 1;
+    while (tmp->nhash < cap) {
+        tmp->nhash <<= 1;
+    }
+
+    /* Enough descriptors for every block and ghost */
+    ndcd = cap + tmp->kout;
+    tmp->hash = dynalloc(tmp->nhash * sizeof(*tmp->hash));
+    tmp->bfree = dynalloc(cap * sizeof(*tmp->bfree));
+    if (tmp->hash == NULL || tmp->bfree == NULL) {
+        goto fail;
+    }
+
+    for (size_t i = 0; i < ndcd; ++i) {
+        if ((dcd = kmem_cache_alloc(kcp, KMEM_ZERO)) == NULL) {
+            goto fail;
+        }
+
+        TAILQ_INSERT_TAIL(&tmp->freeq, dcd, link);
+    }
+
+    /* Carve the block buffers out of one slab */
+    npages = ALIGN_UP(bsize * cap, DEFAULT_PAGESIZE) / DEFAULT_PAGESIZE;
+    if ((pool = vm_alloc_frame(npages)) == 0) {
+        goto fail;
+    }
+
+    pool = (uintptr_t)PHYS_TO_VIRT(pool);
+    for (size_t i = 0; i < cap; ++i) {
+        tmp->bfree[tmp->nbfree++] = (void *)(pool + (i * bsize));
+    }
+
+    memset(tmp->hash, 0, tmp->nhash * sizeof(*tmp->hash));
     return tmp;
+fail:
+    while ((dcd = TAILQ_FIRST(&tmp->freeq)) != NULL) {
+        TAILQ_REMOVE(&tmp->freeq, dcd, link);
+        kmem_cache_free(kcp, dcd);
+    }
+
+    if (tmp->hash != NULL)
+        dynfree(tmp->hash);
+    if (tmp->bfree != NULL)
+        dynfree(tmp->bfree);
+
+    dynfree(tmp);
+    return NULL;
 }
 
 /*
  * Cache a logical block and return a DCD that
- * describes it. This will allocate a block and
- * copy `block` to the allocated memory.
+ * describes it. This will copy `block` into a
+ * block buffer owned by the DCDR.
  */
 struct dcd *
 dcdr_cachein(struct dcdr *dcdr, void *block, off_t lba)
 {
-    struct dcd *dcd, *tmp;
-    struct dcdr_lookup check;
-    int status;
+    struct dcd *dcd;
+
+    spinlock_acquire(&dcdr->lock);
 
     /*
      * If there is already a block within this
      * DCDR, then we simply need to copy the
      * new data into the old DCD.
      */
-    status = dcdr_lookup(dcdr, lba, &check);
-    if (status == 0) {
-        dcd = check.dcd_res;
+    dcd = dcdr_find(dcdr, lba);
+    if (dcd != NULL && dcd_resident(dcd)) {
         memcpy(dcd->block, block, dcdr->bsize);
+        spinlock_release(&dcdr->lock);
         return dcd;
     }
 
-    dcd = dynalloc(sizeof(*dcd));
-    if (dcd == NULL) {
-        return NULL;
-    }
-
-    memset(dcd, 0, sizeof(*dcd));
-    dcd->block = dynalloc(dcdr->bsize);
-    if (dcd->block == NULL) {
-        dynfree(dcd);
-        return NULL;
-    }
-
-    dcd->lba = lba;
-    dcd->next = NULL;
-    dcd->hit_count = 0;
-    memcpy(block, dcd->block, dcdr->bsize);
-
     /*
-     * If we've hit the capacity of the DCDR then
-     * we will need to evict some DCD to make room
-     * for this new one.
+     * A ghost means this block was evicted not long
+     * ago, it is being reused so make it hot.
      */
-    if (dcdr->size >= dcdr->cap) {
-        dcdr_evict_least(dcdr);
-    }
-
-    /* Insert DCD into DCDR */
-    if (dcdr->head == NULL) {
-        dcdr->head = dcd;
-        dcdr->tail = dcd;
+    if (dcd != NULL) {
+        ++dcdr->stat.ghost_hits;
+        dcdr_unlink(dcdr, dcd);
+        dcdr_reclaim(dcdr);
+        dcd->state = DCD_AM;
+        TAILQ_INSERT_HEAD(&dcdr->am, dcd, link);
     } else {
-        tmp = dcdr->tail;
-        dcd->prev = tmp;
-        tmp->next = dcd;
-        dcdr->tail = dcd;
+        dcdr_reclaim(dcdr);
+        dcd = TAILQ_FIRST(&dcdr->freeq);
+        TAILQ_REMOVE(&dcdr->freeq, dcd, link);
+
+        dcd->lba = lba;
+        dcd->hit_count = 0;
+        dcd->hnext = *dcdr_bucket(dcdr, lba);
+        *dcdr_bucket(dcdr, lba) = dcd;
+
+        dcd->state = DCD_A1IN;
+        TAILQ_INSERT_HEAD(&dcdr->a1in, dcd, link);
+        ++dcdr->n_a1in;
     }
 
+    dcd->block = dcdr->bfree[--dcdr->nbfree];
+    memcpy(dcd->block, block, dcdr->bsize);
     ++dcdr->size;
+
+    spinlock_release(&dcdr->lock);
     return dcd;
 }
 
@@ -194,8 +390,7 @@ dcdr_lbc_cachein(struct dcdr *dcdr, void *block, off_t lba)
     struct dcd *tmp;
 
     tmp = dcdr_cachein(dcdr, block, lba);
-    dcdr_cachein(dcdr, (char *)block + dcdr->bsize, lba);
-    tmp->lbc = 1;
+    dcdr_cachein(dcdr, (char *)block + dcdr->bsize, lba + 1);
     return tmp;
 }
 
@@ -204,36 +399,52 @@ dcdr_lbc_cachein(struct dcdr *dcdr, void *block, off_t lba)
  *
  * Returns 0 upon a cache hit with "res" being set
  * and returns a less than 0 value upon a cache miss.
+ *
+ * XXX: The block may be evicted as soon as this
+ *      returns, callers that do not serialize their
+ *      own cache use should use dcdr_read().
  */
 int
 dcdr_lookup(struct dcdr *dcdr, off_t lba, struct dcdr_lookup *res)
 {
-    struct dcdr_lookup ret;
-    struct dcd *tmp = dcdr->head;
-
-    while (tmp != NULL) {
-        if (tmp->lba == lba) {
-            ++tmp->hit_count;
-            ret.dcd_res = tmp;
-            ret.lba = lba;
-            ret.buf = tmp->block;
-            *res = ret;
-            return 0;
-        }
+    struct dcd *dcd;
 
-        if (tmp->lbc && tmp->lba == (lba - 1)) {
-            ++tmp->hit_count;
-            ret.dcd_res = tmp;
-            ret.lba = lba;
-            ret.buf = (char *)tmp->block + dcdr->bsize;
-            *res = ret;
-            return 0;
-        }
+    spinlock_acquire(&dcdr->lock);
+    dcd = dcdr_access(dcdr, lba);
+    spinlock_release(&dcdr->lock);
 
-        tmp = tmp->next;
+    if (dcd == NULL) {
+        return -1;
+    }
+
+    res->dcd_res = dcd;
+    res->lba = lba;
+    res->buf = dcd->block;
+    return 0;
+}
+
+/*
+ * Copy a cached logical block out of the cache.
+ *
+ * @dcdr: DCDR to read from.
+ * @lba: Logical block to read.
+ * @buf: Buffer of at least one block.
+ *
+ * Returns 0 upon a cache hit and a less
+ * than 0 value upon a cache miss.
+ */
+int
+dcdr_read(struct dcdr *dcdr, off_t lba, void *buf)
+{
+    struct dcd *dcd;
+
+    spinlock_acquire(&dcdr->lock);
+    if ((dcd = dcdr_access(dcdr, lba)) != NULL) {
+        memcpy(buf, dcd->block, dcdr->bsize);
     }
 
-    return -1;
+    spinlock_release(&dcdr->lock);
+    return (dcd != NULL) ? 0 : -1;
 }
 
 /*
@@ -242,18 +453,68 @@ dcdr_lookup(struct dcdr *dcdr, off_t lba, struct dcdr_lookup *res)
 int
 dcdr_invldcd(struct dcdr *dcdr, off_t lba)
 {
-    struct dcdr_lookup tmp;
     struct dcd *dcd;
-    int error;
 
-    if ((error = dcdr_lookup(dcdr, lba, &tmp)) < 0) {
-        return error;
+    spinlock_acquire(&dcdr->lock);
+    if ((dcd = dcdr_find(dcdr, lba)) != NULL) {
+        dcdr_remove(dcdr, dcd);
     }
 
-    dcd = tmp.dcd_res;
-    dcdr_remove(dcdr, dcd);
+    spinlock_release(&dcdr->lock);
+    return (dcd != NULL) ? 0 : -1;
+}
 
-    dynfree(dcd->block);
-    dynfree(dcd);
-    return 0;
+/*
+ * Get the statistics of a DCDR.
+ */
+void
+dcdr_stat(struct dcdr *dcdr, struct dcdr_stat *res)
+{
+    spinlock_acquire(&dcdr->lock);
+    *res = dcdr->stat;
+    res->size = dcdr->size;
+    spinlock_release(&dcdr->lock);
+}
+
+/*
+ * Expose the statistics of a DCDR as the
+ * "cache" entry of a ctlfs node.
+ *
+ * @dcdr: DCDR to expose.
+ * @devname: Existing ctlfs node (e.g., "sd0")
+ */
+int
+dcdr_ctl_attach(struct dcdr *dcdr, const char *devname)
+{
+    struct ctlfs_dev ctl;
+
+    ctl.devname = devname;
+    ctl.ops = &dcdr_ctl;
+    ctl.mode = 0444;
+    ctl.data = dcdr;
+    return ctlfs_create_entry("cache", &ctl);
 }
+
+static int
+dcdr_ctl_read(struct ctlfs_dev *cdp, struct sio_txn *sio)
+{
+    struct dcdr_stat stat;
+    size_t len;
+
+    if (sio == NULL || sio->buf == NULL) {
+        return -EINVAL;
+    }
+    if (cdp->data == NULL) {
+        return -EIO;
+    }
+
+    dcdr_stat(cdp->data, &stat);
+    len = MIN(sio->len, sizeof(stat));
+    memcpy(sio->buf, &stat, len);
+    return len;
+}
+
+static const struct ctlops dcdr_ctl = {
+    .read = dcdr_ctl_read,
+    .write = NULL
+};
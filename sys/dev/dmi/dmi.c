@@ -246,6 +246,7 @@ dmi_init_ctl(void)
 
     /* Create '/ctl/dmi/board' */
     ctl.mode = 0444;
+    ctl.data = NULL;
     ctlfs_create_node(ctlname, &ctl);
     ctl.devname = ctlname;
     ctl.ops = &g_ctl_board_ident;
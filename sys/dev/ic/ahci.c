@@ -36,6 +36,7 @@
 #include <sys/param.h>
 #include <sys/bitops.h>
 #include <sys/mmio.h>
+#include <sys/callout.h>
 #include <sys/disk.h>
 #include <dev/pci/pci.h>
 #include <dev/pci/pciregs.h>
@@ -73,6 +74,20 @@ struct dev_info {
     char serial[SERIAL_LEN];
 };
 
+/*
+ * Timeout callout for polling loops, lets the
+ * poller know that it should give up.
+ *
+ * @arg: Flag to set
+ */
+static void
+ahci_poll_timeout(void *arg)
+{
+    volatile bool *timedout = arg;
+
+    *timedout = true;
+}
+
 /*
  * Poll register to have 'bits' set/unset.
  *
@@ -83,32 +98,45 @@ struct dev_info {
 static int
 ahci_poll_reg(volatile uint32_t *reg, uint32_t bits, bool pollset)
 {
-    size_t usec_start, usec;
-    size_t elapsed_msec;
+    const size_t USEC = AHCI_TIMEOUT * 1000;
+    struct callout timeout;
+    volatile bool timedout = false;
     uint32_t val;
-    bool tmp;
+    bool tmp, masked;
+    int error = 0;
+
+    /* The timeout callout needs interrupts */
+    masked = md_intr_masked();
+    md_inton();
 
-    usec_start = tmr.get_time_usec();
+    callout_init(&timeout);
+    callout_reset_slack(&timeout, USEC, USEC / 8, ahci_poll_timeout,
+        (void *)&timedout);
 
     for (;;) {
         val = mmio_read32(reg);
         tmp = (pollset) ? ISSET(val, bits) : !ISSET(val, bits);
 
-        usec = tmr.get_time_usec();
-        elapsed_msec = (usec - usec_start) / 1000;
-
         /* If tmp is set, the register updated in time */
         if (tmp) {
             break;
         }
 
         /* Exit with an error if we timeout */
-        if (elapsed_msec > AHCI_TIMEOUT) {
-            return -ETIME;
+        if (timedout) {
+            error = -ETIME;
+            break;
         }
+
+        md_pause();
     }
 
-    return 0;
+    callout_stop(&timeout);
+    if (masked) {
+        md_intoff();
+    }
+
+    return error;
 }
 
 static struct hba_device *
@@ -555,17 +583,14 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
     bool write)
 {
     paddr_t base, buf;
-    char *p, *dest;
-    bool dcdr_hit = false;
+    char *p;
     struct hba_port *port;
-    struct dcdr_lookup dcd_lookup;
-    struct dcd *dcd;
     struct ahci_cmd_hdr *cmdhdr;
     struct ahci_cmdtab *cmdtbl;
     struct ahci_fis_h2d *fis;
     int cmdslot, status;
     size_t nblocks, cur_lba;
-    size_t len;
+    size_t len, nhit = 0;
 
     if (sio == NULL) {
         return -EINVAL;
@@ -575,6 +600,7 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
     }
 
     port = dev->io;
+    p = sio->buf;
 
     /*
      * Compute how many blocks can be cached.
@@ -582,9 +608,6 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
      * XXX: We do not want to fill the entire DCDR
      *      with a single drive read to reduce the
      *      frequency of DCDR evictions.
-     *
-     * TODO: We should also take advantage of logical
-     *       block coalescing.
      */
     nblocks = sio->len;
     if (nblocks >= AHCI_DCDR_CAP) {
@@ -593,7 +616,8 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
 
     /*
      * If we are reading the drive, see if we have
-     * anything in the cache.
+     * the leading blocks in the cache, the drive is
+     * only asked for what follows them.
      *
      * XXX: If there is a break in the cache and we
      *      have a miss inbetween, other DCDs are
@@ -602,23 +626,12 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
      */
     cur_lba = sio->offset;
     len = sio->len;
-    for (size_t i = 0; i < nblocks && !write; ++i) {
-        status = dcdr_lookup(dev->dcdr, cur_lba, &dcd_lookup);
-        if (status != 0) {
+    while (!write && len > 0) {
+        if (dcdr_read(dev->dcdr, cur_lba, &p[nhit * 512]) != 0) {
             break;
         }
-        if (len == 0) {
-            break;
-        }
-
-        dcdr_hit = true;
-        dcd = dcd_lookup.dcd_res;
-
-        /* Hit, copy the cached data */
-        dest = &((char *)sio->buf)[i * 512];
-        p = dcd->block;
-        memcpy(dest, p, 512);
 
+        ++nhit;
         ++cur_lba;
         --len;
     }
@@ -628,7 +641,7 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
         return 0;
     }
 
-    buf = VIRT_TO_PHYS(sio->buf);
+    buf = VIRT_TO_PHYS(&p[nhit * 512]);
     cmdslot = ahci_alloc_cmdslot(hba, port);
     if (cmdslot < 0) {
         pr_trace("failed to alloc cmdslot\n");
@@ -646,7 +659,7 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
 
     cmdtbl = PHYS_TO_VIRT(cmdhdr->ctba);
     cmdtbl->prdt[0].dba = buf;
-    cmdtbl->prdt[0].dbc = (sio->len << 9) - 1;
+    cmdtbl->prdt[0].dbc = (len << 9) - 1;
     cmdtbl->prdt[0].i = 0;
 
     fis = (void *)&cmdtbl->cfis;
@@ -671,16 +684,14 @@ ahci_sata_rw(struct ahci_hba *hba, struct hba_device *dev, struct sio_txn *sio,
         return status;
     }
 
-    /* Don't cache again on hit */
-    if (!write && dcdr_hit) {
-        return 0;
+    /* Cache what went to or came from the drive */
+    for (size_t i = nhit; i < nblocks; ++i) {
+        dcdr_cachein(dev->dcdr, &p[i * 512], sio->offset + i);
     }
 
-    /* Cache our read */
-    for (size_t i = 0; i < nblocks; ++i) {
-        cur_lba = sio->offset + i;
-        p = sio->buf;
-        dcdr_cachein(dev->dcdr, &p[i * 512], cur_lba);
+    /* Don't leave stale copies past what was cached */
+    for (size_t i = MAX(nblocks, nhit); write && i < sio->len; ++i) {
+        dcdr_invldcd(dev->dcdr, sio->offset + i);
     }
     return 0;
 }
@@ -821,6 +832,7 @@ ahci_register(struct hba_device *dp, struct ahci_hba *hba)
 
     /* Register a control node */
     dev.mode = 0444;
+    dev.data = NULL;
     ctlfs_create_node(devname, &dev);
     pr_trace("drive control @ /ctl/%s/\n", devname);
 
@@ -828,6 +840,7 @@ ahci_register(struct hba_device *dp, struct ahci_hba *hba)
     dev.devname = devname;
     dev.ops = &g_sata_bsize_ops;
     ctlfs_create_entry("bsize", &dev);
+    dcdr_ctl_attach(dp->dcdr, devname);
 
     error = devfs_create_entry(devname, hba->major, dp->dev, 060444);
     if (error < 0) {
@@ -34,26 +34,47 @@
 #include <sys/sched.h>
 #include <sys/syslog.h>
 #include <sys/mmio.h>
+#include <sys/callout.h>
 #include <sys/device.h>
 #include <fs/devfs.h>
+#include <fs/ctlfs.h>
 #include <dev/ic/nvmeregs.h>
 #include <dev/ic/nvmevar.h>
 #include <dev/pci/pci.h>
 #include <dev/pci/pciregs.h>
 #include <dev/timer.h>
+#include <machine/cdefs.h>
+#include <machine/cpu.h>
 #include <vm/dynalloc.h>
+#include <vm/pmap.h>
 #include <vm/vm.h>
 #include <string.h>
 
 #define pr_trace(fmt, ...) kprintf("nvme: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
 
+/*
+ * Polling for completions spares the interrupt
+ * latency at the cost of a busy CPU while I/O is
+ * in flight, this may be set with the `NVME_POLL'
+ * kconf(9) option.
+ */
+#if !defined(__NVME_POLL)
+#define NVME_POLL 0
+#else
+#define NVME_POLL __NVME_POLL
+#endif  /* __NVME_POLL */
+
 static struct bdevsw nvme_bdevsw;
 static TAILQ_HEAD(,nvme_ns) namespaces;
 static struct pci_device *nvme_dev;
+static struct nvme_ctrl *nvme_ctrlp;
 static struct timer tmr;
+static bool nvme_use_intr = false;
 
 static int nvme_poll_submit_cmd(struct nvme_queue *q, struct nvme_cmd cmd);
+static int nvme_poll_submit_res(struct nvme_queue *q, struct nvme_cmd cmd,
+                                uint32_t *res);
 
 static inline int
 is_4k_aligned(void *ptr)
@@ -80,6 +101,20 @@ nvme_get_ns(dev_t dev)
     return NULL;
 }
 
+/*
+ * Timeout callout for polling loops, lets the
+ * poller know that it should give up.
+ *
+ * @arg: Flag to set
+ */
+static void
+nvme_poll_timeout(void *arg)
+{
+    volatile bool *timedout = arg;
+
+    *timedout = true;
+}
+
 /*
  * Poll register to have 'bits' set/unset.
  *
@@ -91,49 +126,76 @@ static int
 nvme_poll_reg(struct nvme_bar *bar, volatile uint32_t *reg, uint32_t bits,
               bool pollset)
 {
-    size_t usec_start, usec;
-    size_t elapsed_msec;
+    struct callout timeout;
+    volatile bool timedout = false;
+    size_t usec;
     uint32_t val, caps;
-    bool tmp;
+    bool tmp, masked;
+    int error = 0;
 
-    usec_start = tmr.get_time_usec();
     caps = mmio_read32(&bar->caps);
+    usec = CAP_TIMEOUT(caps) * 1000;
+
+    /* The timeout callout needs interrupts */
+    masked = md_intr_masked();
+    md_inton();
+
+    callout_init(&timeout);
+    callout_reset_slack(&timeout, usec, usec / 8, nvme_poll_timeout,
+        (void *)&timedout);
 
     for (;;) {
         val = mmio_read32(reg);
         tmp = (pollset) ? ISSET(val, bits) : !ISSET(val, bits);
 
-        usec = tmr.get_time_usec();
-        elapsed_msec = (usec - usec_start) / 1000;
-
         /* If tmp is set, the register updated in time */
         if (tmp) {
             break;
         }
 
         /* Exit with an error if we timeout */
-        if (elapsed_msec > CAP_TIMEOUT(caps)) {
-            return -ETIME;
+        if (timedout) {
+            error = -ETIME;
+            break;
         }
+
+        md_pause();
+    }
+
+    callout_stop(&timeout);
+    if (masked) {
+        md_intoff();
     }
 
-    return val;
+    return (error != 0) ? error : val;
 }
 
+/*
+ * Allocate a queue pair and work out its doorbells.
+ *
+ * @bar: Controller registers.
+ * @queue: Queue to set up.
+ * @id: Queue ID (0 for the admin queue).
+ * @depth: Wanted number of entries, may be
+ *         clamped to what the controller allows.
+ */
 static int
-nvme_create_queue(struct nvme_bar *bar, struct nvme_queue *queue, size_t id)
+nvme_create_queue(struct nvme_bar *bar, struct nvme_queue *queue, size_t id,
+                  uint16_t depth)
 {
     uint8_t dbstride;
-    uint16_t slots;
+    uint32_t slots;
     uint64_t  caps;
     uintptr_t sq_db, cq_db;
 
-    caps = mmio_read32(&bar->caps);
+    caps = mmio_read64(&bar->caps);
     dbstride = CAP_STRIDE(caps);
-    slots = CAP_MQES(caps);
 
-    queue->sq = dynalloc_memalign(sizeof(void *) * slots, 0x1000);
-    queue->cq = dynalloc_memalign(sizeof(void *) * slots, 0x1000);
+    /* CAP.MQES is zero based */
+    slots = MIN(CAP_MQES(caps) + 1, depth);
+
+    queue->sq = dynalloc_memalign(sizeof(*queue->sq) * slots, 0x1000);
+    queue->cq = dynalloc_memalign(sizeof(*queue->cq) * slots, 0x1000);
 
     if (queue->sq == NULL) {
         return -ENOMEM;
@@ -144,8 +206,8 @@ nvme_create_queue(struct nvme_bar *bar, struct nvme_queue *queue, size_t id)
         return -ENOMEM;
     }
 
-    memset(queue->sq, 0, sizeof(void *) * slots);
-    memset(queue->cq, 0, sizeof(void *) * slots);
+    memset(queue->sq, 0, sizeof(*queue->sq) * slots);
+    memset(queue->cq, 0, sizeof(*queue->cq) * slots);
 
     sq_db = (uintptr_t)bar + DEFAULT_PAGESIZE + (2 * id * (4 << dbstride));
     cq_db = (uintptr_t)bar + DEFAULT_PAGESIZE + ((2 * id + 1) * (4 << dbstride));
@@ -157,34 +219,59 @@ nvme_create_queue(struct nvme_bar *bar, struct nvme_queue *queue, size_t id)
     queue->cq_phase = 1;
     queue->sq_db = (void *)sq_db;
     queue->cq_db = (void *)cq_db;
+
+    queue->lock = (struct spinlock){0};
+    queue->reqs = NULL;
+    queue->nreqs = 0;
+    queue->cid_next = 0;
+    queue->lists = NULL;
     return 0;
 }
 
+/*
+ * Create an I/O queue pair, its completions are
+ * signalled on the MSI-X entry of the same index.
+ *
+ * @ctrl: Controller.
+ * @ioq: Queue to create.
+ * @index: Index of the queue pair, its ID is one more.
+ */
 static int
-nvme_create_ioq(struct nvme_ns *ns, size_t id)
+nvme_create_ioq(struct nvme_ctrl *ctrl, struct nvme_queue *ioq, uint16_t index)
 {
-    struct nvme_queue *ioq = &ns->ioq;
-    struct nvme_ctrl *ctrl = ns->ctrl;
     struct nvme_bar *bar = ctrl->bar;
     struct nvme_create_iocq_cmd *create_iocq;
     struct nvme_create_iosq_cmd *create_iosq;
     struct nvme_cmd cmd = {0};
-    uint32_t caps;
-    uint16_t mqes;
+    uint16_t id = index + 1;
+    size_t reqs_len, lists_len;
     int error;
 
-    caps = mmio_read32(&bar->caps);
-    mqes = CAP_MQES(caps);
-
-    if ((error = nvme_create_queue(bar, ioq, id)) != 0)
+    if ((error = nvme_create_queue(bar, ioq, id, NVME_IOQ_DEPTH)) != 0)
         return error;
 
+    reqs_len = sizeof(*ioq->reqs) * ioq->size;
+    if ((ioq->reqs = dynalloc(reqs_len)) == NULL)
+        return -ENOMEM;
+
+    memset(ioq->reqs, 0, reqs_len);
+    ioq->index = index;
+
+    /* PRP/SGL lists, one per CID */
+    lists_len = sizeof(*ioq->lists) * NVME_PRP_MAX * ioq->size;
+    if ((ioq->lists = dynalloc_memalign(lists_len, 0x1000)) == NULL)
+        return -ENOMEM;
+
     create_iocq = &cmd.create_iocq;
     create_iocq->opcode = NVME_OP_CREATE_IOCQ;
     create_iocq->qflags = BIT(0);   /* Physically contiguous */
-    create_iocq->qsize = mqes;
+    create_iocq->qsize = ioq->size - 1;
     create_iocq->qid = id;
-    create_iocq->prp1 = VIRT_TO_PHYS(ns->ioq.cq);
+    create_iocq->prp1 = VIRT_TO_PHYS(ioq->cq);
+    if (nvme_use_intr) {
+        create_iocq->qflags |= BIT(1);  /* Interrupts enabled */
+        create_iocq->irqvec = index;
+    }
 
     if ((error = nvme_poll_submit_cmd(&ctrl->adminq, cmd)) != 0)
         return error;
@@ -192,10 +279,10 @@ nvme_create_ioq(struct nvme_ns *ns, size_t id)
     create_iosq = &cmd.create_iosq;
     create_iosq->opcode = NVME_OP_CREATE_IOSQ;
     create_iosq->qflags = BIT(0);    /* Physically contiguous */
-    create_iosq->qsize = mqes;
+    create_iosq->qsize = ioq->size - 1;
     create_iosq->cqid = id;
     create_iosq->sqid = id;
-    create_iosq->prp1 = VIRT_TO_PHYS(ns->ioq.sq);
+    create_iosq->prp1 = VIRT_TO_PHYS(ioq->sq);
     return nvme_poll_submit_cmd(&ctrl->adminq, cmd);
 }
 
@@ -273,30 +360,64 @@ nvme_submit_cmd(struct nvme_queue *q, struct nvme_cmd cmd)
 static int
 nvme_poll_submit_cmd(struct nvme_queue *q, struct nvme_cmd cmd)
 {
+    return nvme_poll_submit_res(q, cmd, NULL);
+}
+
+/*
+ * Same as nvme_poll_submit_cmd() but also gives
+ * back dword 0 of the completion in `res' if it
+ * is not NULL.
+ */
+static int
+nvme_poll_submit_res(struct nvme_queue *q, struct nvme_cmd cmd, uint32_t *res)
+{
+    volatile struct nvme_cq_entry *cqe;
+    struct callout timeout;
+    volatile bool timedout = false;
     uint16_t status;
-    uint8_t spins = 0;
+    bool masked;
+    int error = 0;
 
+    /* The timeout callout needs interrupts */
+    masked = md_intr_masked();
+    md_inton();
+
+    callout_init(&timeout);
     nvme_submit_cmd(q, cmd);
+    callout_reset_slack(&timeout, NVME_CMD_TIMEOUT, NVME_CMD_TIMEOUT / 8,
+        nvme_poll_timeout, (void *)&timedout);
 
     for (;;) {
-        tmr.msleep(100);
-
         /*
          * If the phase bit matches the most recently submitted
          * command then the command has completed
          */
-        status = q->cq[q->cq_head].status;
+        cqe = &q->cq[q->cq_head];
+        status = cqe->status;
         if ((status & 1) == q->cq_phase) {
             break;
         }
 
         /* Check for timeout */
-        if (spins > 5) {
+        if (timedout) {
             pr_error("hang while polling phase bit, giving up\n");
-            return -ETIME;
+            error = -ETIME;
+            break;
         }
 
-        ++spins;
+        md_pause();
+    }
+
+    callout_stop(&timeout);
+    if (masked) {
+        md_intoff();
+    }
+    if (error != 0) {
+        return error;
+    }
+
+    if (res != NULL) {
+        *res = cqe->res;
     }
 
     ++q->cq_head;
@@ -399,27 +520,465 @@ nvme_init_pci(void)
 }
 
 /*
- * Issue a read/write command for a specific
- * namespace.
+ * Lock an I/O queue. Completions are also reaped from
+ * the interrupt handler so interrupts stay off while
+ * the lock is held.
+ *
+ * Returns true if interrupts were already masked.
+ */
+static inline bool
+nvme_qlock(struct nvme_queue *q)
+{
+    bool masked;
+
+    masked = md_intr_masked();
+    md_intoff();
+    spinlock_acquire(&q->lock);
+    return masked;
+}
+
+static inline void
+nvme_qunlock(struct nvme_queue *q, bool masked)
+{
+    spinlock_release(&q->lock);
+    if (!masked) {
+        md_inton();
+    }
+}
+
+/*
+ * Look up the physical pages behind a buffer, the
+ * buffer may be anywhere in the current address space
+ * and need not be physically contiguous.
+ *
+ * @buf: Buffer to look up.
+ * @len: Length of the buffer in bytes.
+ * @pages: Page frames are written here.
  *
- * `buf' must be 4k aligned.
+ * Returns the number of pages or a negative errno.
+ */
+static ssize_t
+nvme_get_pages(void *buf, size_t len, paddr_t *pages)
+{
+    struct vas vas = pmap_read_vas();
+    vaddr_t va, start;
+    size_t npages;
+
+    start = ALIGN_DOWN((vaddr_t)buf, DEFAULT_PAGESIZE);
+    npages = ALIGN_UP((vaddr_t)buf + len, DEFAULT_PAGESIZE) - start;
+    npages /= DEFAULT_PAGESIZE;
+    if (npages > NVME_PRP_MAX + 1) {
+        return -E2BIG;
+    }
+
+    for (size_t i = 0; i < npages; ++i) {
+        va = start + (i * DEFAULT_PAGESIZE);
+        if (pmap_lookup(vas, va, &pages[i], NULL) != 0) {
+            return -EFAULT;
+        }
+    }
+
+    return npages;
+}
+
+/*
+ * Describe the data of a command with an SGL, pages
+ * that are physically adjacent share a descriptor.
+ * A single descriptor fits in the command itself.
+ *
+ * Returns -E2BIG if the descriptors do not fit in
+ * the list of the command.
  */
 static int
-nvme_rw(struct nvme_ns *ns, char *buf, off_t slba, size_t count, bool write)
+nvme_build_sgl(struct nvme_rw_cmd *rw, struct nvme_sgl_desc *list,
+               const struct nvme_dma *dma)
 {
+    struct nvme_sgl_desc desc, *dp = NULL;
+    size_t nseg = 0, resid = dma->len;
+    paddr_t pa;
+    uint32_t len;
+
+    for (size_t i = 0; i < dma->npages; ++i) {
+        pa = dma->pages[i] + ((i == 0) ? dma->off : 0);
+        len = MIN(resid, DEFAULT_PAGESIZE - (pa & (DEFAULT_PAGESIZE - 1)));
+        resid -= len;
+
+        if (dp != NULL && dp->addr + dp->len == pa) {
+            dp->len += len;
+            continue;
+        }
+
+        if (nseg == NVME_SGL_MAX) {
+            return -E2BIG;
+        }
+
+        dp = &list[nseg++];
+        dp->addr = pa;
+        dp->len = len;
+        dp->type = NVME_SGL_DATA;
+        memset(dp->unused, 0, sizeof(dp->unused));
+    }
+
+    if (nseg == 1) {
+        desc = list[0];
+    } else {
+        desc.addr = VIRT_TO_PHYS(list);
+        desc.len = nseg * sizeof(*list);
+        desc.type = NVME_SGL_LAST_SEG;
+        memset(desc.unused, 0, sizeof(desc.unused));
+    }
+
+    memcpy(&rw->prp1, &desc, sizeof(desc));
+    rw->flags |= NVME_CMD_PSDT_SGL;
+    return 0;
+}
+
+/*
+ * Describe the data of a command with PRPs, more
+ * than two pages take a PRP list.
+ */
+static void
+nvme_build_prp(struct nvme_rw_cmd *rw, uint64_t *list,
+               const struct nvme_dma *dma)
+{
+    rw->prp1 = dma->pages[0] + dma->off;
+    rw->prp2 = 0;
+    if (dma->npages == 2) {
+        rw->prp2 = dma->pages[1];
+    } else if (dma->npages > 2) {
+        for (size_t i = 1; i < dma->npages; ++i) {
+            list[i - 1] = dma->pages[i];
+        }
+
+        rw->prp2 = VIRT_TO_PHYS(list);
+    }
+}
+
+/*
+ * Issue the read/write command of a request, the
+ * CID indexes the in-flight table so completions
+ * can find their request.
+ *
+ * XXX: The queue lock must be held
+ *
+ * Returns -EAGAIN if the queue is full.
+ */
+static int
+nvme_start(struct nvme_queue *q, struct bio *bp, const struct nvme_dma *dma)
+{
+    struct nvme_ns *ns = bp->drv;
     struct nvme_cmd cmd = {0};
     struct nvme_rw_cmd *rw = &cmd.rw;
+    uint64_t *list;
+    uint16_t cid;
 
-    if (!is_4k_aligned(buf)) {
-        return -1;
+    /* One slot stays empty to tell a full ring from an empty one */
+    if (q->nreqs >= q->size - 1) {
+        return -EAGAIN;
     }
 
-    rw->opcode = write ? NVME_OP_WRITE : NVME_OP_READ;
+    cid = q->cid_next;
+    while (q->reqs[cid] != NULL) {
+        cid = (cid + 1) % q->size;
+    }
+
+    q->cid_next = (cid + 1) % q->size;
+    q->reqs[cid] = bp;
+    ++q->nreqs;
+
+    rw->opcode = ISSET(bp->flags, BIO_WRITE) ? NVME_OP_WRITE : NVME_OP_READ;
+    rw->cid = cid;
     rw->nsid = ns->nsid;
-    rw->slba = slba;
-    rw->len = count - 1;
-    rw->prp1 = VIRT_TO_PHYS(buf);
-    return nvme_poll_submit_cmd(&ns->ioq, cmd);
+    rw->slba = bp->offset / ns->lba_bsize;
+    rw->len = (bp->len / ns->lba_bsize) - 1;
+
+    /* SGLs only pay off for physically contiguous runs */
+    list = &q->lists[cid * NVME_PRP_MAX];
+    if (!ns->ctrl->sgl || dma->npages < 2 ||
+        nvme_build_sgl(rw, (void *)list, dma) != 0) {
+        nvme_build_prp(rw, list, dma);
+    }
+
+    nvme_submit_cmd(q, cmd);
+    return 0;
+}
+
+/*
+ * Reap the completions of an I/O queue.
+ *
+ * Returns the number of completions reaped.
+ */
+static size_t
+nvme_reap(struct nvme_queue *q)
+{
+    volatile struct nvme_cq_entry *cqe;
+    TAILQ_HEAD(, bio) doneq;
+    struct bio *bp;
+    uint16_t status, cid;
+    size_t n = 0;
+    bool masked;
+
+    TAILQ_INIT(&doneq);
+    masked = nvme_qlock(q);
+    for (;;) {
+        cqe = &q->cq[q->cq_head];
+        status = cqe->status;
+        if ((status & 1) != q->cq_phase) {
+            break;
+        }
+
+        cid = cqe->cid;
+        q->sq_head = cqe->sqhead;
+        if (cid < q->size && (bp = q->reqs[cid]) != NULL) {
+            q->reqs[cid] = NULL;
+            --q->nreqs;
+            bp->error = (NVME_CQE_SC(status) != 0) ? -EIO : 0;
+            TAILQ_INSERT_TAIL(&doneq, bp, link);
+        }
+
+        if (++q->cq_head >= q->size) {
+            q->cq_head = 0;
+            q->cq_phase = !q->cq_phase;
+        }
+        ++n;
+    }
+
+    if (n > 0) {
+        mmio_write32(q->cq_db, q->cq_head);
+    }
+
+    nvme_qunlock(q, masked);
+
+    /* Complete outside of the lock, callbacks may submit more */
+    while ((bp = TAILQ_FIRST(&doneq)) != NULL) {
+        TAILQ_REMOVE(&doneq, bp, link);
+        bio_done(bp, bp->error);
+    }
+
+    return n;
+}
+
+/*
+ * Get the I/O queue pair of the current CPU and have
+ * the queue interrupt it if it is the queue's owner.
+ * CPUs that came up after the queues were created
+ * are only known here.
+ */
+static struct nvme_queue *
+nvme_get_ioq(void)
+{
+    struct nvme_ctrl *ctrl = nvme_ctrlp;
+    struct cpu_info *ci = this_cpu();
+    struct nvme_queue *q;
+
+    q = &ctrl->ioqs[ci->id % ctrl->nioq];
+    if (nvme_use_intr && !q->routed && ci->id == q->index) {
+        q->routed = 1;
+        pci_msix_route(nvme_dev, q->index, ci);
+    }
+
+    return q;
+}
+
+/*
+ * Queue up a request on a namespace, waiting for
+ * a free slot if the queue is full. The pages of the
+ * buffer are looked up here as they are in the address
+ * space of the caller. Without interrupts the queue is
+ * polled until it drains so the request is done when
+ * this returns.
+ */
+static int
+nvme_queue_req(struct nvme_ns *ns, struct bio *bp)
+{
+    paddr_t pages[NVME_PRP_MAX + 1];
+    struct nvme_dma dma;
+    struct nvme_queue *q;
+    ssize_t npages;
+    bool masked;
+    int error;
+
+    if (((bp->offset | bp->len) & (ns->lba_bsize - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    /* Data must be dword aligned */
+    if (((uintptr_t)bp->data & 3) != 0 || bp->len > ns->ctrl->max_xfer) {
+        return -EINVAL;
+    }
+
+    if ((npages = nvme_get_pages(bp->data, bp->len, pages)) < 0) {
+        return npages;
+    }
+
+    dma.pages = pages;
+    dma.npages = npages;
+    dma.off = (uintptr_t)bp->data & (DEFAULT_PAGESIZE - 1);
+    dma.len = bp->len;
+    bp->drv = ns;
+
+    for (;;) {
+        q = nvme_get_ioq();
+        masked = nvme_qlock(q);
+        error = nvme_start(q, bp, &dma);
+        nvme_qunlock(q, masked);
+        if (error != -EAGAIN) {
+            break;
+        }
+
+        /* Make room ourselves */
+        if (nvme_reap(q) == 0) {
+            md_pause();
+        }
+    }
+
+    /* `bp' may be gone once completed, only look at the queue */
+    if (!nvme_use_intr) {
+        while (__atomic_load_n(&q->nreqs, __ATOMIC_ACQUIRE) > 0) {
+            if (nvme_reap(q) == 0)
+                md_pause();
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * MSI-X handler, the queue pair of the interrupted
+ * CPU is looked at first.
+ */
+static int
+nvme_intr(void *sf)
+{
+    struct nvme_ctrl *ctrl = nvme_ctrlp;
+    struct cpu_info *ci = this_cpu();
+    size_t n;
+
+    if (ctrl == NULL || ctrl->ioqs == NULL) {
+        return 0;
+    }
+
+    n = nvme_reap(&ctrl->ioqs[ci->id % ctrl->nioq]);
+    if (n > 0) {
+        return 1;
+    }
+
+    for (uint16_t i = 0; i < ctrl->nioq; ++i) {
+        n += nvme_reap(&ctrl->ioqs[i]);
+    }
+
+    return n > 0;
+}
+
+/*
+ * Issue read/write commands for a specific
+ * namespace and wait for them to complete.
+ * Transfers larger than the controller takes
+ * are split up.
+ *
+ * `buf' must be dword aligned.
+ *
+ * XXX: Sleeps in bio_wait(), must not be called
+ *      with spinlocks held.
+ */
+static int
+nvme_rw(struct nvme_ns *ns, char *buf, off_t slba, size_t count, bool write)
+{
+    struct bio req;
+    size_t len, max_blocks;
+    int error;
+
+    max_blocks = ns->ctrl->max_xfer / ns->lba_bsize;
+    while (count > 0) {
+        len = MIN(count, max_blocks);
+        memset(&req, 0, sizeof(req));
+        req.offset = slba * ns->lba_bsize;
+        req.data = buf;
+        req.len = len * ns->lba_bsize;
+        req.flags = write ? BIO_WRITE : 0;
+        if ((error = nvme_queue_req(ns, &req)) < 0) {
+            return error;
+        }
+        if ((error = bio_wait(&req)) < 0) {
+            return error;
+        }
+
+        buf += req.len;
+        slba += len;
+        count -= len;
+    }
+
+    return 0;
+}
+
+/*
+ * Try to serve a read entirely from the block
+ * cache of a namespace.
+ *
+ * Returns 0 if every block was cached.
+ */
+static int
+nvme_cache_read(struct nvme_ns *ns, char *buf, off_t slba, size_t count)
+{
+    if (ns->dcdr == NULL || count > NVME_DCDR_CAP / 2) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (dcdr_read(ns->dcdr, slba + i, &buf[i * ns->lba_bsize]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Update the block cache of a namespace with
+ * blocks that went to or came from the drive.
+ * Large transfers are not cached so they do not
+ * push out everything else, though cached copies
+ * of what they wrote are dropped.
+ */
+static void
+nvme_cache_update(struct nvme_ns *ns, char *buf, off_t slba, size_t count,
+                  bool write)
+{
+    if (ns->dcdr == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (count > NVME_DCDR_CAP / 2) {
+            if (write)
+                dcdr_invldcd(ns->dcdr, slba + i);
+            continue;
+        }
+
+        dcdr_cachein(ns->dcdr, &buf[i * ns->lba_bsize], slba + i);
+    }
+}
+
+/*
+ * Transfer whole blocks through the block cache
+ * of a namespace.
+ */
+static int
+nvme_dev_xfer(struct nvme_ns *ns, char *buf, off_t slba, size_t count,
+              bool write)
+{
+    int status;
+
+    if (!write && nvme_cache_read(ns, buf, slba, count) == 0) {
+        return 0;
+    }
+
+    status = nvme_rw(ns, buf, slba, count, write);
+    if (status == 0) {
+        nvme_cache_update(ns, buf, slba, count, write);
+    }
+
+    return status;
 }
 
 /*
@@ -429,10 +988,11 @@ nvme_rw(struct nvme_ns *ns, char *buf, off_t slba, size_t count, bool write)
  * @sio: SIO transaction descriptor.
  * @write: True if this is a write operation.
  *
- * This routine uses an internal buffer aligned on a
- * 4 KiB boundary to enable flexibility with the input
- * SIO buffer. This allows the SIO buffer to be unaligned
- * and/or sized smaller than the namespace block size.
+ * Whole, dword aligned blocks are transferred straight
+ * to or from the SIO buffer. Anything else goes through
+ * an internal buffer aligned on a 4 KiB boundary which
+ * allows the SIO buffer to be unaligned and/or sized
+ * smaller than the namespace block size.
  */
 static int
 nvme_dev_rw(dev_t dev, struct sio_txn *sio, bool write)
@@ -440,6 +1000,7 @@ nvme_dev_rw(dev_t dev, struct sio_txn *sio, bool write)
     struct nvme_ns *ns;
     size_t block_count, len;
     off_t block_off, read_off;
+    bool direct;
     int status;
     char *buf;
 
@@ -457,10 +1018,17 @@ nvme_dev_rw(dev_t dev, struct sio_txn *sio, bool write)
         return -ENODEV;
 
     /* Calculate the block count and offset */
-    block_count = ALIGN_UP(sio->len, ns->lba_bsize);
+    read_off = sio->offset & (ns->lba_bsize - 1);
+    block_count = ALIGN_UP(read_off + sio->len, ns->lba_bsize);
     block_count /= ns->lba_bsize;
     block_off = sio->offset / ns->lba_bsize;
 
+    direct = read_off == 0 && (sio->len & (ns->lba_bsize - 1)) == 0;
+    direct = direct && ((uintptr_t)sio->buf & 3) == 0;
+    if (direct) {
+        return nvme_dev_xfer(ns, sio->buf, block_off, block_count, write);
+    }
+
     /* Allocate internal buffer */
     len = block_count * ns->lba_bsize;
     buf = dynalloc_memalign(len, 0x1000);
@@ -468,21 +1036,25 @@ nvme_dev_rw(dev_t dev, struct sio_txn *sio, bool write)
         return -ENOMEM;
 
     /*
-     * If this is a write, zero the internal buffer and copy over
-     * the contents of the SIO buffer.
+     * If this is a write, read in the blocks it only partly
+     * covers and copy over the contents of the SIO buffer.
      */
     if (write) {
-        memset(buf, 0, len);
-        memcpy(buf, sio->buf, sio->len);
+        status = nvme_dev_xfer(ns, buf, block_off, block_count, false);
+        if (status != 0) {
+            dynfree(buf);
+            return status;
+        }
+
+        memcpy(buf + read_off, sio->buf, sio->len);
     }
 
     /*
      * Perform the r/w operation and copy internal buffer
      * out if this is a read operation.
      */
-    status = nvme_rw(ns, buf, block_off, block_count, write);
+    status = nvme_dev_xfer(ns, buf, block_off, block_count, write);
     if (status == 0 && !write) {
-        read_off = sio->offset & (ns->lba_bsize - 1);
         memcpy(sio->buf, buf + read_off, sio->len);
     }
 
@@ -505,6 +1077,30 @@ nvme_dev_write(dev_t dev, struct sio_txn *sio, int flags)
     return nvme_dev_rw(dev, sio, true);
 }
 
+/*
+ * Device interface strategy, the request completes
+ * from the interrupt handler. Cached copies of the
+ * blocks are dropped as the request skips the cache.
+ */
+static int
+nvme_dev_strategy(dev_t dev, struct bio *bp)
+{
+    struct nvme_ns *ns;
+    off_t slba;
+
+    if ((ns = nvme_get_ns(dev)) == NULL)
+        return -ENODEV;
+
+    if (ns->dcdr != NULL && ISSET(bp->flags, BIO_WRITE)) {
+        slba = bp->offset / ns->lba_bsize;
+        for (size_t i = 0; i < bp->len / ns->lba_bsize; ++i) {
+            dcdr_invldcd(ns->dcdr, slba + i);
+        }
+    }
+
+    return nvme_queue_req(ns, bp);
+}
+
 /*
  * Initializes an NVMe namespace.
  *
@@ -516,6 +1112,7 @@ nvme_init_ns(struct nvme_ctrl *ctrl, uint8_t nsid)
 {
     devmajor_t major;
     char devname[128];
+    struct ctlfs_dev ctl;
     struct nvme_ns *ns = NULL;
     struct nvme_id_ns *idns = NULL;
     uint8_t lba_format;
@@ -545,10 +1142,7 @@ nvme_init_ns(struct nvme_ctrl *ctrl, uint8_t nsid)
     ns->lba_bsize = 1 << ns->lba_fmt.ds;
     ns->size = idns->size;
     ns->ctrl = ctrl;
-
-    if ((status = nvme_create_ioq(ns, ns->nsid)) != 0) {
-        goto done;
-    }
+    ns->dcdr = NULL;
 
     TAILQ_INSERT_TAIL(&namespaces, ns, link);
     snprintf(devname, sizeof(devname), "nvme0n%d", ns->nsid);
@@ -560,6 +1154,15 @@ nvme_init_ns(struct nvme_ctrl *ctrl, uint8_t nsid)
     /* Register the namespace */
     dev_register(major, ns->dev, &nvme_bdevsw);
     devfs_create_entry(devname, major, ns->dev, 0444);
+
+    /* Blocks are cached if we can spare the memory */
+    ns->dcdr = dcdr_alloc(ns->lba_bsize, NVME_DCDR_CAP);
+    if (ns->dcdr != NULL) {
+        ctl.mode = 0444;
+        ctl.data = NULL;
+        ctlfs_create_node(devname, &ctl);
+        dcdr_ctl_attach(ns->dcdr, devname);
+    }
 done:
     if (ns != NULL && status != 0)
         dynfree(ns);
@@ -569,15 +1172,81 @@ done:
     return status;
 }
 
+/*
+ * Create one I/O queue pair per CPU, or as many as
+ * the controller lets us have up to NVME_MAX_IOQ. With
+ * MSI-X there is also one table entry per queue pair,
+ * which goes to the boot CPU until its own CPU submits
+ * to the queue pair.
+ */
+static int
+nvme_init_ioqs(struct nvme_ctrl *ctrl)
+{
+    struct nvme_cmd cmd = {0};
+    struct nvme_set_features_cmd *feat = &cmd.set_features;
+    struct cpu_info *ci = this_cpu();
+    uint16_t nioq, nsq, ncq;
+    uint32_t res = 0;
+    int error;
+
+    feat->opcode = NVME_OP_SET_FEATURES;
+    feat->fid = NVME_FEAT_NQUEUES;
+    feat->dw11 = (NVME_MAX_IOQ - 1) | ((NVME_MAX_IOQ - 1) << 16);
+    if ((error = nvme_poll_submit_res(&ctrl->adminq, cmd, &res)) != 0) {
+        return error;
+    }
+
+    /* Allocated counts are zero based */
+    nsq = (res & 0xFFFF) + 1;
+    ncq = (res >> 16) + 1;
+    nioq = MIN(MIN(nsq, ncq), NVME_MAX_IOQ);
+
+    if (nvme_use_intr) {
+        for (uint16_t i = 0; i < nioq; ++i) {
+            if (pci_msix_route(nvme_dev, i, ci) != 0) {
+                nioq = i;
+                break;
+            }
+        }
+    }
+
+    if (nioq == 0) {
+        pr_trace("no MSI-X entries, polling for I/O completions\n");
+        nvme_use_intr = false;
+        nioq = MIN(MIN(nsq, ncq), NVME_MAX_IOQ);
+    }
+
+    ctrl->ioqs = dynalloc(sizeof(*ctrl->ioqs) * nioq);
+    if (ctrl->ioqs == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(ctrl->ioqs, 0, sizeof(*ctrl->ioqs) * nioq);
+    for (uint16_t i = 0; i < nioq; ++i) {
+        if ((error = nvme_create_ioq(ctrl, &ctrl->ioqs[i], i)) != 0) {
+            /* Make do with what we have */
+            if (i == 0)
+                return error;
+
+            nioq = i;
+            break;
+        }
+    }
+
+    ctrl->nioq = nioq;
+    pr_trace("%d I/O queue pair(s), depth %d, %s completions\n", nioq,
+        ctrl->ioqs[0].size, nvme_use_intr ? "interrupt" : "polled");
+    return 0;
+}
+
 static int
 nvme_init_ctrl(struct nvme_bar *bar)
 {
     int error;
-    uint64_t caps;
     uint32_t config;
     uint16_t mqes;
     uint8_t *nsids;
-    struct nvme_ctrl ctrl = { .bar = bar };
+    struct nvme_ctrl *ctrl;
     struct nvme_smart_data *smart;
     struct nvme_queue *adminq;
     struct nvme_id *id;
@@ -587,12 +1256,20 @@ nvme_init_ctrl(struct nvme_bar *bar)
         return error;
     }
 
-    adminq = &ctrl.adminq;
-    caps = mmio_read64(&bar->caps);
-    mqes = CAP_MQES(caps);
+    if ((ctrl = dynalloc(sizeof(*ctrl))) == NULL) {
+        return -ENOMEM;
+    }
+
+    memset(ctrl, 0, sizeof(*ctrl));
+    ctrl->bar = bar;
+    adminq = &ctrl->adminq;
 
     /* Setup admin queues */
-    nvme_create_queue(bar, adminq, 0);
+    if ((error = nvme_create_queue(bar, adminq, 0, NVME_ADMINQ_DEPTH)) != 0) {
+        return error;
+    }
+
+    mqes = adminq->size - 1;
     mmio_write32(&bar->aqa, (mqes | mqes << 16));
     mmio_write64(&bar->asq, VIRT_TO_PHYS(adminq->sq));
     mmio_write64(&bar->acq, VIRT_TO_PHYS(adminq->cq));
@@ -620,15 +1297,15 @@ nvme_init_ctrl(struct nvme_bar *bar)
         return -ENOMEM;
     }
 
-    nvme_identify(&ctrl, id, 0, ID_CNS_CTRL);
+    nvme_identify(ctrl, id, 0, ID_CNS_CTRL);
     nvme_log_ctrl_id(id);
-    nvme_identify(&ctrl, nsids, 0, ID_CNS_NSID_LIST);
+    nvme_identify(ctrl, nsids, 0, ID_CNS_NSID_LIST);
 
     /*
      * Attempt to read some SMART data but don't bother
      * if it fails in any way.
      */
-    error = nvme_get_logpage(&ctrl, smart, NVME_LOGPAGE_SMART, sizeof(*smart));
+    error = nvme_get_logpage(ctrl, smart, NVME_LOGPAGE_SMART, sizeof(*smart));
     if (error == 0) {
         if (smart->temp != 0 && smart->temp > 283)
             pr_trace("temp: %d K\n", smart->temp);
@@ -636,8 +1313,23 @@ nvme_init_ctrl(struct nvme_bar *bar)
         pr_trace("%d%% used\n", smart->percent_used);
     }
 
-    ctrl.sqes = id->sqes >> 4;
-    ctrl.cqes = id->cqes >> 4;
+    ctrl->sqes = id->sqes >> 4;
+    ctrl->cqes = id->cqes >> 4;
+
+    /*
+     * Transfers are bounded by our PRP lists and by MDTS,
+     * which is in units of the minimum page size (4 KiB
+     * as CC.MPS is left at zero). Zero means no limit.
+     */
+    ctrl->max_xfer = NVME_PRP_MAX * DEFAULT_PAGESIZE;
+    if (id->mdts != 0) {
+        ctrl->max_xfer = MIN(ctrl->max_xfer, DEFAULT_PAGESIZE << id->mdts);
+    }
+
+    ctrl->sgl = (id->sgls & 3) != 0;
+    if (ctrl->sgl) {
+        pr_trace("using SGLs for I/O\n");
+    }
 
     /*
      * Before creating any I/O queues we need to set CC.IOCQES
@@ -645,17 +1337,27 @@ nvme_init_ctrl(struct nvme_bar *bar)
      * is the maximum.
      */
     config = mmio_read32(&bar->config);
-    config |= (ctrl.sqes << CONFIG_IOSQES_SHIFT);
-    config |= (ctrl.cqes << CONFIG_IOCQES_SHIFT);
+    config |= (ctrl->sqes << CONFIG_IOSQES_SHIFT);
+    config |= (ctrl->cqes << CONFIG_IOCQES_SHIFT);
     mmio_write32(&bar->config, config);
 
+    if ((error = nvme_init_ioqs(ctrl)) != 0) {
+        pr_error("failed to create I/O queues\n");
+        dynfree(id);
+        dynfree(nsids);
+        dynfree(smart);
+        return error;
+    }
+
+    nvme_ctrlp = ctrl;
+
     /* Init all active namespaces */
     for (size_t i = 0; i < id->nn; ++i) {
         if (nsids[i] == 0) {
             continue;
         }
 
-        if (nvme_init_ns(&ctrl, nsids[i]) != 0) {
+        if (nvme_init_ns(ctrl, nsids[i]) != 0) {
             pr_error("failed to initialize NSID %d\n", nsids[i]);
         }
     }
@@ -670,6 +1372,7 @@ static int
 nvme_init(void)
 {
     struct pci_lookup lookup;
+    struct msi_intr intr;
     struct nvme_bar *bar;
     int error;
 
@@ -706,6 +1409,17 @@ nvme_init(void)
     TAILQ_INIT(&namespaces);
     nvme_init_pci();
 
+    /* Completions are polled for if we can't get interrupts */
+    intr.name = "nvme0";
+    intr.handler = nvme_intr;
+    if (NVME_POLL) {
+        pr_trace("polling for I/O completions\n");
+    } else if (pci_enable_msix(nvme_dev, &intr) == 0) {
+        nvme_use_intr = true;
+    } else {
+        pr_trace("MSI-X unavailable, polling for I/O completions\n");
+    }
+
     if ((error = pci_map_bar(nvme_dev, 0, (void *)&bar)) != 0) {
         return error;
     }
@@ -715,7 +1429,8 @@ nvme_init(void)
 
 static struct bdevsw nvme_bdevsw = {
     .read = nvme_dev_read,
-    .write = nvme_dev_write
+    .write = nvme_dev_write,
+    .strategy = nvme_dev_strategy
 };
 
 DRIVER_EXPORT(nvme_init, "nvme");
@@ -117,6 +117,7 @@ fbdev_init(void)
 
     /* Register control files */
     ctl.mode = 0444;
+    ctl.data = NULL;
     ctlfs_create_node(devname, &ctl);
     ctl.devname = devname;
     ctl.ops = &fb_size_ctl;
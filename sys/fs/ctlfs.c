@@ -70,6 +70,7 @@ struct ctlfs_entry {
     struct ctlfs_node *parent;
     const struct ctlops *io;
     mode_t mode;
+    void *data;
     TAILQ_ENTRY(ctlfs_entry) link;
 };
 
@@ -313,6 +314,7 @@ ctlfs_create_node(const char *name, const struct ctlfs_dev *dp)
  *      - devname (name of device)
  *      - mode (access flags)
  *      - ops (operations vector)
+ *      - data (handed back to ops)
  */
 int
 ctlfs_create_entry(const char *name, const struct ctlfs_dev *dp)
@@ -352,6 +354,7 @@ ctlfs_create_entry(const char *name, const struct ctlfs_dev *dp)
     memcpy(enp->name, name, namelen);
     enp->name[namelen] = '\0';
     enp->io = dp->ops;
+    enp->data = dp->data;
     enp->magic = CTLFS_ENTRY_MAG;
     enp->mode = dp->mode;
     enp->parent = parent;
@@ -366,6 +369,7 @@ ctlfs_create_entry(const char *name, const struct ctlfs_dev *dp)
  *   - ctlfs_dev.ctlname
  *   - ctlfs_dev.iop
  *   - ctlfs_dev.mode
+ *   - ctlfs_dev.data
  */
 static int
 ctlfs_read(struct vnode *vp, struct sio_txn *sio)
@@ -386,6 +390,7 @@ ctlfs_read(struct vnode *vp, struct sio_txn *sio)
     dev.ctlname = enp->name;
     dev.ops = iop;
     dev.mode = enp->mode;
+    dev.data = enp->data;
     return iop->read(&dev, sio);
 }
 
@@ -396,6 +401,7 @@ ctlfs_read(struct vnode *vp, struct sio_txn *sio)
  *   - ctlfs_dev.ctlname
  *   - ctlfs_dev.iop
  *   - ctlfs_dev.mode
+ *   - ctlfs_dev.data
  */
 static int
 ctlfs_write(struct vnode *vp, struct sio_txn *sio)
@@ -416,6 +422,7 @@ ctlfs_write(struct vnode *vp, struct sio_txn *sio)
     dev.ctlname = enp->name;
     dev.ops = iop;
     dev.mode = enp->mode;
+    dev.data = enp->data;
     return iop->write(&dev, sio);
 }
 
@@ -34,6 +34,8 @@
 #include <sys/limine.h>
 #include <sys/panic.h>
 #include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
 #include <sys/vnode.h>
 #include <fs/initramfs.h>
 #include <vm/dynalloc.h>
@@ -52,6 +54,8 @@ struct initramfs_node {
     void *data;             /* File data */
     size_t size;            /* File size */
     mode_t mode;            /* Perms and type */
+    struct vnode *vp;       /* Vnode of this node */
+    TAILQ_ENTRY(initramfs_node) link;
 };
 
 /*
@@ -81,6 +85,14 @@ static volatile struct limine_module_request mod_req = {
 static const char *initramfs = NULL;
 static uint64_t initramfs_size;
 
+/*
+ * Nodes that have been looked up, each keeps its
+ * vnode (and with it the page cache of the file)
+ * around for the next lookup.
+ */
+static TAILQ_HEAD(, initramfs_node) nodes = TAILQ_HEAD_INITIALIZER(nodes);
+static struct spinlock nodes_lock;
+
 /*
  * Fetch a module from the bootloader.
  * This is used to fetch the ramfs image.
@@ -159,11 +171,32 @@ initramfs_get_file(const char *path, struct initramfs_node *res)
     return -ENOENT;
 }
 
+/*
+ * Find the node of a file that has already been
+ * looked up. Nodes are told apart by where their
+ * data lives in the image.
+ *
+ * XXX: `nodes_lock' must be held
+ */
+static struct initramfs_node *
+initramfs_find(const void *data)
+{
+    struct initramfs_node *n;
+
+    TAILQ_FOREACH(n, &nodes, link) {
+        if (n->data == data) {
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
 static int
 initramfs_lookup(struct vop_lookup_args *args)
 {
     int status, vtype;
-    struct initramfs_node *n;
+    struct initramfs_node node, *n;
     struct vnode *vp;
     const char *path = args->name;
 
@@ -171,27 +204,48 @@ initramfs_lookup(struct vop_lookup_args *args)
         ++path;
     }
 
+    /* Now does this file exist? */
+    if ((status = initramfs_get_file(path, &node)) != 0) {
+        return status;
+    }
+
+    spinlock_acquire(&nodes_lock);
+    if ((n = initramfs_find(node.data)) != NULL) {
+        vfs_vref(n->vp);
+        *args->vpp = n->vp;
+        spinlock_release(&nodes_lock);
+        return 0;
+    }
+
     n = dynalloc(sizeof(*n));
     if (n == NULL) {
+        spinlock_release(&nodes_lock);
         return -ENOMEM;
     }
 
-    /* Now does this file exist? */
-    if ((status = initramfs_get_file(path, n)) != 0) {
-        dynfree(n);
-        return status;
-    }
-
-    vtype = ISSET(n->mode, 0040000) ? VDIR : VREG;
+    vtype = ISSET(node.mode, 0040000) ? VDIR : VREG;
 
     /* Try to create a new vnode */
     if ((status = vfs_alloc_vnode(&vp, vtype)) != 0) {
+        spinlock_release(&nodes_lock);
         dynfree(n);
         return status;
     }
 
+    /*
+     * The image never changes, so the node holds on
+     * to the vnode for good and hands out another
+     * reference on every lookup.
+     */
+    *n = node;
+    n->vp = vp;
     vp->data = n;
     vp->vops = &g_initramfs_vops;
+    vp->flags |= VKEEP;
+    vfs_vref(vp);
+    TAILQ_INSERT_TAIL(&nodes, n, link);
+    spinlock_release(&nodes_lock);
+
     *args->vpp = vp;
     return 0;
 }
@@ -248,8 +302,15 @@ initramfs_read(struct vnode *vp, struct sio_txn *sio)
 static int
 initramfs_reclaim(struct vnode *vp)
 {
-    if (vp->data != NULL) {
-        dynfree(vp->data);
+    struct initramfs_node *n = vp->data;
+
+    if (n != NULL && n->vp == vp) {
+        spinlock_acquire(&nodes_lock);
+        TAILQ_REMOVE(&nodes, n, link);
+        spinlock_release(&nodes_lock);
+    }
+    if (n != NULL) {
+        dynfree(n);
     }
 
     vp->data = NULL;
@@ -38,4 +38,11 @@
 #define md_inton()  __ASMV("msr daifclr, #2")
 #define md_hlt()   __ASMV("hlt #0")
 
+/* Returns true if IRQs are masked (DAIF.I) */
+#define md_intr_masked() __extension__ ({       \
+    uint64_t __daif;                            \
+    __ASMV("mrs %0, daif" : "=r" (__daif));     \
+    ISSET(__daif, BIT(7));                      \
+})
+
 #endif  /* !_AARCH64_CDEFS_H_ */
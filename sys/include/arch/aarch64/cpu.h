@@ -33,8 +33,12 @@
 #include <sys/types.h>
 #include <sys/cdefs.h>
 #include <sys/proc.h>
+#include <sys/sched.h>
 
 struct cpu_info {
+    uint8_t id;                 /* MI Logical ID */
+    struct sched_cpu stat;
+    struct sched_runq *runq;    /* Ready queues */
     struct proc *curtd;
     struct cpu_info *self;
 };
@@ -32,6 +32,7 @@
 
 #include <sys/cdefs.h>
 #include <machine/cpu.h>
+#include <machine/asm.h>
 
 /*
  * Please use CLI wisely, it is a good idea to use
@@ -42,6 +43,7 @@
 #define md_intoff() __ASMV("cli")           /* Clear interrupts */
 #define md_inton()  __ASMV("sti")           /* Enable interrupts */
 #define md_hlt() cpu_halt()                 /* Halt the processor */
+#define md_intr_masked() amd64_is_intr_mask() /* Interrupts off? */
 
 /*
  * AMD64 specific defines
@@ -38,6 +38,7 @@
 #include <machine/tss.h>
 #include <machine/cdefs.h>
 #include <machine/intr.h>
+#include <machine/tlb.h>
 
 #define CPU_IRQ(IRQ_N) (BIT((IRQ_N)) & 0xFF)
 
@@ -46,6 +47,7 @@
 #define CPU_FEAT_SMEP   BIT(1)
 #define CPU_FEAT_UMIP   BIT(2)
 #define CPU_FEAT_TSCINV BIT(3)  /* TSC invariant */
+#define CPU_FEAT_PCID   BIT(4)  /* Process-context identifiers */
 
 /* CPU vendors */
 #define CPU_VENDOR_OTHER    0x00000000
@@ -54,7 +56,13 @@
 
 typedef uint32_t ipi_pend_t;
 
+/*
+ * XXX: The SYSCALL entry accesses the first fields
+ *      through %gs, see syscall.S before moving them.
+ */
 struct cpu_info {
+    uintptr_t syscall_stack;    /* Kernel stack top for SYSCALL */
+    uintptr_t syscall_scratch;  /* User stack pointer on SYSCALL */
     uint32_t apicid;
     uint32_t feat;
     uint32_t vendor;            /* Vendor (see CPU_VENDOR_*) */
@@ -65,13 +73,15 @@ struct cpu_info {
     uint8_t model : 4;          /* CPU model number */
     uint8_t family : 4;         /* CPU family ID */
     uint8_t has_x2apic : 1;
-    uint8_t tlb_shootdown : 1;
     uint8_t online : 1;         /* CPU online */
     uint8_t ipl;
     size_t lapic_tmr_freq;
     uint8_t irq_mask;
-    vaddr_t shootdown_va;
+    volatile uint16_t pcid;     /* PCID loaded in CR3 */
+    volatile uint32_t tlb_gen;  /* Last shootdown handled */
+    uint64_t pcid_stale[TLB_PCID_MAX / 64];
     struct sched_cpu stat;
+    struct sched_runq *runq;    /* Ready queues */
     struct tss_entry *tss;
     struct proc *curtd;
     struct spinlock lock;
@@ -89,13 +99,38 @@ struct cpu_info *cpu_get(uint32_t index);
 struct sched_cpu *cpu_get_stat(uint32_t cpu_index);
 
 uint32_t cpu_count(void);
-void cpu_shootdown_tlb(vaddr_t va);
+void cpu_shootdown_tlb(const struct tlb_batch *tb);
 
 struct cpu_info *this_cpu(void);
 void mp_bootstrap_aps(struct cpu_info *ci);
 
 extern struct cpu_info g_bsp_ci;
 
+/*
+ * Mark the TLB entries of a PCID as stale on a
+ * processor, they are flushed on its next switch.
+ */
+static inline void
+cpu_pcid_stale(struct cpu_info *ci, uint16_t pcid)
+{
+    __atomic_fetch_or(&ci->pcid_stale[pcid / 64], BIT(pcid % 64),
+        __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns true if the TLB entries of a PCID were
+ * marked stale on a processor, and clears the mark.
+ */
+static inline bool
+cpu_pcid_take_stale(struct cpu_info *ci, uint16_t pcid)
+{
+    uint64_t old;
+
+    old = __atomic_fetch_and(&ci->pcid_stale[pcid / 64], ~BIT(pcid % 64),
+        __ATOMIC_SEQ_CST);
+    return ISSET(old, BIT(pcid % 64)) != 0;
+}
+
 __always_inline static inline void
 cpu_halt(void)
 {
@@ -1,17 +1,25 @@
 #ifndef _AMD64_GDT_H_
 #define _AMD64_GDT_H_
 
+#if !defined(__ASSEMBLER__)
 #include <sys/types.h>
 #include <sys/cdefs.h>
+#endif  /* !__ASSEMBLER__ */
 
 #define GDT_TSS_INDEX 5
 #define GDT_ENTRY_COUNT 7
 
-/* Segment selectors */
+/*
+ * Segment selectors
+ *
+ * XXX: SYSRET loads SS from STAR[63:48] + 8 and CS
+ *      from STAR[63:48] + 16, so user data must come
+ *      right before user code.
+ */
 #define KERNEL_CS 0x08
 #define KERNEL_DS 0x10
-#define USER_CS   0x18
-#define USER_DS   0x20
+#define USER_DS   0x18
+#define USER_CS   0x20
 
 /*
  * Bit definitions for regular segment descriptors
@@ -41,6 +49,7 @@
 #define GDT_ATTRIBUTE_DPL2         (2 << 5)
 #define GDT_ATTRIBUTE_DPL3         (3 << 5)
 
+#if !defined(__ASSEMBLER__)
 struct __packed gdt_entry {
     uint16_t limit;
     uint16_t base_low;
@@ -78,4 +87,5 @@ gdt_load(void)
     );
 }
 
+#endif  /* !__ASSEMBLER__ */
 #endif  /* !AMD64_GDT_H_ */
@@ -37,6 +37,7 @@
 #define IST_SW_INT  3U
 #define IST_SYSCALL 4U
 #define IST_DBFLT   5U
+#define IST_NMI     6U
 
 /* Upper 4 bits of interrupt vector */
 #define IPL_SHIFT 4
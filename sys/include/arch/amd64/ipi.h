@@ -44,6 +44,7 @@
 
 /* Fixed IPI IDs */
 #define IPI_TLB    0
+#define IPI_SCHED  1
 
 /*
  * Represents an interprocessor interrupt
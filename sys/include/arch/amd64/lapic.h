@@ -44,6 +44,7 @@
 void lapic_init(void);
 void lapic_eoi(void);
 void lapic_send_ipi(uint8_t id, uint8_t shorthand, uint8_t vector);
+void lapic_timer_fire(void);
 
 extern void *g_lapic_base;
 
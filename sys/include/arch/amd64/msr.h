@@ -35,6 +35,14 @@
 #define IA32_GS_BASE        0xC0000101
 #define IA32_FS_BASE        0xC0000100
 #define IA32_APIC_BASE_MSR  0x0000001B
+#define IA32_EFER           0xC0000080
+#define IA32_STAR           0xC0000081
+#define IA32_LSTAR          0xC0000082
+#define IA32_SFMASK         0xC0000084
+#define IA32_TSC_DEADLINE   0x000006E0
+
+/* IA32_EFER bits */
+#define EFER_SCE            0x00000001  /* SYSCALL enable */
 
 #if !defined(__ASSEMBLER__)
 static inline uint64_t
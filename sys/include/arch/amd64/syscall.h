@@ -31,11 +31,15 @@
 #define _MACHINE_SYSCALL_H_
 
 #if !defined(__ASSEMBLER__)
+/*
+ * System calls are made with the SYSCALL instruction,
+ * which clobbers %rcx (return address) and %r11 (RFLAGS).
+ */
 __always_inline static inline long
 syscall0(uint64_t code)
 {
     volatile long ret;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code));
+    __ASMV("syscall" : "=a"(ret) : "a"(code) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -43,7 +47,7 @@ __always_inline static inline long
 syscall1(uint64_t code, uint64_t arg0)
 {
     volatile long ret;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -51,7 +55,7 @@ __always_inline static long inline
 syscall2(uint64_t code, uint64_t arg0, uint64_t arg1)
 {
     volatile long ret;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -59,7 +63,7 @@ __always_inline static inline long
 syscall3(uint64_t code, uint64_t arg0, uint64_t arg1, uint64_t arg2)
 {
     volatile long ret;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -68,7 +72,7 @@ syscall4(uint64_t code, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t ar
 {
     volatile long ret;
     register uint64_t _arg3 asm("r10") = arg3;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -78,7 +82,7 @@ syscall5(uint64_t code, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t ar
     volatile long ret;
     register uint64_t _arg3 asm("r10") = arg3;
     register uint64_t _arg4 asm("r9") = arg4;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3), "r"(_arg4) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3), "r"(_arg4) : "rcx", "r11", "memory");
     return ret;
 }
 
@@ -89,7 +93,7 @@ syscall6(uint64_t code, uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t ar
     register uint64_t _arg3 asm("r10") = arg3;
     register uint64_t _arg4 asm("r9") = arg4;
     register uint64_t _arg5 asm("r8") = arg5;
-    __ASMV("int $0x80" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3), "r"(_arg4), "r"(_arg5) : "memory");
+    __ASMV("syscall" : "=a"(ret) : "a"(code), "D"(arg0), "S"(arg1), "d"(arg2), "r"(_arg3), "r"(_arg4), "r"(_arg5) : "rcx", "r11", "memory");
     return ret;
 }
 
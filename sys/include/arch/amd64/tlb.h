@@ -30,8 +30,13 @@
 #ifndef _MACHINE_TLB_H_
 #define _MACHINE_TLB_H_
 
+#include <sys/types.h>
 #include <sys/cdefs.h>
 
+#define TLB_PCID_MAX    4096    /* PCIDs, zero is never preserved */
+#define TLB_BATCH_MAX   8       /* Ranges in a shootdown batch */
+#define TLB_FLUSH_MAX   64      /* Pages to invalidate one by one */
+
 #define tlb_flush(va)           \
     __ASMV("invlpg (%0)"        \
            :                    \
@@ -39,4 +44,57 @@
            : "memory"           \
     )
 
+struct tlb_range {
+    vaddr_t va;
+    size_t len;
+};
+
+/*
+ * A list of ranges to invalidate in one address
+ * space, sent to the other processors with a single
+ * IPI each.
+ *
+ * @pcid: PCID of the address space.
+ * @kernel: Ranges are in the shared higher half.
+ * @all: Too many ranges, flush the address space.
+ * @nrange: Number of entries in `range'.
+ */
+struct tlb_batch {
+    uint16_t pcid;
+    uint8_t kernel : 1;
+    uint8_t all : 1;
+    uint8_t nrange;
+    struct tlb_range range[TLB_BATCH_MAX];
+};
+
+/*
+ * Add a range to a shootdown batch, merging it with
+ * the last one if they are adjacent.
+ */
+static inline void
+tlb_batch_add(struct tlb_batch *tb, vaddr_t va, size_t len)
+{
+    struct tlb_range *last;
+
+    if (tb->all) {
+        return;
+    }
+
+    if (tb->nrange > 0) {
+        last = &tb->range[tb->nrange - 1];
+        if (last->va + last->len == va) {
+            last->len += len;
+            return;
+        }
+    }
+
+    if (tb->nrange >= TLB_BATCH_MAX) {
+        tb->all = 1;
+        return;
+    }
+
+    tb->range[tb->nrange].va = va;
+    tb->range[tb->nrange++].len = len;
+}
+
 #endif  /* !_MACHINE_TLB_H_ */
@@ -34,7 +34,12 @@
 #include <sys/cdefs.h>
 #include <sys/param.h>
 
+struct cpu_info;
+
 uint64_t rdtsc_rel(void);
+uint64_t tsc_ticks(uint64_t n, uint64_t per_sec);
+bool tsc_usable(void);
+void tsc_clock_init(struct cpu_info *ci);
 
 __always_inline static inline uint64_t
 rdtsc(void)
@@ -116,6 +116,7 @@ tss_load(void)
 
 int tss_alloc_stack(union tss_stack *entry_out, size_t size);
 int tss_update_ist(struct cpu_info *ci, union tss_stack stack, uint8_t istno);
+void tss_update_rsp0(struct cpu_info *ci, union tss_stack stack);
 void write_tss(struct cpu_info *ci, struct tss_desc *desc);
 
 #endif  /* !_MACHINE_TSS_H_ */
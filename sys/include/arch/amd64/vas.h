@@ -40,6 +40,7 @@ struct vas {
     size_t cr3_flags;       /* CR3 flags */
     uintptr_t top_level;    /* PML5 if `use_l5_paging' true, otherwise PML4 */
     bool use_l5_paging;     /* True if 5-level paging is supported */
+    uint16_t pcid;          /* Process-context ID (0 if none) */
     struct spinlock lock;
 };
 
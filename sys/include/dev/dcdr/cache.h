@@ -31,44 +31,88 @@
 #define _DCDR_CACHE_H_
 
 #include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
 
 /*
- * A drive cache descriptor (DCD) describes a logical
- * block within a storage medium and is chained with
- * other DCDs. Logical block coalescing is a method
- * to optimize caching by combining adjacent logical block
- * pairs that are infrequently invalidated into a single
- * DCD.
+ * The DCDR (drive cache descriptor ring) caches
+ * logical blocks of a disk. Blocks are indexed by
+ * LBA through a hash table and evicted using the
+ * 2Q policy:
  *
- * If the lbc bit is set, this block is coalesced with
- * the next.
+ * - Blocks seen for the first time enter the A1in
+ *   FIFO and leave it without being promoted, a
+ *   single scan cannot push out the hot set.
+ *
+ * - Blocks evicted from A1in are remembered (without
+ *   their data) in the A1out ghost FIFO. A miss on a
+ *   ghost means the block is being reused, it goes
+ *   straight into the Am LRU.
+ *
+ * All of this is constant time, descriptors and block
+ * buffers come from fixed pools set up when the DCDR
+ * is allocated.
  */
+
+/* DCD states */
+#define DCD_FREE    0x00    /* On the free list */
+#define DCD_A1IN    0x01    /* Resident, seen once */
+#define DCD_AM      0x02    /* Resident, seen again */
+#define DCD_A1OUT   0x03    /* Ghost, no data */
+
 struct dcd {
     off_t lba;          /* Starting LBA */
     void *data;         /* Driver specific data */
     void *block;        /* Cached data from described block */
-    uint8_t lbc : 1;    /* Set if coalesced */
+    uint8_t state;      /* DCD_* state */
     uint32_t hit_count; /* Number of hits */
-    struct dcd *next;   /* Next ptr for DCD chaining */
-    struct dcd *prev;   /* Prev ptr for DCD chaining */
+    struct dcd *hnext;  /* Hash chain link */
+    TAILQ_ENTRY(dcd) link;
 };
 
+TAILQ_HEAD(dcd_queue, dcd);
+
 /*
- * This structure describes a drive cache descriptor
- * ring and contains basic information like the size
- * of each block.
+ * Cache statistics, readable as /ctl/<disk>/cache
+ *
+ * @hits: Lookups that found the block.
+ * @misses: Lookups that did not.
+ * @ghost_hits: Misses on a recently evicted block.
+ * @evictions: Blocks evicted to make room.
+ * @size: Resident blocks.
+ * @cap: Capacity in blocks.
+ * @bsize: Block size in bytes.
  */
+struct dcdr_stat {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t ghost_hits;
+    uint64_t evictions;
+    uint32_t size;
+    uint32_t cap;
+    uint32_t bsize;
+};
+
 struct dcdr {
     size_t bsize;       /* Block size */
     size_t cap;         /* Capacity (in entries) */
     size_t size;        /* Size (in entries) */
-    struct dcd *head;   /* Ring head */
-    struct dcd *tail;   /* Ring tail */
+    size_t kin;         /* Target A1in size */
+    size_t kout;        /* Max A1out size */
+    size_t nhash;       /* Hash buckets (power of two) */
+    struct dcd **hash;  /* LBA hash table */
+    struct dcd_queue a1in;
+    struct dcd_queue a1out;
+    struct dcd_queue am;
+    struct dcd_queue freeq;
+    size_t n_a1in;
+    size_t n_a1out;
+    void **bfree;       /* Free block buffers */
+    size_t nbfree;
+    struct dcdr_stat stat;
+    struct spinlock lock;
 };
 
-/*
- * Result from DCDR lookup.
- */
 struct dcdr_lookup {
     struct dcd *dcd_res;
     void *buf;
@@ -80,6 +124,10 @@ struct dcd *dcdr_cachein(struct dcdr *dcdr, void *block, off_t lba);
 
 struct dcd *dcdr_lbc_cachein(struct dcdr *dcdr, void *block, off_t lba);
 int dcdr_lookup(struct dcdr *dcdr, off_t lba, struct dcdr_lookup *res);
+int dcdr_read(struct dcdr *dcdr, off_t lba, void *buf);
 int dcdr_invldcd(struct dcdr *dcdr, off_t lba);
 
+void dcdr_stat(struct dcdr *dcdr, struct dcdr_stat *res);
+int dcdr_ctl_attach(struct dcdr *dcdr, const char *devname);
+
 #endif  /* !_DCDR_CACHE_H_ */
@@ -37,7 +37,7 @@
 #include <dev/ic/ahciregs.h>
 #include <fs/ctlfs.h>
 
-#define AHCI_DCDR_CAP 16
+#define AHCI_DCDR_CAP 512
 
 struct ahci_cmd_hdr;
 extern const struct ctlops g_sata_bsize_ops;
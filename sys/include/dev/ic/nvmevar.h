@@ -32,12 +32,20 @@
 
 #include <sys/types.h>
 #include <sys/cdefs.h>
+#include <sys/queue.h>
+#include <sys/spinlock.h>
+#include <sys/bio.h>
+#include <dev/dcdr/cache.h>
 
 /* Admin commands */
 #define NVME_OP_CREATE_IOSQ     0x01
 #define NVME_OP_GET_LOGPAGE     0x02
 #define NVME_OP_CREATE_IOCQ     0x05
 #define NVME_OP_IDENTIFY        0x06
+#define NVME_OP_SET_FEATURES    0x09
+
+/* Feature identifiers */
+#define NVME_FEAT_NQUEUES   0x07    /* Number of queues */
 
 /* Identify CNS values */
 #define ID_CNS_CTRL         0x01    /* Identify controller */
@@ -50,6 +58,41 @@
 /* Log page identifiers */
 #define NVME_LOGPAGE_SMART 0x02
 
+/* Queue depths (in entries), clamped to CAP.MQES */
+#define NVME_ADMINQ_DEPTH   32
+#define NVME_IOQ_DEPTH      256
+
+/*
+ * Max I/O queue pairs, CPUs share queue pairs
+ * if there are more CPUs than queue pairs.
+ */
+#define NVME_MAX_IOQ        16
+
+/*
+ * PRP list entries per command, the first page of a
+ * transfer goes in PRP1 so up to NVME_PRP_MAX + 1
+ * pages may be touched. The same space holds up to
+ * NVME_SGL_MAX SGL descriptors.
+ */
+#define NVME_PRP_MAX    32
+#define NVME_SGL_MAX    (NVME_PRP_MAX / 2)
+
+/* Command flags */
+#define NVME_CMD_PSDT_SGL   (1 << 6)    /* Data pointer is an SGL */
+
+/* SGL descriptor types */
+#define NVME_SGL_DATA       0x00        /* Data block */
+#define NVME_SGL_LAST_SEG   0x30        /* Last segment */
+
+/* Completion status code, bit 0 is the phase tag */
+#define NVME_CQE_SC(status) (((status) >> 1) & 0x7FFF)
+
+/* Polled command timeout */
+#define NVME_CMD_TIMEOUT 600000     /* In usec */
+
+/* Blocks cached per namespace */
+#define NVME_DCDR_CAP 256
+
 /*
  * S.M.A.R.T health / information log
  *
@@ -181,6 +224,20 @@ struct nvme_get_logpage_cmd {
     uint32_t unused2;
 };
 
+/* Set features */
+struct nvme_set_features_cmd {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t unused[2];
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t fid;
+    uint32_t dw11;
+    uint32_t unused1[4];
+};
+
 /* Read/write */
 struct nvme_rw_cmd {
     uint8_t opcode;
@@ -201,12 +258,36 @@ struct nvme_rw_cmd {
 };
 
 
+/* SGL descriptor */
+struct nvme_sgl_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint8_t unused[3];
+    uint8_t type;
+};
+
+/*
+ * Physical pages behind the data of a request.
+ *
+ * @pages: Page frames.
+ * @npages: Number of page frames.
+ * @off: Offset of the data within the first page.
+ * @len: Length of the data in bytes.
+ */
+struct nvme_dma {
+    const paddr_t *pages;
+    size_t npages;
+    size_t off;
+    size_t len;
+};
+
 struct nvme_cmd {
     union {
         struct nvme_identify_cmd identify;
         struct nvme_create_iocq_cmd create_iocq;
         struct nvme_create_iosq_cmd create_iosq;
         struct nvme_get_logpage_cmd get_logpage;
+        struct nvme_set_features_cmd set_features;
         struct nvme_rw_cmd rw;
     };
 };
@@ -221,6 +302,13 @@ struct nvme_queue {
     uint16_t size;              /* Size in elements */
     volatile uint32_t *sq_db;   /* Submission doorbell */
     volatile uint32_t *cq_db;   /* Completion doorbell */
+    struct spinlock lock;       /* Protects the queue (I/O queues) */
+    struct bio **reqs;          /* In-flight requests by CID */
+    uint64_t *lists;            /* PRP/SGL lists by CID */
+    uint16_t nreqs;             /* Number of requests in flight */
+    uint16_t cid_next;          /* Next CID to try */
+    uint16_t index;             /* Index in the I/O queue array */
+    uint8_t routed : 1;         /* Interrupts go to its own CPU */
 };
 
 struct nvme_id {
@@ -309,15 +397,19 @@ struct nvme_ns {
     size_t nsid;                /* Namespace ID */
     size_t lba_bsize;           /* LBA block size */
     size_t size;                /* Size in logical blocks */
-    struct nvme_queue ioq;      /* I/O queue */
     struct nvme_lbaf lba_fmt;   /* LBA format */
     struct nvme_ctrl *ctrl;     /* NVMe controller */
+    struct dcdr *dcdr;          /* Block cache */
     dev_t dev;
     TAILQ_ENTRY(nvme_ns) link;
 };
 
 struct nvme_ctrl {
     struct nvme_queue adminq;
+    struct nvme_queue *ioqs;    /* I/O queue pairs */
+    uint16_t nioq;              /* Number of I/O queue pairs */
+    size_t max_xfer;            /* Max transfer in bytes */
+    uint8_t sgl : 1;            /* SGLs are supported */
     struct nvme_bar *bar;
     uint8_t sqes;
     uint8_t cqes;
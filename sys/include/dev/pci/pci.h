@@ -41,6 +41,8 @@
 
 typedef uint32_t pcireg_t;
 
+struct cpu_info;
+
 /* For PCI lookups */
 struct pci_lookup {
     uint16_t device_id;
@@ -86,6 +88,7 @@ int pci_map_bar(struct pci_device *dev, uint8_t barno, void **vap);
 void pci_writel(struct pci_device *dev, uint32_t offset, pcireg_t val);
 
 int pci_enable_msix(struct pci_device *dev, const struct msi_intr *intr);
+int pci_msix_route(struct pci_device *dev, uint16_t entry, struct cpu_info *ci);
 void pci_add_device(struct pci_device *dev);
 
 void pci_msix_eoi(void);
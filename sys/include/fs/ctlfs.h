@@ -46,6 +46,7 @@ struct ctlops {
  * @ctlname: [1]: Control name (node entry name)
  * @ops: Callbacks / fs hooks
  * @mode: Access flags.
+ * @data: Driver private data of an entry.
  */
 struct ctlfs_dev {
     union {
@@ -54,6 +55,7 @@ struct ctlfs_dev {
     };
     const struct ctlops *ops;
     mode_t mode;
+    void *data;
 };
 
 int ctlfs_create_node(const char *name, const struct ctlfs_dev *dp);
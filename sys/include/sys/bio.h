@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SYS_BIO_H_
+#define _SYS_BIO_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+#include <sys/disk.h>
+
+#if defined(_KERNEL)
+
+/*
+ * Number of buffers in the buffer cache, this may
+ * be set with the `BIO_NBUF' kconf(9) option.
+ */
+#if defined(__BIO_NBUF)
+#define BIO_NBUF __BIO_NBUF
+#else
+#define BIO_NBUF 256
+#endif  /* __BIO_NBUF */
+
+#define BIO_FLUSH_USEC  1000000     /* Flusher period */
+#define BIO_RUN_MAX     16          /* Max blocks per coalesced write */
+#define BIO_DIRTY_HIGH  (BIO_NBUF / 2)
+#define BIO_NRUN        4           /* Coalesced runs kept in flight */
+
+/* Buffer flags */
+#define B_VALID     BIT(0)      /* Holds the contents of the block */
+#define B_DIRTY     BIT(1)      /* Must be written back */
+#define B_BUSY      BIT(2)      /* Owned by someone */
+
+/*
+ * A buffer caches one virtual block (V_BSIZE bytes)
+ * of a disk.
+ *
+ * @dp: Disk the block belongs to.
+ * @blkno: Virtual block number.
+ * @data: Contents of the block.
+ * @flags: Buffer flags (B_*)
+ * @hlink: Hash chain link.
+ * @lru: LRU link, only idle buffers are on the LRU.
+ * @dlink: Dirty queue link.
+ */
+struct buf {
+    struct disk *dp;
+    blkoff_t blkno;
+    char *data;
+    uint32_t flags;
+    TAILQ_ENTRY(buf) hlink;
+    TAILQ_ENTRY(buf) lru;
+    TAILQ_ENTRY(buf) dlink;
+};
+
+/* Request flags */
+#define BIO_WRITE   BIT(0)      /* Write to the disk */
+#define BIO_DONE    BIT(1)      /* Completed, `error' is valid */
+
+/*
+ * An asynchronous block I/O request. Requests are
+ * handed to a driver with bio_submit() and the driver
+ * completes them with bio_done(), usually from its
+ * interrupt handler.
+ *
+ * @dp: Disk to operate on.
+ * @offset: Byte offset on the disk (block aligned).
+ * @data: Page aligned, physically contiguous buffer.
+ * @len: Length in bytes (block aligned).
+ * @flags: Request flags (BIO_*)
+ * @error: Result of the request once BIO_DONE is set.
+ * @done: Completion callback, may be NULL.
+ * @arg: Private to whoever submitted the request.
+ * @drv: Private to the driver while in flight.
+ * @link: Queue link, owned by the driver while in flight.
+ */
+struct bio {
+    struct disk *dp;
+    off_t offset;
+    void *data;
+    size_t len;
+    volatile uint32_t flags;
+    int error;
+    void(*done)(struct bio *bp);
+    void *arg;
+    void *drv;
+    TAILQ_ENTRY(bio) link;
+};
+
+int bio_submit(struct bio *bp);
+int bio_wait(struct bio *bp);
+void bio_done(struct bio *bp, int error);
+
+struct buf *bio_get(struct disk *dp, blkoff_t blkno);
+int bio_read(struct disk *dp, blkoff_t blkno, struct buf **res);
+ssize_t bio_readblks(struct disk *dp, blkoff_t blkno, void *buf, size_t count);
+int bio_write(struct buf *bp);
+void bio_dirty(struct buf *bp);
+void bio_release(struct buf *bp);
+
+int bio_flush(struct disk *dp);
+void bio_init(void);
+
+#endif  /* _KERNEL */
+#endif  /* !_SYS_BIO_H_ */
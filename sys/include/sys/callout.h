@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _SYS_CALLOUT_H_
+#define _SYS_CALLOUT_H_
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/param.h>
+
+/* Number of histogram buckets */
+#define CALLOUT_NHIST 24
+
+/*
+ * Expiry histogram, exposed through /ctl/callout/latency
+ * and /ctl/callout/slack. Bucket 0 counts expiries that
+ * were on time, bucket N counts [2^(N-1), 2^N) microseconds
+ * late and the last bucket counts everything beyond that.
+ *
+ * @count: Number of expiries recorded
+ * @total_usec: Sum of all samples (for computing the mean)
+ * @max_usec: Largest sample seen
+ * @bucket: Log2 buckets in microseconds
+ */
+struct callout_hist {
+    uint64_t count;
+    uint64_t total_usec;
+    uint64_t max_usec;
+    uint64_t bucket[CALLOUT_NHIST];
+};
+
+#if defined(_KERNEL)
+
+/* Callout flags */
+#define CALLOUT_PENDING BIT(0)      /* Armed and waiting to fire */
+
+/* Default slack for callers that do not care (usec) */
+#define CALLOUT_SLACK_DEFAULT 50
+
+struct callout_cpu;
+
+/*
+ * A callout runs a function once after a deadline
+ * has passed. Callouts are kept in a per-processor
+ * hierarchical timing wheel and are run from the
+ * timer interrupt of the processor they were armed
+ * on, the function must not block.
+ *
+ * @func: Function to run on expiry
+ * @arg: Argument to pass to `func'
+ * @deadline: Requested expiry time (usec)
+ * @expire: Time the callout fires at, after slack (usec)
+ * @flags: Callout flags
+ * @level: Wheel level the callout is filed on [i]
+ * @slot: Wheel slot the callout is filed in [i]
+ * @cc: Processor wheel this callout was last armed on [i]
+ *
+ * Field attributes:
+ * - [i]: Used internally
+ */
+struct callout {
+    void(*func)(void *arg);
+    void *arg;
+    size_t deadline;
+    size_t expire;
+    volatile uint8_t flags;
+    uint8_t level;
+    uint8_t slot;
+    struct callout_cpu *cc;
+    TAILQ_ENTRY(callout) link;
+};
+
+struct cpu_info;
+
+void callout_init(struct callout *c);
+void callout_reset(struct callout *c, size_t usec, void(*func)(void *), void *arg);
+void callout_reset_slack(struct callout *c, size_t usec, size_t slack,
+    void(*func)(void *), void *arg);
+bool callout_stop(struct callout *c);
+void callout_arm(size_t usec);
+
+size_t callout_time_usec(void);
+bool callout_next(size_t *usec);
+void callout_tick(void);
+
+void callout_init_cpu(struct cpu_info *ci);
+void callout_startup(void);
+
+#endif  /* _KERNEL */
+#endif  /* !_SYS_CALLOUT_H_ */
@@ -40,6 +40,8 @@
 
 typedef uint8_t devmajor_t;
 
+struct bio;
+
 /* Device operation typedefs */
 typedef int(*dev_read_t)(dev_t, struct sio_txn *, int);
 typedef int(*dev_write_t)(dev_t, struct sio_txn *, int);
@@ -58,6 +60,7 @@ struct bdevsw {
     int(*read)(dev_t dev, struct sio_txn *sio, int flags);
     int(*write)(dev_t dev, struct sio_txn *sio, int flags);
     int(*bsize)(dev_t dev);
+    int(*strategy)(dev_t dev, struct bio *bp);
 };
 
 void *dev_get(devmajor_t major, dev_t dev);
@@ -44,6 +44,7 @@
 #define AT_RANDOM 7
 #define AT_EXECFN 8
 #define AT_PAGESIZE 9
+#define AT_TIMEPAGE 10
 #define _AT_MAX 16
 
 #if defined(_KERNEL)
@@ -66,6 +67,7 @@ struct auxval {
     uint64_t at_phdr;
     uint64_t at_phent;
     uint64_t at_phnum;
+    uint64_t at_timepage;
 };
 
 /* A loaded program */
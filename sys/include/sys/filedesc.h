@@ -34,7 +34,7 @@
 #if defined(_KERNEL)
 #include <sys/vnode.h>
 #include <sys/syscall.h>
-#include <sys/spinlock.h>
+#include <sys/mutex.h>
 #include <sys/syscall.h>
 
 #define SEEK_SET 0
@@ -48,7 +48,7 @@ struct filedesc {
     int refcnt;
     int flags;
     struct vnode *vp;
-    struct spinlock lock;
+    struct mutex lock;
 };
 
 int fd_close(unsigned int fd);
@@ -55,18 +55,39 @@
 #define MAP_SHARED  0x0001
 #define MAP_PRIVATE 0x0002
 #define MAP_FIXED   0x0004
+#define MAP_POPULATE 0x0008     /* Prefault anonymous pages */
 
 #if defined(_KERNEL)
+/*
+ * Anonymous mappings without an address hint are
+ * placed from here up, well above any physical memory
+ * that may be identity mapped into userspace.
+ */
+#define MMAP_USER_BASE 0x500000000000
+
+/*
+ * End of the lower half, anything at or above this
+ * shares page tables with the kernel.
+ */
+#define MMAP_USER_END  0x800000000000
+
 /*
  * The mmap ledger entry
  *
  * @va_start: Starting virtual address.
  * @obj: VM object representing this entry.
+ * @size: Length of the mapping in bytes.
+ * @prot: Protection flags of the mapping.
+ * @flags: mmap() flags (MAP_*)
+ * @off: Offset into the backing file.
  */
 struct mmap_entry {
     vaddr_t va_start;
     struct vm_object *obj;
     size_t size;
+    vm_prot_t prot;
+    int flags;
+    off_t off;
     RBT_ENTRY(mmap_entry) hd;
 };
 
@@ -76,10 +97,12 @@ struct mmap_entry {
  *
  * @hd: Red-black tree of mmap_entry structures
  * @nbytes: Total bytes mapped.
+ * @va_next: Next free address for anonymous mappings.
  */
 struct mmap_lgdr {
     RBT_HEAD(lgdr_entries, mmap_entry) hd;
     size_t nbytes;
+    vaddr_t va_next;
 };
 
 int mmap_entrycmp(const struct mmap_entry *a, const struct mmap_entry *b);
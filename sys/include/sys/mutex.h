@@ -40,10 +40,12 @@
 struct mutex {
     char name[MUTEX_NAME_LEN];
     volatile uint8_t lock;
+    volatile uint32_t nwaiter;
 };
 
 struct mutex *mutex_new(const char *name);
 void mutex_free(struct mutex *mtx);
+void mutex_cache_init(void);
 
 int mutex_acquire(struct mutex *mtx, int flags);
 void mutex_release(struct mutex *mtx);
@@ -44,6 +44,7 @@
 #include <sys/filedesc.h>
 #include <sys/signal.h>
 #include <sys/vnode.h>
+#include <sys/callout.h>
 #if defined(_KERNEL)
 #include <machine/frame.h>
 #include <machine/pcb.h>
@@ -53,6 +54,8 @@
 #if defined(_KERNEL)
 #define PROC_STACK_PAGES 8
 #define PROC_STACK_SIZE  (PROC_STACK_PAGES * DEFAULT_PAGESIZE)
+#define PROC_KSTACK_PAGES 2
+#define PROC_KSTACK_SIZE  (PROC_KSTACK_PAGES * DEFAULT_PAGESIZE)
 #define PROC_MAX_FILEDES 256
 #define PROC_SIGMAX 64
 
@@ -84,6 +87,8 @@ struct __packed coredump {
  */
 typedef int16_t affinity_t;
 
+struct sched_runq;
+
 struct proc {
     pid_t pid;
     struct exec_prog exec;
@@ -98,6 +103,8 @@ struct proc {
     struct pcb pcb;
     struct proc *parent;
     affinity_t affinity;
+    struct sched_runq *runq;
+    const void *wchan;
     void *data;
     size_t priority;
     int exit_status;
@@ -105,11 +112,15 @@ struct proc {
     volatile uint32_t flags;
     uint32_t nleaves;
     uintptr_t stack_base;
+    uintptr_t kstack_base;
+    struct callout sleep_co;
+    int sleep_error;
     struct spinlock ksigq_lock;
     TAILQ_HEAD(, proc) leafq;
     TAILQ_ENTRY(proc) leaf_link;
     TAILQ_HEAD(, ksiginfo) ksigq;
     TAILQ_ENTRY(proc) link;
+    TAILQ_ENTRY(proc) sleep_link;
 };
 
 #define PROC_EXITING    BIT(0)  /* Exiting */
@@ -118,8 +129,10 @@ struct proc {
 #define PROC_LEAFQ      BIT(3)  /* Leaf queue is active */
 #define PROC_WAITED     BIT(4)  /* Being waited on by parent */
 #define PROC_KTD        BIT(5)  /* Kernel thread */
-#define PROC_SLEEP      BIT(6)  /* Thread execution paused */
+#define PROC_SLEEP      BIT(6)  /* Asleep on a wait channel */
 #define PROC_PINNED     BIT(7)  /* Pinned to CPU */
+#define PROC_PARKED     BIT(8)  /* Switched out while asleep */
+#define PROC_IDLE       BIT(9)  /* Per-CPU idle thread */
 
 struct proc *this_td(void);
 struct proc *td_copy(struct proc *td);
@@ -140,6 +153,8 @@ scret_t sys_getppid(struct syscall_args *scargs);
 scret_t sys_waitpid(struct syscall_args *scargs);
 
 int md_spawn(struct proc *p, struct proc *parent, uintptr_t ip);
+int md_fork(struct proc *p, struct proc *parent, const struct trapframe *tf,
+            uintptr_t ip);
 
 scret_t sys_spawn(struct syscall_args *scargs);
 pid_t spawn(struct proc *cur, void(*func)(void), void *p, int flags, struct proc **newprocp);
@@ -148,6 +163,7 @@ uintptr_t md_td_stackinit(struct proc *td, void *stack_top, struct exec_prog *pr
 __dead void md_td_kick(struct proc *td);
 
 int fork1(struct proc *cur, int flags, void(*ip)(void), struct proc **newprocp);
+scret_t sys_fork(struct syscall_args *scargs);
 int exit1(struct proc *td, int flags);
 __dead scret_t sys_exit(struct syscall_args *scargs);
 
@@ -39,10 +39,13 @@
  * Scheduler CPU information
  *
  * @nswitch: Number of context switches
- * @idle: Number of milliseconds idle
+ * @nsteal: Number of threads stolen from other cores
+ * @nready: Number of threads in this core's ready queues
  */
 struct sched_cpu {
     uint64_t nswitch;
+    uint64_t nsteal;
+    uint32_t nready;
 };
 
 /*
@@ -70,6 +73,7 @@ void sched_preempt_set(bool enable);
 bool sched_preemptable(void);
 
 void sched_yield(void);
+bool sched_cpu_busy(void);
 void sched_suspend(struct proc *td, const struct timeval *tv);
 void sched_detach(struct proc *td);
 
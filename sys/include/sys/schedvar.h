@@ -39,6 +39,9 @@
 #define DEFAULT_TIMESLICE_USEC 9000
 #define SHORT_TIMESLICE_USEC 10
 
+/* Number of sleep queue hash buckets */
+#define SLEEPQ_NBUCKET 64
+
 #define SCHED_POLICY_MLFQ 0x00U   /* Multilevel feedback queue */
 #define SCHED_POLICY_RR   0x01U   /* Round robin */
 
@@ -55,15 +58,67 @@ typedef uint8_t sched_policy_t;
 __static_assert(SCHED_NQUEUE <= 8, "SCHED_NQUEUE exceeds max");
 __static_assert(SCHED_NQUEUE > 0, "SCHED_NQUEUE cannot be zero");
 
+struct cpu_info;
+
 struct sched_queue {
     TAILQ_HEAD(, proc) q;
     size_t nthread;
 };
 
+/*
+ * Per-processor set of ready queues. Each processor
+ * owns one of these so that enqueue and dequeue do
+ * not contend on a single global lock.
+ *
+ * @lock: Protects every queue in this set
+ * @q: Ready queues (one per priority level)
+ * @bitmap: Bit N is set if q[N] is not empty
+ * @idle: Owner is sitting in its idle loop
+ * @started: Owner has entered the scheduler
+ * @idle_td: Thread to run when nothing else is ready
+ * @slice_end: End of the current quantum (usec)
+ * @ci: Processor that owns this set
+ */
+struct sched_runq {
+    struct spinlock lock;
+    struct sched_queue q[SCHED_NQUEUE];
+    uint32_t bitmap;
+    volatile uint8_t idle;
+    volatile uint8_t started;
+    struct proc *idle_td;
+    size_t slice_end;
+    struct cpu_info *ci;
+} __aligned(COHERENCY_UNIT);
+
+/*
+ * Sleep queue bucket - threads asleep on a wait
+ * channel are kept here instead of on the ready
+ * queues so they never need to be skipped over
+ * when picking the next thread to run.
+ *
+ * @lock: Protects `q' and the sleep state of threads on it
+ * @q: Threads asleep on a channel that hashes to this bucket
+ */
+struct sched_sleepq {
+    struct spinlock lock;
+    TAILQ_HEAD(, proc) q;
+} __aligned(COHERENCY_UNIT);
+
 struct proc *sched_dequeue_td(void);
+void sched_init_cpu(struct cpu_info *ci);
+void sched_idle_init(struct proc *td);
+struct proc *sched_idle_td(void);
+bool sched_need_switch(struct proc *td);
+void sched_timer_arm(struct proc *td, bool renew);
+
+void sched_sleep(struct proc *td, const void *wchan);
+size_t sched_wakeup(const void *wchan, size_t nwake);
+bool sched_wakeup_td(struct proc *td);
 void mi_sched_switch(struct proc *from);
 
 void md_sched_switch(struct trapframe *tf);
+void md_sched_kick(struct cpu_info *ci);
+void md_sched_now(void);
 void sched_oneshot(bool now);
 
 #endif  /* _KERNEL */
@@ -33,6 +33,11 @@
 #include <sys/types.h>
 #include <sys/param.h>
 
+#if defined(_KERNEL)
+/* Kernel only spawn() flags */
+#define SPAWN_IDLE BIT(30)      /* Idle thread for the current CPU */
+#endif  /* _KERNEL */
+
 #if !defined(_KERNEL)
 pid_t spawn(const char *pathname, char **argv, char **envp, int flags);
 #endif  /* _KERNEL */
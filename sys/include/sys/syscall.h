@@ -68,6 +68,8 @@
 #define SYS_connect 27
 #define SYS_setsockopt 28
 #define SYS_disk    29
+#define SYS_clock_gettime 30
+#define SYS_fork    31
 
 #if defined(_KERNEL)
 /* Syscall return value and arg type */
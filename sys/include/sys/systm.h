@@ -41,6 +41,15 @@ int copyout(const void *kaddr, void *uaddr, size_t len);
 int copyinstr(const void *uaddr, char *kaddr, size_t len);
 int cpu_report_count(uint32_t count);
 
+struct mutex;
+struct spinlock;
+
+int tsleep(const void *wchan, size_t usec);
+int msleep(const void *wchan, struct mutex *mtx, size_t usec);
+int msleep_spin(const void *wchan, struct spinlock *lock, size_t usec);
+void wakeup(const void *wchan);
+void wakeup_one(const void *wchan);
+
 __always_inline static inline void
 __sigraise(int signo)
 {
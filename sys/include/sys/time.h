@@ -45,6 +45,31 @@ struct timespec {
     long tv_nsec;
 };
 
+/* Clock IDs */
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+/* Time page flags */
+#define TIMEPAGE_TSC    0x01    /* TSC fields are valid */
+
+/*
+ * Read-only page shared with every process (see AT_TIMEPAGE)
+ * so that clocks can be read without a syscall. Readers must
+ * retry while `seq' is odd or if it changed during the read.
+ *
+ * Monotonic nanoseconds are computed as:
+ *
+ *    mono_base + (((TSC - tsc_base) * tsc_mult) >> 32)
+ */
+struct timepage {
+    volatile uint32_t seq;
+    uint32_t flags;
+    uint64_t tsc_base;      /* TSC value at `mono_base' */
+    uint64_t tsc_mult;      /* Nanoseconds per tick (32.32) */
+    uint64_t mono_base;     /* Monotonic time (nsec) */
+    uint64_t wall_base;     /* Unix time at monotonic zero (nsec) */
+};
+
 struct date {
     uint16_t year;
     uint8_t month;
@@ -55,6 +80,13 @@ struct date {
 };
 
 #if defined(_KERNEL)
+time_t date_to_time(const struct date *dp);
+
+void timepage_set_clock(uint64_t tsc_base, uint64_t tsc_mult, uint64_t mono_base);
+void timepage_set_wall(time_t sec);
+paddr_t timepage_paddr(void);
+
 scret_t sys_sleep(struct syscall_args *scargs);
+scret_t sys_clock_gettime(struct syscall_args *scargs);
 #endif
 #endif  /* !_SYS_TIME_H_ */
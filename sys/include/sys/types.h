@@ -109,6 +109,7 @@ typedef __uint32_t gid_t;
 typedef __uint32_t blksize_t;
 typedef __uint32_t blkcnt_t;
 typedef __uint64_t time_t;
+typedef int clockid_t;
 #if defined(_HAVE_PTRDIFF_T)
 typedef __ptrdiff_t ptrdiff_t;
 #endif  /* _HAVE_PTRDIFF_T */
@@ -31,6 +31,10 @@
 #define _SYS_VMSTAT_H_
 
 #include <sys/types.h>
+#include <sys/limits.h>
+
+/* Number of page allocator block orders */
+#define VM_NORDER 16
 
 /*
  * Virtual memory statistics
@@ -38,11 +42,44 @@
  * @mem_avail: Available memory in MiB
  * @mem_used: Allocated memory in MiB
  * @mem_total: Total system memory in MiB
+ * @order_free: Free blocks of 2^n pages for each order n
  */
 struct vm_stat {
     uint32_t mem_avail;
     uint32_t mem_used;
     size_t mem_total;
+    uint32_t order_free[VM_NORDER];
+};
+
+/*
+ * Per-CPU dynalloc arena statistics, read from
+ * /ctl/vm/dynalloc as a `struct vm_dynstat'.
+ *
+ * @pool_size: Size of the arena in bytes
+ * @bytes_used: Bytes currently allocated
+ * @bytes_free: Bytes currently free
+ * @largest_free: Largest free block in bytes
+ * @lock_waits: Times the arena lock was contended
+ * @remote_frees: Frees pushed by other processors
+ * @frag: Percent of free memory outside the largest block
+ */
+struct vm_arena_stat {
+    uint64_t pool_size;
+    uint64_t bytes_used;
+    uint64_t bytes_free;
+    uint64_t largest_free;
+    uint64_t lock_waits;
+    uint64_t remote_frees;
+    uint32_t frag;
+};
+
+/*
+ * @narena: Number of valid entries in `arena'
+ * @arena: Arena statistics indexed by CPU
+ */
+struct vm_dynstat {
+    uint32_t narena;
+    struct vm_arena_stat arena[CPU_MAX];
 };
 
 #endif  /* !_VM_STAT_H_ */
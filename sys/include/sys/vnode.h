@@ -46,10 +46,13 @@ struct vnode {
     void *data;
     const struct vops *vops;
     struct vm_object vobj;
+    off_t ra_next;          /* Expected offset of next read */
+    uint32_t ra_pages;      /* Readahead window in pages */
     uint32_t refcount;
     dev_t major;
     dev_t dev;
     TAILQ_ENTRY(vnode) vcache_link;
+    TAILQ_ENTRY(vnode) pgcache_link;    /* Vnodes with cached pages */
 };
 
 /*
@@ -78,6 +81,9 @@ struct vcache {
 #define VBLK    0x04    /* Block device */
 #define VSOCK   0x05    /* Socket */
 
+/* Vnode flags */
+#define VKEEP   0x01    /* Filesystem keeps a reference */
+
 #define VNOVAL -1
 
 struct vop_lookup_args {
@@ -133,6 +139,8 @@ struct vnode *vfs_recycle_vnode(void);
 /* Vnode operations */
 int vfs_alloc_vnode(struct vnode **res, int type);
 int vfs_release_vnode(struct vnode *vp);
+void vfs_free_vnode(struct vnode *vp);
+void vfs_vnode_init(void);
 
 /* Vnode operation wrappers */
 int vfs_vop_lookup(struct vop_lookup_args *args);
@@ -53,6 +53,7 @@ typedef void(*workfunc_t)(struct workqueue *wqp, struct work *wp);
  * @name: Name of this work/task [i]
  * @data: Optional data to be passed with work [p]
  * @func: Function with work to be done [p]
+ * @deadline: When delayed work becomes due (usec) [i]
  * @cookie: Used for validating the work structure [i]
  *
  * Field attributes:
@@ -63,6 +64,7 @@ struct work {
     char *name;
     void *data;
     workfunc_t func;
+    size_t deadline;
     TAILQ_ENTRY(work) link;
 };
 
@@ -73,6 +75,7 @@ struct work {
  *
  * @name: Name of workqueue.
  * @work: Start of the workqueue
+ * @delayed: Delayed work, soonest deadline first
  * @ipl: IPL that work here must run with
  * @max_work: Max number of jobs that can be queued
  * @nwork: Number of tasks to be done
@@ -83,6 +86,7 @@ struct work {
 struct workqueue {
     char *name;
     TAILQ_HEAD(, work) work;
+    TAILQ_HEAD(, work) delayed;
     uint8_t ipl;
     size_t max_work;
     ssize_t nwork;
@@ -94,6 +98,8 @@ struct workqueue {
 struct workqueue *workqueue_new(const char *name, size_t max_work, int ipl);
 
 int workqueue_enq(struct workqueue *wqp, const char *name, struct work *wp);
+int workqueue_enq_delayed(struct workqueue *wqp, const char *name,
+    struct work *wp, size_t usec);
 int workqueue_destroy(struct workqueue *wqp);
 int work_destroy(struct work *wp);
 
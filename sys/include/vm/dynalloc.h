@@ -31,6 +31,7 @@
 #define _VM_DYNALLOC_H_
 
 #include <sys/types.h>
+#include <sys/vmstat.h>
 
 void *dynalloc(size_t sz);
 void *dynalloc_memalign(size_t sz, size_t align);
@@ -38,4 +39,8 @@ void *dynalloc_memalign(size_t sz, size_t align);
 void *dynrealloc(void *old_ptr, size_t newsize);
 void dynfree(void *ptr);
 
+size_t dynalloc_narena(void);
+int dynalloc_stat(size_t idx, struct vm_arena_stat *res);
+void dynalloc_init(void);
+
 #endif  /* !_VM_DYNALLOC_H_ */
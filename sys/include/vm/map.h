@@ -34,7 +34,15 @@
 #include <machine/vas.h>
 #include <vm/pmap.h>
 
+struct proc;
+
 int vm_map(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot, size_t count);
 int vm_unmap(struct vas vas, vaddr_t va, size_t count);
+void vm_unmap_free(struct vas vas, vaddr_t va, size_t count);
+int vm_fault(vaddr_t va, vm_prot_t access);
+
+int vm_map_fork(struct proc *parent, struct proc *child);
+void mmap_lgdr_release(struct proc *td);
+void vm_map_init(void);
 
 #endif  /* !_VM_MAP_H_ */
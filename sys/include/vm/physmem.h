@@ -31,13 +31,23 @@
 #define _VM_PHYSMEM_H_
 
 #include <sys/types.h>
+#include <sys/param.h>
+
+/* Frame allocation flags */
+#define VM_ALLOC_ZERO   BIT(0)  /* Frames must be zeroed */
 
 uint32_t vm_mem_used(void);
 uint32_t vm_mem_free(void);
 size_t vm_mem_total(void);
+void vm_order_free(uint32_t *res);
 
 void vm_physmem_init(void);
 uintptr_t vm_alloc_frame(size_t count);
+uintptr_t vm_alloc_frame_flags(size_t count, int flags);
+void vm_zero_start(void);
 void vm_free_frame(uintptr_t base, size_t count);
 
+int vm_frame_share(uintptr_t pa);
+size_t vm_frame_refs(uintptr_t pa);
+
 #endif  /* !_VM_PHYSMEM_H_ */
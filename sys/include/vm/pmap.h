@@ -38,6 +38,7 @@
 #define PROT_WRITE      BIT(0)      /* Writable */
 #define PROT_EXEC       BIT(1)      /* Executable */
 #define PROT_USER       BIT(2)      /* User accessible */
+#define PROT_COW        BIT(3)      /* Read-only until copied on write */
 
 /* Caching types */
 #define VM_CACHE_UC 0x00000U /* Uncachable */
@@ -75,6 +76,32 @@ int pmap_map(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot);
  */
 int pmap_unmap(struct vas vas, vaddr_t va);
 
+/*
+ * Map a physically contiguous range of `len' bytes,
+ * using large pages where the range lines up for them.
+ */
+int pmap_map_range(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot,
+                   size_t len);
+
+/*
+ * Unmap a range of `len' bytes. The caller must
+ * invalidate the range with pmap_tlb_flush().
+ */
+int pmap_unmap_range(struct vas vas, vaddr_t va, size_t len);
+
+/*
+ * Change the protection of every page mapped in a
+ * range of `len' bytes. The caller must invalidate
+ * the range with pmap_tlb_flush().
+ */
+int pmap_protect_range(struct vas vas, vaddr_t va, size_t len, vm_prot_t prot);
+
+/*
+ * Get the physical address and protection of a
+ * single page mapping.
+ */
+int pmap_lookup(struct vas vas, vaddr_t va, paddr_t *pa, vm_prot_t *prot);
+
 /*
  * Returns true if the page is clean (modified), otherwise
  * returns false.
@@ -86,12 +113,24 @@ bool pmap_is_clean(struct vas vas, vaddr_t va);
  */
 void pmap_mark_clean(struct vas vas, vaddr_t va);
 
+/*
+ * Invalidate the TLB entries for a range of an
+ * address space on every processor.
+ */
+void pmap_tlb_flush(struct vas vas, vaddr_t va, size_t len);
+
 /*
  * Mark a virtual address with a specific
  * caching type.
  */
 int pmap_set_cache(struct vas vas, vaddr_t va, int type);
 
+/*
+ * Zero a physical page without polluting
+ * the caches if possible.
+ */
+void pmap_zero_page(paddr_t pa);
+
 /*
  * Machine dependent pmap init code.
  */
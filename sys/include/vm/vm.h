@@ -31,6 +31,7 @@
 #define _VM_H_
 
 #include <sys/types.h>
+#include <sys/limits.h>
 #include <sys/limine.h>
 #include <sys/spinlock.h>
 #include <vm/tlsf.h>
@@ -44,11 +45,38 @@ extern volatile struct limine_hhdm_request g_hhdm_request;
 
 #define DEFAULT_PAGESIZE 4096
 
-struct vm_ctx {
-    size_t dynalloc_pool_sz;
-    uintptr_t dynalloc_pool_pa;
-    struct spinlock dynalloc_lock;
+/*
+ * A per-CPU dynalloc arena. Blocks freed by other
+ * processors are pushed onto the lock-free `remote'
+ * list and given back to TLSF by the owner.
+ *
+ * @pool_pa: Physical base of the TLSF pool
+ * @pool_sz: Size of the TLSF pool in bytes
+ * @lock: Protects the TLSF context
+ * @tlsf_ctx: TLSF context, NULL if not set up yet
+ * @remote: Blocks freed by other processors
+ * @bytes_used: Bytes handed out from this arena
+ * @lock_waits: Times `lock' was contended
+ * @nremote: Number of remote frees
+ */
+struct dynalloc_arena {
+    uintptr_t pool_pa;
+    size_t pool_sz;
+    struct spinlock lock;
     tlsf_t tlsf_ctx;
+    void *remote;
+    size_t bytes_used;
+    volatile uint64_t lock_waits;
+    volatile uint64_t nremote;
+};
+
+/*
+ * @arena: Per-CPU dynalloc arenas
+ * @narena: One past the highest arena set up
+ */
+struct vm_ctx {
+    struct dynalloc_arena arena[CPU_MAX];
+    volatile size_t narena;
 };
 
 extern struct vas g_kvas;
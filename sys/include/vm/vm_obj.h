@@ -36,12 +36,23 @@
 #include <sys/cdefs.h>
 #include <vm/vm_pager.h>
 #include <vm/vm_page.h>
+#include <vm/vm_radix.h>
 #include <vm/vm.h>
 
+/*
+ * Iterate over the resident pages of an object in
+ * order of offset. `idx' holds the page index of
+ * `pg', the current page may be freed in the loop.
+ */
+#define VM_OBJ_FOREACH(pg, obp, idx)                        \
+    for ((idx) = 0;                                         \
+        ((pg) = vm_radix_next(&(obp)->pages, &(idx))) != NULL; \
+        ++(idx))
+
 struct vm_object {
     struct spinlock lock;
     const struct vm_pagerops *pgops;
-    RBT_HEAD(vm_objtree, vm_page) objt;
+    struct vm_radix pages;          /* Resident pages by index */
     vm_prot_t prot;
     void *data;
     int refs;
@@ -51,8 +62,4 @@ struct vm_object {
 int vm_obj_init(struct vm_object *obp, const struct vm_pagerops *pgops, int refs);
 void vm_obj_release(struct vm_object *obp);
 
-/* Object tree stuff */
-int vm_pagecmp(const struct vm_page *a, const struct vm_page *b);
-RBT_PROTOTYPE(vm_objtree, vm_page, objt, vm_pagecmp)
-
 #endif  /* !_VM_OBJ_H_ */
@@ -31,7 +31,6 @@
 #define _VM_PAGE_H_
 
 #include <sys/types.h>
-#include <sys/tree.h>
 #include <sys/queue.h>
 #include <sys/param.h>
 #include <sys/spinlock.h>
@@ -43,7 +42,6 @@ struct vm_object;
  */
 struct vm_page {
     TAILQ_ENTRY(vm_page) pageq;     /* Queue data */
-    RBT_ENTRY(vm_page) objt;        /* Object tree */
     paddr_t phys_addr;              /* Physical address of page */
     struct spinlock lock;           /* Page lock */
     uint32_t flags;                 /* Page flags */
@@ -57,9 +55,12 @@ struct vm_page {
 
 /* Page alloc flags */
 #define PALLOC_ZERO BIT(0)
+#define PALLOC_FILL BIT(1)      /* Caller fills page, leave it invalid */
 
 struct vm_page *vm_pagelookup(struct vm_object *obj, off_t off);
-struct vm_page *vm_pagealloc(struct vm_object *obj, int flags);
+struct vm_page *vm_pagealloc(struct vm_object *obj, off_t off, int flags);
+struct vm_page *vm_pagedup(struct vm_object *obj, const struct vm_page *pg);
 void vm_pagefree(struct vm_object *obj, struct vm_page *pg, int flags);
+void vm_page_init(void);
 
 #endif  /* !_VM_PAGE_H_ */
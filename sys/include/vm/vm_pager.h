@@ -55,5 +55,6 @@ struct vm_pagerops {
 };
 
 int vm_pager_get(struct vm_object *obp, struct vm_page **pgs, off_t off, size_t len);
+int vm_pager_put(struct vm_object *obp, struct vm_page *pg, size_t len);
 
 #endif  /* !_VM_PAGER_H_ */
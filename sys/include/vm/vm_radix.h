@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _VM_RADIX_H_
+#define _VM_RADIX_H_
+
+#include <sys/types.h>
+
+#define VM_RADIX_SHIFT  6
+#define VM_RADIX_SLOTS  (1 << VM_RADIX_SHIFT)
+#define VM_RADIX_MASK   (VM_RADIX_SLOTS - 1)
+
+/*
+ * A radix tree node, slots of level 0 nodes hold
+ * the values and slots of other levels hold the
+ * nodes below them.
+ */
+struct vm_radix_node {
+    void *slot[VM_RADIX_SLOTS];
+    uint8_t level;
+};
+
+/*
+ * Radix tree keyed by page index. Lookups may run
+ * without a lock while one writer at a time updates
+ * the tree under a lock of its own.
+ *
+ * XXX: Nodes are only freed by vm_radix_destroy() so
+ *      that lockless readers never see a stale node.
+ */
+struct vm_radix {
+    struct vm_radix_node *root;
+};
+
+void vm_radix_init(struct vm_radix *rt);
+int vm_radix_insert(struct vm_radix *rt, uint64_t idx, void *val);
+void *vm_radix_lookup(struct vm_radix *rt, uint64_t idx);
+void *vm_radix_remove(struct vm_radix *rt, uint64_t idx);
+void *vm_radix_next(struct vm_radix *rt, uint64_t *idx);
+void vm_radix_destroy(struct vm_radix *rt);
+
+#endif  /* !_VM_RADIX_H_ */
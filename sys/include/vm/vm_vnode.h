@@ -39,5 +39,10 @@
 extern const struct vm_pagerops vm_vnops;
 
 struct vm_object *vn_attach(struct vnode *vp, vm_prot_t prot);
+void vn_detach(struct vnode *vp);
+size_t vn_reclaim(size_t count);
+
+ssize_t vn_read(struct vnode *vp, struct sio_txn *sio);
+ssize_t vn_write(struct vnode *vp, struct sio_txn *sio);
 
 #endif  /* !_VM_VNODE_H_ */
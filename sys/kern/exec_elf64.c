@@ -40,6 +40,7 @@
 #include <vm/dynalloc.h>
 #include <vm/vm.h>
 #include <vm/map.h>
+#include <vm/vm_vnode.h>
 #include <string.h>
 #include <machine/pcb.h>
 
@@ -98,6 +99,7 @@ elf_get_file(const char *pathname, struct elf_file *res)
     struct vattr vattr;
     struct vop_getattr_args getattr_args;
     struct sio_txn read_txn;
+    ssize_t n;
     int status = 0;
 
     nd.path = pathname;
@@ -129,11 +131,19 @@ elf_get_file(const char *pathname, struct elf_file *res)
         goto done;
     }
 
-    /* Read data into our buffer */
+    /*
+     * Read data into our buffer, going through the
+     * page cache so that programs that are run over
+     * and over again are not read in each time.
+     */
     read_txn.buf = res->data;
     read_txn.len = res->size;
     read_txn.offset = 0;
-    vfs_vop_read(vp, &read_txn);
+    n = vn_read(vp, &read_txn);
+    if (n < 0 || (size_t)n != res->size) {
+        dynfree(res->data);
+        status = (n < 0) ? n : -EIO;
+    }
 
 done:
     if (vp != NULL) {
@@ -37,6 +37,8 @@
 #include <sys/panic.h>
 #include <sys/sysctl.h>
 #include <sys/systm.h>
+#include <sys/bio.h>
+#include <sys/mutex.h>
 #include <dev/acpi/uacpi.h>
 #include <dev/cons/cons.h>
 #include <dev/acpi/acpi.h>
@@ -44,6 +46,7 @@
 #include <machine/cdefs.h>
 #include <vm/vm.h>
 #include <vm/stat.h>
+#include <vm/physmem.h>
 #include <string.h>
 
 #define _START_PATH "/usr/sbin/init"
@@ -89,6 +92,7 @@ main(void)
 
     /* Init the virtual memory subsystem */
     vm_init();
+    mutex_cache_init();
 
     /* Startup the console */
     cons_init();
@@ -120,6 +124,8 @@ main(void)
 
     /* Startup pid 1 */
     spawn(&g_proc0, start_init, NULL, 0, &g_init);
+    vm_zero_start();
+    bio_init();
     md_inton();
 
     uacpi_init();
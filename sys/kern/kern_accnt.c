@@ -116,6 +116,7 @@ sched_accnt_init(void)
      * '/ctl/sched/stat'
      */
     ctl.mode = 0444;
+    ctl.data = NULL;
     ctlfs_create_node(devname, &ctl);
     ctl.devname = devname;
     ctl.ops = &sched_stat_ctl;
@@ -0,0 +1,784 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/errno.h>
+#include <sys/syslog.h>
+#include <sys/systm.h>
+#include <sys/panic.h>
+#include <sys/mutex.h>
+#include <sys/spinlock.h>
+#include <sys/proc.h>
+#include <sys/sio.h>
+#include <sys/device.h>
+#include <sys/bio.h>
+#include <machine/cdefs.h>
+#include <vm/dynalloc.h>
+#include <vm/physmem.h>
+#include <vm/vm.h>
+#include <string.h>
+
+#define pr_trace(fmt, ...) kprintf("bio: " fmt, ##__VA_ARGS__)
+#define pr_error(...) pr_trace(__VA_ARGS__)
+
+#define BIO_NHASH 64    /* Hash buckets (power of two) */
+
+TAILQ_HEAD(bufq, buf);
+
+extern struct proc g_proc0;
+
+/*
+ * `bio_lock' protects the hash, the LRU, the dirty
+ * queue and the flags of every buffer. The contents
+ * of a buffer belong to whoever has it busy.
+ */
+static struct mutex *bio_lock;
+static struct mutex *bio_flush_lock;
+static struct bufq bio_hash[BIO_NHASH];
+static struct bufq bio_lru;
+static struct bufq bio_dirtyq;
+static size_t bio_ndirty = 0;
+static char *bio_run;       /* Coalesced write buffers */
+static char *bio_rdrun;     /* Coalesced read buffers */
+static uint32_t bio_rdmap;  /* Read buffers in use */
+
+/*
+ * BIO_DONE is set under one of these so that a
+ * waiter cannot miss the wakeup. They are taken
+ * from interrupt handlers so interrupts must be
+ * off while one is held.
+ */
+static struct spinlock bio_wait_lock[BIO_NHASH];
+
+static inline struct bufq *
+bio_bucket(struct disk *dp, blkoff_t blkno)
+{
+    return &bio_hash[(blkno ^ dp->id) & (BIO_NHASH - 1)];
+}
+
+static inline struct spinlock *
+bio_waitlock(const struct bio *bp)
+{
+    return &bio_wait_lock[((uintptr_t)bp >> 6) & (BIO_NHASH - 1)];
+}
+
+/*
+ * Find the buffer of a block if it is cached.
+ *
+ * XXX: `bio_lock' must be held
+ */
+static struct buf *
+bio_lookup(struct disk *dp, blkoff_t blkno)
+{
+    struct bufq *bq = bio_bucket(dp, blkno);
+    struct buf *bp;
+
+    TAILQ_FOREACH(bp, bq, hlink) {
+        if (bp->dp == dp && bp->blkno == blkno) {
+            return bp;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Complete a request, drivers call this once the
+ * hardware is done with it. This may be called from
+ * an interrupt handler so the completion callback
+ * must not sleep.
+ *
+ * @bp: Request to complete.
+ * @error: Zero on success, otherwise a negative errno.
+ */
+void
+bio_done(struct bio *bp, int error)
+{
+    void(*done)(struct bio *) = bp->done;
+    struct spinlock *lock;
+    bool masked;
+
+    bp->error = error;
+    if (done != NULL) {
+        __atomic_or_fetch(&bp->flags, BIO_DONE, __ATOMIC_RELEASE);
+        done(bp);
+        return;
+    }
+
+    /* `bp' may be gone as soon as the lock is dropped */
+    lock = bio_waitlock(bp);
+    if (!(masked = md_intr_masked())) {
+        md_intoff();
+    }
+
+    spinlock_acquire(lock);
+    __atomic_or_fetch(&bp->flags, BIO_DONE, __ATOMIC_RELEASE);
+    spinlock_release(lock);
+    wakeup(bp);
+
+    if (!masked) {
+        md_inton();
+    }
+}
+
+/*
+ * Hand a request to the driver of its disk. Drivers
+ * with a strategy routine complete requests from their
+ * interrupt handler so many may be in flight at once,
+ * the rest are done right here with the synchronous
+ * read/write routines.
+ *
+ * A request is always completed, even if it could not
+ * be started, in which case its error is returned.
+ *
+ * @bp: Request to submit.
+ */
+int
+bio_submit(struct bio *bp)
+{
+    const struct bdevsw *bdev;
+    struct sio_txn sio;
+    bool write, aligned;
+    int error;
+
+    bp->flags &= ~BIO_DONE;
+    bp->error = 0;
+    if (bp->dp == NULL || bp->data == NULL || bp->len == 0) {
+        bio_done(bp, -EINVAL);
+        return -EINVAL;
+    }
+
+    bdev = bp->dp->bdev;
+    write = ISSET(bp->flags, BIO_WRITE);
+
+    /* Strategy routines DMA straight to the pages */
+    aligned = ((uintptr_t)bp->data & (DEFAULT_PAGESIZE - 1)) == 0;
+    if (bdev->strategy != NULL && aligned) {
+        if ((error = bdev->strategy(bp->dp->dev, bp)) < 0) {
+            bio_done(bp, error);
+        }
+        return error;
+    }
+
+    sio.buf = bp->data;
+    sio.offset = bp->offset;
+    sio.len = bp->len;
+    if (write && bdev->write != NULL) {
+        error = bdev->write(bp->dp->dev, &sio, 0);
+    } else if (!write && bdev->read != NULL) {
+        error = bdev->read(bp->dp->dev, &sio, 0);
+    } else {
+        error = -ENOTSUP;
+    }
+
+    error = (error < 0) ? error : 0;
+    bio_done(bp, error);
+    return error;
+}
+
+/*
+ * Wait for a request without a completion callback
+ * to complete.
+ *
+ * Returns the error the request completed with.
+ *
+ * XXX: Must not be called with spinlocks held, this
+ *      sleeps. Block device read()/write() end up
+ *      here, so neither may their callers.
+ */
+int
+bio_wait(struct bio *bp)
+{
+    struct spinlock *lock = bio_waitlock(bp);
+    bool masked;
+
+    masked = md_intr_masked();
+
+    /* Nothing to put to sleep, let the interrupt through */
+    if (this_td() == NULL) {
+        md_inton();
+        while (!ISSET(__atomic_load_n(&bp->flags, __ATOMIC_ACQUIRE), BIO_DONE)) {
+            md_pause();
+        }
+        if (masked) {
+            md_intoff();
+        }
+
+        return bp->error;
+    }
+
+    /* bio_done() sets BIO_DONE under the same lock */
+    md_intoff();
+    spinlock_acquire(lock);
+    while (!ISSET(bp->flags, BIO_DONE)) {
+        msleep_spin(bp, lock, 0);
+    }
+
+    spinlock_release(lock);
+    if (!masked) {
+        md_inton();
+    }
+
+    return bp->error;
+}
+
+/*
+ * Read or write whole virtual blocks straight
+ * to or from a disk.
+ *
+ * @dp: Disk to operate on.
+ * @blkno: First virtual block.
+ * @buf: Physically contiguous buffer.
+ * @count: Number of virtual blocks.
+ * @write: True to write.
+ */
+static int
+bio_devio(struct disk *dp, blkoff_t blkno, void *buf, size_t count, bool write)
+{
+    struct bio req = {0};
+
+    req.dp = dp;
+    req.offset = blkno * V_BSIZE;
+    req.data = buf;
+    req.len = count * V_BSIZE;
+    req.flags = write ? BIO_WRITE : 0;
+    bio_submit(&req);
+    return bio_wait(&req);
+}
+
+/*
+ * Mark a buffer busy and take it off
+ * the LRU.
+ *
+ * XXX: `bio_lock' must be held
+ */
+static inline void
+bio_take(struct buf *bp)
+{
+    bp->flags |= B_BUSY;
+    TAILQ_REMOVE(&bio_lru, bp, lru);
+}
+
+/*
+ * Give up a busy buffer, buffers that hold
+ * nothing useful are reused first.
+ *
+ * XXX: `bio_lock' must be held
+ */
+static void
+bio_put(struct buf *bp)
+{
+    bp->flags &= ~B_BUSY;
+    if (ISSET(bp->flags, B_VALID)) {
+        TAILQ_INSERT_TAIL(&bio_lru, bp, lru);
+    } else {
+        TAILQ_INSERT_HEAD(&bio_lru, bp, lru);
+    }
+
+    wakeup(bp);
+    wakeup(&bio_lru);
+}
+
+static inline void
+bio_undirty(struct buf *bp)
+{
+    if (ISSET(bp->flags, B_DIRTY)) {
+        bp->flags &= ~B_DIRTY;
+        TAILQ_REMOVE(&bio_dirtyq, bp, dlink);
+        --bio_ndirty;
+    }
+}
+
+/*
+ * Get the buffer of a block, its contents are only
+ * meaningful if B_VALID is set. The buffer is busy
+ * until given back with bio_release(), bio_dirty()
+ * or bio_write().
+ *
+ * @dp: Disk the block belongs to.
+ * @blkno: Virtual block number.
+ */
+struct buf *
+bio_get(struct disk *dp, blkoff_t blkno)
+{
+    struct buf *bp;
+    int error;
+
+    mutex_acquire(bio_lock, 0);
+    for (;;) {
+        if ((bp = bio_lookup(dp, blkno)) != NULL) {
+            if (ISSET(bp->flags, B_BUSY)) {
+                msleep(bp, bio_lock, 0);
+                continue;
+            }
+
+            bio_take(bp);
+            break;
+        }
+
+        /* Recycle the least recently used buffer */
+        if ((bp = TAILQ_FIRST(&bio_lru)) == NULL) {
+            msleep(&bio_lru, bio_lock, 0);
+            continue;
+        }
+
+        bio_take(bp);
+
+        /*
+         * A dirty victim is written back first, someone may
+         * have brought in our block meanwhile so look again.
+         */
+        if (ISSET(bp->flags, B_DIRTY)) {
+            mutex_release(bio_lock);
+            error = bio_devio(bp->dp, bp->blkno, bp->data, 1, true);
+            mutex_acquire(bio_lock, 0);
+            if (error == 0) {
+                bio_undirty(bp);
+            } else {
+                pr_error("write back failed (blkno=%d)\n", bp->blkno);
+            }
+
+            bio_put(bp);
+            continue;
+        }
+
+        if (bp->dp != NULL) {
+            TAILQ_REMOVE(bio_bucket(bp->dp, bp->blkno), bp, hlink);
+        }
+
+        bp->dp = dp;
+        bp->blkno = blkno;
+        bp->flags = B_BUSY;
+        TAILQ_INSERT_HEAD(bio_bucket(dp, blkno), bp, hlink);
+        break;
+    }
+
+    mutex_release(bio_lock);
+    return bp;
+}
+
+/*
+ * Get the buffer of a block and read it in
+ * if it is not cached.
+ *
+ * @dp: Disk the block belongs to.
+ * @blkno: Virtual block number.
+ * @res: Busy buffer is written here.
+ */
+int
+bio_read(struct disk *dp, blkoff_t blkno, struct buf **res)
+{
+    struct buf *bp;
+    int error;
+
+    bp = bio_get(dp, blkno);
+    if (!ISSET(bp->flags, B_VALID)) {
+        if ((error = bio_devio(dp, blkno, bp->data, 1, false)) < 0) {
+            bio_release(bp);
+            return error;
+        }
+
+        mutex_acquire(bio_lock, 0);
+        bp->flags |= B_VALID;
+        mutex_release(bio_lock);
+    }
+
+    *res = bp;
+    return 0;
+}
+
+/*
+ * Grab one of the BIO_NRUN coalesced read buffers,
+ * waiting for one to be given back if needed.
+ */
+static char *
+bio_rdrun_get(void)
+{
+    size_t i;
+
+    mutex_acquire(bio_lock, 0);
+    for (;;) {
+        for (i = 0; i < BIO_NRUN; ++i) {
+            if (!ISSET(bio_rdmap, BIT(i))) {
+                break;
+            }
+        }
+
+        if (i < BIO_NRUN) {
+            break;
+        }
+
+        msleep(&bio_rdmap, bio_lock, 0);
+    }
+
+    bio_rdmap |= BIT(i);
+    mutex_release(bio_lock);
+    return &bio_rdrun[i * BIO_RUN_MAX * V_BSIZE];
+}
+
+static void
+bio_rdrun_put(char *data)
+{
+    size_t i;
+
+    i = (data - bio_rdrun) / (BIO_RUN_MAX * V_BSIZE);
+    mutex_acquire(bio_lock, 0);
+    bio_rdmap &= ~BIT(i);
+    wakeup_one(&bio_rdmap);
+    mutex_release(bio_lock);
+}
+
+/*
+ * Read whole virtual blocks through the cache. Runs
+ * of up to BIO_RUN_MAX blocks that are not cached go
+ * out as a single read and are cached on the way
+ * back, cached blocks are copied out as is.
+ *
+ * @dp: Disk to read from.
+ * @blkno: First virtual block.
+ * @buf: Buffer to read into.
+ * @count: Number of virtual blocks.
+ *
+ * Returns the number of blocks read, or a less than
+ * zero value if none could be.
+ */
+ssize_t
+bio_readblks(struct disk *dp, blkoff_t blkno, void *buf, size_t count)
+{
+    struct buf *bp;
+    char *p = buf, *data, *src;
+    size_t i, n, max;
+    int error;
+
+    for (i = 0; i < count; i += n) {
+        max = MIN(count - i, BIO_RUN_MAX);
+        mutex_acquire(bio_lock, 0);
+        for (n = 0; n < max; ++n) {
+            if (bio_lookup(dp, blkno + i + n) != NULL) {
+                break;
+            }
+        }
+        mutex_release(bio_lock);
+
+        /* Cached (or on its way in), take it from the buffer */
+        if (n == 0) {
+            if ((error = bio_read(dp, blkno + i, &bp)) < 0) {
+                return (i > 0) ? (ssize_t)i : error;
+            }
+
+            memcpy(&p[i * V_BSIZE], bp->data, V_BSIZE);
+            bio_release(bp);
+            n = 1;
+            continue;
+        }
+
+        data = bio_rdrun_get();
+        if ((error = bio_devio(dp, blkno + i, data, n, false)) < 0) {
+            bio_rdrun_put(data);
+            return (i > 0) ? (ssize_t)i : error;
+        }
+
+        /*
+         * Someone may have brought in (or changed) one of
+         * these blocks meanwhile, the cached copy wins.
+         */
+        for (size_t j = 0; j < n; ++j) {
+            bp = bio_get(dp, blkno + i + j);
+            src = &data[j * V_BSIZE];
+            if (ISSET(bp->flags, B_VALID)) {
+                src = bp->data;
+            } else {
+                memcpy(bp->data, src, V_BSIZE);
+            }
+
+            memcpy(&p[(i + j) * V_BSIZE], src, V_BSIZE);
+            mutex_acquire(bio_lock, 0);
+            bp->flags |= B_VALID;
+            bio_put(bp);
+            mutex_release(bio_lock);
+        }
+
+        bio_rdrun_put(data);
+    }
+
+    return count;
+}
+
+/*
+ * Give back a busy buffer.
+ */
+void
+bio_release(struct buf *bp)
+{
+    mutex_acquire(bio_lock, 0);
+    bio_put(bp);
+    mutex_release(bio_lock);
+}
+
+/*
+ * Give back a busy buffer whose contents were
+ * changed, they are written back later by the
+ * flusher.
+ */
+void
+bio_dirty(struct buf *bp)
+{
+    mutex_acquire(bio_lock, 0);
+    bp->flags |= B_VALID;
+    if (!ISSET(bp->flags, B_DIRTY)) {
+        bp->flags |= B_DIRTY;
+        TAILQ_INSERT_TAIL(&bio_dirtyq, bp, dlink);
+        ++bio_ndirty;
+    }
+
+    /* Don't let dirty buffers pile up */
+    if (bio_ndirty >= BIO_DIRTY_HIGH) {
+        wakeup(&bio_ndirty);
+    }
+
+    bio_put(bp);
+    mutex_release(bio_lock);
+}
+
+/*
+ * Write a busy buffer to disk right away
+ * and give it back.
+ */
+int
+bio_write(struct buf *bp)
+{
+    int error;
+
+    error = bio_devio(bp->dp, bp->blkno, bp->data, 1, true);
+    mutex_acquire(bio_lock, 0);
+    if (error == 0) {
+        bp->flags |= B_VALID;
+        bio_undirty(bp);
+    }
+
+    bio_put(bp);
+    mutex_release(bio_lock);
+    return error;
+}
+
+static inline bool
+bio_flushable(struct buf *bp)
+{
+    return bp != NULL && (bp->flags & (B_DIRTY | B_BUSY)) == B_DIRTY;
+}
+
+/*
+ * Take the next run of adjacent dirty blocks off
+ * the dirty queue, returns the number of blocks in
+ * the run or zero if there is nothing to flush.
+ *
+ * @dp: Disk to flush, NULL for any disk.
+ * @run: Busy buffers of the run are written here.
+ *
+ * XXX: `bio_lock' must be held
+ */
+static size_t
+bio_gather(struct disk *dp, struct buf **run)
+{
+    struct buf *bp, *tmp;
+    size_t n;
+
+    bp = NULL;
+    TAILQ_FOREACH(tmp, &bio_dirtyq, dlink) {
+        if (bio_flushable(tmp) && (dp == NULL || tmp->dp == dp)) {
+            bp = tmp;
+            break;
+        }
+    }
+
+    if (bp == NULL) {
+        return 0;
+    }
+
+    /* Start the run at the lowest adjacent dirty block */
+    for (n = 1; n < BIO_RUN_MAX; ++n) {
+        tmp = bio_lookup(bp->dp, bp->blkno - 1);
+        if (!bio_flushable(tmp)) {
+            break;
+        }
+        bp = tmp;
+    }
+
+    for (n = 0; n < BIO_RUN_MAX; ++n) {
+        tmp = (n == 0) ? bp : bio_lookup(bp->dp, bp->blkno + n);
+        if (!bio_flushable(tmp)) {
+            break;
+        }
+
+        bio_take(tmp);
+        bio_undirty(tmp);
+        run[n] = tmp;
+    }
+
+    return n;
+}
+
+/*
+ * Write back the dirty buffers of a disk, or of
+ * every disk if `dp' is NULL. Runs of adjacent
+ * dirty blocks go out as a single write and up to
+ * BIO_NRUN runs are in flight at once.
+ *
+ * Returns zero on success, otherwise the last
+ * error seen.
+ */
+int
+bio_flush(struct disk *dp)
+{
+    struct buf *run[BIO_NRUN][BIO_RUN_MAX];
+    struct bio req[BIO_NRUN];
+    size_t n[BIO_NRUN], nrun;
+    struct buf *bp;
+    char *data;
+    int error, retval = 0;
+
+    mutex_acquire(bio_flush_lock, 0);
+    mutex_acquire(bio_lock, 0);
+    while (retval == 0) {
+        for (nrun = 0; nrun < BIO_NRUN; ++nrun) {
+            if ((n[nrun] = bio_gather(dp, run[nrun])) == 0) {
+                break;
+            }
+        }
+
+        if (nrun == 0) {
+            break;
+        }
+
+        mutex_release(bio_lock);
+        for (size_t i = 0; i < nrun; ++i) {
+            data = &bio_run[i * BIO_RUN_MAX * V_BSIZE];
+            for (size_t j = 0; j < n[i]; ++j) {
+                memcpy(&data[j * V_BSIZE], run[i][j]->data, V_BSIZE);
+            }
+
+            bp = run[i][0];
+            memset(&req[i], 0, sizeof(req[i]));
+            req[i].dp = bp->dp;
+            req[i].offset = bp->blkno * V_BSIZE;
+            req[i].data = data;
+            req[i].len = n[i] * V_BSIZE;
+            req[i].flags = BIO_WRITE;
+            bio_submit(&req[i]);
+        }
+
+        for (size_t i = 0; i < nrun; ++i) {
+            bio_wait(&req[i]);
+        }
+
+        mutex_acquire(bio_lock, 0);
+        for (size_t i = 0; i < nrun; ++i) {
+            error = req[i].error;
+            for (size_t j = 0; j < n[i]; ++j) {
+                if (error < 0) {
+                    run[i][j]->flags |= B_DIRTY;
+                    TAILQ_INSERT_TAIL(&bio_dirtyq, run[i][j], dlink);
+                    ++bio_ndirty;
+                }
+
+                bio_put(run[i][j]);
+            }
+
+            /* Don't spin on a disk that keeps failing */
+            if (error < 0) {
+                bp = run[i][0];
+                pr_error("flush failed (blkno=%d, error=%d)\n", bp->blkno,
+                    error);
+                retval = error;
+            }
+        }
+    }
+
+    mutex_release(bio_lock);
+    mutex_release(bio_flush_lock);
+    return retval;
+}
+
+/*
+ * The flusher writes back dirty buffers every
+ * BIO_FLUSH_USEC, or sooner if too many pile up.
+ */
+static void
+bio_flushd(void)
+{
+    for (;;) {
+        tsleep(&bio_ndirty, BIO_FLUSH_USEC);
+        if (bio_ndirty > 0) {
+            bio_flush(NULL);
+        }
+    }
+}
+
+void
+bio_init(void)
+{
+    struct buf *bufs;
+    uintptr_t pool;
+    size_t npages;
+
+    bio_lock = mutex_new("bio");
+    bio_flush_lock = mutex_new("bioflush");
+    bufs = dynalloc(sizeof(*bufs) * BIO_NBUF);
+    if (bio_lock == NULL || bio_flush_lock == NULL || bufs == NULL) {
+        panic("bio: failed to allocate buffer cache\n");
+    }
+
+    /* Buffer contents, then the coalescing buffers */
+    npages = BIO_NBUF + (BIO_RUN_MAX * BIO_NRUN * 2);
+    npages = ALIGN_UP(V_BSIZE * npages, DEFAULT_PAGESIZE);
+    npages /= DEFAULT_PAGESIZE;
+    if ((pool = vm_alloc_frame(npages)) == 0) {
+        panic("bio: failed to allocate buffer memory\n");
+    }
+
+    pool = (uintptr_t)PHYS_TO_VIRT(pool);
+    bio_run = (char *)pool + (V_BSIZE * BIO_NBUF);
+    bio_rdrun = bio_run + (V_BSIZE * BIO_RUN_MAX * BIO_NRUN);
+
+    for (size_t i = 0; i < BIO_NHASH; ++i) {
+        TAILQ_INIT(&bio_hash[i]);
+    }
+
+    TAILQ_INIT(&bio_lru);
+    TAILQ_INIT(&bio_dirtyq);
+    memset(bufs, 0, sizeof(*bufs) * BIO_NBUF);
+    for (size_t i = 0; i < BIO_NBUF; ++i) {
+        bufs[i].data = (char *)pool + (i * V_BSIZE);
+        TAILQ_INSERT_TAIL(&bio_lru, &bufs[i], lru);
+    }
+
+    pr_trace("%d buffers, %d KiB\n", BIO_NBUF, (BIO_NBUF * V_BSIZE) >> 10);
+    spawn(&g_proc0, bio_flushd, NULL, 0, NULL);
+}
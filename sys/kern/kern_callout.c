@@ -0,0 +1,758 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/cdefs.h>
+#include <sys/callout.h>
+#include <sys/spinlock.h>
+#include <sys/schedvar.h>
+#include <sys/syslog.h>
+#include <sys/errno.h>
+#include <sys/sio.h>
+#include <machine/cdefs.h>
+#include <machine/cpu.h>
+#include <fs/ctlfs.h>
+#include <dev/timer.h>
+#include <string.h>
+
+#define pr_trace(fmt, ...) kprintf("callout: " fmt, ##__VA_ARGS__)
+
+/*
+ * Each processor keeps its callouts in a hierarchical
+ * timing wheel. Level 0 has one slot per microsecond
+ * and every level above it covers WHEEL_SIZE slots of
+ * the level below. Callouts on higher levels cascade
+ * down as time catches up with them, so arming and
+ * stopping a callout is O(1) no matter how far out
+ * its deadline is.
+ */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      BIT(WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    6
+#define WHEEL_RANGE     BIT(WHEEL_BITS * WHEEL_LEVELS)
+
+/* Marks a callout as sitting on the expired queue */
+#define WHEEL_EXPIRED   WHEEL_LEVELS
+
+/* Time that never comes, for when the timer is stopped */
+#define CALLOUT_NEVER   ((size_t)-1)
+
+/* Longest we program the timer for in one go (usec) */
+#define CALLOUT_MAX_ARM 1000000
+
+/*
+ * Per-processor callout state
+ *
+ * @lock: Protects everything below
+ * @wheel: Timing wheel slots
+ * @bitmap: Bit N of bitmap[L] is set if wheel[L][N] is not empty
+ * @expq: Callouts that expired and are about to run
+ * @now: Time the wheel has been advanced up to (usec)
+ * @armed: Time the timer is programmed to fire at (usec)
+ * @running: Callout whose function is running right now
+ * @latency: Time between the expiry and the callout running
+ * @slack: Time between the requested deadline and the callout running
+ * @ready: Set once the wheel is initialized
+ */
+struct callout_cpu {
+    struct spinlock lock;
+    TAILQ_HEAD(, callout) wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    uint64_t bitmap[WHEEL_LEVELS];
+    TAILQ_HEAD(, callout) expq;
+    size_t now;
+    size_t armed;
+    struct callout *volatile running;
+    struct callout_hist latency;
+    struct callout_hist slack;
+    bool ready;
+} __aligned(COHERENCY_UNIT);
+
+static struct callout_cpu callout_cpus[CPU_MAX];
+
+/*
+ * If there is no general purpose timer, time is
+ * estimated by counting scheduler quantums on the BSP.
+ */
+static volatile size_t coarse_usec = 0;
+static struct timer gp_tmr;
+static bool have_clock = false;
+
+static inline struct callout_cpu *
+this_cc(void)
+{
+    return &callout_cpus[this_cpu()->id];
+}
+
+/*
+ * Lock the callout state of a processor. Interrupts are
+ * masked while it is held so that the timer interrupt
+ * never spins on a lock held by the thread it interrupted.
+ *
+ * Returns true if interrupts were already masked.
+ */
+static inline bool
+cc_lock(struct callout_cpu *cc)
+{
+    bool masked;
+
+    masked = md_intr_masked();
+    md_intoff();
+    spinlock_acquire(&cc->lock);
+    return masked;
+}
+
+static inline void
+cc_unlock(struct callout_cpu *cc, bool masked)
+{
+    spinlock_release(&cc->lock);
+    if (!masked) {
+        md_inton();
+    }
+}
+
+static inline size_t
+wheel_slot(size_t tick, int level)
+{
+    return (tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+}
+
+/*
+ * File a callout on the wheel level that covers the
+ * time left until it expires.
+ *
+ * XXX: `cc->lock' must be held by the caller
+ */
+static void
+wheel_insert(struct callout_cpu *cc, struct callout *c)
+{
+    size_t delta, tick = c->expire;
+    int level;
+
+    delta = (tick > cc->now) ? tick - cc->now : 0;
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+        if (delta < BIT((level + 1) * WHEEL_BITS)) {
+            break;
+        }
+    }
+
+    /*
+     * Too far out for the wheel, park it on the last
+     * slot in range. It gets filed again once it
+     * cascades all the way down.
+     */
+    if (delta >= WHEEL_RANGE) {
+        tick = cc->now + WHEEL_RANGE - 1;
+    }
+
+    c->level = level;
+    c->slot = wheel_slot(tick, level);
+    TAILQ_INSERT_TAIL(&cc->wheel[level][c->slot], c, link);
+    cc->bitmap[level] |= BIT(c->slot);
+}
+
+/*
+ * XXX: `cc->lock' must be held by the caller
+ */
+static void
+wheel_remove(struct callout_cpu *cc, struct callout *c)
+{
+    if (c->level == WHEEL_EXPIRED) {
+        TAILQ_REMOVE(&cc->expq, c, link);
+        return;
+    }
+
+    TAILQ_REMOVE(&cc->wheel[c->level][c->slot], c, link);
+    if (TAILQ_EMPTY(&cc->wheel[c->level][c->slot])) {
+        cc->bitmap[c->level] &= ~BIT(c->slot);
+    }
+}
+
+/*
+ * Find the next tick at which the wheel has work to do,
+ * either expiring a level 0 slot or cascading a slot of
+ * a higher level. Returns false if the wheel is empty.
+ *
+ * XXX: `cc->lock' must be held by the caller
+ */
+static bool
+wheel_next(struct callout_cpu *cc, size_t *tickp)
+{
+    size_t best = CALLOUT_NEVER, base, cur, t;
+    uint64_t bm, above;
+    int shift;
+
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        if ((bm = cc->bitmap[level]) == 0) {
+            continue;
+        }
+
+        /*
+         * Slots past the current one are reached in this
+         * rotation of the level, the rest in the next one.
+         */
+        shift = level * WHEEL_BITS;
+        cur = wheel_slot(cc->now, level);
+        base = (cc->now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS);
+        above = (cur == WHEEL_MASK) ? 0 : bm & ~(BIT(cur + 1) - 1);
+        if (above != 0) {
+            t = base + ((size_t)__builtin_ctzll(above) << shift);
+        } else {
+            t = base + ((WHEEL_SIZE + __builtin_ctzll(bm)) << shift);
+        }
+
+        best = MIN(best, t);
+    }
+
+    if (best == CALLOUT_NEVER) {
+        return false;
+    }
+
+    *tickp = best;
+    return true;
+}
+
+/*
+ * Move every callout in a slot of a higher level down
+ * to the level that now covers it.
+ *
+ * XXX: `cc->lock' must be held by the caller
+ */
+static void
+wheel_cascade(struct callout_cpu *cc, int level, size_t slot)
+{
+    TAILQ_HEAD(, callout) tmp;
+    struct callout *c;
+
+    if (!ISSET(cc->bitmap[level], BIT(slot))) {
+        return;
+    }
+
+    TAILQ_INIT(&tmp);
+    TAILQ_CONCAT(&tmp, &cc->wheel[level][slot], link);
+    cc->bitmap[level] &= ~BIT(slot);
+
+    while ((c = TAILQ_FIRST(&tmp)) != NULL) {
+        TAILQ_REMOVE(&tmp, c, link);
+        wheel_insert(cc, c);
+    }
+}
+
+/*
+ * Advance the wheel up to `target', moving every
+ * callout that expires on the way to the expired
+ * queue. Empty stretches of the wheel are skipped
+ * over rather than walked one tick at a time.
+ *
+ * XXX: `cc->lock' must be held by the caller
+ */
+static void
+wheel_advance(struct callout_cpu *cc, size_t target)
+{
+    struct callout *c;
+    size_t tick, slot;
+
+    while (cc->now < target) {
+        if (!wheel_next(cc, &tick) || tick > target) {
+            cc->now = target;
+            break;
+        }
+
+        cc->now = tick;
+        for (int level = WHEEL_LEVELS - 1; level > 0; --level) {
+            if ((tick & (BIT(level * WHEEL_BITS) - 1)) == 0) {
+                wheel_cascade(cc, level, wheel_slot(tick, level));
+            }
+        }
+
+        slot = tick & WHEEL_MASK;
+        while ((c = TAILQ_FIRST(&cc->wheel[0][slot])) != NULL) {
+            TAILQ_REMOVE(&cc->wheel[0][slot], c, link);
+
+            /* Parked because it was out of range */
+            if (c->expire > tick) {
+                wheel_insert(cc, c);
+                continue;
+            }
+
+            c->level = WHEEL_EXPIRED;
+            TAILQ_INSERT_TAIL(&cc->expq, c, link);
+        }
+
+        cc->bitmap[0] &= ~BIT(slot);
+    }
+}
+
+/*
+ * Record a sample in an expiry histogram
+ *
+ * @hp: Histogram to update
+ * @usec: How late the expiry was
+ */
+static void
+hist_add(struct callout_hist *hp, size_t usec)
+{
+    size_t i = 0;
+
+    if (usec > 0) {
+        i = 64 - __builtin_clzll(usec);
+        i = MIN(i, CALLOUT_NHIST - 1);
+    }
+
+    ++hp->bucket[i];
+    ++hp->count;
+    hp->total_usec += usec;
+    hp->max_usec = MAX(hp->max_usec, usec);
+}
+
+/*
+ * Pick the expiry time of a callout within its slack
+ * window. The latest time in the window with the most
+ * trailing zero bits is used so that callouts with
+ * similar deadlines expire together.
+ *
+ * @deadline: Requested deadline (usec)
+ * @slack: How late the callout may fire (usec)
+ */
+static size_t
+callout_apply_slack(size_t deadline, size_t slack)
+{
+    size_t limit, mask;
+    int bit;
+
+    if (slack == 0) {
+        return deadline;
+    }
+
+    limit = deadline + slack;
+    bit = 63 - __builtin_clzll(deadline ^ limit);
+    mask = BIT(bit) - 1;
+    return limit & ~mask;
+}
+
+/*
+ * Program the timer of the current processor
+ * to fire at `deadline'.
+ *
+ * @cc: Callout state of the current processor
+ * @now: Current time (usec)
+ * @deadline: When to fire (usec), CALLOUT_NEVER to stop it
+ *
+ * XXX: `cc->lock' must be held by the caller
+ */
+static void
+cc_program(struct callout_cpu *cc, size_t now, size_t deadline)
+{
+    struct timer timer;
+    tmrr_status_t tmr_status;
+    size_t usec;
+
+    tmr_status = req_timer(TIMER_SCHED, &timer);
+    if (__unlikely(tmr_status != TMRR_SUCCESS)) {
+        return;
+    }
+
+    if (deadline == CALLOUT_NEVER) {
+        if (timer.stop != NULL) {
+            timer.stop();
+        }
+        cc->armed = CALLOUT_NEVER;
+        return;
+    }
+
+    usec = (deadline > now) ? deadline - now : 1;
+    usec = MIN(usec, CALLOUT_MAX_ARM);
+    cc->armed = now + usec;
+    timer.oneshot_us(usec);
+}
+
+/*
+ * Returns the current time in microseconds, callout
+ * deadlines are measured against this clock.
+ */
+size_t
+callout_time_usec(void)
+{
+    tmrr_status_t tmr_status;
+
+    if (!have_clock) {
+        tmr_status = req_timer(TIMER_GP, &gp_tmr);
+        if (tmr_status != TMRR_SUCCESS || gp_tmr.get_time_usec == NULL) {
+            return coarse_usec;
+        }
+
+        have_clock = true;
+    }
+
+    return gp_tmr.get_time_usec();
+}
+
+/*
+ * Get the number of microseconds until the wheel of
+ * the current processor needs attention.
+ *
+ * @usec: Set to the time until the next event
+ *
+ * Returns false if there are no callouts pending.
+ */
+bool
+callout_next(size_t *usec)
+{
+    struct callout_cpu *cc = this_cc();
+    size_t tick, now;
+    bool masked, pending;
+
+    now = callout_time_usec();
+    masked = cc_lock(cc);
+    if ((pending = wheel_next(cc, &tick))) {
+        *usec = (tick > now) ? tick - now : 0;
+    }
+
+    cc_unlock(cc, masked);
+    return pending;
+}
+
+/*
+ * Program the timer of the current processor to fire
+ * after `usec' microseconds or when the next callout
+ * is due, whichever comes first.
+ *
+ * @usec: Microseconds from now, zero to only wait for
+ *        callouts (the timer is stopped if there are none)
+ */
+void
+callout_arm(size_t usec)
+{
+    struct callout_cpu *cc = this_cc();
+    size_t now, tick, deadline;
+    bool masked;
+
+    /* The coarse clock needs the BSP to keep ticking */
+    if (!have_clock && usec == 0) {
+        usec = DEFAULT_TIMESLICE_USEC;
+    }
+
+    now = callout_time_usec();
+    deadline = (usec != 0) ? now + usec : CALLOUT_NEVER;
+
+    masked = cc_lock(cc);
+    if (wheel_next(cc, &tick)) {
+        deadline = MIN(deadline, tick);
+    }
+
+    cc_program(cc, now, deadline);
+    cc_unlock(cc, masked);
+}
+
+/*
+ * Run callouts on the current processor whose time
+ * has come, called from the timer interrupt.
+ */
+void
+callout_tick(void)
+{
+    struct callout_cpu *cc = this_cc();
+    struct callout *c;
+    void(*func)(void *);
+    void *arg;
+    size_t now;
+    bool masked;
+
+    if (__unlikely(!cc->ready)) {
+        return;
+    }
+
+    if (!have_clock && this_cpu()->id == 0) {
+        coarse_usec += DEFAULT_TIMESLICE_USEC;
+    }
+
+    now = callout_time_usec();
+    masked = cc_lock(cc);
+    wheel_advance(cc, now);
+    cc->armed = CALLOUT_NEVER;
+
+    while ((c = TAILQ_FIRST(&cc->expq)) != NULL) {
+        TAILQ_REMOVE(&cc->expq, c, link);
+        c->flags &= ~CALLOUT_PENDING;
+
+        hist_add(&cc->latency, (now > c->expire) ? now - c->expire : 0);
+        hist_add(&cc->slack, (now > c->deadline) ? now - c->deadline : 0);
+
+        /*
+         * Run the function without the lock held so that
+         * it may arm or stop callouts itself. callout_stop()
+         * waits on `running' so that nobody frees the callout
+         * from under us in the meantime.
+         */
+        func = c->func;
+        arg = c->arg;
+        cc->running = c;
+        cc_unlock(cc, true);
+        func(arg);
+        cc_lock(cc);
+        cc->running = NULL;
+    }
+
+    cc_unlock(cc, masked);
+}
+
+/*
+ * Initialize a callout, must be done before it
+ * is used for the first time.
+ *
+ * @c: Callout to initialize
+ */
+void
+callout_init(struct callout *c)
+{
+    memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Arm a callout to run `func' after `usec' microseconds
+ * or up to `slack' microseconds after that. Allowing for
+ * slack lets expiries be batched up. A callout that is
+ * already pending is stopped first.
+ *
+ * @c: Callout to arm
+ * @usec: Microseconds from now
+ * @slack: Max microseconds the callout may be late by
+ * @func: Function to run from the timer interrupt
+ * @arg: Argument to pass to `func'
+ */
+void
+callout_reset_slack(struct callout *c, size_t usec, size_t slack,
+    void(*func)(void *), void *arg)
+{
+    struct callout_cpu *cc;
+    size_t now;
+    bool masked;
+
+    callout_stop(c);
+    cc = this_cc();
+    now = callout_time_usec();
+
+    masked = cc_lock(cc);
+    c->func = func;
+    c->arg = arg;
+    c->deadline = now + usec;
+    c->expire = callout_apply_slack(c->deadline, slack);
+    if (c->expire <= cc->now) {
+        c->expire = cc->now + 1;
+    }
+
+    c->cc = cc;
+    c->flags |= CALLOUT_PENDING;
+    wheel_insert(cc, c);
+
+    /* Fire earlier than planned if we need to */
+    if (c->expire < cc->armed) {
+        cc_program(cc, now, c->expire);
+    }
+
+    cc_unlock(cc, masked);
+}
+
+/*
+ * Same as callout_reset_slack() with no slack
+ */
+void
+callout_reset(struct callout *c, size_t usec, void(*func)(void *), void *arg)
+{
+    callout_reset_slack(c, usec, 0, func, arg);
+}
+
+/*
+ * Stop a pending callout. If the callout is running on
+ * another processor, wait for it to finish so that the
+ * caller may safely free it once we return.
+ *
+ * @c: Callout to stop
+ *
+ * Returns true if the callout was pending.
+ */
+bool
+callout_stop(struct callout *c)
+{
+    struct callout_cpu *cc;
+    bool masked, pending;
+
+    for (;;) {
+        if ((cc = c->cc) == NULL) {
+            return false;
+        }
+
+        masked = cc_lock(cc);
+        if (c->cc != cc) {
+            cc_unlock(cc, masked);
+            continue;
+        }
+
+        pending = ISSET(c->flags, CALLOUT_PENDING);
+        if (pending) {
+            wheel_remove(cc, c);
+            c->flags &= ~CALLOUT_PENDING;
+            break;
+        }
+
+        /* Running on our processor means we are the callout */
+        if (cc->running != c || cc == this_cc()) {
+            break;
+        }
+
+        cc_unlock(cc, masked);
+        md_pause();
+    }
+
+    cc_unlock(cc, masked);
+    return pending;
+}
+
+/*
+ * Read one of the expiry histograms, summed up
+ * across all processors.
+ *
+ * @sio: Transaction to fill in
+ * @slack: True for the slack histogram
+ */
+static int
+callout_hist_read(struct sio_txn *sio, bool slack)
+{
+    struct callout_hist hist, *hp;
+    struct callout_cpu *cc;
+    size_t len;
+    bool masked;
+
+    if (sio == NULL || sio->buf == NULL) {
+        return -EINVAL;
+    }
+    if (sio->offset >= sizeof(hist)) {
+        return 0;
+    }
+
+    memset(&hist, 0, sizeof(hist));
+    for (int i = 0; i < CPU_MAX; ++i) {
+        cc = &callout_cpus[i];
+        if (!cc->ready) {
+            continue;
+        }
+
+        masked = cc_lock(cc);
+        hp = slack ? &cc->slack : &cc->latency;
+        hist.count += hp->count;
+        hist.total_usec += hp->total_usec;
+        hist.max_usec = MAX(hist.max_usec, hp->max_usec);
+        for (int j = 0; j < CALLOUT_NHIST; ++j) {
+            hist.bucket[j] += hp->bucket[j];
+        }
+        cc_unlock(cc, masked);
+    }
+
+    len = MIN(sio->len, sizeof(hist) - sio->offset);
+    memcpy(sio->buf, (char *)&hist + sio->offset, len);
+    return len;
+}
+
+static int
+ctl_latency_read(struct ctlfs_dev *cdp, struct sio_txn *sio)
+{
+    return callout_hist_read(sio, false);
+}
+
+static int
+ctl_slack_read(struct ctlfs_dev *cdp, struct sio_txn *sio)
+{
+    return callout_hist_read(sio, true);
+}
+
+/*
+ * Operations for /ctl/callout/latency
+ */
+static const struct ctlops ctl_latency = {
+    .read = ctl_latency_read,
+    .write = NULL
+};
+
+/*
+ * Operations for /ctl/callout/slack
+ */
+static const struct ctlops ctl_slack = {
+    .read = ctl_slack_read,
+    .write = NULL
+};
+
+/*
+ * Setup the callout wheel of a processor, must be
+ * called before any callouts are armed on it.
+ *
+ * @ci: Processor to setup
+ */
+void
+callout_init_cpu(struct cpu_info *ci)
+{
+    struct callout_cpu *cc;
+
+    cc = &callout_cpus[ci->id];
+    memset(cc, 0, sizeof(*cc));
+    for (int i = 0; i < WHEEL_LEVELS; ++i) {
+        for (int j = 0; j < WHEEL_SIZE; ++j) {
+            TAILQ_INIT(&cc->wheel[i][j]);
+        }
+    }
+
+    TAILQ_INIT(&cc->expq);
+    cc->now = callout_time_usec();
+    cc->armed = CALLOUT_NEVER;
+    cc->ready = true;
+}
+
+/*
+ * Expose callout statistics through ctlfs
+ */
+void
+callout_startup(void)
+{
+    struct ctlfs_dev ctl;
+    char ctlname[] = "callout";
+
+    /* Create '/ctl/callout/latency' and '/ctl/callout/slack' */
+    ctl.mode = 0444;
+    ctl.data = NULL;
+    ctlfs_create_node(ctlname, &ctl);
+    ctl.devname = ctlname;
+    ctl.ops = &ctl_latency;
+    ctlfs_create_entry("latency", &ctl);
+    ctl.ops = &ctl_slack;
+    ctlfs_create_entry("slack", &ctl);
+
+    pr_trace("%d level timing wheel, %d slots/level\n",
+        WHEEL_LEVELS, WHEEL_SIZE);
+}
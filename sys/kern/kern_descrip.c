@@ -36,6 +36,7 @@
 #include <sys/filedesc.h>
 #include <sys/systm.h>
 #include <vm/dynalloc.h>
+#include <vm/vm_vnode.h>
 #include <string.h>
 
 /*
@@ -122,22 +123,26 @@ fd_close(unsigned int fd)
         return -EBADF;
     }
 
+    /*
+     * Drop our slot before the ref, the descriptor may
+     * be shared with a forked process and we must not
+     * touch it once another holder is able to free it.
+     */
+    td = this_td();
+    td->fds[fd] = NULL;
+
     /* Return if other threads still hold a ref */
     if (atomic_dec_int(&filedes->refcnt) > 0) {
         return 0;
     }
 
-    td = this_td();
-
     /*
      * Each file descriptor structure references a vnode,
      * we want to reclaim it or at the very least drop
      * one of its references. After we've cleaned up within
-     * the file descriptor, we can clear it from the fd table
-     * and free up the memory for it.
+     * the file descriptor, we can free up the memory for it.
      */
     vfs_release_vnode(filedes->vp);
-    td->fds[fd] = NULL;
     dynfree(filedes);
     return 0;
 }
@@ -204,49 +209,54 @@ fd_rw(unsigned int fd, void *buf, size_t count, uint8_t write)
         return -EPERM;
     }
 
+    /*
+     * The read or write may sleep in the page cache or
+     * the block layer, so this must not be a spinlock.
+     */
+    mutex_acquire(&filedes->lock, 0);
     sio.len = count;
     sio.buf = kbuf;
     sio.offset = filedes->offset;
 
-    spinlock_acquire(&filedes->lock);
     if (write) {
         /* Copy in user buffer */
         if (copyin(buf, kbuf, count) < 0) {
             retval = -EFAULT;
-            goto done;
+            goto unlock;
         }
 
-        /* Call VFS write hook */
-        if ((n = vfs_vop_write(filedes->vp, &sio)) < 0) {
+        /* Write through the page cache */
+        if ((n = vn_write(filedes->vp, &sio)) < 0) {
             retval = n;
-            goto done;
+            goto unlock;
         }
     } else {
-        if ((n = vfs_vop_read(filedes->vp, &sio)) < 0) {
+        if ((n = vn_read(filedes->vp, &sio)) < 0) {
             retval = n;
-            goto done;
+            goto unlock;
         }
 
         /* End of file? */
         if (n == 0) {
             retval = 0;
-            goto done;
+            goto unlock;
         }
 
         if (copyout(kbuf, buf, count) < 0) {
             retval = -EFAULT;
-            goto done;
+            goto unlock;
         }
     }
 
     /* Increment the offset per read */
     filedes->offset += n;
     retval = n;
+unlock:
+    mutex_release(&filedes->lock);
 done:
     if (kbuf != NULL) {
         dynfree(kbuf);
     }
-    spinlock_release(&filedes->lock);
     return retval;
 }
 
@@ -37,6 +37,7 @@
 #include <sys/spinlock.h>
 #include <sys/device.h>
 #include <sys/disk.h>
+#include <sys/bio.h>
 #include <vm/dynalloc.h>
 #include <assert.h>
 #include <string.h>
@@ -164,7 +165,7 @@ __disk_get_id(diskid_t id)
 
 /*
  * Attempt to perform a read/write operation on
- * a disk.
+ * a disk through the buffer cache.
  *
  * @id: ID of disk to operate on
  * @blk: Block offset to read at
@@ -172,20 +173,21 @@ __disk_get_id(diskid_t id)
  * @len: Number of bytes to read
  * @write: If true, do a write
  *
- * XXX: The size in which blocks are read at is in
- *      virtual blocks which is defined by V_BSIZE
- *      in sys/disk.h
+ * XXX: `blk' is in hardware blocks while the buffer
+ *      cache works in virtual blocks, which are
+ *      defined by V_BSIZE in sys/disk.h
  */
 static ssize_t
 disk_rw(diskid_t id, blkoff_t blk, void *buf, size_t len, bool write)
 {
-    const struct bdevsw *bdev;
-    struct sio_txn sio;
     struct disk *dp;
+    struct buf *bp;
+    char *p = buf;
+    off_t off, boff;
+    size_t done, n;
+    ssize_t nread;
     int error;
 
-    len = ALIGN_UP(len, V_BSIZE);
-
     /* Attempt to grab the disk object */
     error = disk_get_id(id, &dp);
     if (error < 0) {
@@ -193,31 +195,46 @@ disk_rw(diskid_t id, blkoff_t blk, void *buf, size_t len, bool write)
     }
 
     /* Sanity check, should not happen */
-    bdev = dp->bdev;
-    if (__unlikely(bdev == NULL)) {
+    if (__unlikely(dp->bdev == NULL)) {
         return -EIO;
     }
 
-    /* Prepare the buffer */
-    sio.buf = buf;
-    sio.offset = blk * dp->bsize;
-    sio.len = len;
+    off = blk * dp->bsize;
+    for (done = 0; done < len; done += n) {
+        boff = (off + done) & (V_BSIZE - 1);
+        n = MIN(V_BSIZE - boff, len - done);
+        blk = (off + done) / V_BSIZE;
+
+        /* Runs of missing blocks are read in one go */
+        if (!write && boff == 0 && n == V_BSIZE) {
+            nread = bio_readblks(dp, blk, &p[done], (len - done) / V_BSIZE);
+            if (nread < 0) {
+                return (done > 0) ? (ssize_t)done : nread;
+            }
+
+            n = nread * V_BSIZE;
+            continue;
+        }
 
-    /* Handle writes */
-    if (write) {
-        if (bdev->write == NULL) {
-            return -ENOTSUP;
+        /* Whole blocks being written need not be read */
+        if (write && n == V_BSIZE) {
+            bp = bio_get(dp, blk);
+        } else if ((error = bio_read(dp, blk, &bp)) < 0) {
+            return (done > 0) ? (ssize_t)done : error;
         }
 
-        return bdev->write(dp->dev, &sio, 0);
-    }
+        if (!write) {
+            memcpy(&p[done], bp->data + boff, n);
+            bio_release(bp);
+            continue;
+        }
 
-    /* Do we support this operation? */
-    if (bdev->read == NULL) {
-        return -ENOTSUP;
+        /* Written back later by the flusher */
+        memcpy(bp->data + boff, &p[done], n);
+        bio_dirty(bp);
     }
 
-    return bdev->read(dp->dev, &sio, 0);
+    return len;
 }
 
 /*
@@ -389,23 +406,7 @@ disk_buf_free(void *p)
 ssize_t
 disk_read(diskid_t id, blkoff_t blk, void *buf, size_t len)
 {
-    ssize_t retval;
-    char *tmp;
-
-    tmp = disk_buf_alloc(id, len);
-    if (tmp == NULL) {
-        return -ENOMEM;
-    }
-
-    retval = disk_rw(id, blk, tmp, len, false);
-    if (retval < 0) {
-        disk_buf_free(tmp);
-        return retval;
-    }
-
-    memcpy(buf, tmp, len);
-    disk_buf_free(tmp);
-    return retval;
+    return disk_rw(id, blk, buf, len, false);
 }
 
 /*
@@ -420,18 +421,7 @@ disk_read(diskid_t id, blkoff_t blk, void *buf, size_t len)
 ssize_t
 disk_write(diskid_t id, blkoff_t blk, const void *buf, size_t len)
 {
-    ssize_t retval;
-    char *tmp;
-
-    tmp = disk_buf_alloc(id, len);
-    if (tmp == NULL) {
-        return -ENOMEM;
-    }
-
-    memcpy(tmp, buf, len);
-    retval  = disk_rw(id, blk, tmp, len, true);
-    disk_buf_free(tmp);
-    return retval;
+    return disk_rw(id, blk, (void *)buf, len, true);
 }
 
 /*
@@ -33,6 +33,7 @@
 #include <sys/proc.h>
 #include <sys/sched.h>
 #include <sys/signal.h>
+#include <sys/time.h>
 #include <vm/vm.h>
 #include <vm/map.h>
 #include <vm/physmem.h>
@@ -55,8 +56,7 @@ release_stack(struct proc *td)
         base -= VM_HIGHER_HALF;
         vm_free_frame(base, PROC_STACK_PAGES);
     } else {
-        vm_unmap(pcbp->addrsp, base, PROC_STACK_SIZE);
-        vm_free_frame(base, PROC_STACK_PAGES);
+        vm_unmap_free(pcbp->addrsp, base, PROC_STACK_SIZE);
     }
 }
 
@@ -67,6 +67,7 @@ execve(struct proc *td, const struct execve_args *args)
     struct exec_prog prog;
     struct pcb *pcbp = &td->pcb;
     uintptr_t stack_top, stack;
+    paddr_t timepage;
 
     if (td == NULL || args == NULL)
         return -EINVAL;
@@ -96,8 +97,15 @@ execve(struct proc *td, const struct execve_args *args)
     vm_map(pcbp->addrsp, td->stack_base, td->stack_base,
         (PROT_READ | PROT_WRITE | PROT_USER), PROC_STACK_SIZE);
 
+    /* Map the shared time page read-only */
+    if ((timepage = timepage_paddr()) != 0) {
+        vm_map(pcbp->addrsp, timepage, timepage, (PROT_READ | PROT_USER),
+            DEFAULT_PAGESIZE);
+    }
+
     prog.argp = args->argv;
     prog.envp = args->envp;
+    prog.auxval.at_timepage = timepage;
     stack_top = td->stack_base + (PROC_STACK_SIZE - 1);
 
     /* Setup registers, signals and stack */
@@ -29,6 +29,7 @@
 
 #include <sys/proc.h>
 #include <sys/sched.h>
+#include <sys/schedvar.h>
 #include <sys/syslog.h>
 #include <sys/atomic.h>
 #include <sys/panic.h>
@@ -75,15 +76,14 @@ unload_td(struct proc *td)
             continue;
         }
 
-        /* Attempt to unmap the range */
-        if (vm_unmap(pcbp->addrsp, range->vbase, len) != 0) {
-            pr_error("failed to unmap %p - %p (pid=%d)\n",
-                range->start, range->end, td->pid);
-        }
-
-        /* Free the physical memory */
-        vm_free_frame(range->start, len / DEFAULT_PAGESIZE);
+        /*
+         * Unmap the range and free the physical memory, the
+         * frames may be shared with a forked process.
+         */
+        vm_unmap_free(pcbp->addrsp, range->vbase, len);
     }
+
+    mmap_lgdr_release(td);
 }
 
 void
@@ -102,10 +102,12 @@ proc_reap(struct proc *td)
         if (fdp == NULL) {
             continue;
         }
-        if (fdp->refcnt == 1) {
+
+        /* Only the last holder may free it, see fd_close() */
+        td->fds[i] = NULL;
+        if (atomic_dec_int((unsigned int *)&fdp->refcnt) == 0) {
             vfs_release_vnode(fdp->vp);
             dynfree(fdp);
-            fdp = NULL;
         }
     }
 
@@ -117,15 +119,18 @@ proc_reap(struct proc *td)
      * kernel space stacks are not.
      */
     if (ISSET(td->flags, PROC_KTD)) {
-        stack_va = td->stack_base;
         stack_pa = td->stack_base - VM_HIGHER_HALF;
+        vm_free_frame(stack_pa, PROC_STACK_PAGES);
     } else {
         stack_va = td->stack_base;
-        stack_pa = td->stack_base;
-        vm_unmap(pcbp->addrsp, stack_va, PROC_STACK_SIZE);
+        vm_unmap_free(pcbp->addrsp, stack_va, PROC_STACK_SIZE);
+    }
+
+    if (td->kstack_base != 0) {
+        stack_pa = td->kstack_base - VM_HIGHER_HALF;
+        vm_free_frame(stack_pa, PROC_KSTACK_PAGES);
     }
 
-    vm_free_frame(stack_pa, PROC_STACK_PAGES);
     pmap_destroy_vas(pcbp->addrsp);
 }
 
@@ -202,7 +207,7 @@ exit1(struct proc *td, int flags)
         if (parent->pid == 0)
             sched_enter();
 
-        parent->flags &= ~PROC_SLEEP;
+        sched_wakeup_td(parent);
         sched_enter();
     }
 
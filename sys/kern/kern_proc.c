@@ -36,6 +36,7 @@
 #include <sys/syscall.h>
 #include <sys/filedesc.h>
 #include <sys/fcntl.h>
+#include <vm/vm_vnode.h>
 #include <string.h>
 #include <crc32.h>
 
@@ -99,7 +100,7 @@ proc_coredump(struct proc *td, uintptr_t fault_addr)
     sio.offset = 0;
 
     /* Write the core file */
-    vfs_vop_write(vp, &sio);
+    vn_write(vp, &sio);
     fd_close(fd);
 }
 
@@ -123,9 +124,11 @@ proc_init(struct proc *td, struct proc *parent)
 
     /* Initialize the mmap ledger */
     mlgdr->nbytes = 0;
+    mlgdr->va_next = MMAP_USER_BASE;
     RBT_INIT(lgdr_entries, &mlgdr->hd);
     td->mlgdr = mlgdr;
     td->flags |= PROC_WAITED;
+    callout_init(&td->sleep_co);
     signals_init(td);
     return 0;
 }
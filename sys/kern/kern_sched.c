@@ -33,7 +33,9 @@
 #include <sys/cdefs.h>
 #include <sys/param.h>
 #include <sys/syslog.h>
+#include <sys/systm.h>
 #include <sys/atomic.h>
+#include <sys/callout.h>
 #include <dev/cons/cons.h>
 #include <machine/frame.h>
 #include <machine/cpu.h>
@@ -51,31 +53,123 @@ void sched_accnt_init(void);
 static sched_policy_t policy = SCHED_POLICY_MLFQ;
 
 /*
- * Thread ready queues - all threads ready to be
- * scheduled should be added to the toplevel queue.
+ * Per-processor thread ready queues - all threads ready
+ * to be scheduled are added to the toplevel queue of the
+ * processor they are enqueued on. Each set is indexed by
+ * the MI logical ID of its processor.
  */
-static struct sched_queue qlist[SCHED_NQUEUE];
+static struct sched_runq runqs[CPU_MAX];
 
 /*
- * Thread queue lock - all operations to `qlist'
- * must be done with this lock acquired.
+ * Sleep queues - threads asleep on a wait channel
+ * are hashed by channel into one of these buckets.
  */
-__cacheline_aligned static struct spinlock tdq_lock = {0};
+static struct sched_sleepq sleepq[SLEEPQ_NBUCKET];
+
+#define SLEEPQ_HASH(WCHAN) \
+    (&sleepq[((uintptr_t)(WCHAN) >> 4) % SLEEPQ_NBUCKET])
+
+/*
+ * Number of processors running their idle thread,
+ * lets sched_kick() skip looking for an idle processor
+ * when every processor is busy.
+ */
+static volatile uint32_t nidle = 0;
 
 /*
  * Perform timer oneshot
+ *
+ * @now: End the current quantum right away
  */
 void
 sched_oneshot(bool now)
 {
-    struct timer timer;
-    size_t usec = now ? SHORT_TIMESLICE_USEC : DEFAULT_TIMESLICE_USEC;
-    tmrr_status_t tmr_status;
+    struct sched_runq *rq = this_cpu()->runq;
+
+    if (now && rq != NULL) {
+        rq->slice_end = 0;
+    }
+
+    callout_arm(now ? SHORT_TIMESLICE_USEC : DEFAULT_TIMESLICE_USEC);
+}
+
+/*
+ * Program the scheduler timer for the thread that is
+ * about to run. The timer fires at the end of its quantum
+ * or for the next callout, whichever comes first. Idle
+ * processors have no quantum to enforce so they go
+ * tickless and only wake up for callouts or an IPI
+ * (see sched_kick()).
+ *
+ * @td: Thread that is about to run (NULL if none)
+ * @renew: Start a new quantum for `td'
+ */
+void
+sched_timer_arm(struct proc *td, bool renew)
+{
+    struct sched_runq *rq = this_cpu()->runq;
+    size_t now;
+
+    if (td == NULL || ISSET(td->flags, PROC_IDLE)) {
+        callout_arm(0);
+        return;
+    }
+
+    now = callout_time_usec();
+    if (renew) {
+        rq->slice_end = now + DEFAULT_TIMESLICE_USEC;
+    }
+
+    if (rq->slice_end > now) {
+        callout_arm(rq->slice_end - now);
+    } else {
+        callout_arm(SHORT_TIMESLICE_USEC);
+    }
+}
+
+/*
+ * Returns true if the current thread should give up
+ * the processor. The timer also fires for callouts so
+ * a thread keeps running until its quantum is up or
+ * until it has nothing left to do.
+ *
+ * @td: Current thread (NULL if none)
+ */
+bool
+sched_need_switch(struct proc *td)
+{
+    struct sched_runq *rq = this_cpu()->runq;
 
-    tmr_status = req_timer(TIMER_SCHED, &timer);
-    __assert(tmr_status == TMRR_SUCCESS);
+    /* Nothing gets switched until sched_enter() */
+    if (rq == NULL || !rq->started) {
+        return false;
+    }
+    if (td == NULL || ISSET(td->flags, PROC_SLEEP | PROC_IDLE)) {
+        return true;
+    }
+
+    return callout_time_usec() >= rq->slice_end;
+}
+
+/*
+ * Mark the current processor as idle or busy.
+ *
+ * @rq: Ready queues of the current processor
+ * @idle: True if the processor is going idle
+ */
+static inline void
+runq_set_idle(struct sched_runq *rq, bool idle)
+{
+    if (rq->idle == idle) {
+        return;
+    }
 
-    timer.oneshot_us(usec);
+    rq->idle = idle;
+    if (idle) {
+        atomic_inc_int(&nidle);
+    } else {
+        atomic_dec_int(&nidle);
+    }
 }
 
 /*
@@ -99,75 +193,353 @@ cpu_is_assoc(struct cpu_info *ci, struct proc *td)
     return ci->id == td->affinity;
 }
 
-struct proc *
-sched_dequeue_td(void)
+/*
+ * Remove a thread from the ready queue set it
+ * is on.
+ *
+ * XXX: `rq->lock' must be held by the caller
+ */
+static void
+runq_remove(struct sched_runq *rq, struct proc *td)
+{
+    struct sched_queue *queue;
+
+    queue = &rq->q[td->priority];
+    TAILQ_REMOVE(&queue->q, td, link);
+    if (--queue->nthread == 0) {
+        rq->bitmap &= ~BIT(td->priority);
+    }
+
+    --rq->ci->stat.nready;
+    td->runq = NULL;
+}
+
+/*
+ * Take the highest priority thread from the
+ * ready queues of the current processor.
+ *
+ * Only threads that may run on the owning processor
+ * are ever enqueued on it and sleeping threads live
+ * on the sleep queues, so the head of the first
+ * non-empty queue is always what we want.
+ *
+ * @rq: Ready queue set to take from
+ */
+static struct proc *
+runq_take(struct sched_runq *rq)
+{
+    struct proc *td;
+    int i;
+
+    spinlock_acquire(&rq->lock);
+    if ((i = __builtin_ffs(rq->bitmap)) == 0) {
+        spinlock_release(&rq->lock);
+        return NULL;
+    }
+
+    td = TAILQ_FIRST(&rq->q[i - 1].q);
+    runq_remove(rq, td);
+    spinlock_release(&rq->lock);
+    return td;
+}
+
+/*
+ * Take the first thread that `ci' may run from
+ * the ready queues of another processor, threads
+ * pinned to the other processor are left alone.
+ *
+ * @rq: Ready queue set to steal from
+ * @ci: Processor that is stealing
+ */
+static struct proc *
+runq_steal(struct sched_runq *rq, struct cpu_info *ci)
 {
     struct sched_queue *queue;
     struct proc *td = NULL;
-    struct cpu_info *ci;
-    uint32_t ncpu = 0;
+    uint32_t bitmap;
+    int i;
 
-    spinlock_acquire(&tdq_lock);
-    ci = this_cpu();
+    spinlock_acquire(&rq->lock);
+    bitmap = rq->bitmap;
+    while ((i = __builtin_ffs(bitmap)) != 0) {
+        queue = &rq->q[i - 1];
+        bitmap &= ~BIT(i - 1);
 
-    for (size_t i = 0; i < SCHED_NQUEUE; ++i) {
-        queue = &qlist[i];
-        if (TAILQ_EMPTY(&queue->q)) {
-            continue;
+        TAILQ_FOREACH(td, &queue->q, link) {
+            if (cpu_is_assoc(ci, td)) {
+                break;
+            }
         }
 
-        td = TAILQ_FIRST(&queue->q);
-        if (td == NULL) {
-            continue;
+        if (td != NULL) {
+            runq_remove(rq, td);
+            break;
         }
+    }
 
-        while (ISSET(td->flags, PROC_SLEEP)) {
-            td = TAILQ_NEXT(td, link);
-            if (td == NULL) {
-                break;
-            }
+    spinlock_release(&rq->lock);
+    return td;
+}
+
+/*
+ * Steal a thread from the busiest processor. This
+ * is used when our own ready queues have nothing
+ * for us to run. If everything the busiest one has
+ * is pinned to it, the others that have threads
+ * ready are tried in turn.
+ *
+ * @ci: Processor that is stealing
+ */
+static struct proc *
+sched_steal(struct cpu_info *ci)
+{
+    struct cpu_info *peer, *victim = NULL;
+    struct proc *td;
+    uint32_t nready, max_ready = 0;
+    uint32_t ncpu = cpu_count();
+
+    for (uint32_t i = 0; i < ncpu; ++i) {
+        peer = cpu_get(i);
+        if (peer == NULL || peer == ci) {
+            continue;
+        }
+        if (peer->runq == NULL) {
+            continue;
         }
 
         /*
-         * If we are on a multicore system and this isn't
-         * our process, don't take it. Some threads might
-         * be pinned to a specific processor.
+         * This is only a hint, the queue depth might
+         * change under us but runq_steal() will sort
+         * that out for us.
          */
-        ncpu = cpu_count();
-        while (!cpu_is_assoc(ci, td) && ncpu > 1) {
-            td = TAILQ_NEXT(td, link);
-            if (td == NULL) {
-                break;
-            }
+        nready = atomic_load_int(&peer->stat.nready);
+        if (nready > max_ready) {
+            max_ready = nready;
+            victim = peer;
         }
+    }
+
+    if (victim == NULL) {
+        return NULL;
+    }
 
-        if (td == NULL) {
+    td = runq_steal(victim->runq, ci);
+    for (uint32_t i = 0; td == NULL && i < ncpu; ++i) {
+        peer = cpu_get(i);
+        if (peer == NULL || peer == ci || peer == victim) {
+            continue;
+        }
+        if (peer->runq == NULL) {
+            continue;
+        }
+        if (atomic_load_int(&peer->stat.nready) == 0) {
             continue;
         }
 
-        TAILQ_REMOVE(&queue->q, td, link);
-        spinlock_release(&tdq_lock);
-        return td;
+        td = runq_steal(peer->runq, ci);
+    }
+
+    if (td != NULL) {
+        atomic_inc_64(&ci->stat.nsteal);
+    }
+
+    return td;
+}
+
+struct proc *
+sched_dequeue_td(void)
+{
+    struct proc *td;
+    struct cpu_info *ci;
+
+    ci = this_cpu();
+    if (__unlikely(ci->runq == NULL)) {
+        return NULL;
+    }
+
+    if ((td = runq_take(ci->runq)) == NULL) {
+        td = sched_steal(ci);
+    }
+
+    if (td != NULL) {
+        runq_set_idle(ci->runq, false);
+    }
+
+    return td;
+}
+
+/*
+ * Returns true if other threads are ready to run on
+ * the current processor. Used by background work
+ * that should only soak up idle time.
+ */
+bool
+sched_cpu_busy(void)
+{
+    struct cpu_info *ci = this_cpu();
+
+    if (ci == NULL || ci->runq == NULL) {
+        return false;
+    }
+
+    return ci->runq->bitmap != 0;
+}
+
+/*
+ * Returns the idle thread of the current processor
+ * and marks the processor as idle, NULL if it does
+ * not have one yet.
+ */
+struct proc *
+sched_idle_td(void)
+{
+    struct sched_runq *rq = this_cpu()->runq;
+
+    if (rq == NULL || rq->idle_td == NULL) {
+        return NULL;
     }
 
-    /* We got nothing */
-    spinlock_release(&tdq_lock);
-    return NULL;
+    runq_set_idle(rq, true);
+    return rq->idle_td;
 }
 
 /*
- * Add a thread to the scheduler.
+ * Make a newly spawned thread the idle thread of
+ * the current processor. Idle threads are never put
+ * on a ready queue, they only run when there is
+ * nothing else to do.
+ *
+ * @td: Thread to use
+ */
+void
+sched_idle_init(struct proc *td)
+{
+    struct cpu_info *ci = this_cpu();
+
+    td->affinity = ci->id;
+    td->flags |= (PROC_PINNED | PROC_IDLE);
+    ci->runq->idle_td = td;
+}
+
+/*
+ * Park a thread that is being switched out while
+ * asleep. Returns true if the thread was parked on
+ * its sleep queue, false if it has been woken up in
+ * the meantime and should go on a ready queue.
+ */
+static bool
+sleepq_park(struct proc *td)
+{
+    struct sched_sleepq *sq;
+    const void *wchan = td->wchan;
+    bool parked = false;
+
+    if (wchan == NULL) {
+        return false;
+    }
+
+    sq = SLEEPQ_HASH(wchan);
+    spinlock_acquire(&sq->lock);
+    if (ISSET(td->flags, PROC_SLEEP) && td->wchan == wchan) {
+        td->flags |= PROC_PARKED;
+        parked = true;
+    }
+
+    spinlock_release(&sq->lock);
+    return parked;
+}
+
+/*
+ * Let a processor know that a thread was just made
+ * ready on it. If the thread was made ready on our
+ * own processor, try to hand it off to one that is
+ * sitting idle instead.
+ *
+ * @td: Thread that was made ready
+ */
+static void
+sched_kick(struct proc *td)
+{
+    struct sched_runq *rq = td->runq;
+    struct cpu_info *ci, *self;
+
+    if (rq == NULL) {
+        return;
+    }
+
+    /*
+     * A busy processor picks the thread up at the end
+     * of its current quantum, only idle ones need a
+     * nudge as their timer might not be armed at all.
+     */
+    self = this_cpu();
+    if (rq->ci != self) {
+        if (rq->idle) {
+            md_sched_kick(rq->ci);
+        }
+        return;
+    }
+
+    /* Pinned threads cannot be stolen */
+    if (ISSET(td->flags, PROC_PINNED)) {
+        return;
+    }
+    if (atomic_load_int(&nidle) == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < cpu_count(); ++i) {
+        ci = cpu_get(i);
+        if (ci == NULL || ci == self || ci->runq == NULL) {
+            continue;
+        }
+
+        if (ci->runq->idle) {
+            md_sched_kick(ci);
+            return;
+        }
+    }
+}
+
+/*
+ * Add a thread to the scheduler. Pinned threads
+ * go to the ready queues of the processor they
+ * are pinned to, everything else is enqueued on
+ * the current processor. Sleeping threads stay
+ * on their sleep queue until woken up.
  */
 void
 sched_enqueue_td(struct proc *td)
 {
     struct sched_queue *queue;
+    struct sched_runq *rq;
+    struct cpu_info *ci = NULL;
+
+    if (ISSET(td->flags, PROC_IDLE)) {
+        return;
+    }
+    if (ISSET(td->flags, PROC_SLEEP) && sleepq_park(td)) {
+        return;
+    }
 
-    spinlock_acquire(&tdq_lock);
-    queue = &qlist[td->priority];
+    if (ISSET(td->flags, PROC_PINNED)) {
+        ci = cpu_get(td->affinity);
+    }
+    if (ci == NULL || ci->runq == NULL) {
+        ci = this_cpu();
+    }
+
+    rq = ci->runq;
+    spinlock_acquire(&rq->lock);
+    queue = &rq->q[td->priority];
 
     TAILQ_INSERT_TAIL(&queue->q, td, link);
-    spinlock_release(&tdq_lock);
+    ++queue->nthread;
+    ++ci->stat.nready;
+    rq->bitmap |= BIT(td->priority);
+    td->runq = rq;
+    spinlock_release(&rq->lock);
+    sched_kick(td);
 }
 
 /*
@@ -241,10 +613,11 @@ mi_sched_switch(struct proc *from)
 void
 sched_enter(void)
 {
+    this_cpu()->runq->started = 1;
     md_inton();
     sched_oneshot(false);
     for (;;) {
-        md_pause();
+        md_hlt();
     }
 }
 
@@ -253,6 +626,7 @@ sched_yield(void)
 {
     struct proc *td;
     struct cpu_info *ci = this_cpu();
+    bool masked;
 
     if ((td = ci->curtd) == NULL) {
         return;
@@ -265,25 +639,197 @@ sched_yield(void)
         return;
     }
 
-    ci->curtd = NULL;
+    /*
+     * Stay the current thread while halted so that we
+     * are saved and put back on a ready queue if the
+     * switch that follows finds something else to run.
+     */
+    masked = md_intr_masked();
     md_inton();
-    sched_oneshot(false);
+    sched_oneshot(true);
 
     md_hlt();
-    md_intoff();
-    ci->curtd = td;
+    if (masked) {
+        md_intoff();
+    }
+}
+
+/*
+ * Put a thread to sleep on a wait channel. The thread
+ * is taken off the processor the next time it is
+ * switched out and stays off the ready queues until
+ * sched_wakeup() or sched_wakeup_td() is called.
+ *
+ * @td: Thread to put to sleep
+ * @wchan: Wait channel to sleep on
+ */
+void
+sched_sleep(struct proc *td, const void *wchan)
+{
+    struct sched_sleepq *sq;
+
+    sq = SLEEPQ_HASH(wchan);
+    spinlock_acquire(&sq->lock);
+    td->wchan = wchan;
+    td->flags |= PROC_SLEEP;
+    TAILQ_INSERT_TAIL(&sq->q, td, sleep_link);
+    spinlock_release(&sq->lock);
+}
+
+/*
+ * Take a thread off its sleep queue. Returns true if
+ * the thread was already switched out and needs to be
+ * put back on a ready queue with sleepq_ready().
+ *
+ * XXX: `sq->lock' must be held by the caller
+ */
+static bool
+sleepq_remove(struct sched_sleepq *sq, struct proc *td)
+{
+    TAILQ_REMOVE(&sq->q, td, sleep_link);
+    td->flags &= ~PROC_SLEEP;
+    td->wchan = NULL;
+
+    if (ISSET(td->flags, PROC_PARKED)) {
+        td->flags &= ~PROC_PARKED;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Put a thread that was taken off its sleep queue
+ * back on a ready queue.
+ *
+ * XXX: Must be called without `sq->lock' held as
+ *      releasing a nested spinlock enables preemption.
+ */
+static void
+sleepq_ready(struct proc *td)
+{
+    sched_enqueue_td(td);
+}
+
+/*
+ * Wake up threads sleeping on a wait channel
+ *
+ * @wchan: Wait channel to wake up
+ * @nwake: Max threads to wake up (0 for all of them)
+ *
+ * Returns the number of threads woken up.
+ */
+size_t
+sched_wakeup(const void *wchan, size_t nwake)
+{
+    struct sched_sleepq *sq;
+    struct proc *td, *tmp;
+    TAILQ_HEAD(, proc) readyq;
+    size_t n = 0;
+
+    /*
+     * Parked threads are not on any ready queue so we may
+     * borrow their ready queue link to collect them.
+     */
+    TAILQ_INIT(&readyq);
+    sq = SLEEPQ_HASH(wchan);
+    spinlock_acquire(&sq->lock);
+    TAILQ_FOREACH_SAFE(td, &sq->q, sleep_link, tmp) {
+        if (td->wchan != wchan) {
+            continue;
+        }
+
+        if (sleepq_remove(sq, td)) {
+            TAILQ_INSERT_TAIL(&readyq, td, link);
+        }
+        if (++n == nwake) {
+            break;
+        }
+    }
+    spinlock_release(&sq->lock);
+
+    while ((td = TAILQ_FIRST(&readyq)) != NULL) {
+        TAILQ_REMOVE(&readyq, td, link);
+        sleepq_ready(td);
+    }
+
+    return n;
+}
+
+/*
+ * Wake up a specific thread if it is asleep
+ *
+ * @td: Thread to wake up
+ *
+ * Returns true if the thread was asleep.
+ */
+bool
+sched_wakeup_td(struct proc *td)
+{
+    struct sched_sleepq *sq;
+    const void *wchan = td->wchan;
+    bool woken = false, ready = false;
+
+    if (wchan == NULL) {
+        return false;
+    }
+
+    sq = SLEEPQ_HASH(wchan);
+    spinlock_acquire(&sq->lock);
+    if (ISSET(td->flags, PROC_SLEEP) && td->wchan == wchan) {
+        ready = sleepq_remove(sq, td);
+        woken = true;
+    }
+    spinlock_release(&sq->lock);
+
+    if (ready) {
+        sleepq_ready(td);
+    }
+
+    return woken;
 }
 
 void
 sched_detach(struct proc *td)
 {
-    struct sched_queue *queue;
+    struct sched_sleepq *sq;
+    struct sched_runq *rq;
+    const void *wchan = td->wchan;
+
+    callout_stop(&td->sleep_co);
+
+    /* Sleeping threads are not on any ready queue */
+    if (wchan != NULL) {
+        sq = SLEEPQ_HASH(wchan);
+        spinlock_acquire(&sq->lock);
+        if (ISSET(td->flags, PROC_SLEEP) && td->wchan == wchan) {
+            TAILQ_REMOVE(&sq->q, td, sleep_link);
+            td->flags &= ~(PROC_SLEEP | PROC_PARKED);
+            td->wchan = NULL;
+        }
+        spinlock_release(&sq->lock);
+    }
 
-    spinlock_acquire(&tdq_lock);
-    queue = &qlist[td->priority];
+    /*
+     * The thread might be stolen by another processor
+     * while we are trying to lock its queues, make sure
+     * it is still where we expect it to be.
+     */
+    for (;;) {
+        if ((rq = td->runq) == NULL) {
+            return;
+        }
 
-    TAILQ_REMOVE(&queue->q, td, link);
-    spinlock_release(&tdq_lock);
+        spinlock_acquire(&rq->lock);
+        if (td->runq == rq) {
+            break;
+        }
+
+        spinlock_release(&rq->lock);
+    }
+
+    runq_remove(rq, td);
+    spinlock_release(&rq->lock);
 }
 
 /*
@@ -298,8 +844,20 @@ sched_detach(struct proc *td)
 void
 proc_pin(struct proc *td, affinity_t cpu)
 {
+    struct sched_runq *rq;
+
     td->affinity = cpu;
     td->flags |= PROC_PINNED;
+
+    /*
+     * If the thread is ready on another processor,
+     * move it over to the one it is pinned to.
+     */
+    rq = td->runq;
+    if (rq != NULL && rq->ci->id != cpu) {
+        sched_detach(td);
+        sched_enqueue_td(td);
+    }
 }
 
 /*
@@ -317,7 +875,7 @@ proc_unpin(struct proc *td)
 
 /*
  * Suspend a process for a specified amount
- * of time. This calling process will yield for
+ * of time. This calling process will sleep for
  * the amount of time specified in 'tv'
  *
  * @td: Process to suspend (NULL for current)
@@ -325,16 +883,15 @@ proc_unpin(struct proc *td)
  *
  * XXX: 'tv' being NULL is equivalent to calling
  *      sched_detach()
+ *
+ * XXX: Only the current process may be suspended
+ *      for an amount of time.
  */
 void
 sched_suspend(struct proc *td, const struct timeval *tv)
 {
-    struct timer tmr;
     const time_t USEC_PER_SEC = 1000000;
     ssize_t usec;
-    time_t usec_cur, usec_tmp;
-    bool have_timer = true;
-    tmrr_status_t tmr_status;
 
     if (td == NULL)
         td = this_td();
@@ -346,23 +903,8 @@ sched_suspend(struct proc *td, const struct timeval *tv)
         return;
     }
 
-    /*
-     * Now, we need a generic timer so that we can compute
-     * how much time has elapsed since this process has
-     * requested to be suspended. However, we cannot assume
-     * that it would be present. If the lookup fails, all we
-     * can do is try to estimate how much time went by which
-     * works fine too, just not as accurate.
-     */
-    tmr_status = req_timer(TIMER_GP, &tmr);
-    if (tmr_status != TMRR_SUCCESS) {
-        have_timer = false;
-    }
-
-    /* We need microsecond precision */
-    if (tmr.get_time_sec == NULL) {
-        have_timer = false;
-    }
+    if (__unlikely(td != this_td()))
+        return;
 
     /*
      * Compute the max time in microseconds that
@@ -371,46 +913,56 @@ sched_suspend(struct proc *td, const struct timeval *tv)
      */
     usec = tv->tv_usec;
     usec += tv->tv_sec * USEC_PER_SEC;
-    usec_cur = (have_timer) ? tmr.get_time_usec() : 0;
+    if (usec <= 0) {
+        return;
+    }
 
-    for (;;) {
-        sched_yield();
+    /*
+     * Nobody wakes this channel up, we simply sleep
+     * until the deadline passes.
+     */
+    tsleep(&td->sleep_co, usec);
+}
 
-        /*
-         * If we have a timer in our paws, compute how much
-         * time went by. Otherwise we estimate by subtracting
-         * the scheduler quantum.
-         *
-         * XXX: The timing here works decently as intended. However,
-         *      it would be nice to smoothen out any jitter. Such can
-         *      probably be done by subtracting 'usec' by the exponential
-         *      moving average of 'usec_tmp' rather than the raw original
-         *      value.
-         */
-        if (have_timer) {
-            usec_tmp = (tmr.get_time_usec() - usec_cur);
-        } else {
-            usec_tmp = DEFAULT_TIMESLICE_USEC;
-        }
+/*
+ * Setup the ready queues of a processor, must be
+ * called before any threads are enqueued on it.
+ *
+ * @ci: Processor to setup
+ */
+void
+sched_init_cpu(struct cpu_info *ci)
+{
+    struct sched_runq *rq;
 
-        /* We are done here! */
-        usec -= usec_tmp;
-        if (usec <= 0) {
-            break;
-        }
+    rq = &runqs[ci->id];
+    for (int i = 0; i < SCHED_NQUEUE; ++i) {
+        TAILQ_INIT(&rq->q[i].q);
+        rq->q[i].nthread = 0;
     }
+
+    rq->bitmap = 0;
+    rq->slice_end = 0;
+    rq->ci = ci;
+    ci->stat.nready = 0;
+    ci->stat.nsteal = 0;
+    ci->runq = rq;
+    callout_init_cpu(ci);
 }
 
 void
 sched_init(void)
 {
-    /* Setup the queues */
-    for (int i = 0; i < SCHED_NQUEUE; ++i) {
-        TAILQ_INIT(&qlist[i].q);
+    /* Setup the queues for the BSP */
+    sched_init_cpu(this_cpu());
+    for (int i = 0; i < SLEEPQ_NBUCKET; ++i) {
+        TAILQ_INIT(&sleepq[i].q);
     }
 
-    pr_trace("prepared %d queues (policy=0x%x)\n",
+    pr_trace("prepared %d queues/cpu (policy=0x%x)\n",
         SCHED_NQUEUE, policy);
 
+    callout_startup();
+
     sched_accnt_init();
 }
@@ -218,15 +218,14 @@ connect_domain(int sockfd, struct ksocket *ksock, struct sockaddr_un *un)
 static int
 socket_rx_wait(int sockfd)
 {
+    const time_t USEC_PER_SEC = 1000000;
     struct ksocket *ksock;
     struct sockopt *opt;
+    struct netbuf *netbuf;
     struct timeval tv;
+    ssize_t usec;
     int error;
 
-    if (ksock == NULL) {
-        return -EINVAL;
-    }
-
     error = get_ksock(sockfd, &ksock);
     if (error < 0) {
         return error;
@@ -242,7 +241,22 @@ socket_rx_wait(int sockfd)
     }
 
     memcpy(&tv, opt->data, opt->len);
-    sched_suspend(NULL, &tv);
+    usec = tv.tv_usec + (tv.tv_sec * USEC_PER_SEC);
+    if (usec <= 0) {
+        return 0;
+    }
+
+    /*
+     * Sleep until send() hands us data or until the
+     * timeout passes, whichever comes first.
+     */
+    netbuf = &ksock->buf.buf;
+    mutex_acquire(ksock->mtx, 0);
+    if (netbuf->len == 0) {
+        msleep(&ksock->buf, ksock->mtx, usec);
+    }
+
+    mutex_release(ksock->mtx);
     return 0;
 }
 
@@ -304,6 +318,7 @@ send(int sockfd, const void *buf, size_t size, int flags)
 
     sbuf->tail += size;
     netbuf->len += size;
+    wakeup(&ksock->buf);
     mutex_release(ksock->mtx);
     return size;
 }
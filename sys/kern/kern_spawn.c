@@ -39,7 +39,13 @@
 #include <sys/signal.h>
 #include <sys/limits.h>
 #include <sys/sched.h>
+#include <sys/schedvar.h>
+#include <sys/atomic.h>
 #include <vm/dynalloc.h>
+#include <vm/physmem.h>
+#include <vm/pmap.h>
+#include <vm/map.h>
+#include <vm/vm.h>
 #include <string.h>
 
 #define pr_trace(fmt, ...) kprintf("spawn: " fmt, ##__VA_ARGS__)
@@ -47,6 +53,7 @@
 
 #define ARGVP_MAX (ARG_MAX / sizeof(void *))
 
+extern volatile size_t g_nthreads;
 static size_t next_pid = 1;
 
 /*
@@ -181,11 +188,155 @@ spawn(struct proc *cur, void(*func)(void), void *p, int flags, struct proc **new
 
     newproc->data = p;
     newproc->pid = next_pid++;
-    sched_enqueue_td(newproc);
+    if (ISSET(flags, SPAWN_IDLE)) {
+        sched_idle_init(newproc);
+    } else {
+        sched_enqueue_td(newproc);
+    }
+
     pid = newproc->pid;
     return pid;
 }
 
+/*
+ * Tear down a child that failed to fork before it
+ * was ever scheduled.
+ *
+ * @cur: Parent process.
+ * @newproc: Half-built child, freed on return.
+ */
+static void
+fork_abort(struct proc *cur, struct proc *newproc)
+{
+    struct pcb *pcbp = &newproc->pcb;
+    struct exec_range *range;
+    paddr_t kstack_pa;
+
+    if (newproc->parent != NULL) {
+        TAILQ_REMOVE(&cur->leafq, newproc, leaf_link);
+        atomic_dec_int(&cur->nleaves);
+        atomic_dec_64(&g_nthreads);
+    }
+
+    /* Drop whatever vm_map_fork() managed to share */
+    for (size_t i = 0; i < newproc->exec.auxval.at_phnum; ++i) {
+        range = &newproc->exec.loadmap[i];
+        if (range->start == 0 && range->end == 0) {
+            continue;
+        }
+
+        vm_unmap_free(pcbp->addrsp, range->vbase, range->end - range->start);
+    }
+
+    vm_unmap_free(pcbp->addrsp, newproc->stack_base, PROC_STACK_SIZE);
+    mmap_lgdr_release(newproc);
+    for (int i = 0; i < PROC_SIGMAX; ++i) {
+        delsig(newproc, i);
+    }
+
+    kstack_pa = newproc->kstack_base - VM_HIGHER_HALF;
+    vm_free_frame(kstack_pa, PROC_KSTACK_PAGES);
+    pmap_destroy_vas(pcbp->addrsp);
+    dynfree(newproc);
+}
+
+/*
+ * Create a copy of a process that shares its memory
+ * copy-on-write and its open files.
+ *
+ * @cur: Process to copy.
+ * @tf: Trapframe for the child to resume from.
+ * @ip: Start address for the child, 0 to resume from `tf'.
+ * @newprocp: If not NULL, will contain the new process.
+ */
+static pid_t
+fork_common(struct proc *cur, const struct trapframe *tf, uintptr_t ip,
+            struct proc **newprocp)
+{
+    struct proc *newproc;
+    struct filedesc *fdp;
+    int error;
+
+    /* Kernel threads have no user memory to share */
+    if (ISSET(cur->flags, PROC_KTD)) {
+        return -ENOTSUP;
+    }
+
+    newproc = dynalloc(sizeof(*newproc));
+    if (newproc == NULL) {
+        pr_error("could not alloc proc (-ENOMEM)\n");
+        return -ENOMEM;
+    }
+
+    memset(newproc, 0, sizeof(*newproc));
+    error = md_fork(newproc, cur, tf, ip);
+    if (error < 0) {
+        dynfree(newproc);
+        pr_error("error initializing forked proc\n");
+        return error;
+    }
+
+    if (!ISSET(cur->flags, PROC_LEAFQ)) {
+        TAILQ_INIT(&cur->leafq);
+        cur->flags |= PROC_LEAFQ;
+    }
+
+    error = proc_init(newproc, cur);
+    if (error < 0) {
+        fork_abort(cur, newproc);
+        pr_error("error initializing forked proc\n");
+        return error;
+    }
+
+    memcpy(&newproc->exec, &cur->exec, sizeof(newproc->exec));
+    error = vm_map_fork(cur, newproc);
+    if (error < 0) {
+        fork_abort(cur, newproc);
+        pr_error("failed to copy address space (error=%d)\n", error);
+        return error;
+    }
+
+    /* Open files are shared with the child */
+    for (size_t i = 0; i < PROC_MAX_FILEDES; ++i) {
+        if ((fdp = cur->fds[i]) == NULL) {
+            continue;
+        }
+
+        atomic_inc_int((unsigned int *)&fdp->refcnt);
+        newproc->fds[i] = fdp;
+    }
+
+    if (newprocp != NULL) {
+        *newprocp = newproc;
+    }
+
+    newproc->pid = next_pid++;
+    sched_enqueue_td(newproc);
+    return newproc->pid;
+}
+
+/*
+ * Fork a process, the child resumes from the saved
+ * state of `cur' or starts at `ip'.
+ *
+ * @cur: Process to fork.
+ * @flags: Reserved, must be zero.
+ * @ip: Start address for the child, NULL to resume.
+ * @newprocp: If not NULL, will contain the new process.
+ *
+ * Returns the PID of the child on success, otherwise an
+ * errno value that is less than zero.
+ */
+int
+fork1(struct proc *cur, int flags, void(*ip)(void), struct proc **newprocp)
+{
+    if (cur == NULL || flags != 0) {
+        return -EINVAL;
+    }
+
+    return fork_common(cur, &cur->tf, (uintptr_t)ip, newprocp);
+}
+
 /*
  * Get the child of a process by PID.
  *
@@ -253,7 +404,7 @@ sys_spawn(struct syscall_args *scargs)
     td = this_td();
     u_path = (const char *)scargs->arg0;
     u_argv = (const char **)scargs->arg1;
-    flags = scargs->arg3;
+    flags = scargs->arg3 & ~SPAWN_IDLE;
 
     args = dynalloc(sizeof(*args));
     if (args == NULL) {
@@ -293,3 +444,13 @@ sys_spawn(struct syscall_args *scargs)
 
     return spawn(td, spawn_thunk, args, flags, NULL);
 }
+
+/*
+ * Returns the PID of the child to the parent
+ * and zero to the child.
+ */
+scret_t
+sys_fork(struct syscall_args *scargs)
+{
+    return fork_common(this_td(), scargs->tf, 0, NULL);
+}
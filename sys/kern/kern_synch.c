@@ -32,16 +32,217 @@
 #include <sys/systm.h>
 #include <sys/errno.h>
 #include <sys/sched.h>
+#include <sys/schedvar.h>
 #include <sys/atomic.h>
+#include <sys/callout.h>
 #include <sys/syslog.h>
 #include <sys/spinlock.h>
+#include <sys/panic.h>
 #include <machine/cdefs.h>
+#include <machine/cpu.h>
 #include <dev/timer.h>
+#include <vm/kmem.h>
 #include <string.h>
 
 #define pr_trace(fmt, ...) kprintf("synch: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
 
+static struct kmem_cache *mutex_cache;
+
+/*
+ * Sleep deadline callout, wakes up a thread that
+ * is still asleep once its deadline passes.
+ *
+ * @arg: Thread that went to sleep
+ */
+static void
+tsleep_expire(void *arg)
+{
+    struct proc *td = arg;
+
+    /*
+     * The thread cannot leave tsleep() before this
+     * function returns as callout_stop() waits for
+     * us, so it is safe to set the error after
+     * waking it up.
+     */
+    if (sched_wakeup_td(td)) {
+        td->sleep_error = -ETIMEDOUT;
+    }
+}
+
+/*
+ * Block the current thread until it is taken off its
+ * sleep queue by a wakeup or by its deadline passing.
+ * The thread must already be on a sleep queue.
+ *
+ * @td: Current thread
+ * @usec: Max microseconds to sleep (0 for no limit)
+ */
+static int
+sleep_block(struct proc *td, size_t usec)
+{
+    bool masked;
+
+    if (usec != 0) {
+        callout_reset_slack(&td->sleep_co, usec, CALLOUT_SLACK_DEFAULT,
+            tsleep_expire, td);
+    }
+
+    /*
+     * Give up the processor now rather than at the end of
+     * our quantum. The switch happens before md_sched_now()
+     * returns and we are parked on our sleep queue until a
+     * wakeup, so normally the loop below is never entered.
+     * It only catches a switch that was put off (e.g.,
+     * while preemption is off).
+     */
+    masked = md_intr_masked();
+    md_inton();
+    sched_oneshot(true);
+    md_sched_now();
+    while (ISSET(td->flags, PROC_SLEEP)) {
+        md_pause();
+    }
+
+    if (masked) {
+        md_intoff();
+    }
+
+    if (usec != 0) {
+        callout_stop(&td->sleep_co);
+    }
+
+    return td->sleep_error;
+}
+
+/*
+ * Sleep on a wait channel until woken up by wakeup()
+ * or until `usec' microseconds have passed.
+ *
+ * @wchan: Wait channel to sleep on
+ * @usec: Max microseconds to sleep (0 for no limit)
+ *
+ * Returns zero when woken up, -ETIMEDOUT when the
+ * deadline passed and -EAGAIN if there is no thread
+ * to put to sleep.
+ *
+ * XXX: Must not be called with spinlocks held.
+ */
+int
+tsleep(const void *wchan, size_t usec)
+{
+    struct proc *td;
+
+    if ((td = this_td()) == NULL) {
+        return -EAGAIN;
+    }
+
+    td->sleep_error = 0;
+    sched_sleep(td, wchan);
+    return sleep_block(td, usec);
+}
+
+/*
+ * Same as tsleep() but atomically releases `mtx' while
+ * asleep so that a wakeup issued with `mtx' held is
+ * never missed. The mutex is held again on return.
+ *
+ * @wchan: Wait channel to sleep on
+ * @mtx: Mutex protecting the condition being waited on
+ * @usec: Max microseconds to sleep (0 for no limit)
+ */
+int
+msleep(const void *wchan, struct mutex *mtx, size_t usec)
+{
+    struct proc *td;
+    int error;
+
+    if ((td = this_td()) == NULL) {
+        mutex_release(mtx);
+        md_pause();
+        mutex_acquire(mtx, 0);
+        return -EAGAIN;
+    }
+
+    td->sleep_error = 0;
+    sched_sleep(td, wchan);
+    mutex_release(mtx);
+
+    error = sleep_block(td, usec);
+    mutex_acquire(mtx, 0);
+    return error;
+}
+
+/*
+ * Same as msleep() but for a condition protected by a
+ * spinlock, for when the wakeup may come from places
+ * that cannot block. The spinlock is held again on
+ * return.
+ *
+ * @wchan: Wait channel to sleep on
+ * @lock: Spinlock protecting the condition being waited on
+ * @usec: Max microseconds to sleep (0 for no limit)
+ */
+int
+msleep_spin(const void *wchan, struct spinlock *lock, size_t usec)
+{
+    struct proc *td;
+    bool masked;
+    int error;
+
+    if ((td = this_td()) == NULL) {
+        spinlock_release(lock);
+        md_pause();
+        spinlock_acquire(lock);
+        return -EAGAIN;
+    }
+
+    /*
+     * We must not be switched out while asleep and still
+     * holding `lock', keep interrupts off until it is
+     * dropped.
+     */
+    if (!(masked = md_intr_masked())) {
+        md_intoff();
+    }
+
+    td->sleep_error = 0;
+    sched_sleep(td, wchan);
+    spinlock_release(lock);
+
+    error = sleep_block(td, usec);
+    spinlock_acquire(lock);
+    if (!masked) {
+        md_inton();
+    }
+
+    return error;
+}
+
+/*
+ * Wake up every thread sleeping on a wait channel
+ *
+ * @wchan: Wait channel to wake up
+ */
+void
+wakeup(const void *wchan)
+{
+    sched_wakeup(wchan, 0);
+}
+
+/*
+ * Wake up a single thread sleeping on a wait
+ * channel
+ *
+ * @wchan: Wait channel to wake up
+ */
+void
+wakeup_one(const void *wchan)
+{
+    sched_wakeup(wchan, 1);
+}
+
 /*
  * Returns 0 on success, returns non-zero value
  * on timeout/failure.
@@ -127,12 +328,11 @@ mutex_new(const char *name)
     struct mutex *mtx;
     size_t namelen;
 
-    mtx = dynalloc(sizeof(*mtx));
+    mtx = kmem_cache_alloc(mutex_cache, KMEM_ZERO);
     if (mtx == NULL) {
         return NULL;
     }
 
-    mtx->lock = 0;
     namelen = strlen(name);
 
     /* Don't overflow the name buffer */
@@ -153,8 +353,31 @@ mutex_new(const char *name)
 int
 mutex_acquire(struct mutex *mtx, int flags)
 {
+    struct proc *td;
+
     while (__atomic_test_and_set(&mtx->lock, __ATOMIC_ACQUIRE)) {
-        sched_yield();
+        /* We can only block if we have a thread */
+        if ((td = this_td()) == NULL) {
+            md_pause();
+            continue;
+        }
+
+        /*
+         * Get on the sleep queue before checking the lock
+         * again so that a release in between cannot slip
+         * by without waking us up.
+         */
+        atomic_inc_int(&mtx->nwaiter);
+        td->sleep_error = 0;
+        sched_sleep(td, mtx);
+
+        if (__atomic_load_n(&mtx->lock, __ATOMIC_SEQ_CST) == 0) {
+            sched_wakeup_td(td);
+        } else {
+            sleep_block(td, 0);
+        }
+
+        atomic_dec_int(&mtx->nwaiter);
     }
 
     return 0;
@@ -163,11 +386,27 @@ mutex_acquire(struct mutex *mtx, int flags)
 void
 mutex_release(struct mutex *mtx)
 {
-    __atomic_clear(&mtx->lock, __ATOMIC_RELEASE);
+    __atomic_clear(&mtx->lock, __ATOMIC_SEQ_CST);
+    if (atomic_load_int(&mtx->nwaiter) > 0) {
+        sched_wakeup(mtx, 1);
+    }
 }
 
 void
 mutex_free(struct mutex *mtx)
 {
-    dynfree(mtx);
+    kmem_cache_free(mutex_cache, mtx);
+}
+
+/*
+ * Set up the object cache of mutexes, must be
+ * done before the first mutex_new().
+ */
+void
+mutex_cache_init(void)
+{
+    mutex_cache = kmem_cache_create("mutex", sizeof(struct mutex), 0);
+    if (mutex_cache == NULL) {
+        panic("failed to create mutex cache\n");
+    }
 }
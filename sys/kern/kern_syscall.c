@@ -71,6 +71,8 @@ scret_t(*g_sctab[])(struct syscall_args *) = {
     sys_connect, /* SYS_connect */
     sys_setsockopt,  /* SYS_setsockopt */
     sys_disk,    /* SYS_disk */
+    sys_clock_gettime, /* SYS_clock_gettime */
+    sys_fork,    /* SYS_fork */
 };
 
 const size_t MAX_SYSCALLS = NELEM(g_sctab);
@@ -35,6 +35,159 @@
 #include <sys/cdefs.h>
 #include <dev/timer.h>
 #include <machine/cdefs.h>
+#include <vm/physmem.h>
+#include <vm/vm.h>
+#include <string.h>
+
+#define NSEC_PER_SECOND 1000000000ULL
+
+static struct timepage *timepage = NULL;
+static paddr_t timepage_pa = 0;
+
+/*
+ * Get the shared time page, allocating it on
+ * first use. Returns NULL if we are out of memory.
+ */
+static struct timepage *
+timepage_get(void)
+{
+    if (timepage != NULL) {
+        return timepage;
+    }
+
+    if ((timepage_pa = vm_alloc_frame(1)) == 0) {
+        return NULL;
+    }
+
+    timepage = PHYS_TO_VIRT(timepage_pa);
+    memset(timepage, 0, DEFAULT_PAGESIZE);
+    return timepage;
+}
+
+/*
+ * Begin and end an update of the time page, readers
+ * retry while the sequence count is odd.
+ */
+static inline void
+timepage_write_begin(struct timepage *tp)
+{
+    ++tp->seq;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void
+timepage_write_end(struct timepage *tp)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    ++tp->seq;
+}
+
+/*
+ * Get the monotonic time in nanoseconds from the
+ * general purpose timer. Returns 0 if there is none.
+ */
+static size_t
+time_mono_nsec(void)
+{
+    struct timer tmr;
+    tmrr_status_t status;
+
+    status = req_timer(TIMER_GP, &tmr);
+    if (status != TMRR_SUCCESS) {
+        return 0;
+    }
+    if (tmr.get_time_nsec != NULL) {
+        return tmr.get_time_nsec();
+    }
+    if (tmr.get_time_usec != NULL) {
+        return tmr.get_time_usec() * 1000;
+    }
+
+    return 0;
+}
+
+/*
+ * Convert a calendar date (UTC) into seconds since
+ * the Unix epoch.
+ *
+ * @dp: Date to convert.
+ */
+time_t
+date_to_time(const struct date *dp)
+{
+    uint64_t year, month, era, yoe, doy, doe, days;
+
+    /* Days from civil date, with March as the first month */
+    year = dp->year - (dp->month <= 2);
+    month = dp->month;
+    era = year / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + dp->day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    days = era * 146097 + doe - 719468;
+
+    return (days * 86400) + (dp->hour * 3600) + (dp->min * 60) + dp->sec;
+}
+
+/*
+ * Publish the TSC scale of the monotonic clock so
+ * that it can be read from userspace.
+ *
+ * @tsc_base: TSC value at `mono_base'
+ * @tsc_mult: Nanoseconds per TSC tick (32.32 fixed point)
+ * @mono_base: Monotonic time in nanoseconds
+ */
+void
+timepage_set_clock(uint64_t tsc_base, uint64_t tsc_mult, uint64_t mono_base)
+{
+    struct timepage *tp;
+
+    if ((tp = timepage_get()) == NULL) {
+        return;
+    }
+
+    timepage_write_begin(tp);
+    tp->tsc_base = tsc_base;
+    tp->tsc_mult = tsc_mult;
+    tp->mono_base = mono_base;
+    tp->flags |= TIMEPAGE_TSC;
+    timepage_write_end(tp);
+}
+
+/*
+ * Set the wall clock time.
+ *
+ * @sec: Current seconds since the Unix epoch.
+ */
+void
+timepage_set_wall(time_t sec)
+{
+    struct timepage *tp;
+    size_t mono;
+
+    if ((tp = timepage_get()) == NULL) {
+        return;
+    }
+
+    mono = time_mono_nsec();
+    timepage_write_begin(tp);
+    tp->wall_base = (sec * NSEC_PER_SECOND) - mono;
+    timepage_write_end(tp);
+}
+
+/*
+ * Returns the physical address of the time
+ * page, or zero if there is none.
+ */
+paddr_t
+timepage_paddr(void)
+{
+    if (timepage_get() == NULL) {
+        return 0;
+    }
+
+    return timepage_pa;
+}
 
 /*
  * arg0: Timespec
@@ -71,3 +224,34 @@ sys_sleep(struct syscall_args *scargs)
     tmr.msleep(timeout_msec);
     return 0;
 }
+
+/*
+ * Slow path of clock_gettime(), used by processes when
+ * the time page cannot be read without the kernel.
+ *
+ * arg0: Clock ID
+ * arg1: Timespec result
+ */
+scret_t
+sys_clock_gettime(struct syscall_args *scargs)
+{
+    struct timespec ts;
+    clockid_t id = scargs->arg0;
+    uint64_t nsec;
+
+    if (id != CLOCK_REALTIME && id != CLOCK_MONOTONIC) {
+        return -EINVAL;
+    }
+
+    if ((nsec = time_mono_nsec()) == 0) {
+        return -ENOTSUP;
+    }
+
+    if (id == CLOCK_REALTIME && timepage != NULL) {
+        nsec += timepage->wall_base;
+    }
+
+    ts.tv_sec = nsec / NSEC_PER_SECOND;
+    ts.tv_nsec = nsec % NSEC_PER_SECOND;
+    return copyout(&ts, (void *)scargs->arg1, sizeof(ts));
+}
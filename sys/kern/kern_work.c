@@ -33,7 +33,9 @@
 #include <sys/proc.h>
 #include <sys/sched.h>
 #include <sys/syslog.h>
+#include <sys/systm.h>
 #include <sys/workqueue.h>
+#include <sys/callout.h>
 #include <vm/dynalloc.h>
 #include <string.h>
 
@@ -49,6 +51,40 @@ extern struct proc g_proc0;
  */
 #define WQ_COOKIE 0xFC0B
 
+/*
+ * Move delayed work that has become due over to
+ * the work queue.
+ *
+ * @wqp: Workqueue to check
+ *
+ * Returns the number of microseconds until the next
+ * delayed work is due, zero if there is none left.
+ *
+ * XXX: `wqp->lock' must be held by the caller
+ */
+static size_t
+workqueue_ripen(struct workqueue *wqp)
+{
+    struct work *wp;
+    size_t now;
+
+    if (TAILQ_EMPTY(&wqp->delayed)) {
+        return 0;
+    }
+
+    now = callout_time_usec();
+    while ((wp = TAILQ_FIRST(&wqp->delayed)) != NULL) {
+        if (wp->deadline > now) {
+            return wp->deadline - now;
+        }
+
+        TAILQ_REMOVE(&wqp->delayed, wp, link);
+        TAILQ_INSERT_TAIL(&wqp->work, wp, link);
+    }
+
+    return 0;
+}
+
 /*
  * A worker services work in the queue
  * and there is one per workqueue.
@@ -59,6 +95,7 @@ workqueue_worker(void)
     struct proc *td;
     struct workqueue *wqp;
     struct work *wp;
+    size_t usec;
 
     td = this_td();
     if ((wqp = td->data) == NULL) {
@@ -75,13 +112,18 @@ workqueue_worker(void)
 
     for (;;) {
         mutex_acquire(wqp->lock, 0);
-        wp = TAILQ_FIRST(&wqp->work);
 
-        /* Try again later if empty */
-        if (wp == NULL) {
-            mutex_release(wqp->lock);
-            sched_yield();
-            continue;
+        /*
+         * Sleep until there is work to be done, waking up
+         * in time for the next delayed work if there is any.
+         */
+        for (;;) {
+            usec = workqueue_ripen(wqp);
+            if ((wp = TAILQ_FIRST(&wqp->work)) != NULL) {
+                break;
+            }
+
+            msleep(wqp, wqp->lock, usec);
         }
 
         wp->func(wqp, wp);
@@ -98,7 +140,6 @@ workqueue_worker(void)
         }
 
         mutex_release(wqp->lock);
-        sched_yield();
     }
 }
 
@@ -132,6 +173,7 @@ workqueue_new(const char *name, size_t max_work, int ipl)
 
     wqp->name = strdup(name);
     TAILQ_INIT(&wqp->work);
+    TAILQ_INIT(&wqp->delayed);
     wqp->ipl = ipl;
     wqp->max_work = max_work;
     wqp->nwork = 0;
@@ -198,6 +240,73 @@ workqueue_enq(struct workqueue *wqp, const char *name, struct work *wp)
 
     TAILQ_INSERT_TAIL(&wqp->work, wp, link);
     ++wqp->nwork;
+    wakeup_one(wqp);
+    mutex_release(wqp->lock);
+    return 0;
+}
+
+/*
+ * Enqueue a work item onto a specific workqueue
+ * to be done after a delay.
+ *
+ * @wqp: Pointer to specific workqueue
+ * @name: Name to set for work unit
+ * @wp: Pointer to work that should be enqueued
+ * @usec: Microseconds to wait before doing the work
+ *
+ * Returns zero on success, otherwise a less than
+ * zero value is returned.
+ */
+int
+workqueue_enq_delayed(struct workqueue *wqp, const char *name,
+    struct work *wp, size_t usec)
+{
+    struct work *tmp, *prev = NULL;
+
+    if (wqp == NULL || wp == NULL) {
+        return -EINVAL;
+    }
+
+    if (name == NULL) {
+        return -EINVAL;
+    }
+
+    if (usec == 0) {
+        return workqueue_enq(wqp, name, wp);
+    }
+
+    /* Verify that we have a valid workqueue */
+    if (__unlikely(wqp->cookie != WQ_COOKIE)) {
+        panic("workq: bad cookie on work enqueue\n");
+    }
+
+    wp->name = strdup(name);
+    mutex_acquire(wqp->lock, 0);
+
+    if (wqp->nwork >= wqp->max_work) {
+        pr_error("max jobs reached for '%s'\n", wqp->name);
+        mutex_release(wqp->lock);
+        return -EAGAIN;
+    }
+
+    /* Keep the soonest deadline at the head */
+    wp->deadline = callout_time_usec() + usec;
+    TAILQ_FOREACH(tmp, &wqp->delayed, link) {
+        if (tmp->deadline > wp->deadline) {
+            break;
+        }
+        prev = tmp;
+    }
+
+    if (prev != NULL) {
+        TAILQ_INSERT_AFTER(&wqp->delayed, prev, wp, link);
+    } else {
+        TAILQ_INSERT_HEAD(&wqp->delayed, wp, link);
+    }
+
+    /* Let the worker pick up the new deadline */
+    ++wqp->nwork;
+    wakeup_one(wqp);
     mutex_release(wqp->lock);
     return 0;
 }
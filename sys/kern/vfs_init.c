@@ -48,6 +48,7 @@ vfs_init(void)
     const struct vfsops *vfsops;
 
     TAILQ_INIT(&g_mountlist);
+    vfs_vnode_init();
 
     for (size_t i= 0; i < NELEM(fs_list); ++i) {
         fs = &fs_list[i];
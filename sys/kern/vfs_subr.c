@@ -31,10 +31,14 @@
 #include <sys/errno.h>
 #include <sys/mount.h>
 #include <sys/syslog.h>
+#include <sys/panic.h>
 #include <vm/dynalloc.h>
+#include <vm/kmem.h>
+#include <vm/vm_vnode.h>
 #include <string.h>
 
 mountlist_t g_mountlist;
+static struct kmem_cache *vnode_cache;
 
 int
 vfs_alloc_vnode(struct vnode **res, int type)
@@ -46,7 +50,7 @@ vfs_alloc_vnode(struct vnode **res, int type)
      * to allocate a new one.
      */
     if (vp == NULL)
-        vp = dynalloc(sizeof(struct vnode));
+        vp = kmem_cache_alloc(vnode_cache, 0);
     if (vp == NULL)
         return -ENOMEM;
 
@@ -57,6 +61,28 @@ vfs_alloc_vnode(struct vnode **res, int type)
     return 0;
 }
 
+/*
+ * Free a vnode that is no longer referenced
+ * or cached anywhere.
+ */
+void
+vfs_free_vnode(struct vnode *vp)
+{
+    kmem_cache_free(vnode_cache, vp);
+}
+
+/*
+ * Set up the object cache of vnodes.
+ */
+void
+vfs_vnode_init(void)
+{
+    vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 0);
+    if (vnode_cache == NULL) {
+        panic("failed to create vnode cache\n");
+    }
+}
+
 /*
  * Allocate a mount structure.
  *
@@ -131,6 +157,10 @@ vfs_release_vnode(struct vnode *vp)
     if (atomic_dec_int(&vp->refcount) > 0)
         return 0;
 
+    /* Drop any cached file pages */
+    if (vp->type == VREG)
+        vn_detach(vp);
+
     if (vops->reclaim != NULL)
         status = vops->reclaim(vp);
     if (status != 0)
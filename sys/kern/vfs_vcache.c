@@ -113,7 +113,7 @@ vcache_add(struct vnode *vp, struct vcache *vcp)
         /* Evict the tail */
         tmp = TAILQ_LAST(&vcp->q, vcache_head);
         TAILQ_REMOVE(&vcp->q, tmp, vcache_link);
-        dynfree(tmp);
+        vfs_free_vnode(tmp);
         --vcp->size;
     }
 
@@ -41,73 +41,50 @@
 #define pr_trace(fmt, ...) kprintf("vm_anon: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
 
-#define ANON_TIMEOUT_USEC 200000
-
 /*
- * Get pages from physical memory.
+ * Get pages from physical memory, pages that were
+ * never touched are allocated and zeroed here.
  *
  * @obp: Object representing the backing store (in memory).
- * @pgs: Page descriptors to be filled.
- * @off: Offset to read from in backing store.
- * @len: Length to read in bytes.
+ * @pgs: Filled with the pages of the range.
+ * @off: Byte offset into the object.
+ * @len: Length of the range in bytes.
  */
 static int
 anon_get(struct vm_object *obp, struct vm_page **pgs, off_t off, size_t len)
 {
-    struct vm_page *pgtmp, *pgres;
-    int retval = 0;
-    size_t j, npgs;
+    struct vm_page *pg;
+    size_t npgs;
 
-    len = ALIGN_DOWN(len, DEFAULT_PAGESIZE);
     if (obp == NULL || pgs == NULL) {
         return -EINVAL;
     }
 
     /* Zero bytes is invalid */
     if (len == 0) {
-        len = 4096;
+        len = DEFAULT_PAGESIZE;
     }
 
+    off = ALIGN_DOWN(off, DEFAULT_PAGESIZE);
+    npgs = ALIGN_UP(len, DEFAULT_PAGESIZE) / DEFAULT_PAGESIZE;
     spinlock_acquire(&obp->lock);
-    npgs = len >> 12;
-
-    for (int i = 0; i < npgs; ++i) {
-        j = i / DEFAULT_PAGESIZE;
-        pgtmp = vm_pagelookup(obp, i);
-        pgres = pgs[j];
-
-        /* Do we need to create our own entry? */
-        if (pgtmp == NULL) {
-            pgtmp = vm_pagealloc(obp, PALLOC_ZERO);
-        }
 
-        if (pgtmp == NULL) {
-            pr_trace("anon_get: failed to add page %d, marking invalid\n", j);
-            pgres->flags &= ~PG_VALID;
-            continue;
+    for (size_t i = 0; i < npgs; ++i, off += DEFAULT_PAGESIZE) {
+        if ((pg = vm_pagelookup(obp, off)) == NULL) {
+            pg = vm_pagealloc(obp, off, PALLOC_ZERO);
         }
 
-        *pgres = *pgtmp;
-
-        /*
-         * We are *just* populating `pgs' and therefore nobody
-         * should even attempt to acquire this lock... Shit
-         * happens though, so just make sure we can grab it
-         * without assuming success.
-         */
-        if (spinlock_usleep(&pgres->lock, ANON_TIMEOUT_USEC) < 0) {
-            vm_pagefree(obp, pgtmp, 0);
-            pr_error("anon_get: pgres spin timeout\n");
-            return -ETIMEDOUT;
+        if (pg == NULL) {
+            pr_error("anon_get: failed to allocate page at %p\n", off);
+            spinlock_release(&obp->lock);
+            return -ENOMEM;
         }
 
-        pgres->flags |= (PG_VALID | PG_CLEAN);
-        spinlock_release(&pgres->lock);
-
+        pgs[i] = pg;
     }
 
     spinlock_release(&obp->lock);
-    return retval;
+    return 0;
 }
 
 const struct vm_pagerops vm_anonops = {
@@ -27,24 +27,253 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/*
+ * Every processor allocates from its own TLSF arena so that
+ * dynalloc() does not serialize on one global lock. Blocks
+ * freed by a processor other than the owner are pushed onto
+ * the owner's lock-free remote list, the owner gives them
+ * back to TLSF the next time it takes its arena lock.
+ *
+ * Arena 0 is set up at boot and is used until per-CPU data
+ * exists, other arenas are set up on first use.
+ */
+
+#include <sys/param.h>
+#include <sys/atomic.h>
+#include <sys/errno.h>
+#include <sys/panic.h>
+#include <machine/cpu.h>
 #include <vm/dynalloc.h>
+#include <vm/physmem.h>
+#include <vm/kmem.h>
 #include <vm/vm.h>
+#include <string.h>
+
+#define BOOT_ARENA_SZ   0x400000    /* 4 MiB */
+#define CPU_ARENA_SZ    0x100000    /* 1 MiB */
+
+/*
+ * Lowest and highest addresses covered by any
+ * arena, used to quickly tell slab objects apart.
+ * Processors set up their arenas concurrently so
+ * these and `narena' are only widened under
+ * `arena_bounds_lock'.
+ */
+static uintptr_t arena_lo = (uintptr_t)-1;
+static uintptr_t arena_hi = 0;
+static struct spinlock arena_bounds_lock = {0};
+
+static inline tlsf_t
+arena_tlsf(struct dynalloc_arena *ap)
+{
+    return __atomic_load_n(&ap->tlsf_ctx, __ATOMIC_ACQUIRE);
+}
+
+static inline bool
+arena_owns(struct dynalloc_arena *ap, uintptr_t addr)
+{
+    uintptr_t base;
+
+    if (arena_tlsf(ap) == NULL) {
+        return false;
+    }
+
+    base = (uintptr_t)PHYS_TO_VIRT(ap->pool_pa);
+    return addr >= base && addr < base + ap->pool_sz;
+}
+
+/*
+ * Acquire the lock of an arena, counting
+ * the times we had to wait for it. This always
+ * goes through spinlock_acquire() so that
+ * preemption is turned off with the lock held.
+ */
+static void
+arena_lock(struct dynalloc_arena *ap)
+{
+    if (__atomic_load_n(&ap->lock.lock, __ATOMIC_RELAXED) != 0) {
+        atomic_inc_64(&ap->lock_waits);
+    }
+
+    spinlock_acquire(&ap->lock);
+}
+
+/*
+ * Give blocks freed by other processors
+ * back to TLSF.
+ *
+ * XXX: Arena lock must be held.
+ */
+static void
+arena_drain(struct dynalloc_arena *ap)
+{
+    void *blk, *next;
+
+    blk = __atomic_exchange_n(&ap->remote, NULL, __ATOMIC_ACQUIRE);
+    while (blk != NULL) {
+        next = *(void **)blk;
+        ap->bytes_used -= tlsf_block_size(blk);
+        tlsf_free(ap->tlsf_ctx, blk);
+        blk = next;
+    }
+}
 
 /*
- * Dynamically allocates memory
+ * Set up the TLSF pool of an arena.
+ *
+ * @ap: Arena to set up.
+ * @size: Size of the pool in bytes.
+ */
+static int
+arena_init(struct dynalloc_arena *ap, size_t size)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+    uintptr_t base;
+    size_t idx;
+    tlsf_t tlsf;
+
+    spinlock_acquire(&ap->lock);
+    if (ap->tlsf_ctx != NULL) {
+        spinlock_release(&ap->lock);
+        return 0;
+    }
+
+    ap->pool_pa = vm_alloc_frame(size / DEFAULT_PAGESIZE);
+    if (ap->pool_pa == 0) {
+        spinlock_release(&ap->lock);
+        return -ENOMEM;
+    }
+
+    ap->pool_sz = size;
+    base = (uintptr_t)PHYS_TO_VIRT(ap->pool_pa);
+    tlsf = tlsf_create_with_pool((void *)base, size);
+
+    /* Widen the range of arena addresses */
+    spinlock_acquire(&arena_bounds_lock);
+    if (base < arena_lo) {
+        arena_lo = base;
+    }
+    if (base + size > arena_hi) {
+        arena_hi = base + size;
+    }
+
+    idx = ap - &vm_ctx->arena[0];
+    if (idx >= vm_ctx->narena) {
+        vm_ctx->narena = idx + 1;
+    }
+    spinlock_release(&arena_bounds_lock);
+
+    __atomic_store_n(&ap->tlsf_ctx, tlsf, __ATOMIC_RELEASE);
+    spinlock_release(&ap->lock);
+    return 0;
+}
+
+/*
+ * Returns the arena of the current processor,
+ * setting it up if needed.
+ */
+static struct dynalloc_arena *
+arena_self(void)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+    struct dynalloc_arena *ap;
+    struct cpu_info *ci;
+
+    if ((ci = this_cpu()) == NULL) {
+        return &vm_ctx->arena[0];
+    }
+
+    ap = &vm_ctx->arena[ci->id];
+    if (arena_tlsf(ap) == NULL) {
+        if (arena_init(ap, CPU_ARENA_SZ) < 0) {
+            return &vm_ctx->arena[0];
+        }
+    }
+
+    return ap;
+}
+
+/*
+ * Returns the arena that `ptr' was allocated
+ * from or NULL if it came from a slab cache.
+ *
+ * @self: Arena of the current processor.
+ */
+static struct dynalloc_arena *
+arena_of(struct dynalloc_arena *self, const void *ptr)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+    uintptr_t addr = (uintptr_t)ptr;
+    struct dynalloc_arena *ap;
+
+    if (arena_owns(self, addr)) {
+        return self;
+    }
+    if (addr < arena_lo || addr >= arena_hi) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < vm_ctx->narena; ++i) {
+        ap = &vm_ctx->arena[i];
+        if (arena_owns(ap, addr)) {
+            return ap;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate from the current arena, falling back
+ * to the other arenas if it is exhausted.
+ */
+static void *
+arena_alloc(size_t sz, size_t align)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+    struct dynalloc_arena *self, *ap;
+    void *tmp = NULL;
+
+    self = arena_self();
+    for (size_t i = 0; tmp == NULL && i <= vm_ctx->narena; ++i) {
+        ap = (i == 0) ? self : &vm_ctx->arena[i - 1];
+        if ((i > 0 && ap == self) || arena_tlsf(ap) == NULL) {
+            continue;
+        }
+
+        arena_lock(ap);
+        arena_drain(ap);
+        if (align == 0) {
+            tmp = tlsf_malloc(ap->tlsf_ctx, sz);
+        } else {
+            tmp = tlsf_memalign(ap->tlsf_ctx, align, sz);
+        }
+        if (tmp != NULL) {
+            ap->bytes_used += tlsf_block_size(tmp);
+        }
+        spinlock_release(&ap->lock);
+    }
+
+    return tmp;
+}
+
+/*
+ * Dynamically allocates memory, small sizes are
+ * served from the slab caches and everything else
+ * from the TLSF arenas.
  *
  * @sz: The amount of bytes to allocate
  */
 void *
 dynalloc(size_t sz)
 {
-    struct vm_ctx *vm_ctx = vm_get_ctx();
     void *tmp;
 
-    spinlock_acquire(&vm_ctx->dynalloc_lock);
-    tmp = tlsf_malloc(vm_ctx->tlsf_ctx, sz);
-    spinlock_release(&vm_ctx->dynalloc_lock);
-    return tmp;
+    if (sz <= KMEM_MAX_SIZE && (tmp = kmem_alloc(sz)) != NULL) {
+        return tmp;
+    }
+
+    return arena_alloc(sz, 0);
 }
 
 /*
@@ -56,13 +285,7 @@ dynalloc(size_t sz)
 void *
 dynalloc_memalign(size_t sz, size_t align)
 {
-    struct vm_ctx *vm_ctx = vm_get_ctx();
-    void *tmp;
-
-    spinlock_acquire(&vm_ctx->dynalloc_lock);
-    tmp = tlsf_memalign(vm_ctx->tlsf_ctx, align, sz);
-    spinlock_release(&vm_ctx->dynalloc_lock);
-    return tmp;
+    return arena_alloc(sz, MAX(align, 1));
 }
 
 /*
@@ -74,12 +297,42 @@ dynalloc_memalign(size_t sz, size_t align)
 void *
 dynrealloc(void *old_ptr, size_t newsize)
 {
-    struct vm_ctx *vm_ctx = vm_get_ctx();
+    struct dynalloc_arena *ap;
+    size_t oldsize;
     void *tmp;
 
-    spinlock_acquire(&vm_ctx->dynalloc_lock);
-    tmp = tlsf_realloc(vm_ctx->tlsf_ctx, old_ptr, newsize);
-    spinlock_release(&vm_ctx->dynalloc_lock);
+    if (old_ptr == NULL) {
+        return dynalloc(newsize);
+    }
+    if (newsize == 0) {
+        dynfree(old_ptr);
+        return NULL;
+    }
+
+    ap = arena_of(arena_self(), old_ptr);
+    if (ap == NULL) {
+        oldsize = kmem_size(old_ptr);
+    } else {
+        /* Try to resize in place within the owning arena */
+        arena_lock(ap);
+        oldsize = tlsf_block_size(old_ptr);
+        tmp = tlsf_realloc(ap->tlsf_ctx, old_ptr, newsize);
+        if (tmp != NULL) {
+            ap->bytes_used += tlsf_block_size(tmp);
+            ap->bytes_used -= oldsize;
+        }
+        spinlock_release(&ap->lock);
+        if (tmp != NULL) {
+            return tmp;
+        }
+    }
+
+    if ((tmp = dynalloc(newsize)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(tmp, old_ptr, MIN(oldsize, newsize));
+    dynfree(old_ptr);
     return tmp;
 }
 
@@ -90,10 +343,110 @@ dynrealloc(void *old_ptr, size_t newsize)
  */
 void
 dynfree(void *ptr)
+{
+    struct dynalloc_arena *self, *ap;
+    void *head;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    self = arena_self();
+    if ((ap = arena_of(self, ptr)) == NULL) {
+        kmem_free(ptr);
+        return;
+    }
+
+    if (ap == self) {
+        arena_lock(ap);
+        arena_drain(ap);
+        ap->bytes_used -= tlsf_block_size(ptr);
+        tlsf_free(ap->tlsf_ctx, ptr);
+        spinlock_release(&ap->lock);
+        return;
+    }
+
+    /* Not ours, let the owner free it */
+    head = __atomic_load_n(&ap->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&ap->remote, &head, ptr, true,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    atomic_inc_64(&ap->nremote);
+}
+
+static void
+arena_walk(void *ptr, size_t size, int used, void *user)
+{
+    struct vm_arena_stat *res = user;
+
+    if (used) {
+        return;
+    }
+
+    res->bytes_free += size;
+    if (size > res->largest_free) {
+        res->largest_free = size;
+    }
+}
+
+/*
+ * Returns the number of arenas that may
+ * have been set up.
+ */
+size_t
+dynalloc_narena(void)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+
+    return vm_ctx->narena;
+}
+
+/*
+ * Get statistics for a dynalloc arena.
+ *
+ * @idx: Index of the arena (CPU ID)
+ * @res: Statistics are written here.
+ */
+int
+dynalloc_stat(size_t idx, struct vm_arena_stat *res)
+{
+    struct vm_ctx *vm_ctx = vm_get_ctx();
+    struct dynalloc_arena *ap;
+
+    if (res == NULL || idx >= CPU_MAX) {
+        return -EINVAL;
+    }
+
+    memset(res, 0, sizeof(*res));
+    ap = &vm_ctx->arena[idx];
+    if (arena_tlsf(ap) == NULL) {
+        return 0;
+    }
+
+    arena_lock(ap);
+    arena_drain(ap);
+    tlsf_walk_pool(tlsf_get_pool(ap->tlsf_ctx), arena_walk, res);
+    res->pool_size = ap->pool_sz;
+    res->bytes_used = ap->bytes_used;
+    spinlock_release(&ap->lock);
+
+    res->lock_waits = __atomic_load_n(&ap->lock_waits, __ATOMIC_RELAXED);
+    res->remote_frees = __atomic_load_n(&ap->nremote, __ATOMIC_RELAXED);
+    if (res->bytes_free > 0) {
+        res->frag = 100 - ((res->largest_free * 100) / res->bytes_free);
+    }
+
+    return 0;
+}
+
+void
+dynalloc_init(void)
 {
     struct vm_ctx *vm_ctx = vm_get_ctx();
 
-    spinlock_acquire(&vm_ctx->dynalloc_lock);
-    tlsf_free(vm_ctx->tlsf_ctx, ptr);
-    spinlock_release(&vm_ctx->dynalloc_lock);
+    if (arena_init(&vm_ctx->arena[0], BOOT_ARENA_SZ) < 0) {
+        panic("failed to allocate dynamic pool\n");
+    }
 }
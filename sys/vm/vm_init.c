@@ -28,14 +28,13 @@
  */
 
 #include <sys/limine.h>
-#include <sys/panic.h>
 #include <vm/vm.h>
 #include <vm/physmem.h>
 #include <vm/pmap.h>
-#include <assert.h>
-
-#define DYNALLOC_POOL_SZ        0x400000  /* 4 MiB */
-#define DYNALLOC_POOL_PAGES     (DYNALLOC_POOL_SZ / DEFAULT_PAGESIZE)
+#include <vm/kmem.h>
+#include <vm/dynalloc.h>
+#include <vm/vm_page.h>
+#include <vm/map.h>
 
 struct vas g_kvas;
 static struct vm_ctx vm_ctx;
@@ -53,19 +52,12 @@ vm_get_ctx(void)
 void
 vm_init(void)
 {
-    void *pool;
-
     vm_physmem_init();
     pmap_init();
 
     g_kvas = pmap_read_vas();
-    vm_ctx.dynalloc_pool_sz = DYNALLOC_POOL_SZ;
-    vm_ctx.dynalloc_pool_pa = vm_alloc_frame(DYNALLOC_POOL_PAGES);
-    if (vm_ctx.dynalloc_pool_pa == 0) {
-        panic("failed to allocate dynamic pool\n");
-    }
-
-    pool = PHYS_TO_VIRT(vm_ctx.dynalloc_pool_pa);
-    vm_ctx.tlsf_ctx = tlsf_create_with_pool(pool, DYNALLOC_POOL_SZ);
-    __assert(vm_ctx.tlsf_ctx != 0);
+    dynalloc_init();
+    kmem_init();
+    vm_page_init();
+    vm_map_init();
 }
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Slab object caches - objects of one size are carved out
+ * of single page slabs, and each processor keeps a small
+ * magazine of free objects so that the common case never
+ * takes a lock. Objects of up to KMEM_MAX_SIZE bytes that
+ * are allocated through dynalloc() are served by a set of
+ * generic size class caches, anything larger goes to TLSF.
+ *
+ * Every slab is exactly one page with its header at the
+ * start, so the slab (and cache) of any object is found
+ * by rounding its address down to the page boundary.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/limits.h>
+#include <sys/spinlock.h>
+#include <sys/panic.h>
+#include <machine/cpu.h>
+#include <machine/cdefs.h>
+#include <vm/physmem.h>
+#include <vm/kmem.h>
+#include <vm/vm.h>
+#include <string.h>
+
+/* Per-CPU magazine size, refills and flushes move half */
+#define KMEM_MAG_SIZE   16
+#define KMEM_MAG_BATCH  (KMEM_MAG_SIZE / 2)
+
+/* Minimum object alignment */
+#define KMEM_MIN_ALIGN  16
+
+struct kmem_slab {
+    TAILQ_ENTRY(kmem_slab) link;
+    struct kmem_cache *cache;
+    void *freelist;             /* Free objects in this slab */
+    size_t ninuse;              /* Objects handed out */
+};
+
+/*
+ * Free objects cached by a processor, only
+ * touched by that processor with interrupts
+ * masked.
+ */
+struct kmem_mag {
+    size_t count;
+    void *objs[KMEM_MAG_SIZE];
+};
+
+/*
+ * An object cache
+ *
+ * @name: Name for diagnostics
+ * @size: Object size, rounded up to the alignment
+ * @offset: Offset of the first object in a slab
+ * @nobjs: Number of objects per slab
+ * @lock: Protects the slab lists
+ * @partial: Slabs with some free objects
+ * @full: Slabs with no free objects
+ * @empty: One cached slab with every object free
+ * @nslabs: Number of slabs owned by this cache
+ * @mag: Per-CPU magazines
+ */
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    size_t offset;
+    size_t nobjs;
+    struct spinlock lock;
+    TAILQ_HEAD(, kmem_slab) partial;
+    TAILQ_HEAD(, kmem_slab) full;
+    struct kmem_slab *empty;
+    size_t nslabs;
+    struct kmem_mag mag[CPU_MAX];
+};
+
+/* Generic size classes used by kmem_alloc() */
+static const size_t kmem_sizes[] = {
+    16, 32, 64, 96, 128, 192, 256, 384, 512
+};
+
+static struct kmem_cache *kmem_classes[NELEM(kmem_sizes)];
+static bool kmem_ready = false;
+
+static inline struct kmem_slab *
+kmem_slab_of(const void *obj)
+{
+    return (void *)ALIGN_DOWN((uintptr_t)obj, DEFAULT_PAGESIZE);
+}
+
+/*
+ * Create a new slab for a cache with every
+ * object on its free list.
+ */
+static struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kcp)
+{
+    struct kmem_slab *slab;
+    uintptr_t pa;
+    char *obj;
+
+    pa = vm_alloc_frame_flags(1, 0);
+    if (pa == 0) {
+        return NULL;
+    }
+
+    slab = PHYS_TO_VIRT(pa);
+    slab->cache = kcp;
+    slab->freelist = NULL;
+    slab->ninuse = 0;
+
+    /* Thread the free list through the objects */
+    for (size_t i = kcp->nobjs; i > 0; --i) {
+        obj = (char *)slab + kcp->offset + ((i - 1) * kcp->size);
+        *(void **)obj = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    return slab;
+}
+
+/*
+ * Take an object from the slab layer.
+ *
+ * XXX: Cache lock must be held.
+ */
+static void *
+kmem_slab_alloc(struct kmem_cache *kcp)
+{
+    struct kmem_slab *slab;
+    void *obj;
+
+    if ((slab = TAILQ_FIRST(&kcp->partial)) == NULL) {
+        if ((slab = kcp->empty) == NULL) {
+            /* Don't hold the lock over the page allocator */
+            spinlock_release(&kcp->lock);
+            slab = kmem_slab_create(kcp);
+            spinlock_acquire(&kcp->lock);
+            if (slab == NULL) {
+                return NULL;
+            }
+
+            ++kcp->nslabs;
+        } else {
+            kcp->empty = NULL;
+        }
+
+        TAILQ_INSERT_HEAD(&kcp->partial, slab, link);
+    }
+
+    obj = slab->freelist;
+    slab->freelist = *(void **)obj;
+    if (++slab->ninuse == kcp->nobjs) {
+        TAILQ_REMOVE(&kcp->partial, slab, link);
+        TAILQ_INSERT_HEAD(&kcp->full, slab, link);
+    }
+
+    return obj;
+}
+
+/*
+ * Give an object back to its slab. Empty slabs beyond
+ * the one we keep around go back to the page allocator.
+ *
+ * XXX: Cache lock must be held.
+ */
+static void
+kmem_slab_free(struct kmem_cache *kcp, void *obj)
+{
+    struct kmem_slab *slab = kmem_slab_of(obj);
+    uintptr_t pa;
+
+    if (slab->ninuse-- == kcp->nobjs) {
+        TAILQ_REMOVE(&kcp->full, slab, link);
+        TAILQ_INSERT_HEAD(&kcp->partial, slab, link);
+    }
+
+    *(void **)obj = slab->freelist;
+    slab->freelist = obj;
+    if (slab->ninuse > 0) {
+        return;
+    }
+
+    TAILQ_REMOVE(&kcp->partial, slab, link);
+    if (kcp->empty == NULL) {
+        kcp->empty = slab;
+        return;
+    }
+
+    --kcp->nslabs;
+    pa = VIRT_TO_PHYS(slab);
+    vm_free_frame(pa, 1);
+}
+
+/*
+ * Get the magazine of the current processor for a
+ * cache and mask interrupts so that we stay on it.
+ * Returns NULL if per-CPU data is not up yet.
+ *
+ * @masked: Set to whether interrupts were masked.
+ */
+static struct kmem_mag *
+kmem_mag_get(struct kmem_cache *kcp, bool *masked)
+{
+    struct cpu_info *ci;
+
+    *masked = md_intr_masked();
+    md_intoff();
+    if ((ci = this_cpu()) == NULL) {
+        if (!*masked) {
+            md_inton();
+        }
+        return NULL;
+    }
+
+    return &kcp->mag[ci->id];
+}
+
+static inline void
+kmem_mag_put(bool masked)
+{
+    if (!masked) {
+        md_inton();
+    }
+}
+
+/*
+ * Create an object cache.
+ *
+ * @name: Name of the cache.
+ * @size: Size of each object, at most KMEM_MAX_SIZE.
+ * @align: Object alignment, zero for the default.
+ *
+ * Returns NULL on failure.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align)
+{
+    struct kmem_cache *kcp;
+    size_t npages;
+
+    align = MAX(align, KMEM_MIN_ALIGN);
+    size = ALIGN_UP(MAX(size, sizeof(void *)), align);
+    if (size > KMEM_MAX_SIZE || align > DEFAULT_PAGESIZE) {
+        return NULL;
+    }
+
+    /* The magazines make this too large for dynalloc() */
+    npages = ALIGN_UP(sizeof(*kcp), DEFAULT_PAGESIZE) / DEFAULT_PAGESIZE;
+    kcp = PHYS_TO_VIRT(vm_alloc_frame(npages));
+
+    kcp->name = name;
+    kcp->size = size;
+    kcp->offset = ALIGN_UP(sizeof(struct kmem_slab), align);
+    kcp->nobjs = (DEFAULT_PAGESIZE - kcp->offset) / size;
+    TAILQ_INIT(&kcp->partial);
+    TAILQ_INIT(&kcp->full);
+    return kcp;
+}
+
+/*
+ * Allocate an object from a cache.
+ *
+ * @kcp: Cache to allocate from.
+ * @flags: Allocation flags (KMEM_*)
+ *
+ * Returns NULL if we are out of memory.
+ */
+void *
+kmem_cache_alloc(struct kmem_cache *kcp, int flags)
+{
+    struct kmem_mag *mag;
+    void *obj = NULL;
+    bool masked;
+
+    if ((mag = kmem_mag_get(kcp, &masked)) == NULL) {
+        spinlock_acquire(&kcp->lock);
+        obj = kmem_slab_alloc(kcp);
+        spinlock_release(&kcp->lock);
+        goto done;
+    }
+
+    /* Refill in a batch if the magazine is empty */
+    if (mag->count == 0) {
+        spinlock_acquire(&kcp->lock);
+        while (mag->count < KMEM_MAG_BATCH) {
+            if ((obj = kmem_slab_alloc(kcp)) == NULL) {
+                break;
+            }
+            mag->objs[mag->count++] = obj;
+        }
+        spinlock_release(&kcp->lock);
+    }
+
+    obj = (mag->count > 0) ? mag->objs[--mag->count] : NULL;
+    kmem_mag_put(masked);
+done:
+    if (obj != NULL && ISSET(flags, KMEM_ZERO)) {
+        memset(obj, 0, kcp->size);
+    }
+
+    return obj;
+}
+
+/*
+ * Free an object back to its cache.
+ *
+ * @kcp: Cache the object came from.
+ * @obj: Object to free.
+ */
+void
+kmem_cache_free(struct kmem_cache *kcp, void *obj)
+{
+    struct kmem_mag *mag;
+    bool masked;
+
+    if (obj == NULL) {
+        return;
+    }
+
+    if ((mag = kmem_mag_get(kcp, &masked)) == NULL) {
+        spinlock_acquire(&kcp->lock);
+        kmem_slab_free(kcp, obj);
+        spinlock_release(&kcp->lock);
+        return;
+    }
+
+    /* Flush half of the magazine if it is full */
+    if (mag->count >= KMEM_MAG_SIZE) {
+        spinlock_acquire(&kcp->lock);
+        while (mag->count > KMEM_MAG_BATCH) {
+            kmem_slab_free(kcp, mag->objs[--mag->count]);
+        }
+        spinlock_release(&kcp->lock);
+    }
+
+    mag->objs[mag->count++] = obj;
+    kmem_mag_put(masked);
+}
+
+/*
+ * Allocate memory from the generic size class caches.
+ * Returns NULL if `sz' is too large for any of them.
+ *
+ * @sz: Number of bytes to allocate.
+ */
+void *
+kmem_alloc(size_t sz)
+{
+    if (!kmem_ready) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < NELEM(kmem_sizes); ++i) {
+        if (sz <= kmem_sizes[i]) {
+            return kmem_cache_alloc(kmem_classes[i], 0);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Free memory from any slab cache.
+ *
+ * @ptr: Object to free.
+ */
+void
+kmem_free(void *ptr)
+{
+    struct kmem_slab *slab;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    slab = kmem_slab_of(ptr);
+    kmem_cache_free(slab->cache, ptr);
+}
+
+/*
+ * Returns the usable size of a slab object.
+ */
+size_t
+kmem_size(const void *ptr)
+{
+    struct kmem_slab *slab = kmem_slab_of(ptr);
+
+    return slab->cache->size;
+}
+
+void
+kmem_init(void)
+{
+    struct kmem_cache *kcp;
+
+    for (size_t i = 0; i < NELEM(kmem_sizes); ++i) {
+        kcp = kmem_cache_create("kmem", kmem_sizes[i], 0);
+        if (kcp == NULL) {
+            panic("failed to create kmem size class %d\n", (int)kmem_sizes[i]);
+        }
+
+        kmem_classes[i] = kcp;
+    }
+
+    kmem_ready = true;
+}
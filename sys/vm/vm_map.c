@@ -34,21 +34,30 @@
 #include <sys/systm.h>
 #include <sys/syscall.h>
 #include <sys/syslog.h>
+#include <sys/panic.h>
 #include <sys/mman.h>
 #include <sys/filedesc.h>
+#include <sys/fcntl.h>
+#include <sys/time.h>
 #include <vm/dynalloc.h>
+#include <vm/kmem.h>
+#include <vm/physmem.h>
 #include <vm/vm_pager.h>
 #include <vm/vm_device.h>
+#include <vm/vm_vnode.h>
 #include <vm/pmap.h>
 #include <vm/map.h>
 #include <vm/vm.h>
 #include <assert.h>
+#include <string.h>
 
 #define pr_trace(fmt, ...) kprintf("vm_map: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
 
 RBT_GENERATE(lgdr_entries, mmap_entry, hd, mmap_entrycmp);
 
+static struct kmem_cache *mmap_entry_cache;
+
 static inline void
 mmap_dbg(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 {
@@ -92,12 +101,612 @@ mmap_remove(struct proc *td, struct mmap_entry *ep)
 
     RBT_REMOVE(lgdr_entries, &lp->hd, ep);
     lp->nbytes -= ep->size;
-    dynfree(ep);
+    kmem_cache_free(mmap_entry_cache, ep);
+}
+
+/*
+ * Find the mmap ledger entry that covers
+ * a virtual address.
+ *
+ * @lp: Ledger to search.
+ * @va: Virtual address to look up.
+ */
+static struct mmap_entry *
+mmap_lookup(struct mmap_lgdr *lp, vaddr_t va)
+{
+    struct mmap_entry find, *ep;
+
+    /* Get the closest entry that starts at or below `va' */
+    find.va_start = va;
+    ep = RBT_NFIND(lgdr_entries, &lp->hd, &find);
+    if (ep == NULL) {
+        ep = RBT_MAX(lgdr_entries, &lp->hd);
+    } else if (ep->va_start > va) {
+        ep = RBT_PREV(lgdr_entries, ep);
+    }
+
+    if (ep == NULL || va >= ep->va_start + ep->size) {
+        return NULL;
+    }
+
+    return ep;
+}
+
+/*
+ * Returns true if a ledger entry maps a
+ * regular file.
+ */
+static inline bool
+mmap_isfile(const struct mmap_entry *ep)
+{
+    return ep->obj != NULL && ep->obj->pgops == &vm_vnops;
+}
+
+/*
+ * Returns true if [va, va + len) lies wholly
+ * within user space.
+ */
+static inline bool
+mmap_inrange(vaddr_t va, size_t len)
+{
+    return len != 0 && va + len > va && va + len <= MMAP_USER_END;
+}
+
+/*
+ * Returns the first ledger entry that overlaps
+ * [va, va + len), or NULL if there is none.
+ *
+ * @lp: Ledger to search.
+ * @va: Start of the range.
+ * @len: Length of the range in bytes.
+ */
+static struct mmap_entry *
+mmap_overlap(struct mmap_lgdr *lp, vaddr_t va, size_t len)
+{
+    struct mmap_entry find, *ep;
+
+    if ((ep = mmap_lookup(lp, va)) != NULL) {
+        return ep;
+    }
+
+    find.va_start = va;
+    ep = RBT_NFIND(lgdr_entries, &lp->hd, &find);
+    if (ep != NULL && ep->va_start < va + len) {
+        return ep;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns true if any page in [va, va + len) is
+ * mapped, whether or not the ledger knows of it.
+ */
+static bool
+mmap_mapped(struct vas vas, vaddr_t va, size_t len)
+{
+    paddr_t pa;
+
+    for (size_t i = 0; i < len; i += DEFAULT_PAGESIZE) {
+        if (pmap_lookup(vas, va + i, &pa, NULL) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Pick the address of a new mapping. The hint is
+ * only used if it leaves the mapping wholly within
+ * free user space, otherwise the mapping goes in
+ * the anonymous region with an unmapped guard page
+ * after it.
+ *
+ * @lp: Ledger of the current process.
+ * @vas: Current address space.
+ * @hint: Address hint, zero for none.
+ * @len: Length of the mapping in bytes.
+ *
+ * Returns zero if there is no room left.
+ */
+static vaddr_t
+mmap_place(struct mmap_lgdr *lp, struct vas vas, vaddr_t hint, size_t len)
+{
+    struct mmap_entry *ep;
+    vaddr_t va;
+
+    hint = ALIGN_DOWN(hint, DEFAULT_PAGESIZE);
+    if (hint != 0 && mmap_inrange(hint, len) &&
+        mmap_overlap(lp, hint, len) == NULL && !mmap_mapped(vas, hint, len)) {
+        return hint;
+    }
+
+    for (;;) {
+        va = lp->va_next;
+        if (!mmap_inrange(va, len + DEFAULT_PAGESIZE)) {
+            return 0;
+        }
+
+        /* Skip over whatever is already here */
+        if ((ep = mmap_overlap(lp, va, len)) != NULL) {
+            lp->va_next = ep->va_start + ep->size + DEFAULT_PAGESIZE;
+            continue;
+        }
+        if (mmap_mapped(vas, va, len)) {
+            lp->va_next += DEFAULT_PAGESIZE;
+            continue;
+        }
+
+        lp->va_next = va + len + DEFAULT_PAGESIZE;
+        return va;
+    }
+}
+
+/*
+ * Bring in the page of an anonymous mapping
+ * that covers `va' and map it.
+ *
+ * @vas: Address space of the mapping.
+ * @ep: Ledger entry of the mapping.
+ * @va: Virtual address within the mapping.
+ */
+static int
+mmap_fill(struct vas vas, struct mmap_entry *ep, vaddr_t va)
+{
+    struct vm_page *pg;
+    off_t off;
+    int error;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    off = va - ep->va_start;
+
+    error = vm_pager_get(ep->obj, &pg, off, DEFAULT_PAGESIZE);
+    if (error < 0) {
+        return error;
+    }
+
+    if (pmap_map(vas, va, pg->phys_addr, ep->prot) != 0) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Bring in the page of a file mapping that covers
+ * `va' from the page cache and map it. Shared
+ * mappings map the cached page itself, private ones
+ * share it copy-on-write and get their own copy
+ * once written to.
+ *
+ * @vas: Address space of the mapping.
+ * @ep: Ledger entry of the mapping.
+ * @va: Virtual address within the mapping.
+ * @access: Access that caused the fault (PROT_*)
+ */
+static int
+mmap_fill_file(struct vas vas, struct mmap_entry *ep, vaddr_t va,
+               vm_prot_t access)
+{
+    struct vm_page *pg;
+    vm_prot_t prot = ep->prot;
+    paddr_t pa, copy;
+    off_t off;
+    int error;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    off = ep->off + (va - ep->va_start);
+
+    error = vm_pager_get(ep->obj, &pg, off, DEFAULT_PAGESIZE);
+    if (error < 0) {
+        return error;
+    }
+
+    pa = pg->phys_addr;
+    if (ISSET(ep->flags, MAP_SHARED)) {
+        return (pmap_map(vas, va, pa, prot) != 0) ? -ENOMEM : 0;
+    }
+
+    /*
+     * Each private page holds a reference to its frame,
+     * copy right away if this is a write or if the cached
+     * page has too many sharers.
+     */
+    if (ISSET(access, PROT_WRITE) || vm_frame_share(pa) < 0) {
+        copy = vm_alloc_frame_flags(1, 0);
+        if (copy == 0) {
+            return -ENOMEM;
+        }
+
+        memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(pa), DEFAULT_PAGESIZE);
+        pa = copy;
+    } else if (ISSET(prot, PROT_WRITE)) {
+        prot = (prot & ~PROT_WRITE) | PROT_COW;
+    }
+
+    if (pmap_map(vas, va, pa, prot) != 0) {
+        vm_free_frame(pa, 1);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Unmap a file mapping and drop its reference to
+ * the vnode. Pages that were written to through a
+ * shared mapping are written back to the file.
+ *
+ * @vas: Address space of the mapping.
+ * @ep: Ledger entry of the mapping.
+ */
+static void
+mmap_release_file(struct vas vas, struct mmap_entry *ep)
+{
+    struct vm_object *obp = ep->obj;
+    struct vm_page *pg;
+    vaddr_t va;
+
+    if (!ISSET(ep->flags, MAP_SHARED)) {
+        vm_unmap_free(vas, ep->va_start, ep->size);
+        vfs_release_vnode(obp->data);
+        return;
+    }
+
+    for (size_t i = 0; i < ep->size; i += DEFAULT_PAGESIZE) {
+        va = ep->va_start + i;
+        if (pmap_is_clean(vas, va)) {
+            continue;
+        }
+
+        pg = vm_pagelookup(obp, ep->off + i);
+        if (pg != NULL) {
+            vm_pager_put(obp, pg, DEFAULT_PAGESIZE);
+        }
+    }
+
+    vm_unmap(vas, ep->va_start, ep->size);
+    vfs_release_vnode(obp->data);
+}
+
+/*
+ * Unmap and free the resident pages of
+ * an anonymous mapping.
+ *
+ * @vas: Address space of the mapping.
+ * @ep: Ledger entry of the mapping.
+ */
+static void
+mmap_release(struct vas vas, struct mmap_entry *ep)
+{
+    struct vm_object *obp = ep->obj;
+    struct vm_page *pg;
+    uint64_t idx;
+
+    spinlock_acquire(&obp->lock);
+    VM_OBJ_FOREACH(pg, obp, idx) {
+        pmap_unmap(vas, ep->va_start + pg->offset);
+    }
+    spinlock_release(&obp->lock);
+    pmap_tlb_flush(vas, ep->va_start, ep->size);
+
+    vm_obj_release(obp);
+    dynfree(obp);
+}
+
+/*
+ * Tear down the mapping described by a ledger
+ * entry, the entry itself is left in the ledger.
+ *
+ * @vas: Address space of the mapping.
+ * @ep: Ledger entry of the mapping.
+ */
+static void
+mmap_unmap_entry(struct vas vas, struct mmap_entry *ep)
+{
+    if (ep->obj != NULL && ep->obj->pgops == &vm_anonops) {
+        mmap_release(vas, ep);
+    } else if (mmap_isfile(ep)) {
+        mmap_release_file(vas, ep);
+    } else {
+        vm_unmap(vas, ep->va_start, ep->size);
+    }
+}
+
+/*
+ * Returns zero if no ledger entry only partly
+ * overlaps [va, va + len), otherwise -EBUSY.
+ */
+static int
+mmap_clearable(struct mmap_lgdr *lp, vaddr_t va, size_t len)
+{
+    struct mmap_entry *ep;
+    vaddr_t end = va + len;
+
+    RBT_FOREACH(ep, lgdr_entries, &lp->hd) {
+        if (ep->va_start >= end || ep->va_start + ep->size <= va) {
+            continue;
+        }
+        if (ep->va_start < va || ep->va_start + ep->size > end) {
+            return -EBUSY;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Returns true if any page in [va, va + len) is
+ * mapped by something other than the ledger, such
+ * as the program image, the user stack or the
+ * time page. Those must never be replaced as the
+ * ledger does not own their frames.
+ */
+static bool
+mmap_foreign(struct mmap_lgdr *lp, struct vas vas, vaddr_t va, size_t len)
+{
+    paddr_t pa;
+
+    for (size_t i = 0; i < len; i += DEFAULT_PAGESIZE) {
+        if (pmap_lookup(vas, va + i, &pa, NULL) != 0) {
+            continue;
+        }
+        if (mmap_lookup(lp, va + i) == NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Remove every mapping of the current process in
+ * the range [va, va + len). Mappings that only
+ * partly overlap the range are not split, so they
+ * make this fail without anything being removed.
+ *
+ * @td: Current process.
+ * @vas: Address space of `td'.
+ * @va: Start of the range.
+ * @len: Length of the range in bytes.
+ */
+static int
+mmap_clear(struct proc *td, struct vas vas, vaddr_t va, size_t len)
+{
+    struct mmap_lgdr *lp = td->mlgdr;
+    struct mmap_entry *ep, *tmp;
+    vaddr_t end = va + len;
+
+    if (mmap_clearable(lp, va, len) < 0) {
+        return -EBUSY;
+    }
+
+    RBT_FOREACH_SAFE(ep, lgdr_entries, &lp->hd, tmp) {
+        if (ep->va_start >= end || ep->va_start + ep->size <= va) {
+            continue;
+        }
+
+        mmap_unmap_entry(vas, ep);
+        mmap_remove(td, ep);
+    }
+
+    return 0;
+}
+
+/*
+ * Share a private page of one address space with
+ * another, copy-on-write if it is writable.
+ *
+ * @src: Address space the page is mapped in.
+ * @dst: Address space to share the page with.
+ * @va: Virtual address of the page.
+ * @pa: Physical address of the page.
+ * @prot: Protection of the page in `src'.
+ */
+static int
+vm_share_page(struct vas src, struct vas dst, vaddr_t va, paddr_t pa,
+              vm_prot_t prot)
+{
+    paddr_t copy;
+
+    /* Too many sharers, make a private copy */
+    if (vm_frame_share(pa) < 0) {
+        copy = vm_alloc_frame_flags(1, 0);
+        if (copy == 0) {
+            return -ENOMEM;
+        }
+
+        memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(pa), DEFAULT_PAGESIZE);
+        if (ISSET(prot, PROT_COW)) {
+            prot = (prot & ~PROT_COW) | PROT_WRITE;
+        }
+
+        return (pmap_map(dst, va, copy, prot) != 0) ? -ENOMEM : 0;
+    }
+
+    if (ISSET(prot, PROT_WRITE)) {
+        prot = (prot & ~PROT_WRITE) | PROT_COW;
+        pmap_map(src, va, pa, prot);
+    }
+
+    return (pmap_map(dst, va, pa, prot) != 0) ? -ENOMEM : 0;
+}
+
+/*
+ * Share every mapped page in a range of private
+ * memory with another address space.
+ */
+static int
+vm_share_range(struct vas src, struct vas dst, vaddr_t va, size_t len)
+{
+    vm_prot_t prot;
+    paddr_t pa;
+    int error = 0;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    len = ALIGN_UP(len, DEFAULT_PAGESIZE);
+    for (size_t i = 0; i < len; i += DEFAULT_PAGESIZE) {
+        if (pmap_lookup(src, va + i, &pa, &prot) != 0) {
+            continue;
+        }
+
+        error = vm_share_page(src, dst, va + i, pa, prot);
+        if (error < 0) {
+            break;
+        }
+    }
+
+    /* Pages in `src' may have become read-only */
+    pmap_tlb_flush(src, va, len);
+    return error;
+}
+
+/*
+ * Duplicate a mmap ledger entry into another
+ * address space. Anonymous memory gets its own
+ * object whose pages share frames copy-on-write.
+ *
+ * @src: Address space of the entry.
+ * @dst: Address space of the copy.
+ * @ep: Entry to duplicate.
+ * @newep: Copy of `ep' to fill in.
+ *
+ * `newep' can be torn down like any other entry
+ * even if this fails partway through.
+ */
+static int
+mmap_fork(struct vas src, struct vas dst, struct mmap_entry *ep,
+          struct mmap_entry *newep)
+{
+    struct vm_object *obp = ep->obj, *newobj;
+    struct vm_page *pg, *newpg;
+    vm_prot_t prot;
+    uint64_t idx;
+    vaddr_t va;
+    paddr_t pa;
+    int error = 0;
+
+    memcpy(newep, ep, sizeof(*newep));
+
+    /* Private file pages are shared copy-on-write */
+    if (mmap_isfile(ep) && !ISSET(ep->flags, MAP_SHARED)) {
+        vfs_vref((struct vnode *)obp->data);
+        return vm_share_range(src, dst, ep->va_start, ep->size);
+    }
+
+    if (obp == NULL || obp->pgops != &vm_anonops) {
+        if (mmap_isfile(ep)) {
+            vfs_vref((struct vnode *)obp->data);
+        }
+
+        /* Device memory and shared files are simply mapped in again */
+        for (size_t i = 0; i < ep->size; i += DEFAULT_PAGESIZE) {
+            va = ep->va_start + i;
+            if (pmap_lookup(src, va, &pa, &prot) != 0) {
+                continue;
+            }
+            if (pmap_map(dst, va, pa, prot) != 0) {
+                return -ENOMEM;
+            }
+        }
+
+        return 0;
+    }
+
+    newobj = dynalloc(sizeof(*newobj));
+    if (newobj == NULL) {
+        newep->obj = NULL;
+        return -ENOMEM;
+    }
+
+    vm_obj_init(newobj, &vm_anonops, 1);
+    newep->obj = newobj;
+
+    spinlock_acquire(&obp->lock);
+    VM_OBJ_FOREACH(pg, obp, idx) {
+        if ((newpg = vm_pagedup(newobj, pg)) == NULL) {
+            error = -ENOMEM;
+            break;
+        }
+
+        va = ep->va_start + pg->offset;
+        prot = ep->prot;
+        if (newpg->phys_addr == pg->phys_addr && ISSET(prot, PROT_WRITE)) {
+            prot = (prot & ~PROT_WRITE) | PROT_COW;
+            pmap_map(src, va, pg->phys_addr, prot);
+        }
+
+        if (pmap_map(dst, va, newpg->phys_addr, prot) != 0) {
+            error = -ENOMEM;
+            break;
+        }
+    }
+    spinlock_release(&obp->lock);
+    pmap_tlb_flush(src, ep->va_start, ep->size);
+    return error;
+}
+
+/*
+ * Resolve a write to a copy-on-write page, the page
+ * is copied unless nobody else references it anymore.
+ *
+ * @td: Current process.
+ * @vas: Current address space.
+ * @va: Page aligned virtual address.
+ * @pa: Frame currently mapped at `va'.
+ * @prot: Protection currently mapped at `va'.
+ */
+static int
+vm_cow(struct proc *td, struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot)
+{
+    struct vm_object *obp = NULL;
+    struct mmap_entry *ep;
+    struct vm_page *pg = NULL;
+    paddr_t copy;
+
+    prot = (prot & ~PROT_COW) | PROT_WRITE;
+
+    /* Anonymous pages also track their frame in the object */
+    ep = mmap_lookup(td->mlgdr, va);
+    if (ep != NULL && ep->obj != NULL && ep->obj->pgops == &vm_anonops) {
+        obp = ep->obj;
+        spinlock_acquire(&obp->lock);
+        pg = vm_pagelookup(obp, va - ep->va_start);
+    }
+
+    if (vm_frame_refs(pa) > 1) {
+        copy = vm_alloc_frame_flags(1, 0);
+        if (copy == 0) {
+            if (obp != NULL) {
+                spinlock_release(&obp->lock);
+            }
+            return -ENOMEM;
+        }
+
+        memcpy(PHYS_TO_VIRT(copy), PHYS_TO_VIRT(pa), DEFAULT_PAGESIZE);
+        if (pg != NULL) {
+            pg->phys_addr = copy;
+        }
+
+        pmap_map(vas, va, copy, prot);
+        pmap_tlb_flush(vas, va, DEFAULT_PAGESIZE);
+        vm_free_frame(pa, 1);
+    } else {
+        pmap_map(vas, va, pa, prot);
+    }
+
+    if (obp != NULL) {
+        spinlock_release(&obp->lock);
+    }
+
+    return 0;
 }
 
 /*
  * Create/destroy virtual memory mappings in a specific
- * address space.
+ * address space. The page tables are walked once per
+ * range by the pmap.
  *
  * @vas: Address space.
  * @va: Virtual address.
@@ -107,17 +716,15 @@ mmap_remove(struct proc *td, struct mmap_entry *ep)
  * @count: Count of bytes to be mapped which is aligned to the
  *         machine's page granularity.
  *
- * Returns 0 on success. On failure, this routine
- * returns a less than zero value or greater than zero
- * value that contains the offset into the memory where the
- * mapping failed.
+ * Returns 0 on success, and a less than zero errno
+ * on failure. A failed mapping is not left half done.
  */
 static int
 vm_map_modify(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot, bool unmap,
               size_t count)
 {
     size_t misalign = va & (DEFAULT_PAGESIZE - 1);
-    int s;
+    int error;
 
     if (count == 0) {
         return -EINVAL;
@@ -128,21 +735,13 @@ vm_map_modify(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot, bool unmap
     va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
     pa = ALIGN_DOWN(pa, DEFAULT_PAGESIZE);
 
-    for (uintptr_t i = 0; i < count; i += DEFAULT_PAGESIZE) {
-        /* See if we should map or unmap the range */
-        if (unmap) {
-            s = pmap_unmap(vas, va + i);
-        } else {
-            s = pmap_map(vas, va + i, pa + i, prot);
-        }
-
-        if (s != 0) {
-            /* Something went wrong, return the offset */
-            return i;
-        }
+    if (!unmap) {
+        return pmap_map_range(vas, va, pa, prot, count);
     }
 
-    return 0;
+    error = pmap_unmap_range(vas, va, count);
+    pmap_tlb_flush(vas, va, count);
+    return error;
 }
 
 /*
@@ -151,10 +750,19 @@ vm_map_modify(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot, bool unmap
  * @addr: Virtual address to map (NULL to be any).
  * @len: The amount of bytes to map (must be page aligned)
  * @prot: Protection flags (PROT_*)
+ * @flags: Mapping flags (MAP_*)
  * @fildes: File descriptor.
  * @off: Offset.
  *
- * TODO: Fields to use: `fildes' and `off'
+ * Anonymous mappings only reserve address space, their
+ * pages are allocated on first touch by vm_fault() unless
+ * MAP_POPULATE is given. Regular files are demand paged
+ * from their page cache starting at `off', which must be
+ * page aligned.
+ *
+ * With MAP_FIXED the mapping is placed at exactly `addr'
+ * and replaces whatever was mapped there.
+ *
  * XXX: Must be called after pid 1 is up and running to avoid
  *      crashes.
  */
@@ -163,36 +771,76 @@ mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 {
     struct vm_object *map_obj = NULL;
     struct cdevsw *cdevp;
-    struct vm_page *pg;
+    struct mmap_lgdr *lp;
     struct mmap_entry *ep;
     struct vnode *vp;
-    struct filedesc *fdp;
+    struct filedesc *fdp = NULL;
     struct proc *td;
     struct vas vas;
-    int error, npgs;
+    int error;
+    bool populate, devmap = false;
     paddr_t pa;
     vaddr_t va;
     size_t misalign;
-    off_t page_off;
 
     misalign = len & (DEFAULT_PAGESIZE - 1);
     len = ALIGN_UP(len + misalign, DEFAULT_PAGESIZE);
-    npgs = len / DEFAULT_PAGESIZE;
     vas = pmap_read_vas();
+    td = this_td();
+    lp = td->mlgdr;
 
-    /* Validate flags */
+    /*
+     * Validate a fixed address up front, nothing may be
+     * torn down before we know the mapping can be made.
+     */
     if (ISSET(flags, MAP_FIXED)) {
-        pr_error("mmap: fixed mappings not yet supported\n");
-        mmap_dbg(addr, len, prot, flags, fildes, off);
-        return NULL;
+        va = (vaddr_t)addr;
+        if (addr == NULL || (va & (DEFAULT_PAGESIZE - 1)) != 0 ||
+            !mmap_inrange(va, len)) {
+            pr_error("mmap: bad fixed address %p\n", addr);
+            return NULL;
+        }
+        if (mmap_foreign(lp, vas, va, len)) {
+            pr_error("mmap: fixed mapping overlaps unmanaged memory\n");
+            return NULL;
+        }
+        if (mmap_clearable(lp, va, len) < 0) {
+            pr_error("mmap: fixed mapping overlaps part of another\n");
+            mmap_dbg(addr, len, prot, flags, fildes, off);
+            return NULL;
+        }
     }
 
     /*
      * Attempt to open the file if mapping
-     * is shared.
+     * is shared or private.
      */
-    if (ISSET(flags, MAP_SHARED)) {
+    if (ISSET(flags, MAP_SHARED | MAP_PRIVATE)) {
         fdp = fd_get(NULL, fildes);
+    }
+
+    if (fdp != NULL && fdp->vp->type == VREG) {
+        vp = fdp->vp;
+        if ((off & (DEFAULT_PAGESIZE - 1)) != 0) {
+            pr_error("mmap: unaligned file offset (off=%d)\n", off);
+            return NULL;
+        }
+
+        /* Shared writes go back to the file */
+        if (ISSET(flags, MAP_SHARED) && ISSET(prot, PROT_WRITE) &&
+            !ISSET(fdp->flags, O_ALLOW_WR)) {
+            pr_error("mmap: file not open for writing (fd=%d)\n", fildes);
+            return NULL;
+        }
+
+        map_obj = vn_attach(vp, prot);
+        if (map_obj == NULL) {
+            pr_error("mmap: vn_attach() failure\n");
+            return NULL;
+        }
+
+        vfs_vref(vp);
+    } else if (ISSET(flags, MAP_SHARED)) {
         if (fdp == NULL) {
             pr_error("mmap: no such fd (fd=%d)\n", fildes);
             return NULL;
@@ -200,8 +848,7 @@ mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 
         vp = fdp->vp;
         if (vp->type != VCHR) {
-            /* TODO */
-            pr_error("mmap: only device files supported\n");
+            pr_error("mmap: cannot map file type %d\n", vp->type);
             return NULL;
         }
 
@@ -218,7 +865,7 @@ mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
         }
 
         /*
-         * If the address passed is NULL, just identity
+         * If the address passed is NULL, try to identity
          * map everything.
          *
          * XXX: This is why the bounds check done in the
@@ -235,14 +882,21 @@ mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
             addr = (void *)pa;
         }
 
-        va = ALIGN_DOWN((vaddr_t)addr, DEFAULT_PAGESIZE);
-        error = vm_map(vas, va, pa, prot, len);
-        if (error != 0) {
-            kprintf("mmap: map failed (error=%d)\n", error);
+        devmap = true;
+    }
+
+    /* A non-fixed address is only a hint */
+    if (!ISSET(flags, MAP_FIXED)) {
+        va = mmap_place(lp, vas, (vaddr_t)addr, len);
+        if (va == 0) {
+            pr_error("mmap: out of address space\n");
+            if (map_obj != NULL && map_obj->pgops == &vm_vnops) {
+                vfs_release_vnode(map_obj->data);
+            }
             return NULL;
         }
 
-        goto done;
+        addr = (void *)va;
     }
 
     /* Only allocate new obj if needed */
@@ -260,46 +914,56 @@ mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
         }
     }
 
-    /* XXX: Assuming private */
-    va = ALIGN_DOWN((vaddr_t)addr, DEFAULT_PAGESIZE);
-
-    for (int i = 0; i < npgs; ++i) {
-        pg = vm_pagealloc(map_obj, PALLOC_ZERO);
-        page_off = i * DEFAULT_PAGESIZE;
-
-        if (pg == NULL) {
-            /* TODO */
-            pr_error("mmap: failed to allocate page %d\n");
-            return NULL;
+    /* Add entry to ledger */
+    ep = kmem_cache_alloc(mmap_entry_cache, 0);
+    if (ep == NULL) {
+        pr_error("mmap: failed to allocate mmap ledger entry\n");
+        if (map_obj->pgops == &vm_vnops) {
+            vfs_release_vnode(map_obj->data);
         }
+        return NULL;
+    }
 
-        /* TODO: copy-on-write */
-        if (addr == NULL) {
-            va = pg->phys_addr;
-            addr = (void *)va;
-        }
+    /* Anything already mapped here is replaced */
+    if (ISSET(flags, MAP_FIXED)) {
+        mmap_clear(td, vas, va, len);
+    }
 
-        pa = pg->phys_addr;
-        error = vm_map(vas, va + page_off, pa, prot, len);
-        if (error < 0) {
-            pr_error("mmap: failed to map page (retval=%x)\n", error);
+    if (devmap) {
+        error = vm_map(vas, va, pa, prot, len);
+        if (error != 0) {
+            kprintf("mmap: map failed (error=%d)\n", error);
+            kmem_cache_free(mmap_entry_cache, ep);
             return NULL;
         }
     }
 
-done:
-    /* Add entry to ledger */
-    td = this_td();
-    ep = dynalloc(sizeof(*ep));
-    if (ep == NULL) {
-        pr_error("mmap: failed to allocate mmap ledger entry\n");
-        return NULL;
-    }
-
     ep->va_start = va;
     ep->obj = map_obj;
     ep->size = len;
+    ep->prot = prot;
+    ep->flags = flags;
+    ep->off = off;
     mmap_add(td, ep);
+
+    /* Prefault every page now if asked to */
+    populate = map_obj->pgops == &vm_anonops || mmap_isfile(ep);
+    if (ISSET(flags, MAP_POPULATE) && populate) {
+        for (size_t i = 0; i < len; i += DEFAULT_PAGESIZE) {
+            if (mmap_isfile(ep)) {
+                error = mmap_fill_file(vas, ep, va + i, PROT_READ);
+            } else {
+                error = mmap_fill(vas, ep, va + i);
+            }
+
+            if (error < 0) {
+                pr_error("mmap: failed to populate (error=%d)\n", error);
+                munmap(addr, len);
+                return NULL;
+            }
+        }
+    }
+
     return addr;
 }
 
@@ -353,7 +1017,7 @@ munmap(void *addr, size_t len)
         return -EINVAL;
     }
 
-    vm_unmap(vas, va, len);
+    mmap_unmap_entry(vas, res);
     mmap_remove(td, res);
     return 0;
 }
@@ -418,21 +1082,8 @@ sys_munmap(struct syscall_args *scargs)
 int
 vm_map(struct vas vas, vaddr_t va, paddr_t pa, vm_prot_t prot, size_t count)
 {
-    int retval;
-
     va = ALIGN_UP(va, DEFAULT_PAGESIZE);
-    retval = vm_map_modify(vas, va, pa, prot, false, count);
-
-    /* Return on success */
-    if (retval == 0)
-        return 0;
-
-    /* Failure, clean up */
-    for (int i = 0; i < retval; i += DEFAULT_PAGESIZE) {
-        pmap_unmap(vas, va + i);
-    }
-
-    return -1;
+    return vm_map_modify(vas, va, pa, prot, false, count);
 }
 
 /*
@@ -449,6 +1100,183 @@ vm_unmap(struct vas vas, vaddr_t va, size_t count)
     return vm_map_modify(vas, va, 0, 0, true, count);
 }
 
+/*
+ * Resolve a fault on a page of the current process,
+ * either a write to a copy-on-write page or a page
+ * that was never touched. Anonymous and file
+ * mappings are demand paged.
+ *
+ * @va: Faulting virtual address.
+ * @access: Access that faulted (PROT_*)
+ *
+ * Returns 0 if the page is now mapped and the access
+ * may be retried, otherwise a less than zero errno.
+ */
+int
+vm_fault(vaddr_t va, vm_prot_t access)
+{
+    struct proc *td = this_td();
+    struct mmap_entry *ep;
+    struct vas vas;
+    vm_prot_t prot;
+    paddr_t pa;
+
+    if (td == NULL || td->mlgdr == NULL) {
+        return -EFAULT;
+    }
+
+    /* Present pages only fault on copy-on-write */
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    vas = pmap_read_vas();
+    if (pmap_lookup(vas, va, &pa, &prot) == 0) {
+        if (!ISSET(access, PROT_WRITE) || !ISSET(prot, PROT_COW)) {
+            return -EACCES;
+        }
+
+        return vm_cow(td, vas, va, pa, prot);
+    }
+
+    ep = mmap_lookup(td->mlgdr, va);
+    if (ep == NULL || ep->obj == NULL) {
+        return -EFAULT;
+    }
+    if (ep->obj->pgops != &vm_anonops && !mmap_isfile(ep)) {
+        return -EFAULT;
+    }
+
+    /* Make sure the access is allowed */
+    if (ISSET(access, PROT_WRITE) && !ISSET(ep->prot, PROT_WRITE)) {
+        return -EACCES;
+    }
+    if (ISSET(access, PROT_EXEC) && !ISSET(ep->prot, PROT_EXEC)) {
+        return -EACCES;
+    }
+
+    if (mmap_isfile(ep)) {
+        return mmap_fill_file(vas, ep, va, access);
+    }
+
+    return mmap_fill(vas, ep, va);
+}
+
+/*
+ * Duplicate the user address space of a process into
+ * a child. Private memory is shared copy-on-write and
+ * the mmap ledger is copied.
+ *
+ * @parent: Process to duplicate.
+ * @child: New process with an empty address space.
+ */
+int
+vm_map_fork(struct proc *parent, struct proc *child)
+{
+    struct vas src = parent->pcb.addrsp;
+    struct vas dst = child->pcb.addrsp;
+    struct exec_prog *execp = &parent->exec;
+    struct exec_range *range;
+    struct mmap_entry *ep, *newep;
+    paddr_t timepage;
+    int error;
+
+    /* Program image */
+    for (size_t i = 0; i < execp->auxval.at_phnum; ++i) {
+        range = &execp->loadmap[i];
+        if (range->start == 0 && range->end == 0) {
+            continue;
+        }
+
+        error = vm_share_range(src, dst, range->vbase,
+            range->end - range->start);
+        if (error < 0) {
+            return error;
+        }
+    }
+
+    /* User stack */
+    error = vm_share_range(src, dst, parent->stack_base, PROC_STACK_SIZE);
+    if (error < 0) {
+        return error;
+    }
+
+    if ((timepage = timepage_paddr()) != 0) {
+        vm_map(dst, timepage, timepage, (PROT_READ | PROT_USER),
+            DEFAULT_PAGESIZE);
+    }
+
+    /* Memory mappings */
+    RBT_FOREACH(ep, lgdr_entries, &parent->mlgdr->hd) {
+        newep = kmem_cache_alloc(mmap_entry_cache, 0);
+        if (newep == NULL) {
+            return -ENOMEM;
+        }
+
+        /* Partial copies are torn down with the child */
+        error = mmap_fork(src, dst, ep, newep);
+        mmap_add(child, newep);
+        if (error < 0) {
+            return error;
+        }
+    }
+
+    child->mlgdr->va_next = parent->mlgdr->va_next;
+    return 0;
+}
+
+/*
+ * Tear down every mapping in the mmap ledger
+ * of a process.
+ *
+ * @td: Process that is going away.
+ */
+void
+mmap_lgdr_release(struct proc *td)
+{
+    struct mmap_lgdr *lp = td->mlgdr;
+    struct mmap_entry *ep, *tmp;
+    struct vas vas = td->pcb.addrsp;
+
+    if (lp == NULL) {
+        return;
+    }
+
+    RBT_FOREACH_SAFE(ep, lgdr_entries, &lp->hd, tmp) {
+        mmap_unmap_entry(vas, ep);
+        mmap_remove(td, ep);
+    }
+
+    dynfree(lp);
+    td->mlgdr = NULL;
+}
+
+/*
+ * Unmap a range of private memory and drop the
+ * reference to each of its frames. The page tables
+ * are followed as frames may have been replaced by
+ * copy-on-write.
+ *
+ * @vas: Address space.
+ * @va: Virtual address to start at.
+ * @count: Bytes to unmap.
+ */
+void
+vm_unmap_free(struct vas vas, vaddr_t va, size_t count)
+{
+    paddr_t pa;
+
+    va = ALIGN_DOWN(va, DEFAULT_PAGESIZE);
+    count = ALIGN_UP(count, DEFAULT_PAGESIZE);
+    for (size_t i = 0; i < count; i += DEFAULT_PAGESIZE) {
+        if (pmap_lookup(vas, va + i, &pa, NULL) != 0) {
+            continue;
+        }
+
+        pmap_unmap(vas, va + i);
+        vm_free_frame(pa, 1);
+    }
+
+    pmap_tlb_flush(vas, va, count);
+}
+
 /*
  * Helper for tree(3) and the mmap ledger.
  */
@@ -457,3 +1285,16 @@ mmap_entrycmp(const struct mmap_entry *a, const struct mmap_entry *b)
 {
     return (a->va_start < b->va_start) ? -1 : a->va_start > b->va_start;
 }
+
+/*
+ * Set up the object cache of mmap ledger entries.
+ */
+void
+vm_map_init(void)
+{
+    mmap_entry_cache = kmem_cache_create("mmap_entry",
+        sizeof(struct mmap_entry), 0);
+    if (mmap_entry_cache == NULL) {
+        panic("failed to create mmap entry cache\n");
+    }
+}
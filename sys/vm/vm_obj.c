@@ -27,7 +27,9 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/atomic.h>
 #include <vm/vm_obj.h>
+#include <vm/vm_page.h>
 #include <vm/vm_pager.h>
 
 int
@@ -39,13 +41,29 @@ vm_obj_init(struct vm_object *obp, const struct vm_pagerops *pgops, int refs)
     obp->pgops = pgops;
     obp->refs = refs;
     obp->npages = 0;
-    RBT_INIT(vm_objtree, &obp->objt);
+    vm_radix_init(&obp->pages);
     return 0;
 }
 
+/*
+ * Drop a reference to an object, the pages of
+ * the object are freed with the last reference.
+ */
 void
 vm_obj_release(struct vm_object *obp)
 {
-    /* STUB */
-    (void)obp;
+    struct vm_page *pg;
+    uint64_t idx;
+
+    if (atomic_dec_int((unsigned int *)&obp->refs) > 0) {
+        return;
+    }
+
+    spinlock_acquire(&obp->lock);
+    VM_OBJ_FOREACH(pg, obp, idx) {
+        vm_pagefree(obp, pg, 0);
+    }
+
+    vm_radix_destroy(&obp->pages);
+    spinlock_release(&obp->lock);
 }
@@ -27,67 +27,139 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/panic.h>
 #include <vm/vm_page.h>
 #include <vm/vm_obj.h>
 #include <vm/physmem.h>
-#include <vm/dynalloc.h>
+#include <vm/kmem.h>
 #include <vm/vm.h>
 #include <assert.h>
 #include <string.h>
 
-RBT_GENERATE(vm_objtree, vm_page, objt, vm_pagecmp);
+#define PAGE_INDEX(off) ((uint64_t)(off) / DEFAULT_PAGESIZE)
+
+static struct kmem_cache *vm_page_cache;
 
 /*
  * Insert a page into an object.
  */
-static inline void
+static inline int
 vm_pageinsert(struct vm_page *pg, struct vm_object *obp)
 {
-    struct vm_page *tmp;
+    int error;
+
+    error = vm_radix_insert(&obp->pages, PAGE_INDEX(pg->offset), pg);
+    if (error < 0) {
+        return error;
+    }
 
-    tmp = RBT_INSERT(vm_objtree, &obp->objt, pg);
-    if (tmp != NULL)
-        return;
     ++obp->npages;
+    return 0;
 }
 
 static inline void
 vm_pageremove(struct vm_page *pg, struct vm_object *obp)
 {
-    RBT_REMOVE(vm_objtree, &obp->objt, pg);
+    vm_radix_remove(&obp->pages, PAGE_INDEX(pg->offset));
     --obp->npages;
 }
 
+/*
+ * Look up the page at a byte offset of an object.
+ * The page index may be read without the object
+ * lock, though the page itself is only kept around
+ * while the lock is held.
+ */
 struct vm_page *
 vm_pagelookup(struct vm_object *obj, off_t off)
 {
-    struct vm_page tmp;
+    return vm_radix_lookup(&obj->pages, PAGE_INDEX(off));
+}
+
+/*
+ * Allocate a page and insert it into an object.
+ *
+ * @obj: Object to insert the page into.
+ * @off: Byte offset of the page within `obj'.
+ * @flags: Allocation flags (PALLOC_*)
+ */
+struct vm_page *
+vm_pagealloc(struct vm_object *obj, off_t off, int flags)
+{
+    struct vm_page *tmp;
+    int frame_flags;
+
+    tmp = kmem_cache_alloc(vm_page_cache, KMEM_ZERO);
+    if (tmp == NULL) {
+        return NULL;
+    }
 
-    tmp.offset = off;
-    return RBT_FIND(vm_objtree, &obj->objt, &tmp);
+    frame_flags = ISSET(flags, PALLOC_ZERO) ? VM_ALLOC_ZERO : 0;
+    tmp->phys_addr = vm_alloc_frame_flags(1, frame_flags);
+    if (tmp->phys_addr == 0) {
+        kmem_cache_free(vm_page_cache, tmp);
+        return NULL;
+    }
+
+    /*
+     * Pages that are to be filled in by the caller stay
+     * invalid until they are, lockless lookups will skip
+     * over them until then.
+     */
+    tmp->flags |= PG_CLEAN;
+    if (!ISSET(flags, PALLOC_FILL)) {
+        tmp->flags |= PG_VALID;
+    }
+
+    tmp->offset = off;
+    if (vm_pageinsert(tmp, obj) < 0) {
+        vm_free_frame(tmp->phys_addr, 1);
+        kmem_cache_free(vm_page_cache, tmp);
+        return NULL;
+    }
+
+    return tmp;
 }
 
+/*
+ * Duplicate a page into another object. The copy
+ * shares the frame of `pg' (which stays around until
+ * both pages are freed) unless it has too many
+ * references, then the contents are copied.
+ *
+ * @obj: Object to insert the copy into.
+ * @pg: Page to duplicate.
+ */
 struct vm_page *
-vm_pagealloc(struct vm_object *obj, int flags)
+vm_pagedup(struct vm_object *obj, const struct vm_page *pg)
 {
     struct vm_page *tmp;
 
-    tmp = dynalloc(sizeof(*tmp));
+    tmp = kmem_cache_alloc(vm_page_cache, KMEM_ZERO);
     if (tmp == NULL) {
         return NULL;
     }
 
-    memset(tmp, 0, sizeof(*tmp));
-    tmp->phys_addr = vm_alloc_frame(1);
-    tmp->flags |= (PG_VALID | PG_CLEAN);
-    tmp->offset = tmp->phys_addr >> 12;
-    __assert(tmp->phys_addr != 0);
+    tmp->phys_addr = pg->phys_addr;
+    if (vm_frame_share(pg->phys_addr) < 0) {
+        tmp->phys_addr = vm_alloc_frame_flags(1, 0);
+        if (tmp->phys_addr == 0) {
+            kmem_cache_free(vm_page_cache, tmp);
+            return NULL;
+        }
 
-    if (ISSET(flags, PALLOC_ZERO)) {
-        memset(PHYS_TO_VIRT(tmp->phys_addr), 0, DEFAULT_PAGESIZE);
+        memcpy(PHYS_TO_VIRT(tmp->phys_addr), PHYS_TO_VIRT(pg->phys_addr),
+            DEFAULT_PAGESIZE);
+    }
+
+    tmp->flags = pg->flags;
+    tmp->offset = pg->offset;
+    if (vm_pageinsert(tmp, obj) < 0) {
+        vm_free_frame(tmp->phys_addr, 1);
+        kmem_cache_free(vm_page_cache, tmp);
+        return NULL;
     }
 
-    vm_pageinsert(tmp, obj);
     return tmp;
 }
 
@@ -98,11 +170,17 @@ vm_pagefree(struct vm_object *obj, struct vm_page *pg, int flags)
 
     vm_pageremove(pg, obj);
     vm_free_frame(pg->phys_addr, 1);
-    dynfree(pg);
+    kmem_cache_free(vm_page_cache, pg);
 }
 
-int
-vm_pagecmp(const struct vm_page *a, const struct vm_page *b)
+/*
+ * Set up the object cache of page descriptors.
+ */
+void
+vm_page_init(void)
 {
-    return (a->offset < b->offset) ? -1 : a->offset > b->offset;
+    vm_page_cache = kmem_cache_create("vm_page", sizeof(struct vm_page), 0);
+    if (vm_page_cache == NULL) {
+        panic("failed to create vm_page cache\n");
+    }
 }
@@ -43,3 +43,15 @@ vm_pager_get(struct vm_object *obp, struct vm_page **pgs, off_t off, size_t len)
 
     return pgops->get(obp, pgs, off, len);
 }
+
+int
+vm_pager_put(struct vm_object *obp, struct vm_page *pg, size_t len)
+{
+    const struct vm_pagerops *pgops = obp->pgops;
+
+    if (pgops->put == NULL) {
+        return -ENOTSUP;
+    }
+
+    return pgops->put(obp, pg, len);
+}
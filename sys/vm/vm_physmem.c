@@ -28,197 +28,732 @@
  */
 
 #include <sys/param.h>
+#include <sys/errno.h>
 #include <sys/types.h>
 #include <sys/limine.h>
+#include <sys/limits.h>
 #include <sys/syslog.h>
 #include <sys/spinlock.h>
+#include <sys/vmstat.h>
 #include <sys/panic.h>
+#include <sys/proc.h>
+#include <sys/sched.h>
+#include <sys/systm.h>
+#include <machine/cpu.h>
+#include <machine/cdefs.h>
 #include <vm/physmem.h>
+#include <vm/pmap.h>
+#include <vm/vm_vnode.h>
 #include <vm/vm.h>
 #include <string.h>
 
+#define pr_trace(fmt, ...) kprintf("physmem: " fmt, ##__VA_ARGS__)
+#define pr_error(...) pr_trace(__VA_ARGS__)
+
 #define BYTES_PER_MIB 8388608
 
+/*
+ * Each frame has a tag byte. The first frame of a
+ * block on a free list has FRAME_FREE set along with
+ * the order of the block, frames sitting in a per-CPU
+ * magazine have FRAME_CACHED set. Anything else is
+ * either allocated or part of a larger free block.
+ *
+ * Allocated frames that are shared (e.g., copy-on-write
+ * after fork) keep the number of extra references in
+ * the low bits instead.
+ */
+#define FRAME_FREE      BIT(7)
+#define FRAME_CACHED    BIT(6)
+#define FRAME_ORDER     0x3F
+#define FRAME_REFS      0x3F
+
+/* Per-CPU order-0 magazine size and refill batch */
+#define MAG_SIZE    64
+#define MAG_BATCH   (MAG_SIZE / 2)
+
+/*
+ * Size of the pre-zeroed frame pool, the level below
+ * which a full pool gets refilled, how many frames
+ * the zeroing thread does at a time and how long it
+ * backs off while the processor is busy.
+ */
+#define ZPOOL_SIZE          512
+#define ZPOOL_LOW           (ZPOOL_SIZE / 4)
+#define ZPOOL_BATCH         16
+#define ZEROD_WAIT_USEC     10000
+
+/*
+ * Free blocks are linked through their
+ * own memory.
+ */
+struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
+};
+
+/*
+ * A small per-CPU stack of free order-0 frames. Only
+ * its own processor touches it, with interrupts masked,
+ * so it needs no lock.
+ */
+struct page_mag {
+    size_t count;
+    uintptr_t frames[MAG_SIZE];
+};
+
 static size_t pages_free = 0;
-static size_t pages_used = 0;
+static size_t pages_reserved = 0;
+static size_t pages_usable = 0;
 static size_t pages_total = 0;
 static size_t highest_frame_idx = 0;
-static size_t bitmap_size = 0;
-static size_t bitmap_free_start = 0;
-static ssize_t last_idx = 0;
 
-static uint8_t *bitmap;
+static uint8_t *frame_tag;
+static struct buddy_block *free_area[VM_NORDER];
+static size_t nfree_order[VM_NORDER];
+static struct page_mag page_mags[CPU_MAX];
 static struct limine_memmap_response *resp = NULL;
+extern struct proc g_proc0;
 static struct spinlock lock = {0};
 
+/*
+ * Pool of order-0 frames zeroed ahead of time by
+ * the zeroing thread.
+ */
+static size_t zpool[ZPOOL_SIZE];
+static volatile size_t zpool_count = 0;
+static struct spinlock zpool_lock = {0};
+
 static struct limine_memmap_request mmap_req = {
     .id = LIMINE_MEMMAP_REQUEST,
     .revision = 0
 };
 
+static inline struct buddy_block *
+pfn_to_block(size_t pfn)
+{
+    return PHYS_TO_VIRT(pfn * DEFAULT_PAGESIZE);
+}
+
+static inline size_t
+block_to_pfn(struct buddy_block *bp)
+{
+    return ((uintptr_t)bp - VM_HIGHER_HALF) / DEFAULT_PAGESIZE;
+}
+
 /*
- * Populate physical memory bitmap.
+ * Returns the order needed to hold `count'
+ * frames.
  */
-static void
-physmem_populate_bitmap(void)
+static inline uint8_t
+count_to_order(size_t count)
 {
-    struct limine_memmap_entry *ent;
+    uint8_t order = 0;
 
-    for (size_t i = 0; i < resp->entry_count; ++i) {
-        ent = resp->entries[i];
-        pages_total += ent->length / DEFAULT_PAGESIZE;
+    while ((1ULL << order) < count) {
+        ++order;
+    }
 
-        if (ent->type != LIMINE_MEMMAP_USABLE) {
-            /* This memory is not usable */
-            pages_used += ent->length / DEFAULT_PAGESIZE;
-            continue;
-        }
+    return order;
+}
 
-        if (bitmap_free_start == 0) {
-            bitmap_free_start = ent->base / DEFAULT_PAGESIZE;
-        }
+/*
+ * Push a block onto the free list of its order.
+ *
+ * XXX: Physmem lock must be held.
+ */
+static void
+buddy_push(size_t pfn, uint8_t order)
+{
+    struct buddy_block *bp = pfn_to_block(pfn);
+    struct buddy_block *head = free_area[order];
 
-        for (size_t j = 0; j < ent->length; j += DEFAULT_PAGESIZE) {
-            clrbit(bitmap, (ent->base + j) / DEFAULT_PAGESIZE);
-        }
+    bp->prev = NULL;
+    bp->next = head;
+    if (head != NULL) {
+        head->prev = bp;
+    }
+
+    free_area[order] = bp;
+    frame_tag[pfn] = FRAME_FREE | order;
+    ++nfree_order[order];
+    pages_free += 1ULL << order;
+}
 
-        pages_free += ent->length / DEFAULT_PAGESIZE;
+/*
+ * Remove a block from the free list of its order.
+ *
+ * XXX: Physmem lock must be held.
+ */
+static void
+buddy_remove(size_t pfn, uint8_t order)
+{
+    struct buddy_block *bp = pfn_to_block(pfn);
+
+    if (bp->prev != NULL) {
+        bp->prev->next = bp->next;
+    } else {
+        free_area[order] = bp->next;
+    }
+    if (bp->next != NULL) {
+        bp->next->prev = bp->prev;
     }
+
+    frame_tag[pfn] = 0;
+    --nfree_order[order];
+    pages_free -= 1ULL << order;
 }
 
 /*
- * Allocate physical memory for the bitmap
- * we'll use to keep track of free memory.
+ * Free a block, merging it with its buddy for as
+ * long as the buddy is free and of the same order.
+ *
+ * XXX: Physmem lock must be held.
  */
 static void
-physmem_alloc_bitmap(void)
+buddy_free(size_t pfn, uint8_t order)
 {
-    struct limine_memmap_entry *ent;
-    uintptr_t highest_addr = 0;
+    size_t buddy;
 
-    for (size_t i = 0; i < resp->entry_count; ++i) {
-        ent = resp->entries[i];
+    if (ISSET(frame_tag[pfn], FRAME_FREE | FRAME_CACHED)) {
+        pr_error("double free of frame %p\n", pfn * DEFAULT_PAGESIZE);
+        return;
+    }
 
-        if (ent->type != LIMINE_MEMMAP_USABLE) {
-            /* This memory is not usable */
-            continue;
+    while (order < VM_NORDER - 1) {
+        buddy = pfn ^ (1ULL << order);
+        if (buddy + (1ULL << order) > highest_frame_idx) {
+            break;
         }
-
-        if (ent->length >= bitmap_size) {
-            bitmap = PHYS_TO_VIRT(ent->base);
-            memset(bitmap, 0xFF, bitmap_size);
-            ent->length -= bitmap_size;
-            ent->base += bitmap_size;
-            return;
+        if (frame_tag[buddy] != (FRAME_FREE | order)) {
+            break;
         }
 
-        highest_addr = MAX(highest_addr, ent->base + ent->length);
+        buddy_remove(buddy, order);
+        pfn = MIN(pfn, buddy);
+        ++order;
     }
-}
 
+    buddy_push(pfn, order);
+}
 
 /*
- * Init the physical memory bitmap.
+ * Free a range of frames as the largest naturally
+ * aligned blocks that fit.
+ *
+ * XXX: Physmem lock must be held.
  */
 static void
-physmem_init_bitmap(void)
+buddy_free_range(size_t pfn, size_t count)
 {
-    uintptr_t highest_addr = 0;
-    struct limine_memmap_entry *ent;
+    uint8_t order;
 
-    for (size_t i = 0; i < resp->entry_count; ++i) {
-        ent = resp->entries[i];
+    while (count > 0) {
+        order = 0;
+        while (order < VM_NORDER - 1) {
+            if ((pfn & (1ULL << order)) != 0) {
+                break;
+            }
+            if ((2ULL << order) > count) {
+                break;
+            }
+            ++order;
+        }
 
-        if (ent->type != LIMINE_MEMMAP_USABLE) {
-            continue;
+        buddy_free(pfn, order);
+        pfn += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+/*
+ * Allocate a block of `order', splitting a larger
+ * one if needed. Returns the first frame number or
+ * 0 if we are out of memory.
+ *
+ * XXX: Physmem lock must be held.
+ */
+static size_t
+buddy_alloc(uint8_t order)
+{
+    struct buddy_block *bp;
+    uint8_t i;
+    size_t pfn;
+
+    for (i = order; i < VM_NORDER; ++i) {
+        if (free_area[i] != NULL) {
+            break;
         }
+    }
 
-        highest_addr = MAX(highest_addr, ent->base + ent->length);
+    if (i >= VM_NORDER) {
+        return 0;
     }
 
-    highest_frame_idx = highest_addr / DEFAULT_PAGESIZE;
-    bitmap_size = ALIGN_UP(highest_frame_idx / 8, DEFAULT_PAGESIZE);
+    bp = free_area[i];
+    pfn = block_to_pfn(bp);
+    buddy_remove(pfn, i);
+
+    /* Give back the upper halves we don't need */
+    while (i > order) {
+        --i;
+        buddy_push(pfn + (1ULL << i), i);
+    }
 
-    physmem_alloc_bitmap();
-    physmem_populate_bitmap();
+    return pfn;
 }
 
 /*
- * Allocate page frames.
+ * Slow path for contiguous allocations the free
+ * lists cannot serve, either because they are
+ * larger than the largest order or because every
+ * block big enough has been split. Looks for `count'
+ * frames worth of free blocks that happen to sit
+ * next to each other and takes them all. Returns
+ * the first frame number or 0 if there is no such
+ * run.
  *
- * @count: Number of frames to allocate.
+ * XXX: Physmem lock must be held.
+ */
+static size_t
+buddy_alloc_scan(size_t count)
+{
+    size_t pfn = 1, start = 0, run = 0;
+    size_t blksize, end;
+    uint8_t tag;
+
+    while (pfn < highest_frame_idx && run < count) {
+        tag = frame_tag[pfn];
+        if (!ISSET(tag, FRAME_FREE) || ISSET(tag, FRAME_CACHED)) {
+            run = 0;
+            ++pfn;
+            continue;
+        }
+
+        if (run == 0) {
+            start = pfn;
+        }
+
+        blksize = 1ULL << (tag & FRAME_ORDER);
+        run += blksize;
+        pfn += blksize;
+    }
+
+    if (run < count) {
+        return 0;
+    }
+
+    /* Pull the blocks off of the free lists */
+    end = pfn;
+    for (pfn = start; pfn < end; pfn += blksize) {
+        tag = frame_tag[pfn];
+        blksize = 1ULL << (tag & FRAME_ORDER);
+        buddy_remove(pfn, tag & FRAME_ORDER);
+    }
+
+    /* The last block may go past what we need */
+    if (run > count) {
+        buddy_free_range(start + count, run - count);
+    }
+
+    return start;
+}
+
+/*
+ * Allocate `count' frames, returning the tail of
+ * the block that is not needed.
  */
 static uintptr_t
 __vm_alloc_frame(size_t count)
 {
-    size_t frames = 0;
-    ssize_t idx = -1;
-    uintptr_t ret = 0;
+    uint8_t order;
+    size_t pfn, blksize;
+
+    order = count_to_order(count);
+    spinlock_acquire(&lock);
+    if (order >= VM_NORDER || (pfn = buddy_alloc(order)) == 0) {
+        pfn = buddy_alloc_scan(count);
+        spinlock_release(&lock);
+        return pfn * DEFAULT_PAGESIZE;
+    }
+
+    blksize = 1ULL << order;
+    if (blksize > count) {
+        buddy_free_range(pfn + count, blksize - count);
+    }
+
+    spinlock_release(&lock);
+    return pfn * DEFAULT_PAGESIZE;
+}
+
+/*
+ * Get the magazine of the current processor and
+ * mask interrupts so that we stay on it. Returns
+ * NULL if per-CPU data is not up yet.
+ *
+ * @masked: Set to whether interrupts were masked.
+ */
+static struct page_mag *
+mag_get(bool *masked)
+{
+    struct cpu_info *ci;
+
+    *masked = md_intr_masked();
+    md_intoff();
+    if ((ci = this_cpu()) == NULL) {
+        if (!*masked) {
+            md_inton();
+        }
+        return NULL;
+    }
+
+    return &page_mags[ci->id];
+}
+
+static inline void
+mag_put(bool masked)
+{
+    if (!masked) {
+        md_inton();
+    }
+}
+
+/*
+ * Allocate a single frame, from the magazine of
+ * the current processor if possible.
+ */
+static uintptr_t
+vm_alloc_frame1(void)
+{
+    struct page_mag *mag;
+    size_t pfn;
+    uintptr_t pa = 0;
+    bool masked;
+
+    if ((mag = mag_get(&masked)) == NULL) {
+        return __vm_alloc_frame(1);
+    }
 
-    for (size_t i = last_idx; i < highest_frame_idx; ++i) {
-        if (!testbit(bitmap, i)) {
-            if (idx < 0)
-                idx = i;
-            if (++frames >= count)
+    /* Refill in a batch if the magazine is empty */
+    if (mag->count == 0) {
+        spinlock_acquire(&lock);
+        while (mag->count < MAG_BATCH) {
+            if ((pfn = buddy_alloc(0)) == 0) {
                 break;
+            }
 
-            continue;
+            frame_tag[pfn] = FRAME_CACHED;
+            mag->frames[mag->count++] = pfn;
         }
+        spinlock_release(&lock);
+    }
 
-        idx = -1;
-        frames = 0;
+    if (mag->count > 0) {
+        pfn = mag->frames[--mag->count];
+        frame_tag[pfn] = 0;
+        pa = pfn * DEFAULT_PAGESIZE;
     }
 
-    if (idx < 0 || frames != count) {
-        ret = 0;
-        goto done;
+    mag_put(masked);
+    return pa;
+}
+
+/*
+ * Free a single frame into the magazine of the
+ * current processor, spilling half of it back to
+ * the buddy allocator when it is full.
+ */
+static void
+vm_free_frame1(size_t pfn)
+{
+    struct page_mag *mag;
+    size_t spill;
+    bool masked;
+
+    if ((mag = mag_get(&masked)) == NULL) {
+        spinlock_acquire(&lock);
+        buddy_free(pfn, 0);
+        spinlock_release(&lock);
+        return;
     }
 
-    for (size_t i = idx; i < idx + count; ++i) {
-        setbit(bitmap, i);
+    if (ISSET(frame_tag[pfn], FRAME_FREE | FRAME_CACHED)) {
+        pr_error("double free of frame %p\n", pfn * DEFAULT_PAGESIZE);
+        mag_put(masked);
+        return;
     }
-    ret = idx * DEFAULT_PAGESIZE;
-    last_idx = idx;
-    memset(PHYS_TO_VIRT(ret), 0, count * DEFAULT_PAGESIZE);
-done:
-    return ret;
+
+    if (mag->count >= MAG_SIZE) {
+        spinlock_acquire(&lock);
+        while (mag->count > MAG_BATCH) {
+            spill = mag->frames[--mag->count];
+            frame_tag[spill] = 0;
+            buddy_free(spill, 0);
+        }
+        spinlock_release(&lock);
+    }
+
+    frame_tag[pfn] = FRAME_CACHED;
+    mag->frames[mag->count++] = pfn;
+    mag_put(masked);
+}
+
+/*
+ * Take a frame from the pre-zeroed pool, returns
+ * zero if the pool is empty. The zeroing thread is
+ * woken up once the pool drops below ZPOOL_LOW.
+ */
+static uintptr_t
+zpool_take(void)
+{
+    size_t pfn;
+    bool low;
+
+    if (zpool_count == 0) {
+        return 0;
+    }
+
+    spinlock_acquire(&zpool_lock);
+    if (zpool_count == 0) {
+        spinlock_release(&zpool_lock);
+        return 0;
+    }
+
+    pfn = zpool[--zpool_count];
+    frame_tag[pfn] = 0;
+    low = (zpool_count == ZPOOL_LOW - 1);
+    spinlock_release(&zpool_lock);
+
+    if (low) {
+        wakeup_one(zpool);
+    }
+
+    return pfn * DEFAULT_PAGESIZE;
+}
+
+/*
+ * Put a zeroed frame into the pool, returns
+ * false if the pool is full.
+ */
+static bool
+zpool_put(uintptr_t pa)
+{
+    size_t pfn = pa / DEFAULT_PAGESIZE;
+
+    spinlock_acquire(&zpool_lock);
+    if (zpool_count >= ZPOOL_SIZE) {
+        spinlock_release(&zpool_lock);
+        return false;
+    }
+
+    frame_tag[pfn] = FRAME_CACHED;
+    zpool[zpool_count++] = pfn;
+    spinlock_release(&zpool_lock);
+    return true;
 }
 
+/*
+ * Allocate page frames.
+ *
+ * @count: Number of frames to allocate.
+ * @flags: Allocation flags (VM_ALLOC_*)
+ *
+ * Single zeroed frames come from the pre-zeroed pool
+ * when possible, otherwise the frames are zeroed here
+ * if VM_ALLOC_ZERO is set.
+ */
 uintptr_t
-vm_alloc_frame(size_t count)
+vm_alloc_frame_flags(size_t count, int flags)
 {
     uintptr_t ret;
+    bool zero = ISSET(flags, VM_ALLOC_ZERO);
 
-    spinlock_acquire(&lock);
-    if ((ret = __vm_alloc_frame(count)) == 0) {
-        last_idx = 0;
+    if (count == 1 && zero) {
+        if ((ret = zpool_take()) != 0) {
+            return ret;
+        }
+    }
+
+    if (count == 1) {
+        ret = vm_alloc_frame1();
+    } else {
         ret = __vm_alloc_frame(count);
     }
 
+    /* Out of free frames, use up the zeroed ones too */
+    if (ret == 0 && count == 1) {
+        if ((ret = zpool_take()) != 0) {
+            return ret;
+        }
+    }
+
+    /* Still nothing, take pages from the page cache */
+    if (ret == 0 && vn_reclaim(count) > 0) {
+        ret = (count == 1) ? vm_alloc_frame1() : __vm_alloc_frame(count);
+    }
+
     if (ret == 0) {
         panic("out of memory\n");
     }
 
-    pages_used += count;
-    pages_free -= count;
-    spinlock_release(&lock);
+    if (zero) {
+        memset(PHYS_TO_VIRT(ret), 0, count * DEFAULT_PAGESIZE);
+    }
+
     return ret;
 }
 
+uintptr_t
+vm_alloc_frame(size_t count)
+{
+    return vm_alloc_frame_flags(count, VM_ALLOC_ZERO);
+}
+
+/*
+ * Drop an extra reference to a shared frame, returns
+ * false if the frame has no other references.
+ *
+ * XXX: Physmem lock must be held.
+ */
+static bool
+frame_unshare(size_t pfn)
+{
+    uint8_t tag = frame_tag[pfn];
+
+    if (ISSET(tag, FRAME_FREE | FRAME_CACHED)) {
+        return false;
+    }
+    if ((tag & FRAME_REFS) == 0) {
+        return false;
+    }
+
+    --frame_tag[pfn];
+    return true;
+}
+
+/*
+ * Free page frames, or drop a reference to the
+ * frames that are shared.
+ *
+ * @base: Physical address of the first frame.
+ * @count: Number of frames.
+ */
 void
 vm_free_frame(uintptr_t base, size_t count)
 {
-    size_t stop_at = base + (count * DEFAULT_PAGESIZE);
+    size_t pfn, run;
+    bool shared;
 
     base = ALIGN_UP(base, DEFAULT_PAGESIZE);
+    pfn = base / DEFAULT_PAGESIZE;
+    if (count == 0 || pfn + count > highest_frame_idx) {
+        return;
+    }
+
+    if (count == 1) {
+        if (frame_tag[pfn] != 0) {
+            spinlock_acquire(&lock);
+            shared = frame_unshare(pfn);
+            spinlock_release(&lock);
+            if (shared) {
+                return;
+            }
+        }
+
+        vm_free_frame1(pfn);
+        return;
+    }
+
+    /* Free the runs of frames nobody else references */
+    spinlock_acquire(&lock);
+    run = pfn;
+    for (size_t i = pfn; i < pfn + count; ++i) {
+        if (!frame_unshare(i)) {
+            continue;
+        }
+        if (i > run) {
+            buddy_free_range(run, i - run);
+        }
+        run = i + 1;
+    }
+
+    if (pfn + count > run) {
+        buddy_free_range(run, (pfn + count) - run);
+    }
+    spinlock_release(&lock);
+}
+
+/*
+ * Take another reference to an allocated frame so
+ * that it may be shared. Each reference is dropped
+ * with vm_free_frame() and the frame is only freed
+ * along with the last one.
+ *
+ * @pa: Physical address of the frame.
+ *
+ * Returns -EMLINK if the frame cannot take any
+ * more references.
+ */
+int
+vm_frame_share(uintptr_t pa)
+{
+    size_t pfn = pa / DEFAULT_PAGESIZE;
+    int error = 0;
+
+    if (pfn == 0 || pfn >= highest_frame_idx) {
+        return -EINVAL;
+    }
 
     spinlock_acquire(&lock);
-    for (uintptr_t p = base; p < stop_at; p += DEFAULT_PAGESIZE) {
-        clrbit(bitmap, p / DEFAULT_PAGESIZE);
+    if (ISSET(frame_tag[pfn], FRAME_FREE | FRAME_CACHED)) {
+        error = -EINVAL;
+    } else if ((frame_tag[pfn] & FRAME_REFS) == FRAME_REFS) {
+        error = -EMLINK;
+    } else {
+        ++frame_tag[pfn];
     }
-    pages_used -= count;
-    pages_free += count;
     spinlock_release(&lock);
+    return error;
+}
+
+/*
+ * Returns the number of references to an
+ * allocated frame.
+ */
+size_t
+vm_frame_refs(uintptr_t pa)
+{
+    size_t pfn = pa / DEFAULT_PAGESIZE;
+    size_t refs;
+
+    if (pfn == 0 || pfn >= highest_frame_idx) {
+        return 1;
+    }
+
+    spinlock_acquire(&lock);
+    if (ISSET(frame_tag[pfn], FRAME_FREE | FRAME_CACHED)) {
+        refs = 0;
+    } else {
+        refs = 1 + (frame_tag[pfn] & FRAME_REFS);
+    }
+    spinlock_release(&lock);
+    return refs;
+}
+
+/*
+ * Returns the number of free frames, including
+ * the ones cached in per-CPU magazines.
+ */
+static size_t
+physmem_nfree(void)
+{
+    size_t nfree = pages_free + zpool_count;
+
+    for (size_t i = 0; i < CPU_MAX; ++i) {
+        nfree += page_mags[i].count;
+    }
+
+    return nfree;
 }
 
 /*
@@ -228,7 +763,10 @@ vm_free_frame(uintptr_t base, size_t count)
 uint32_t
 vm_mem_used(void)
 {
-    return (pages_used * DEFAULT_PAGESIZE) / BYTES_PER_MIB;
+    size_t used;
+
+    used = pages_reserved + (pages_usable - physmem_nfree());
+    return (used * DEFAULT_PAGESIZE) / BYTES_PER_MIB;
 }
 
 /*
@@ -238,7 +776,7 @@ vm_mem_used(void)
 uint32_t
 vm_mem_free(void)
 {
-    return (pages_free * DEFAULT_PAGESIZE) / BYTES_PER_MIB;
+    return (physmem_nfree() * DEFAULT_PAGESIZE) / BYTES_PER_MIB;
 }
 
 /*
@@ -251,9 +789,152 @@ vm_mem_total(void)
     return (pages_total * DEFAULT_PAGESIZE) / BYTES_PER_MIB;
 }
 
+/*
+ * Get the number of free blocks of each order.
+ *
+ * @res: Array of VM_NORDER entries to fill.
+ */
+void
+vm_order_free(uint32_t *res)
+{
+    spinlock_acquire(&lock);
+    for (size_t i = 0; i < VM_NORDER; ++i) {
+        res[i] = nfree_order[i];
+    }
+    spinlock_release(&lock);
+}
+
+/*
+ * Allocate the frame tag array from the first
+ * usable memory map entry large enough to hold it.
+ *
+ * @size: Size of the tag array in bytes.
+ */
+static void
+physmem_alloc_tags(size_t size)
+{
+    struct limine_memmap_entry *ent;
+
+    for (size_t i = 0; i < resp->entry_count; ++i) {
+        ent = resp->entries[i];
+
+        if (ent->type != LIMINE_MEMMAP_USABLE) {
+            /* This memory is not usable */
+            continue;
+        }
+
+        if (ent->length >= size) {
+            frame_tag = PHYS_TO_VIRT(ent->base);
+            memset(frame_tag, 0, size);
+            ent->length -= size;
+            ent->base += size;
+            pages_reserved += size / DEFAULT_PAGESIZE;
+            return;
+        }
+    }
+
+    panic("no memory for frame tags\n");
+}
+
+/*
+ * Build the free lists from the memory map.
+ */
+static void
+physmem_init_buddy(void)
+{
+    struct limine_memmap_entry *ent;
+    uintptr_t highest_addr = 0;
+    size_t pfn, count;
+
+    for (size_t i = 0; i < resp->entry_count; ++i) {
+        ent = resp->entries[i];
+        pages_total += ent->length / DEFAULT_PAGESIZE;
+
+        if (ent->type != LIMINE_MEMMAP_USABLE) {
+            continue;
+        }
+
+        highest_addr = MAX(highest_addr, ent->base + ent->length);
+    }
+
+    highest_frame_idx = highest_addr / DEFAULT_PAGESIZE;
+    physmem_alloc_tags(ALIGN_UP(highest_frame_idx, DEFAULT_PAGESIZE));
+
+    for (size_t i = 0; i < resp->entry_count; ++i) {
+        ent = resp->entries[i];
+
+        if (ent->type != LIMINE_MEMMAP_USABLE) {
+            /* This memory is not usable */
+            pages_reserved += ent->length / DEFAULT_PAGESIZE;
+            continue;
+        }
+
+        /*
+         * Frame zero doubles as the allocation failure
+         * value, so never hand it out.
+         */
+        pfn = ALIGN_UP(ent->base, DEFAULT_PAGESIZE) / DEFAULT_PAGESIZE;
+        count = ent->length / DEFAULT_PAGESIZE;
+        if (pfn == 0 && count > 0) {
+            ++pfn;
+            --count;
+            ++pages_reserved;
+        }
+
+        pages_usable += count;
+        buddy_free_range(pfn, count);
+    }
+}
+
+/*
+ * Page zeroing thread, fills the pre-zeroed pool
+ * whenever the processor has nothing else to do.
+ * A full pool is left alone until zpool_take()
+ * drains it below ZPOOL_LOW.
+ */
+static void
+vm_zerod(void)
+{
+    uintptr_t pa;
+
+    for (;;) {
+        spinlock_acquire(&zpool_lock);
+        while (zpool_count >= ZPOOL_SIZE) {
+            msleep_spin(zpool, &zpool_lock, 0);
+        }
+        spinlock_release(&zpool_lock);
+
+        if (sched_cpu_busy()) {
+            tsleep(zpool, ZEROD_WAIT_USEC);
+            continue;
+        }
+
+        for (size_t i = 0; i < ZPOOL_BATCH; ++i) {
+            if ((pa = vm_alloc_frame1()) == 0) {
+                break;
+            }
+
+            pmap_zero_page(pa);
+            if (!zpool_put(pa)) {
+                vm_free_frame(pa, 1);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Start the page zeroing thread.
+ */
+void
+vm_zero_start(void)
+{
+    spawn(&g_proc0, vm_zerod, NULL, 0, NULL);
+}
+
 void
 vm_physmem_init(void)
 {
     resp = mmap_req.response;
-    physmem_init_bitmap();
+    physmem_init_buddy();
 }
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2023-2025 Ian Marco Moffett and the Osmora Team.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Hyra nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <vm/vm_radix.h>
+#include <vm/dynalloc.h>
+#include <string.h>
+
+#define radix_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define radix_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/*
+ * Returns true if a node of `level' can
+ * hold index `idx' below it.
+ */
+static inline bool
+radix_fits(uint8_t level, uint64_t idx)
+{
+    size_t shift = VM_RADIX_SHIFT * (level + 1);
+
+    return shift >= 64 || (idx >> shift) == 0;
+}
+
+static inline size_t
+radix_slot(uint8_t level, uint64_t idx)
+{
+    return (idx >> (VM_RADIX_SHIFT * level)) & VM_RADIX_MASK;
+}
+
+static struct vm_radix_node *
+radix_node_alloc(uint8_t level)
+{
+    struct vm_radix_node *node;
+
+    node = dynalloc(sizeof(*node));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    memset(node, 0, sizeof(*node));
+    node->level = level;
+    return node;
+}
+
+static void
+radix_node_free(struct vm_radix_node *node)
+{
+    if (node->level > 0) {
+        for (size_t i = 0; i < VM_RADIX_SLOTS; ++i) {
+            if (node->slot[i] != NULL)
+                radix_node_free(node->slot[i]);
+        }
+    }
+
+    dynfree(node);
+}
+
+/*
+ * Find the first value at or after `*idx' below
+ * a node.
+ */
+static void *
+radix_next(struct vm_radix_node *node, uint64_t *idx)
+{
+    size_t shift = VM_RADIX_SHIFT * node->level;
+    size_t first = radix_slot(node->level, *idx);
+    uint64_t base, start;
+    void *p, *val;
+
+    /* Index bits above what this node covers */
+    base = *idx & ~(((uint64_t)VM_RADIX_SLOTS << shift) - 1);
+
+    for (size_t i = first; i < VM_RADIX_SLOTS; ++i) {
+        start = (i == first) ? *idx : base | ((uint64_t)i << shift);
+        if ((p = radix_load(&node->slot[i])) == NULL) {
+            continue;
+        }
+
+        if (node->level == 0) {
+            *idx = start;
+            return p;
+        }
+
+        if ((val = radix_next(p, &start)) != NULL) {
+            *idx = start;
+            return val;
+        }
+    }
+
+    return NULL;
+}
+
+void
+vm_radix_init(struct vm_radix *rt)
+{
+    rt->root = NULL;
+}
+
+/*
+ * Insert a value, the tree grows taller as
+ * needed to cover `idx'.
+ *
+ * Returns -EEXIST if `idx' already has a value.
+ */
+int
+vm_radix_insert(struct vm_radix *rt, uint64_t idx, void *val)
+{
+    struct vm_radix_node *node, *child;
+    size_t slot;
+
+    if ((node = rt->root) == NULL) {
+        if ((node = radix_node_alloc(0)) == NULL)
+            return -ENOMEM;
+
+        radix_store(&rt->root, node);
+    }
+
+    /* Push the root down until `idx' fits */
+    while (!radix_fits(node->level, idx)) {
+        if ((child = radix_node_alloc(node->level + 1)) == NULL)
+            return -ENOMEM;
+
+        child->slot[0] = node;
+        radix_store(&rt->root, child);
+        node = child;
+    }
+
+    while (node->level > 0) {
+        slot = radix_slot(node->level, idx);
+        if ((child = node->slot[slot]) == NULL) {
+            if ((child = radix_node_alloc(node->level - 1)) == NULL)
+                return -ENOMEM;
+
+            radix_store(&node->slot[slot], child);
+        }
+
+        node = child;
+    }
+
+    slot = radix_slot(0, idx);
+    if (node->slot[slot] != NULL) {
+        return -EEXIST;
+    }
+
+    radix_store(&node->slot[slot], val);
+    return 0;
+}
+
+/*
+ * Look up a value, this does not need the lock
+ * writers hold.
+ */
+void *
+vm_radix_lookup(struct vm_radix *rt, uint64_t idx)
+{
+    struct vm_radix_node *node;
+    void *p;
+
+    node = radix_load(&rt->root);
+    if (node == NULL || !radix_fits(node->level, idx)) {
+        return NULL;
+    }
+
+    for (;;) {
+        p = radix_load(&node->slot[radix_slot(node->level, idx)]);
+        if (p == NULL || node->level == 0) {
+            return p;
+        }
+
+        node = p;
+    }
+}
+
+/*
+ * Remove a value and return it, or NULL if
+ * there was none.
+ */
+void *
+vm_radix_remove(struct vm_radix *rt, uint64_t idx)
+{
+    struct vm_radix_node *node = rt->root;
+    void **slotp;
+    void *val;
+
+    if (node == NULL || !radix_fits(node->level, idx)) {
+        return NULL;
+    }
+
+    while (node->level > 0) {
+        node = node->slot[radix_slot(node->level, idx)];
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    slotp = &node->slot[radix_slot(0, idx)];
+    val = *slotp;
+    radix_store(slotp, NULL);
+    return val;
+}
+
+/*
+ * Get the value with the lowest index at or
+ * after `*idx', which is updated to its index.
+ * Returns NULL if there is none.
+ */
+void *
+vm_radix_next(struct vm_radix *rt, uint64_t *idx)
+{
+    struct vm_radix_node *node;
+
+    node = radix_load(&rt->root);
+    if (node == NULL || !radix_fits(node->level, *idx)) {
+        return NULL;
+    }
+
+    return radix_next(node, idx);
+}
+
+/*
+ * Free every node of a tree, the values are
+ * left to the caller.
+ */
+void
+vm_radix_destroy(struct vm_radix *rt)
+{
+    if (rt->root != NULL) {
+        radix_node_free(rt->root);
+        rt->root = NULL;
+    }
+}
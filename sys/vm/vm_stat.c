@@ -28,9 +28,12 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/cdefs.h>
 #include <sys/errno.h>
 #include <fs/ctlfs.h>
 #include <vm/physmem.h>
+#include <vm/dynalloc.h>
 #include <vm/vm.h>
 #include <vm/stat.h>
 #include <string.h>
@@ -38,6 +41,7 @@
 #include <sys/syslog.h>
 
 static struct ctlops vm_stat_ctl;
+static struct ctlops vm_dynstat_ctl;
 
 /*
  * ctlfs hook to read the virtual memory
@@ -62,6 +66,40 @@ vm_stat_read(struct ctlfs_dev *cdp, struct sio_txn *sio)
     return sio->len;
 }
 
+/*
+ * ctlfs hook to read the dynalloc arena
+ * statistics as a `struct vm_dynstat'.
+ */
+static int
+vm_dynstat_read(struct ctlfs_dev *cdp, struct sio_txn *sio)
+{
+    struct vm_arena_stat stat;
+    uint32_t narena;
+    size_t off, len;
+    char *buf = sio->buf;
+
+    if (sio->len > sizeof(struct vm_dynstat)) {
+        sio->len = sizeof(struct vm_dynstat);
+    }
+
+    /* Fill the header then each arena in place */
+    narena = dynalloc_narena();
+    len = MIN(sio->len, sizeof(narena));
+    memcpy(buf, &narena, len);
+    for (size_t i = 0; i < narena; ++i) {
+        off = offsetof(struct vm_dynstat, arena[i]);
+        if (off >= sio->len) {
+            break;
+        }
+
+        dynalloc_stat(i, &stat);
+        len = MIN(sio->len - off, sizeof(stat));
+        memcpy(buf + off, &stat, len);
+    }
+
+    return sio->len;
+}
+
 int
 vm_stat_get(struct vm_stat *vmstat)
 {
@@ -72,6 +110,7 @@ vm_stat_get(struct vm_stat *vmstat)
     vmstat->mem_avail = vm_mem_free();
     vmstat->mem_used = vm_mem_used();
     vmstat->mem_total = vm_mem_total();
+    vm_order_free(vmstat->order_free);
     return 0;
 }
 
@@ -83,13 +122,21 @@ vm_stat_init(void)
 
     /* Register a stat control file */
     ctl.mode = 0444;
+    ctl.data = NULL;
     ctlfs_create_node(devname, &ctl);
     ctl.devname = devname;
     ctl.ops = &vm_stat_ctl;
     ctlfs_create_entry("stat", &ctl);
+    ctl.ops = &vm_dynstat_ctl;
+    ctlfs_create_entry("dynalloc", &ctl);
 }
 
 static struct ctlops vm_stat_ctl = {
     .read = vm_stat_read,
     .write = NULL
 };
+
+static struct ctlops vm_dynstat_ctl = {
+    .read = vm_dynstat_read,
+    .write = NULL
+};
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/cdefs.h>
 #include <sys/errno.h>
+#include <sys/param.h>
 #include <sys/syslog.h>
 #include <sys/systm.h>
 #include <sys/vnode.h>
@@ -37,8 +38,11 @@
 #include <vm/vm_page.h>
 #include <vm/pmap.h>
 #include <vm/vm.h>
+#include <string.h>
 
-#define VN_TIMEOUT_USEC 200000
+/* Readahead window bounds (in pages) */
+#define VN_RA_MIN 4
+#define VN_RA_MAX 32
 
 #define pr_trace(fmt, ...) kprintf("vm_vnode: " fmt, ##__VA_ARGS__)
 #define pr_error(...) pr_trace(__VA_ARGS__)
@@ -50,50 +54,198 @@
 #define pr_debug(...) __nothing
 #endif  /* PR_DEBUG */
 
+#define pg_isvalid(PG) \
+    ISSET(__atomic_load_n(&(PG)->flags, __ATOMIC_ACQUIRE), PG_VALID)
+
+/*
+ * Vnodes that have a page cache attached, pages of
+ * the ones nobody is using are given back when
+ * memory runs low.
+ */
+static TAILQ_HEAD(, vnode) pgcache = TAILQ_HEAD_INITIALIZER(pgcache);
+static struct spinlock pgcache_lock;
+
 /*
- * Perform read/write operation on vnode to/from pages.
+ * Get the size of the file a vnode refers to.
  *
- * Returns number of bytes read.
+ * @vp: Vnode to query.
+ * @res: Size is written here.
  */
 static int
-vn_io(struct vnode *vp, struct vm_page **pgs, unsigned int npages, int rw)
+vn_getsize(struct vnode *vp, size_t *res)
 {
     struct vop_getattr_args args;
-    struct sio_txn sio;
     struct vattr vattr;
-    size_t c, read = 0;
-    int err;
-
-    /* TODO: Add support for writes */
-    if (rw != 0) {
-        return -ENOTSUP;
-    }
+    int error;
 
     args.vp = vp;
     args.res = &vattr;
-    c = MAX(vattr.size / DEFAULT_PAGESIZE, 1);
+    if ((error = vfs_vop_getattr(&args)) != 0) {
+        return error;
+    }
+
+    *res = vattr.size;
+    return 0;
+}
 
-    if ((err = vfs_vop_getattr(&args)) != 0) {
-        return err;
+/*
+ * Read a single page of a file into a page of its
+ * object. Anything past the end of the file is left
+ * zeroed.
+ *
+ * @vp: Vnode to read from.
+ * @pg: Page to fill, `pg->offset' is the file offset.
+ * @fsize: Size of the file in bytes.
+ */
+static int
+vn_pagein(struct vnode *vp, struct vm_page *pg, size_t fsize)
+{
+    struct sio_txn sio;
+    int n;
+
+    if (pg->offset >= fsize) {
+        return 0;
     }
 
-    if (npages > c) {
-        npages = c;
+    sio.buf = PHYS_TO_VIRT(pg->phys_addr);
+    sio.offset = pg->offset;
+    sio.len = MIN(DEFAULT_PAGESIZE, fsize - pg->offset);
+    if ((n = vfs_vop_read(vp, &sio)) < 0) {
+        pr_debug("vn_pagein: page-in @ %p failed (err=%d)\n", pg->offset, n);
+        return n;
     }
 
-    /* Prepare SIO constants */
-    sio.len = DEFAULT_PAGESIZE;
-    sio.offset = 0;
+    return 0;
+}
 
-    /* Copy in each page */
-    for (size_t i = 0; i < npages; ++i) {
-        sio.buf = PHYS_TO_VIRT(pgs[i]->phys_addr);
-        read = vfs_vop_read(vp, &sio);
-        if (read < 0)
-            pr_debug("vn_io: page-in @ %p failed (err=%d)\n", err);
+/*
+ * Bring in the page at `off' along with up to `ra'
+ * pages after it that are not yet resident. Pages
+ * that would lie wholly past the end of the file are
+ * not read ahead. Must be called with the object
+ * lock held and the page at `off' not resident.
+ *
+ * The pages are inserted invalid and the lock is
+ * dropped while they are read in, anyone who finds
+ * one of them waits until it is valid or gone.
+ *
+ * @vp: Vnode to read from.
+ * @off: Page aligned file offset.
+ * @fsize: Size of the file in bytes.
+ * @ra: Number of pages to read ahead.
+ *
+ * Returns the page at `off' or NULL on failure.
+ */
+static struct vm_page *
+vn_fill(struct vnode *vp, off_t off, size_t fsize, size_t ra)
+{
+    struct vm_object *obp = &vp->vobj;
+    struct vm_page *fill[VN_RA_MAX + 1];
+    struct vm_page *pg;
+    size_t nfill = 0, nvalid = 0;
+    off_t pgoff;
+
+    for (size_t i = 0; i <= ra && nfill < NELEM(fill); ++i) {
+        pgoff = off + (i * DEFAULT_PAGESIZE);
+        if (i > 0 && pgoff >= fsize) {
+            break;
+        }
+
+        if (vm_pagelookup(obp, pgoff) != NULL) {
+            continue;
+        }
+
+        pg = vm_pagealloc(obp, pgoff, PALLOC_ZERO | PALLOC_FILL);
+        if (pg == NULL) {
+            break;
+        }
+
+        fill[nfill++] = pg;
+    }
+
+    if (nfill == 0) {
+        return NULL;
+    }
+
+    /* Stop at the first page that fails to come in */
+    spinlock_release(&obp->lock);
+    while (nvalid < nfill) {
+        if (vn_pagein(vp, fill[nvalid], fsize) != 0) {
+            break;
+        }
+        ++nvalid;
+    }
+    spinlock_acquire(&obp->lock);
+
+    for (size_t i = 0; i < nfill; ++i) {
+        if (i < nvalid) {
+            __atomic_or_fetch(&fill[i]->flags, PG_VALID, __ATOMIC_RELEASE);
+        } else {
+            vm_pagefree(obp, fill[i], 0);
+        }
+
+        wakeup(fill[i]);
+    }
+
+    return (nvalid > 0) ? fill[0] : NULL;
+}
+
+/*
+ * Look up the cached page at a file offset, reading
+ * it in (and `ra' pages after it) if it is not resident.
+ *
+ * @vp: Vnode the page belongs to.
+ * @off: Page aligned file offset.
+ * @fsize: Size of the file in bytes.
+ * @ra: Number of pages to read ahead on a miss.
+ */
+static struct vm_page *
+vn_getpage(struct vnode *vp, off_t off, size_t fsize, size_t ra)
+{
+    struct vm_object *obp = &vp->vobj;
+    struct vm_page *pg;
+
+    /* Fast path, the page is already cached */
+    pg = vm_pagelookup(obp, off);
+    if (pg != NULL && pg_isvalid(pg)) {
+        return pg;
+    }
+
+    spinlock_acquire(&obp->lock);
+    while ((pg = vm_pagelookup(obp, off)) != NULL && !pg_isvalid(pg)) {
+        /* Someone else is reading it in */
+        msleep_spin(pg, &obp->lock, 0);
+    }
+
+    if (pg == NULL) {
+        pg = vn_fill(vp, off, fsize, ra);
+    }
+
+    spinlock_release(&obp->lock);
+    return pg;
+}
+
+/*
+ * Update the readahead window of a vnode for a read
+ * of `len' bytes at `off'. Sequential reads grow the
+ * window while anything else collapses it.
+ *
+ * Returns the number of pages to read ahead.
+ */
+static size_t
+vn_readahead(struct vnode *vp, off_t off, size_t len)
+{
+    uint32_t ra = vp->ra_pages;
+
+    if (off == vp->ra_next) {
+        ra = (ra == 0) ? VN_RA_MIN : MIN(ra * 2, VN_RA_MAX);
+    } else {
+        ra = 0;
     }
 
-    return read;
+    vp->ra_pages = ra;
+    vp->ra_next = off + len;
+    return ra;
 }
 
 /*
@@ -107,50 +259,172 @@ vn_io(struct vnode *vp, struct vm_page **pgs, unsigned int npages, int rw)
 static int
 vn_get(struct vm_object *obp, struct vm_page **pgs, off_t off, size_t len)
 {
-    struct vm_page *pgtmp;
-    size_t j, pgcnt;
+    struct vnode *vp = obp->data;
+    size_t fsize, npages;
+    int error;
 
-    spinlock_acquire(&obp->lock);
+    if ((error = vn_getsize(vp, &fsize)) != 0) {
+        return error;
+    }
+
+    off = ALIGN_DOWN(off, DEFAULT_PAGESIZE);
+    npages = ALIGN_UP(len, DEFAULT_PAGESIZE) / DEFAULT_PAGESIZE;
+    for (size_t i = 0; i < npages; ++i) {
+        pgs[i] = vn_getpage(vp, off, fsize, npages - i - 1);
+        if (pgs[i] == NULL) {
+            return -ENOMEM;
+        }
+
+        off += DEFAULT_PAGESIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Write a page back to backing store, nothing past
+ * the end of the file is written.
+ *
+ * @obp: Object representing the backing store.
+ * @pg: Page to write back.
+ * @len: Length to write in bytes.
+ */
+static int
+vn_put(struct vm_object *obp, struct vm_page *pg, size_t len)
+{
+    struct vnode *vp = obp->data;
+    struct sio_txn sio;
+    size_t fsize;
+    int error;
+
+    if ((error = vn_getsize(vp, &fsize)) != 0) {
+        return error;
+    }
+    if (pg->offset >= fsize) {
+        return 0;
+    }
+
+    sio.buf = PHYS_TO_VIRT(pg->phys_addr);
+    sio.offset = pg->offset;
+    sio.len = MIN(len, fsize - pg->offset);
+    if ((error = vfs_vop_write(vp, &sio)) < 0) {
+        return error;
+    }
+
+    return 0;
+}
+
+/*
+ * Read from a vnode through its page cache. Reads
+ * of anything other than a regular file go straight
+ * to the filesystem.
+ *
+ * @vp: Vnode to read from.
+ * @sio: Transaction describing the read.
+ *
+ * Returns the number of bytes read.
+ */
+ssize_t
+vn_read(struct vnode *vp, struct sio_txn *sio)
+{
+    struct vm_page *pg;
+    char *buf = sio->buf;
+    size_t fsize, len, done, n;
+    size_t npages, ra;
+    off_t off, pgbase, pgoff;
+    int error;
+
+    if (vp->type != VREG) {
+        return vfs_vop_read(vp, sio);
+    }
+    if (vn_attach(vp, PROT_READ | PROT_WRITE) == NULL) {
+        return -ENOMEM;
+    }
+    if ((error = vn_getsize(vp, &fsize)) != 0) {
+        return error;
+    }
+    if (sio->offset >= fsize) {
+        return 0;
+    }
 
-    for (int i = off; i < len; i += DEFAULT_PAGESIZE) {
-        j = i / DEFAULT_PAGESIZE;
-        pgtmp = vm_pagelookup(obp, i);
+    len = MIN(sio->len, fsize - sio->offset);
+    ra = vn_readahead(vp, sio->offset, len);
+    pgbase = ALIGN_DOWN(sio->offset, DEFAULT_PAGESIZE);
+    npages = ALIGN_UP(sio->offset + len, DEFAULT_PAGESIZE) - pgbase;
+    npages /= DEFAULT_PAGESIZE;
+
+    for (done = 0; done < len; done += n) {
+        off = sio->offset + done;
+        pgoff = off & (DEFAULT_PAGESIZE - 1);
+        n = MIN(DEFAULT_PAGESIZE - pgoff, len - done);
 
         /*
-         * If we have no corresponding page in the object
-         * at this offset, we will need to make our own.
+         * A miss brings in the rest of this request
+         * along with the readahead window.
          */
-        if (pgtmp == NULL) {
-            pgtmp = vm_pagealloc(obp, PALLOC_ZERO);
-            if (pgtmp == NULL) {
-                pgs[j]->flags &= ~PG_VALID;
-                continue;
-            }
-            pgtmp->offset = i;
-            pgs[j] = pgtmp;
+        --npages;
+        pg = vn_getpage(vp, off - pgoff, fsize, npages + ra);
+        if (pg == NULL) {
+            return (done > 0) ? done : -EIO;
         }
 
-        if (spinlock_usleep(&pgtmp->lock, VN_TIMEOUT_USEC) != 0) {
-            pgs[j]->flags &= ~PG_VALID;
-            continue;
-        }
+        memcpy(buf + done, PHYS_TO_VIRT(pg->phys_addr + pgoff), n);
+    }
+
+    return done;
+}
 
-        /* Set the page count and ensure it is valid */
-        pgcnt = ALIGN_DOWN(len, DEFAULT_PAGESIZE);
-        pgcnt = MAX(pgcnt, 1);
+/*
+ * Write to a vnode. Writes go through to the
+ * filesystem and any cached pages in the written
+ * range are updated to match.
+ *
+ * @vp: Vnode to write to.
+ * @sio: Transaction describing the write.
+ *
+ * Returns the number of bytes written.
+ */
+ssize_t
+vn_write(struct vnode *vp, struct sio_txn *sio)
+{
+    struct vm_object *obp = &vp->vobj;
+    struct vm_page *pg;
+    const char *buf = sio->buf;
+    size_t done, n;
+    off_t off, pgoff;
+    ssize_t len;
 
-        /* Page in and save this pgtmp */
-        vn_io(obp->data, &pgtmp, pgcnt, 0);
-        pgs[j] = pgtmp;
-        spinlock_release(&pgtmp->lock);
+    len = vfs_vop_write(vp, sio);
+    if (len <= 0 || vp->type != VREG || obp->pgops != &vm_vnops) {
+        return len;
+    }
+
+    spinlock_acquire(&obp->lock);
+    for (done = 0; done < (size_t)len; done += n) {
+        off = sio->offset + done;
+        pgoff = off & (DEFAULT_PAGESIZE - 1);
+        n = MIN(DEFAULT_PAGESIZE - pgoff, (size_t)len - done);
+
+        pg = vm_pagelookup(obp, off - pgoff);
+        if (pg != NULL && !pg_isvalid(pg)) {
+            /* Let the read finish so it cannot undo us */
+            msleep_spin(pg, &obp->lock, 0);
+            n = 0;
+            continue;
+        }
+        if (pg != NULL) {
+            memcpy(PHYS_TO_VIRT(pg->phys_addr + pgoff), buf + done, n);
+        }
     }
 
     spinlock_release(&obp->lock);
-    return 0;
+    return len;
 }
 
 /*
- * Attach a virtual memory object to a vnode.
+ * Attach a virtual memory object to a vnode, the
+ * object is set up on first use and shared from
+ * then on.
  *
  * @vp: Vnode to attach to.
  */
@@ -165,18 +439,116 @@ vn_attach(struct vnode *vp, vm_prot_t prot)
         return NULL;
     }
 
-    error = vm_obj_init(&vp->vobj, &vm_vnops, 1);
-    if (error != 0) {
-        return NULL;
+    vmobj = &vp->vobj;
+    if (__atomic_load_n(&vmobj->pgops, __ATOMIC_ACQUIRE) == &vm_vnops) {
+        return vmobj;
     }
 
-    vmobj = &vp->vobj;
-    vmobj->prot = prot;
-    vmobj->data = vp;
-    vmobj->pgops = &vm_vnops;
+    spinlock_acquire(&vmobj->lock);
+    if (vmobj->pgops != &vm_vnops) {
+        vmobj->prot = prot;
+        vmobj->data = vp;
+        error = vm_obj_init(vmobj, &vm_vnops, 1);
+        if (error != 0) {
+            spinlock_release(&vmobj->lock);
+            return NULL;
+        }
+
+        spinlock_acquire(&pgcache_lock);
+        TAILQ_INSERT_TAIL(&pgcache, vp, pgcache_link);
+        spinlock_release(&pgcache_lock);
+    }
+
+    spinlock_release(&vmobj->lock);
     return vmobj;
 }
 
+/*
+ * Drop the page cache of a vnode, called when
+ * the last reference to the vnode goes away.
+ * Filesystems that keep their vnodes around
+ * (VKEEP) keep the cached pages with them.
+ *
+ * @vp: Vnode to detach from.
+ */
+void
+vn_detach(struct vnode *vp)
+{
+    struct vm_object *vmobj = &vp->vobj;
+
+    if (vmobj->pgops != &vm_vnops) {
+        return;
+    }
+
+    spinlock_acquire(&pgcache_lock);
+    TAILQ_REMOVE(&pgcache, vp, pgcache_link);
+    spinlock_release(&pgcache_lock);
+
+    vm_obj_release(vmobj);
+    vmobj->pgops = NULL;
+    vp->ra_pages = 0;
+    vp->ra_next = 0;
+}
+
+/*
+ * Give cached file pages back to the frame allocator
+ * when it runs out. Only vnodes the filesystem keeps
+ * around and that nobody else holds a reference to
+ * (no open files, no mappings) are touched, objects
+ * that are busy are skipped.
+ *
+ * @count: Number of pages wanted.
+ *
+ * Returns the number of pages freed.
+ */
+size_t
+vn_reclaim(size_t count)
+{
+    struct vm_object *obp;
+    struct vm_page *pg;
+    struct vnode *vp;
+    uint64_t idx;
+    size_t nfreed = 0;
+
+    spinlock_acquire(&pgcache_lock);
+    TAILQ_FOREACH(vp, &pgcache, pgcache_link) {
+        if (nfreed >= count) {
+            break;
+        }
+        if (!ISSET(vp->flags, VKEEP)) {
+            continue;
+        }
+        if (__atomic_load_n(&vp->refcount, __ATOMIC_ACQUIRE) > 1) {
+            continue;
+        }
+
+        /* The caller may be filling this very object */
+        obp = &vp->vobj;
+        if (spinlock_try_acquire(&obp->lock) != 0) {
+            continue;
+        }
+
+        VM_OBJ_FOREACH(pg, obp, idx) {
+            if (nfreed >= count) {
+                break;
+            }
+            if (!pg_isvalid(pg)) {
+                continue;
+            }
+
+            vm_pagefree(obp, pg, 0);
+            ++nfreed;
+        }
+
+        vp->ra_pages = 0;
+        spinlock_release(&obp->lock);
+    }
+
+    spinlock_release(&pgcache_lock);
+    return nfreed;
+}
+
 const struct vm_pagerops vm_vnops = {
-    .get = vn_get
+    .get = vn_get,
+    .put = vn_put
 };
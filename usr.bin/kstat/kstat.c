@@ -29,6 +29,7 @@
 
 #include <sys/sched.h>
 #include <sys/vmstat.h>
+#include <sys/callout.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -71,6 +72,44 @@ get_vm_stat(void)
     print_size_mib("memory available", vmstat.mem_avail);
     print_size_mib("memory used", vmstat.mem_used);
     print_size_mib("memory total", vmstat.mem_total);
+
+    printf("free blocks by order:");
+    for (int i = 0; i < VM_NORDER; ++i) {
+        printf(" %d", vmstat.order_free[i]);
+    }
+    printf("\n");
+}
+
+static void
+get_dynalloc_stat(void)
+{
+    static struct vm_dynstat stat;
+    struct vm_arena_stat *arena;
+    int fd;
+
+    fd = open("/ctl/vm/dynalloc", O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open '/ctl/vm/dynalloc'\n");
+        return;
+    }
+    if (read(fd, &stat, sizeof(stat)) <= 0) {
+        printf("failed to read dynalloc stat\n");
+        close(fd);
+        return;
+    }
+
+    close(fd);
+    for (uint32_t i = 0; i < stat.narena; ++i) {
+        arena = &stat.arena[i];
+        if (arena->pool_size == 0) {
+            continue;
+        }
+
+        printf("[arena %d]: %d/%d KiB used, %d%% fragmented, "
+            "%d lock waits, %d remote frees\n", i,
+            arena->bytes_used / 1024, arena->pool_size / 1024,
+            arena->frag, arena->lock_waits, arena->remote_frees);
+    }
 }
 
 static void
@@ -107,7 +146,47 @@ get_sched_stat(void)
      */
     for (int i = 0; i < stat.ncpu; ++i) {
         cpu = &stat.cpus[i];
-        printf("[cpu %d]: %d switches\n", i, cpu->nswitch);
+        printf("[cpu %d]: %d switches, %d ready, %d stolen\n", i,
+            cpu->nswitch, cpu->nready, cpu->nsteal);
+    }
+}
+
+static void
+print_callout_hist(const char *name)
+{
+    struct callout_hist hist;
+    char path[64];
+    size_t mean = 0;
+    int fd;
+
+    snprintf(path, sizeof(path), "/ctl/callout/%s", name);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open '%s'\n", path);
+        return;
+    }
+    if (read(fd, &hist, sizeof(hist)) < 0) {
+        printf("failed to read callout %s\n", name);
+        close(fd);
+        return;
+    }
+
+    close(fd);
+    if (hist.count > 0) {
+        mean = hist.total_usec / hist.count;
+    }
+
+    printf("callout %s: %d expiries, %d usec mean, %d usec max\n",
+        name, hist.count, mean, hist.max_usec);
+    for (int i = 0; i < CALLOUT_NHIST; ++i) {
+        if (hist.bucket[i] == 0) {
+            continue;
+        }
+        if (i == 0) {
+            printf("  < 1 usec: %d\n", hist.bucket[i]);
+        } else {
+            printf("  < %d usec: %d\n", 1 << i, hist.bucket[i]);
+        }
     }
 }
 
@@ -118,5 +197,9 @@ main(void)
     get_sched_stat();
     printf("-- memory statistics --\n");
     get_vm_stat();
+    get_dynalloc_stat();
+    printf("-- callout statistics --\n");
+    print_callout_hist("latency");
+    print_callout_hist("slack");
     return 0;
 }